@@ -0,0 +1,189 @@
+/*
+** Convert obstacle and final state files between the text formats
+** read and written by the d2q9-bgk solvers and the binary formats
+** of lbm_io.h:
+**
+**   lbm-convert.exe obstacles-to-binary <nx> <ny> obstacles.dat obstacles.bin
+**   lbm-convert.exe obstacles-to-text obstacles.bin obstacles.dat
+**   lbm-convert.exe state-to-binary <nx> <ny> final_state.dat final_state.bin
+**   lbm-convert.exe state-to-text final_state.bin final_state.dat
+**
+** The text of a final state carries %.12E, more than the 9 significant
+** digits a float needs, so a final state written by a solver converts
+** both ways without loss. Obstacle text is written in row order.
+*/
+
+#include<stdio.h>
+#include<stdlib.h>
+#include<string.h>
+#include"lbm_io.h"
+
+int obstacles_to_binary(const int nx, const int ny, const char* textfile, const char* binfile);
+int obstacles_to_text(const char* binfile, const char* textfile);
+int state_to_binary(const int nx, const int ny, const char* textfile, const char* binfile);
+int state_to_text(const char* binfile, const char* textfile);
+
+/* utility functions */
+void die(const char* message, const int line, const char *file);
+void usage(const char* exe);
+
+int main(int argc, char* argv[])
+{
+  if (argc == 6 && !strcmp(argv[1], "obstacles-to-binary"))
+    return obstacles_to_binary(atoi(argv[2]), atoi(argv[3]), argv[4], argv[5]);
+  if (argc == 4 && !strcmp(argv[1], "obstacles-to-text"))
+    return obstacles_to_text(argv[2], argv[3]);
+  if (argc == 6 && !strcmp(argv[1], "state-to-binary"))
+    return state_to_binary(atoi(argv[2]), atoi(argv[3]), argv[4], argv[5]);
+  if (argc == 4 && !strcmp(argv[1], "state-to-text"))
+    return state_to_text(argv[2], argv[3]);
+  usage(argv[0]);
+
+  return EXIT_FAILURE;
+}
+
+int obstacles_to_binary(const int nx, const int ny, const char* textfile, const char* binfile)
+{
+  char   message[1024];  /* message buffer */
+  int*   obstacles;      /* grid indicating which cells are blocked */
+  long   line;           /* line no. of an error in the obstacle file */
+  int    retval;         /* to hold return value for checking */
+
+  if (nx < 1 || ny < 1) die("grid dimensions must be positive",__LINE__,__FILE__);
+  obstacles = (int*)malloc(sizeof(int) * (size_t)nx * ny);
+  if (obstacles == NULL) die("cannot allocate memory for obstacles",__LINE__,__FILE__);
+
+  retval = lbm_parse_obstacles(textfile, nx, ny, obstacles, NULL, &line);
+  if (retval == LBM_EOPEN) {
+    sprintf(message,"could not open input obstacles file: %s", textfile);
+    die(message,__LINE__,__FILE__);
+  }
+  if (retval != LBM_OK) {
+    sprintf(message,"%s (line %ld of %s)", lbm_strerror(retval), line, textfile);
+    die(message,__LINE__,__FILE__);
+  }
+
+  if ((retval = lbm_write_obstacles(binfile, nx, ny, obstacles)) != LBM_OK)
+    die(lbm_strerror(retval),__LINE__,__FILE__);
+  free(obstacles);
+
+  return EXIT_SUCCESS;
+}
+
+int obstacles_to_text(const char* binfile, const char* textfile)
+{
+  lbm_mapping map;
+  const lbm_header* header;
+  int*   obstacles;
+  FILE*  fp;
+  int    ii,jj;
+  int    retval;
+
+  /* the grid size comes from the header */
+  if ((retval = lbm_map(binfile, &map)) != LBM_OK ||
+      (retval = lbm_check(&map, LBM_KIND_OBSTACLES, LBM_DTYPE_U8, LBM_LAYOUT_DENSE)) != LBM_OK)
+    die(lbm_strerror(retval),__LINE__,__FILE__);
+  header = (const lbm_header*)map.base;
+  const int nx = header->nx;
+  const int ny = header->ny;
+  lbm_unmap(&map);
+
+  obstacles = (int*)malloc(sizeof(int) * (size_t)nx * ny);
+  if (obstacles == NULL) die("cannot allocate memory for obstacles",__LINE__,__FILE__);
+  if ((retval = lbm_read_obstacles(binfile, nx, ny, 0, ny, obstacles, NULL)) != LBM_OK)
+    die(lbm_strerror(retval),__LINE__,__FILE__);
+
+  fp = fopen(textfile,"w");
+  if (fp == NULL) die("could not open file output file",__LINE__,__FILE__);
+  for(ii=0;ii<ny;ii++) {
+    for(jj=0;jj<nx;jj++) {
+      if (obstacles[ii*nx + jj]) fprintf(fp,"%d %d %d\n", jj, ii, 1);
+    }
+  }
+  fclose(fp);
+  free(obstacles);
+
+  return EXIT_SUCCESS;
+}
+
+int state_to_binary(const int nx, const int ny, const char* textfile, const char* binfile)
+{
+  char   message[1024];  /* message buffer */
+  FILE*  fp;             /* file pointer */
+  lbm_state state;
+  float  u_x,u_y,pressure;
+  int    ii,jj;
+  int    blocked;
+  int    retval;
+  size_t cells = (size_t)nx * ny;
+
+  if (nx < 1 || ny < 1) die("grid dimensions must be positive",__LINE__,__FILE__);
+  state.u_x = (float*)calloc(cells, sizeof(float));
+  state.u_y = (float*)calloc(cells, sizeof(float));
+  state.pressure = (float*)calloc(cells, sizeof(float));
+  state.obstacles = (int*)calloc(cells, sizeof(int));
+  if (state.u_x == NULL || state.u_y == NULL || state.pressure == NULL || state.obstacles == NULL)
+    die("cannot allocate memory for the final state",__LINE__,__FILE__);
+
+  fp = fopen(textfile,"r");
+  if (fp == NULL) {
+    sprintf(message,"could not open final state file: %s", textfile);
+    die(message,__LINE__,__FILE__);
+  }
+  while( (retval = fscanf(fp,"%d %d %E %E %E %d\n", &ii, &jj, &u_x, &u_y, &pressure, &blocked)) != EOF) {
+    if ( retval != 6)
+      die("expected 6 values per line in final state file",__LINE__,__FILE__);
+    if ( ii<0 || ii>ny-1 || jj<0 || jj>nx-1 )
+      die("final state cell out of range",__LINE__,__FILE__);
+    state.u_x[ii*nx + jj] = u_x;
+    state.u_y[ii*nx + jj] = u_y;
+    state.pressure[ii*nx + jj] = pressure;
+    state.obstacles[ii*nx + jj] = blocked;
+  }
+  fclose(fp);
+
+  if ((retval = lbm_write_state(binfile, nx, ny, state.u_x, state.u_y, state.pressure, state.obstacles)) != LBM_OK)
+    die(lbm_strerror(retval),__LINE__,__FILE__);
+  lbm_free_state(&state);
+
+  return EXIT_SUCCESS;
+}
+
+int state_to_text(const char* binfile, const char* textfile)
+{
+  lbm_state state;
+  FILE*  fp;
+  int    ii;
+  int    retval;
+
+  if ((retval = lbm_read_state(binfile, &state)) != LBM_OK)
+    die(lbm_strerror(retval),__LINE__,__FILE__);
+
+  fp = fopen(textfile,"w");
+  if (fp == NULL) die("could not open file output file",__LINE__,__FILE__);
+  for (ii = 0; ii < state.nx * state.ny; ii++) {
+    fprintf(fp,"%d %d %.12E %.12E %.12E %d\n", ii / state.nx, ii % state.nx,
+            state.u_x[ii], state.u_y[ii], state.pressure[ii], state.obstacles[ii]);
+  }
+  fclose(fp);
+  lbm_free_state(&state);
+
+  return EXIT_SUCCESS;
+}
+
+void die(const char* message, const int line, const char *file)
+{
+  fprintf(stderr, "Error at line %d of file %s:\n", line, file);
+  fprintf(stderr, "%s\n",message);
+  fflush(stderr);
+  exit(EXIT_FAILURE);
+}
+
+void usage(const char* exe)
+{
+  fprintf(stderr, "Usage: %s obstacles-to-binary <nx> <ny> <obstaclefile> <binfile>\n", exe);
+  fprintf(stderr, "       %s obstacles-to-text <binfile> <obstaclefile>\n", exe);
+  fprintf(stderr, "       %s state-to-binary <nx> <ny> <statefile> <binfile>\n", exe);
+  fprintf(stderr, "       %s state-to-text <binfile> <statefile>\n", exe);
+  exit(EXIT_FAILURE);
+}
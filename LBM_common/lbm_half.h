@@ -0,0 +1,144 @@
+/*
+** 16 bit storage of the populations of the d2q9-bgk solvers.
+**
+** The solvers are bound by memory bandwidth, and a float per
+** population is more precision than most runs need. Built with
+**
+**   -DLBM_STORAGE_FP16   IEEE half precision: 11 bit mantissa, 5 bit exponent
+**   -DLBM_STORAGE_BF16   bfloat16: 8 bit mantissa, the exponent range of float
+**
+** lbm_store is a 16 bit integer holding the bits of the value, and the
+** arithmetic stays in float: LBM_LOAD widens a population as it is read
+** and LBM_STORE rounds it back, to nearest even, as it is written. The
+** populations only move in the propagate step, so they are copied there
+** as they are stored. Without either flag lbm_store is float and the
+** macros do nothing.
+**
+** With -DLBM_STORAGE_DEVIATION as well, the 16 bits hold the difference
+** of a population from its value in the fluid at rest, w_k * density,
+** passed to the macros as rest. The populations stay close to it, so
+** the bits of the mantissa go on the part that changes.
+*/
+
+#ifndef LBM_HALF_H
+#define LBM_HALF_H
+
+#include<stdint.h>
+#include<string.h>
+#if defined(LBM_STORAGE_FP16) && defined(__F16C__)
+#include<immintrin.h>
+#endif
+
+#if defined(LBM_STORAGE_FP16) && defined(LBM_STORAGE_BF16)
+#error "choose one of LBM_STORAGE_FP16 and LBM_STORAGE_BF16"
+#endif
+#if defined(LBM_STORAGE_DEVIATION) && !defined(LBM_STORAGE_FP16) && !defined(LBM_STORAGE_BF16)
+#error "LBM_STORAGE_DEVIATION needs LBM_STORAGE_FP16 or LBM_STORAGE_BF16"
+#endif
+
+/* round a float to the nearest half, ties to even */
+static inline uint16_t lbm_float_to_half(const float value)
+{
+#if defined(LBM_STORAGE_FP16) && defined(__F16C__)
+  return _cvtss_sh(value, _MM_FROUND_TO_NEAREST_INT);
+#else
+  uint32_t bits, sign, mant, rem, half;
+  int      shift;
+
+  memcpy(&bits, &value, sizeof(bits));
+  sign = (bits >> 16) & 0x8000;
+  bits &= 0x7fffffff;
+  if (bits > 0x7f800000) return sign | 0x7e00;        /* nan */
+  if (bits >= 0x477ff000) return sign | 0x7c00;       /* 65520 and up round to inf */
+  if (bits < 0x38800000) {
+    /* below 2^-14, a multiple of the smallest denormal half, 2^-24 */
+    if (bits <= 0x33000000) return sign;              /* up to 2^-25 rounds to zero */
+    mant = (bits & 0x7fffff) | 0x800000;
+    shift = 126 - (int)(bits >> 23);
+    rem = mant & ((1u << shift) - 1);
+    half = 1u << (shift - 1);
+    mant >>= shift;
+    if (rem > half || (rem == half && (mant & 1))) mant++;
+    return sign | mant;
+  }
+  /* rebias the exponent and round off 13 bits of mantissa; a carry
+  ** out of the mantissa correctly bumps the exponent */
+  bits -= (127 - 15) << 23;
+  bits += 0xfff + ((bits >> 13) & 1);
+  return sign | (bits >> 13);
+#endif
+}
+
+/* widen a half to a float, which is exact */
+static inline float lbm_half_to_float(const uint16_t value)
+{
+#if defined(LBM_STORAGE_FP16) && defined(__F16C__)
+  return _cvtsh_ss(value);
+#else
+  const uint32_t sign = (uint32_t)(value & 0x8000) << 16;
+  const uint32_t exp = (value >> 10) & 0x1f;
+  const uint32_t mant = value & 0x3ff;
+  uint32_t bits;
+  float    result;
+
+  if (exp == 0x1f) bits = sign | 0x7f800000 | (mant << 13);     /* inf and nan */
+  else if (exp) bits = sign | ((exp + 127 - 15) << 23) | (mant << 13);
+  else {
+    /* zero or a denormal, mant * 2^-24 */
+    result = (float)mant * 5.9604644775390625e-8f;
+    return sign ? -result : result;
+  }
+  memcpy(&result, &bits, sizeof(result));
+  return result;
+#endif
+}
+
+/* round a float to the nearest bfloat16, ties to even */
+static inline uint16_t lbm_float_to_bf16(const float value)
+{
+  uint32_t bits;
+
+  memcpy(&bits, &value, sizeof(bits));
+  if ((bits & 0x7fffffff) > 0x7f800000) return (bits >> 16) | 0x40;  /* keep a nan a nan */
+  bits += 0x7fff + ((bits >> 16) & 1);
+  return bits >> 16;
+}
+
+/* widen a bfloat16 to a float, which is exact */
+static inline float lbm_bf16_to_float(const uint16_t value)
+{
+  const uint32_t bits = (uint32_t)value << 16;
+  float result;
+
+  memcpy(&result, &bits, sizeof(result));
+  return result;
+}
+
+#if defined(LBM_STORAGE_FP16)
+typedef uint16_t lbm_store;
+#define LBM_STORAGE_NAME   "fp16"
+#define LBM_WIDEN(stored)  lbm_half_to_float(stored)
+#define LBM_NARROW(value)  lbm_float_to_half(value)
+#elif defined(LBM_STORAGE_BF16)
+typedef uint16_t lbm_store;
+#define LBM_STORAGE_NAME   "bf16"
+#define LBM_WIDEN(stored)  lbm_bf16_to_float(stored)
+#define LBM_NARROW(value)  lbm_float_to_bf16(value)
+#else
+typedef float lbm_store;
+#define LBM_STORAGE_NAME   "fp32"
+#define LBM_WIDEN(stored)  (stored)
+#define LBM_NARROW(value)  (value)
+#endif
+
+#ifdef LBM_STORAGE_DEVIATION
+#define LBM_DEVIATES             1
+#define LBM_LOAD(stored, rest)   (LBM_WIDEN(stored) + (rest))
+#define LBM_STORE(value, rest)   LBM_NARROW((value) - (rest))
+#else
+#define LBM_DEVIATES             0
+#define LBM_LOAD(stored, rest)   LBM_WIDEN(stored)
+#define LBM_STORE(value, rest)   LBM_NARROW(value)
+#endif
+
+#endif
@@ -0,0 +1,727 @@
+/*
+** Binary file formats for the d2q9-bgk solvers.
+**
+** Every file starts with a 32 byte header followed by dense arrays in
+** row major order (row ii = y, column jj = x), so that a whole grid is
+** loaded or dumped with a single mmap and memcpy instead of one
+** fscanf/fprintf per line:
+**
+**   obstacles:   LBM_KIND_OBSTACLES, LBM_DTYPE_U8,  LBM_LAYOUT_DENSE
+**                nx*ny bytes, 1 for a blocked cell and 0 otherwise
+**
+**   final state: LBM_KIND_STATE,     LBM_DTYPE_F32, LBM_LAYOUT_PLANAR
+**                nx*ny floats of u_x, then of u_y, then of pressure,
+**                followed by nx*ny bytes of the obstacle map
+**
+**   checkpoint:  LBM_KIND_CHECKPOINT, LBM_DTYPE_F32, LBM_LAYOUT_CELLS
+**                an lbm_checkpoint record, then nfields floats (the
+**                speeds, as stored: deviations from the fluid at rest
+**                if the record says so) of each cell in turn, then
+**                the av. velocity of each of the iteration timesteps
+**                done, from the first, and if samples is not zero,
+**                nx*ny floats of u_x and then of u_y of the last sample
+**
+** Values are stored in the byte order of the machine that wrote them;
+** a file written on a machine of the other byte order fails the
+** version check rather than being misread. Obstacle and final state
+** files have not changed since version 1 and are read at any version;
+** a checkpoint must be of the current one.
+**
+** A checkpoint holds a hash of the obstacle map of the run it was taken
+** from (lbm_hash_obstacles), and is only loaded into a run of the same
+** map.
+**
+** lbm_parse_obstacles loads the text obstacle format, lines of
+** "x y 1", from a mapping of the file: the file is split into one
+** chunk per OpenMP thread at line boundaries and the integers are
+** parsed by hand straight into the obstacle map.
+**
+** The functions return LBM_OK or an error code for lbm_strerror, and
+** leave it to the caller to die().
+*/
+
+#ifndef LBM_IO_H
+#define LBM_IO_H
+
+#include<stdio.h>
+#include<stdlib.h>
+#include<string.h>
+#include<stdint.h>
+#include<fcntl.h>
+#include<unistd.h>
+#include<sys/mman.h>
+#include<sys/stat.h>
+#ifdef _OPENMP
+#include<omp.h>
+#endif
+
+#define LBM_MAGIC          "LBM2"  /* first bytes of every binary file */
+#define LBM_VERSION        5
+
+#define LBM_KIND_OBSTACLES 1
+#define LBM_KIND_STATE     2
+#define LBM_KIND_CHECKPOINT 3
+
+#define LBM_DTYPE_U8       1
+#define LBM_DTYPE_F32      2
+
+#define LBM_LAYOUT_DENSE   1  /* one value per cell */
+#define LBM_LAYOUT_PLANAR  2  /* one plane per field, then the obstacle plane */
+#define LBM_LAYOUT_CELLS   3  /* nfields values of one cell, then the next */
+
+#define LBM_STATE_FIELDS   3  /* u_x, u_y, pressure */
+
+/* header of every binary file */
+typedef struct {
+  char     magic[4];    /* LBM_MAGIC, not NUL terminated */
+  uint32_t version;     /* LBM_VERSION */
+  uint32_t kind;        /* LBM_KIND_* */
+  uint32_t dtype;       /* LBM_DTYPE_* of the field data */
+  uint32_t layout;      /* LBM_LAYOUT_* */
+  uint32_t nx;          /* no. of cells in x-direction */
+  uint32_t ny;          /* no. of cells in y-direction */
+  uint32_t nfields;     /* no. of float planes before the obstacle plane */
+} lbm_header;
+
+/* the run a checkpoint was taken from, following its header */
+typedef struct {
+  uint32_t iteration;     /* no. of timesteps done */
+  uint32_t max_iters;     /* no. of iterations the run was set for */
+  uint32_t reynolds_dim;  /* dimension for Reynolds number */
+  float    density;       /* density per link */
+  float    accel;         /* density redistribution */
+  float    omega;         /* relaxation parameter */
+  uint64_t obstacles;     /* lbm_hash_obstacles of the whole obstacle map */
+  uint32_t deviation;     /* TRUE if the speeds are deviations from the fluid at rest */
+  uint32_t samples;       /* samples of the field taken for the steady state test */
+  double   l2_change;     /* relative change between the last two of them */
+} lbm_checkpoint;
+
+/* error codes */
+enum {
+  LBM_OK = 0,
+  LBM_EOPEN,      /* could not open the file */
+  LBM_EMAP,       /* could not map or size the file */
+  LBM_EMAGIC,     /* not a binary lattice file */
+  LBM_EVERSION,   /* unknown version or byte order */
+  LBM_EKIND,      /* wrong kind, dtype or layout for the request */
+  LBM_ESIZE,      /* grid size differs from the parameter file */
+  LBM_ETRUNC,     /* file shorter than its header promises */
+  LBM_ERANGE,     /* requested rows outside the grid */
+  LBM_EWRITE,     /* could not write the file */
+  LBM_EFORMAT,    /* text obstacle line without exactly 3 values */
+  LBM_EXRANGE,    /* text obstacle x-coord outside the grid */
+  LBM_EYRANGE,    /* text obstacle y-coord outside the grid */
+  LBM_EBLOCKED,   /* text obstacle blocked value other than 1 */
+  LBM_EITERS,     /* checkpoint taken past the last iteration of the run */
+  LBM_EOBSTACLES  /* checkpoint taken with a different obstacle map */
+};
+
+#define LBM_PARSE_CHUNK_MIN  65536  /* smallest text chunk worth a thread */
+
+/* a read-only mapping of a whole file */
+typedef struct {
+  void*  base;
+  size_t length;
+} lbm_mapping;
+
+/* a final state loaded by lbm_read_state; release with lbm_free_state */
+typedef struct {
+  int    nx, ny;
+  float* u_x;
+  float* u_y;
+  float* pressure;
+  int*   obstacles;
+} lbm_state;
+
+static inline const char* lbm_strerror(const int code)
+{
+  switch (code) {
+  case LBM_OK:       return "success";
+  case LBM_EOPEN:    return "could not open binary file";
+  case LBM_EMAP:     return "could not map binary file";
+  case LBM_EMAGIC:   return "not a binary lattice file";
+  case LBM_EVERSION: return "unsupported binary file version or byte order";
+  case LBM_EKIND:    return "binary file holds the wrong kind of data";
+  case LBM_ESIZE:    return "binary file grid size does not match the parameters";
+  case LBM_ETRUNC:   return "binary file is truncated";
+  case LBM_ERANGE:   return "rows out of range of the binary file";
+  case LBM_EWRITE:   return "could not write binary file";
+  case LBM_EFORMAT:  return "expected 3 values per line in obstacle file";
+  case LBM_EXRANGE:  return "obstacle x-coord out of range";
+  case LBM_EYRANGE:  return "obstacle y-coord out of range";
+  case LBM_EBLOCKED: return "obstacle blocked value should be 1";
+  case LBM_EITERS:   return "checkpoint is beyond the no. of iterations";
+  case LBM_EOBSTACLES: return "checkpoint was taken with a different obstacle map";
+  default:           return "unknown binary file error";
+  }
+}
+
+/* TRUE if the file starts with LBM_MAGIC; text files never do */
+static inline int lbm_is_binary(const char* path)
+{
+  char  magic[4];
+  FILE* fp = fopen(path, "rb");
+  int   binary;
+
+  if (fp == NULL) return 0;
+  binary = (fread(magic, 1, 4, fp) == 4 && memcmp(magic, LBM_MAGIC, 4) == 0);
+  fclose(fp);
+
+  return binary;
+}
+
+static inline int lbm_map(const char* path, lbm_mapping* map)
+{
+  struct stat st;
+  int fd = open(path, O_RDONLY);
+
+  if (fd < 0) return LBM_EOPEN;
+  if (fstat(fd, &st) != 0) {
+    close(fd);
+    return LBM_EMAP;
+  }
+  if (st.st_size < (off_t)sizeof(lbm_header)) {
+    close(fd);
+    return LBM_ETRUNC;
+  }
+  map->length = (size_t)st.st_size;
+  map->base = mmap(NULL, map->length, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (map->base == MAP_FAILED) return LBM_EMAP;
+  /* the arrays are read front to back */
+  madvise(map->base, map->length, MADV_SEQUENTIAL);
+
+  return LBM_OK;
+}
+
+static inline void lbm_unmap(lbm_mapping* map)
+{
+  munmap(map->base, map->length);
+  map->base = NULL;
+  map->length = 0;
+}
+
+/* bytes of payload following a header; a checkpoint has its av.
+** velocities after that, as many as its record says */
+static inline size_t lbm_payload(const lbm_header* header)
+{
+  const size_t cells = (size_t)header->nx * header->ny;
+  const size_t value = (header->dtype == LBM_DTYPE_F32) ? sizeof(float) : 1;
+
+  if (header->layout == LBM_LAYOUT_PLANAR)
+    return cells * value * header->nfields + cells;
+  if (header->layout == LBM_LAYOUT_CELLS)
+    return sizeof(lbm_checkpoint) + cells * value * header->nfields;
+  return cells * value;
+}
+
+/* check a mapped file's header against the expected kind */
+static inline int lbm_check(const lbm_mapping* map, const uint32_t kind, const uint32_t dtype,
+                            const uint32_t layout)
+{
+  const lbm_header* header = (const lbm_header*)map->base;
+
+  if (memcmp(header->magic, LBM_MAGIC, 4) != 0) return LBM_EMAGIC;
+  if (header->version < 1 || header->version > LBM_VERSION) return LBM_EVERSION;
+  if (kind == LBM_KIND_CHECKPOINT && header->version != LBM_VERSION) return LBM_EVERSION;
+  if (header->kind != kind || header->dtype != dtype || header->layout != layout)
+    return LBM_EKIND;
+  if (kind == LBM_KIND_STATE && header->nfields != LBM_STATE_FIELDS) return LBM_EKIND;
+  if (kind == LBM_KIND_CHECKPOINT && header->nfields == 0) return LBM_EKIND;
+  if (map->length < sizeof(lbm_header) + lbm_payload(header)) return LBM_ETRUNC;
+
+  return LBM_OK;
+}
+
+static inline void lbm_init_header(lbm_header* header, const uint32_t kind, const int nx, const int ny)
+{
+  memset(header, 0, sizeof(*header));
+  memcpy(header->magic, LBM_MAGIC, 4);
+  header->version = LBM_VERSION;
+  header->kind = kind;
+  header->nx = nx;
+  header->ny = ny;
+  if (kind == LBM_KIND_STATE) {
+    header->dtype = LBM_DTYPE_F32;
+    header->layout = LBM_LAYOUT_PLANAR;
+    header->nfields = LBM_STATE_FIELDS;
+  }
+  else if (kind == LBM_KIND_CHECKPOINT) {
+    header->dtype = LBM_DTYPE_F32;
+    header->layout = LBM_LAYOUT_CELLS;
+    header->nfields = 0;         /* no. of speeds, set by the writer */
+  }
+  else {
+    header->dtype = LBM_DTYPE_U8;
+    header->layout = LBM_LAYOUT_DENSE;
+    header->nfields = 0;
+  }
+}
+
+/*
+** Load rows [row0, row0 + nrows) of a binary obstacle file of an
+** nx x ny grid into obstacles (nrows*nx ints, row0 at index 0), and
+** count the blocked cells in *nblocked if it is not NULL. Each MPI
+** rank can load its own band of rows this way.
+*/
+static inline int lbm_read_obstacles(const char* path, const int nx, const int ny,
+                                     const int row0, const int nrows, int* obstacles, int* nblocked)
+{
+  lbm_mapping map;
+  const unsigned char* data;
+  const lbm_header* header;
+  size_t ii, cells;
+  int    blocked = 0;
+  int    retval;
+
+  if ((retval = lbm_map(path, &map)) != LBM_OK) return retval;
+  if ((retval = lbm_check(&map, LBM_KIND_OBSTACLES, LBM_DTYPE_U8, LBM_LAYOUT_DENSE)) != LBM_OK) {
+    lbm_unmap(&map);
+    return retval;
+  }
+  header = (const lbm_header*)map.base;
+  if ((int)header->nx != nx || (int)header->ny != ny) {
+    lbm_unmap(&map);
+    return LBM_ESIZE;
+  }
+  if (row0 < 0 || nrows < 0 || row0 + nrows > ny) {
+    lbm_unmap(&map);
+    return LBM_ERANGE;
+  }
+
+  data = (const unsigned char*)map.base + sizeof(lbm_header) + (size_t)row0 * nx;
+  cells = (size_t)nrows * nx;
+  for (ii = 0; ii < cells; ii++) {
+    obstacles[ii] = (data[ii] != 0);
+    blocked += obstacles[ii];
+  }
+  if (nblocked != NULL) *nblocked = blocked;
+  lbm_unmap(&map);
+
+  return LBM_OK;
+}
+
+/* parse an optionally signed decimal int at *pos, skipping blanks first */
+static inline int lbm_parse_int(const char** pos, const char* end, int* value)
+{
+  const char* p = *pos;
+  long magnitude = 0;
+  int  negative = 0;
+
+  while (p < end && (*p == ' ' || *p == '\t')) p++;
+  if (p < end && (*p == '-' || *p == '+')) negative = (*p++ == '-');
+  if (p == end || *p < '0' || *p > '9') return 0;
+  while (p < end && *p >= '0' && *p <= '9') {
+    /* saturate; anything this large fails the range checks anyway */
+    if (magnitude < 0x7fffffffL) magnitude = magnitude * 10 + (*p - '0');
+    p++;
+  }
+  if (magnitude > 0x7fffffffL) magnitude = 0x7fffffffL;
+  *value = negative ? (int)-magnitude : (int)magnitude;
+  *pos = p;
+
+  return 1;
+}
+
+/*
+** Parse the whole lines of text in [begin, end) into an nx x ny map.
+** *lines is set to the no. of lines parsed, or on an error to the
+** no. of lines before the offending one.
+*/
+static inline int lbm_parse_obstacle_lines(const char* begin, const char* end, const int nx,
+                                           const int ny, int* obstacles, long* lines)
+{
+  const char* p = begin;
+  long count = 0;
+  int  xx, yy, blocked;
+
+  while (p < end) {
+    while (p < end && (*p == ' ' || *p == '\t' || *p == '\r')) p++;
+    /* blank lines are skipped, as fscanf would */
+    if (p < end && *p != '\n') {
+      if (!lbm_parse_int(&p, end, &xx) || !lbm_parse_int(&p, end, &yy) ||
+          !lbm_parse_int(&p, end, &blocked)) {
+        *lines = count;
+        return LBM_EFORMAT;
+      }
+      while (p < end && (*p == ' ' || *p == '\t' || *p == '\r')) p++;
+      if (p < end && *p != '\n') {
+        *lines = count;
+        return LBM_EFORMAT;
+      }
+      if (xx < 0 || xx > nx - 1) {
+        *lines = count;
+        return LBM_EXRANGE;
+      }
+      if (yy < 0 || yy > ny - 1) {
+        *lines = count;
+        return LBM_EYRANGE;
+      }
+      if (blocked != 1) {
+        *lines = count;
+        return LBM_EBLOCKED;
+      }
+      obstacles[(size_t)yy * nx + xx] = blocked;
+    }
+    if (p < end) p++;             /* the newline */
+    count++;
+  }
+  *lines = count;
+
+  return LBM_OK;
+}
+
+/*
+** Load a text obstacle file of an nx x ny grid into obstacles (nx*ny
+** ints, zeroed first) and count the blocked cells in *nblocked if it is
+** not NULL. On a parse or range error *line is set to the (1 based)
+** no. of the first offending line in the file.
+*/
+static inline int lbm_parse_obstacles(const char* path, const int nx, const int ny, int* obstacles,
+                                      int* nblocked, long* line)
+{
+  struct stat st;
+  const char* text;
+  size_t* starts;                 /* first byte of each chunk, and the end */
+  long*   lines;                  /* lines parsed in each chunk */
+  int*    errors;                 /* error code of each chunk */
+  size_t  length, cells = (size_t)nx * ny, ii;
+  int     nchunks = 1, kk, blocked = 0, retval = LBM_OK;
+  int     fd = open(path, O_RDONLY);
+
+  *line = 0;
+  if (fd < 0) return LBM_EOPEN;
+  if (fstat(fd, &st) != 0) {
+    close(fd);
+    return LBM_EMAP;
+  }
+  length = (size_t)st.st_size;
+  memset(obstacles, 0, cells * sizeof(int));
+  if (length == 0) {
+    close(fd);
+    if (nblocked != NULL) *nblocked = 0;
+    return LBM_OK;
+  }
+  text = (const char*)mmap(NULL, length, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (text == MAP_FAILED) return LBM_EMAP;
+  madvise((void*)text, length, MADV_WILLNEED);
+
+#ifdef _OPENMP
+  nchunks = omp_get_max_threads();
+  if ((size_t)nchunks > length / LBM_PARSE_CHUNK_MIN + 1) nchunks = (int)(length / LBM_PARSE_CHUNK_MIN + 1);
+#endif
+  starts = (size_t*)malloc((nchunks + 1) * sizeof(size_t));
+  lines = (long*)malloc(nchunks * sizeof(long));
+  errors = (int*)malloc(nchunks * sizeof(int));
+  if (starts == NULL || lines == NULL || errors == NULL) {
+    free(starts);
+    free(lines);
+    free(errors);
+    munmap((void*)text, length);
+    return LBM_EMAP;
+  }
+
+  /* chunks start just after the first newline past an even split */
+  starts[0] = 0;
+  for (kk = 1; kk < nchunks; kk++) {
+    const char* nl;
+    size_t split = length * kk / nchunks;
+    if (split < starts[kk - 1]) split = starts[kk - 1];
+    nl = (const char*)memchr(text + split, '\n', length - split);
+    starts[kk] = (nl == NULL) ? length : (size_t)(nl - text) + 1;
+  }
+  starts[nchunks] = length;
+
+  /* an obstacle listed twice sets the same cell to the same value */
+#ifdef _OPENMP
+#pragma omp parallel for schedule(static, 1)
+#endif
+  for (kk = 0; kk < nchunks; kk++) {
+    errors[kk] = lbm_parse_obstacle_lines(text + starts[kk], text + starts[kk + 1], nx, ny,
+                                          obstacles, &lines[kk]);
+  }
+
+  /* report the first error in the file, numbering lines across chunks */
+  for (kk = 0; kk < nchunks; kk++) {
+    *line += lines[kk];
+    if (errors[kk] != LBM_OK) {
+      (*line)++;
+      retval = errors[kk];
+      break;
+    }
+  }
+  free(starts);
+  free(lines);
+  free(errors);
+  munmap((void*)text, length);
+  if (retval != LBM_OK) return retval;
+
+  if (nblocked != NULL) {
+#ifdef _OPENMP
+#pragma omp parallel for reduction(+:blocked)
+#endif
+    for (ii = 0; ii < cells; ii++) {
+      blocked += obstacles[ii];
+    }
+    *nblocked = blocked;
+  }
+  *line = 0;
+
+  return LBM_OK;
+}
+
+/* create a file of the given length and map it for writing */
+static inline int lbm_create(const char* path, const size_t length, void** base, int* fd)
+{
+  *fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+  if (*fd < 0) return LBM_EOPEN;
+  if (ftruncate(*fd, (off_t)length) != 0) {
+    close(*fd);
+    return LBM_EWRITE;
+  }
+  *base = mmap(NULL, length, PROT_READ | PROT_WRITE, MAP_SHARED, *fd, 0);
+  if (*base == MAP_FAILED) {
+    close(*fd);
+    return LBM_EMAP;
+  }
+
+  return LBM_OK;
+}
+
+static inline int lbm_close(void* base, const size_t length, const int fd)
+{
+  int retval = LBM_OK;
+
+  if (munmap(base, length) != 0) retval = LBM_EWRITE;
+  if (close(fd) != 0) retval = LBM_EWRITE;
+
+  return retval;
+}
+
+/* write an obstacle map of nx*ny ints as a binary obstacle file */
+static inline int lbm_write_obstacles(const char* path, const int nx, const int ny, const int* obstacles)
+{
+  lbm_header header;
+  const size_t cells = (size_t)nx * ny;
+  unsigned char* data;
+  void*  base;
+  size_t ii;
+  int    fd, retval;
+
+  lbm_init_header(&header, LBM_KIND_OBSTACLES, nx, ny);
+  if ((retval = lbm_create(path, sizeof(header) + cells, &base, &fd)) != LBM_OK) return retval;
+  memcpy(base, &header, sizeof(header));
+  data = (unsigned char*)base + sizeof(header);
+  for (ii = 0; ii < cells; ii++) {
+    data[ii] = (obstacles[ii] != 0);
+  }
+
+  return lbm_close(base, sizeof(header) + cells, fd);
+}
+
+/* write the derived fields and obstacle map of an nx x ny grid as a binary final state */
+static inline int lbm_write_state(const char* path, const int nx, const int ny, const float* u_x,
+                                  const float* u_y, const float* pressure, const int* obstacles)
+{
+  lbm_header header;
+  const size_t cells = (size_t)nx * ny;
+  unsigned char* data;
+  float* plane;
+  void*  base;
+  size_t ii, length;
+  int    fd, retval;
+
+  lbm_init_header(&header, LBM_KIND_STATE, nx, ny);
+  length = sizeof(header) + lbm_payload(&header);
+  if ((retval = lbm_create(path, length, &base, &fd)) != LBM_OK) return retval;
+  memcpy(base, &header, sizeof(header));
+  plane = (float*)((char*)base + sizeof(header));
+  memcpy(plane, u_x, cells * sizeof(float));
+  memcpy(plane + cells, u_y, cells * sizeof(float));
+  memcpy(plane + 2 * cells, pressure, cells * sizeof(float));
+  data = (unsigned char*)(plane + 3 * cells);
+  for (ii = 0; ii < cells; ii++) {
+    data[ii] = (obstacles[ii] != 0);
+  }
+
+  return lbm_close(base, length, fd);
+}
+
+/* load a binary final state into freshly allocated arrays */
+static inline int lbm_read_state(const char* path, lbm_state* state)
+{
+  lbm_mapping map;
+  const lbm_header* header;
+  const unsigned char* data;
+  const float* plane;
+  size_t ii, cells;
+  int    retval;
+
+  if ((retval = lbm_map(path, &map)) != LBM_OK) return retval;
+  if ((retval = lbm_check(&map, LBM_KIND_STATE, LBM_DTYPE_F32, LBM_LAYOUT_PLANAR)) != LBM_OK) {
+    lbm_unmap(&map);
+    return retval;
+  }
+  header = (const lbm_header*)map.base;
+  state->nx = header->nx;
+  state->ny = header->ny;
+  cells = (size_t)state->nx * state->ny;
+  state->u_x = (float*)malloc(cells * sizeof(float));
+  state->u_y = (float*)malloc(cells * sizeof(float));
+  state->pressure = (float*)malloc(cells * sizeof(float));
+  state->obstacles = (int*)malloc(cells * sizeof(int));
+  if (state->u_x == NULL || state->u_y == NULL || state->pressure == NULL || state->obstacles == NULL) {
+    lbm_unmap(&map);
+    return LBM_EMAP;
+  }
+
+  plane = (const float*)((const char*)map.base + sizeof(lbm_header));
+  memcpy(state->u_x, plane, cells * sizeof(float));
+  memcpy(state->u_y, plane + cells, cells * sizeof(float));
+  memcpy(state->pressure, plane + 2 * cells, cells * sizeof(float));
+  data = (const unsigned char*)(plane + 3 * cells);
+  for (ii = 0; ii < cells; ii++) {
+    state->obstacles[ii] = data[ii];
+  }
+  lbm_unmap(&map);
+
+  return LBM_OK;
+}
+
+/* FNV-1a hash of an obstacle map of cells ints, blocked or not */
+static inline uint64_t lbm_hash_obstacles(const int* obstacles, const size_t cells)
+{
+  uint64_t hash = 0xcbf29ce484222325ull;
+  size_t   ii;
+
+  for (ii = 0; ii < cells; ii++) {
+    hash ^= (obstacles[ii] != 0);
+    hash *= 0x100000001b3ull;
+  }
+
+  return hash;
+}
+
+/*
+** Write a checkpoint of an nx x ny grid of nspeeds floats per cell, the
+** av. velocities of the info->iteration timesteps to it, and last_u,
+** the last sample of the field, if info->samples is not zero. The file
+** is written under a temporary name, synced and renamed over path, so
+** a run killed mid-write leaves the previous checkpoint intact.
+*/
+static inline int lbm_write_checkpoint(const char* path, const int nx, const int ny, const int nspeeds,
+                                       const lbm_checkpoint* info, const float* cells,
+                                       const float* av_vels, const float* last_u)
+{
+  lbm_header header;
+  char   tmppath[4096];
+  char*  data;
+  void*  base;
+  size_t length, values = (size_t)nx * ny * nspeeds;
+  size_t sample = info->samples ? 2 * (size_t)nx * ny : 0;
+  int    fd, retval;
+
+  if (snprintf(tmppath, sizeof(tmppath), "%s.tmp", path) >= (int)sizeof(tmppath)) return LBM_EOPEN;
+  lbm_init_header(&header, LBM_KIND_CHECKPOINT, nx, ny);
+  header.nfields = nspeeds;
+  length = sizeof(header) + lbm_payload(&header) + ((size_t)info->iteration + sample) * sizeof(float);
+  if ((retval = lbm_create(tmppath, length, &base, &fd)) != LBM_OK) return retval;
+
+  data = (char*)base;
+  memcpy(data, &header, sizeof(header));
+  data += sizeof(header);
+  memcpy(data, info, sizeof(*info));
+  data += sizeof(*info);
+  memcpy(data, cells, values * sizeof(float));
+  data += values * sizeof(float);
+  memcpy(data, av_vels, (size_t)info->iteration * sizeof(float));
+  data += (size_t)info->iteration * sizeof(float);
+  if (sample) memcpy(data, last_u, sample * sizeof(float));
+
+  if (msync(base, length, MS_SYNC) != 0) retval = LBM_EWRITE;
+  if (lbm_close(base, length, fd) != LBM_OK) retval = LBM_EWRITE;
+  if (retval == LBM_OK && rename(tmppath, path) != 0) retval = LBM_EWRITE;
+  if (retval != LBM_OK) unlink(tmppath);
+
+  return retval;
+}
+
+/*
+** Load a checkpoint of an nx x ny grid of nspeeds floats per cell into
+** cells, for a run of max_iters timesteps around obstacles, the
+** lbm_hash_obstacles of its obstacle map. The av. velocities of the
+** timesteps done are loaded into a freshly allocated *av_vels, and the
+** last sample of the field into a freshly allocated *last_u, or NULL if
+** none was taken, both to be freed by the caller.
+*/
+static inline int lbm_read_checkpoint(const char* path, const int nx, const int ny, const int nspeeds,
+                                      const int max_iters, const uint64_t obstacles,
+                                      lbm_checkpoint* info, float* cells, float** av_vels,
+                                      float** last_u)
+{
+  lbm_mapping map;
+  const lbm_header* header;
+  const char* data;
+  size_t values = (size_t)nx * ny * nspeeds;
+  size_t sample;
+  int    retval;
+
+  if ((retval = lbm_map(path, &map)) != LBM_OK) return retval;
+  if ((retval = lbm_check(&map, LBM_KIND_CHECKPOINT, LBM_DTYPE_F32, LBM_LAYOUT_CELLS)) != LBM_OK) {
+    lbm_unmap(&map);
+    return retval;
+  }
+  header = (const lbm_header*)map.base;
+  if ((int)header->nx != nx || (int)header->ny != ny || (int)header->nfields != nspeeds) {
+    lbm_unmap(&map);
+    return LBM_ESIZE;
+  }
+
+  data = (const char*)map.base + sizeof(lbm_header);
+  memcpy(info, data, sizeof(*info));
+  data += sizeof(*info);
+  if (info->iteration > (uint32_t)max_iters) {
+    lbm_unmap(&map);
+    return LBM_EITERS;
+  }
+  if (info->obstacles != obstacles) {
+    lbm_unmap(&map);
+    return LBM_EOBSTACLES;
+  }
+  sample = info->samples ? 2 * (size_t)nx * ny : 0;
+  if (map.length < sizeof(lbm_header) + lbm_payload(header) +
+                   ((size_t)info->iteration + sample) * sizeof(float)) {
+    lbm_unmap(&map);
+    return LBM_ETRUNC;
+  }
+  /* one more than needed, so that none is not a NULL */
+  *av_vels = (float*)malloc(((size_t)info->iteration + 1) * sizeof(float));
+  *last_u = sample ? (float*)malloc(sample * sizeof(float)) : NULL;
+  if (*av_vels == NULL || (sample && *last_u == NULL)) {
+    free(*av_vels);
+    lbm_unmap(&map);
+    return LBM_EMAP;
+  }
+  memcpy(cells, data, values * sizeof(float));
+  data += values * sizeof(float);
+  memcpy(*av_vels, data, (size_t)info->iteration * sizeof(float));
+  data += (size_t)info->iteration * sizeof(float);
+  if (sample) memcpy(*last_u, data, sample * sizeof(float));
+  lbm_unmap(&map);
+
+  return LBM_OK;
+}
+
+static inline void lbm_free_state(lbm_state* state)
+{
+  free(state->u_x);
+  free(state->u_y);
+  free(state->pressure);
+  free(state->obstacles);
+  state->u_x = state->u_y = state->pressure = NULL;
+  state->obstacles = NULL;
+}
+
+#endif
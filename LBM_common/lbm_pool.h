@@ -0,0 +1,332 @@
+/*
+** A persistent pool of posix threads for the timestep loops of the
+** d2q9-bgk solvers.
+**
+** An OpenMP 'parallel for' per phase of a timestep forks and joins
+** the team, and waits at its implicit barrier, several times a step;
+** on the small grids that is a good part of the step. Instead the
+** threads of the pool are started once, the others pinned one to a
+** cpu when there are enough cpus, and lbm_pool_run has them all run one
+** function, which holds the whole timestep loop. Within it each
+** thread works on the same block of rows every step (lbm_pool_rows),
+** and the phases are separated by lbm_pool_barrier: a sense reversing
+** barrier, spinning on one shared flag, that costs a few hundred
+** cycles rather than a trip through the OpenMP runtime.
+**
+** Where a phase only needs its neighbours to have finished, rather
+** than every thread, an lbm_pool_flag counts how far a piece of work
+** has got: its thread posts each step as it is done, and another
+** waits for the step it needs, with no barrier at all.
+**
+** Where the work of a phase is uneven, an lbm_pool_deque holds the
+** pieces dealt to a thread: a Chase-Lev deque, which the thread takes
+** its own pieces from at one end while idle threads steal from the
+** other. Each piece is taken exactly once.
+**
+** The barrier, and a wait on a flag, spin for LBM_POOL_SPINS polls
+** and then yield the cpu while they wait, so a pool with more threads
+** than cpus still gets on. Between runs the threads sleep on a
+** condition variable.
+**
+** The caller is thread 0 and is left unpinned: the threads it starts
+** later, such as those of an OpenMP team, would inherit its cpu. The
+** others take the second cpu it may run on, the third, and so on.
+** Pinning needs the cpu sets of <sched.h>, so _GNU_SOURCE must be
+** defined before the first #include; without it no thread is pinned.
+*/
+
+#ifndef LBM_POOL_H
+#define LBM_POOL_H
+
+#include<stdlib.h>
+#include<pthread.h>
+#include<sched.h>
+
+#define LBM_POOL_SPINS  4096  /* polls of the barrier before yielding */
+#define LBM_POOL_LINE   64    /* bytes of a cache line */
+
+typedef struct lbm_pool lbm_pool;
+
+/* the function run by every thread of the pool, tid 0 being the caller */
+typedef void (*lbm_pool_fn)(lbm_pool* pool, const int tid, void* arg);
+
+/* per thread state, a cache line each so the threads do not share them */
+typedef struct {
+  int       sense;            /* sense of the barrier this thread waits for next */
+  int       tid;              /* the thread's number */
+  lbm_pool* pool;
+  char      pad[LBM_POOL_LINE - 2 * sizeof(int) - sizeof(lbm_pool*)];
+} lbm_pool_local;
+
+struct lbm_pool {
+  int             nthreads;   /* threads of the pool, the caller included */
+  pthread_t*      threads;    /* the nthreads-1 others */
+  lbm_pool_local* local;      /* per thread state */
+  pthread_mutex_t lock;
+  pthread_cond_t  cond;       /* signalled when there is work, or at the end */
+  long            generation; /* runs started */
+  int             stop;       /* TRUE once the threads are to exit */
+  lbm_pool_fn     fn;         /* the function of the current run */
+  void*           arg;
+  int             pinned;     /* TRUE if the threads are pinned */
+  /* the barrier, on its own line */
+  char            pad0[LBM_POOL_LINE];
+  int             count;      /* threads arrived */
+  int             sense;      /* flips as the last one arrives */
+  char            pad1[LBM_POOL_LINE - 2 * sizeof(int)];
+};
+
+/* progress of a piece of work, a cache line each */
+typedef struct {
+  int  value;                 /* steps done */
+  char pad[LBM_POOL_LINE - sizeof(int)];
+} lbm_pool_flag;
+
+#define LBM_POOL_EMPTY  -1  /* nothing to take from a deque */
+#define LBM_POOL_ABORT  -2  /* lost a race for the last piece, try again */
+
+/* a Chase-Lev deque of pieces of work, numbered from 0; the owner
+** fills it and takes from the bottom, the others steal from the top */
+typedef struct {
+  int  top;                   /* next to be stolen */
+  char pad0[LBM_POOL_LINE - sizeof(int)];
+  int  bottom;                /* one past the next the owner takes */
+  char pad1[LBM_POOL_LINE - sizeof(int)];
+  int* pieces;
+  int  capacity;
+} lbm_pool_deque;
+
+/* the block of n rows worked on by thread tid of nthreads */
+static inline void lbm_pool_rows(const int n, const int tid, const int nthreads,
+                                 int* first, int* last)
+{
+  *first = (int)((long)n * tid / nthreads);
+  *last = (int)((long)n * (tid + 1) / nthreads);
+}
+
+static inline void lbm_pool_pause(void)
+{
+#if defined(__x86_64__) || defined(__i386__)
+  __builtin_ia32_pause();
+#endif
+}
+
+/* wait until all the threads of the pool have arrived; everything
+** written before it by any thread is seen by all of them after it */
+static inline void lbm_pool_barrier(lbm_pool* pool, const int tid)
+{
+  const int sense = !pool->local[tid].sense;
+  int spins = 0;
+
+  pool->local[tid].sense = sense;
+  if (pool->nthreads == 1) return;
+  if (__atomic_add_fetch(&pool->count, 1, __ATOMIC_ACQ_REL) == pool->nthreads) {
+    /* the last to arrive resets the count, and lets the others go */
+    __atomic_store_n(&pool->count, 0, __ATOMIC_RELAXED);
+    __atomic_store_n(&pool->sense, sense, __ATOMIC_RELEASE);
+  }
+  else {
+    while (__atomic_load_n(&pool->sense, __ATOMIC_ACQUIRE) != sense) {
+      if (++spins < LBM_POOL_SPINS) lbm_pool_pause();
+      else sched_yield();
+    }
+  }
+}
+
+/* set the flag to value: everything written before it is seen by a
+** thread whose wait for the value returns */
+static inline void lbm_pool_post(lbm_pool_flag* flag, const int value)
+{
+  __atomic_store_n(&flag->value, value, __ATOMIC_RELEASE);
+}
+
+static inline int lbm_pool_value(const lbm_pool_flag* flag)
+{
+  return __atomic_load_n(&flag->value, __ATOMIC_ACQUIRE);
+}
+
+/* wait until the flag is at least value */
+static inline void lbm_pool_wait(const lbm_pool_flag* flag, const int value)
+{
+  int spins = 0;
+
+  while (lbm_pool_value(flag) < value) {
+    if (++spins < LBM_POOL_SPINS) lbm_pool_pause();
+    else sched_yield();
+  }
+}
+
+/* allocate a deque of up to capacity pieces; returns 0, or -1 if out of memory */
+static inline int lbm_pool_deque_init(lbm_pool_deque* deque, const int capacity)
+{
+  deque->top = deque->bottom = 0;
+  deque->capacity = capacity;
+  deque->pieces = (int*)malloc(sizeof(int) * (capacity > 0 ? capacity : 1));
+  return (deque->pieces == NULL) ? -1 : 0;
+}
+
+static inline void lbm_pool_deque_free(lbm_pool_deque* deque)
+{
+  free(deque->pieces);
+  deque->pieces = NULL;
+}
+
+/* refill the deque with pieces first to last-1, for its owner to take
+** in that order; no thread may be taking from it meanwhile */
+static inline void lbm_pool_deque_fill(lbm_pool_deque* deque, const int first, const int last)
+{
+  int ii;
+
+  for (ii = 0; ii < last - first; ii++) deque->pieces[ii] = last - 1 - ii;
+  __atomic_store_n(&deque->top, 0, __ATOMIC_RELAXED);
+  __atomic_store_n(&deque->bottom, last - first, __ATOMIC_RELEASE);
+}
+
+/* the owner takes the piece at the bottom; returns it, or LBM_POOL_EMPTY */
+static inline int lbm_pool_deque_take(lbm_pool_deque* deque)
+{
+  const int bottom = __atomic_load_n(&deque->bottom, __ATOMIC_RELAXED) - 1;
+  int top, piece;
+
+  __atomic_store_n(&deque->bottom, bottom, __ATOMIC_RELAXED);
+  __atomic_thread_fence(__ATOMIC_SEQ_CST);
+  top = __atomic_load_n(&deque->top, __ATOMIC_RELAXED);
+  if (top > bottom) {
+    __atomic_store_n(&deque->bottom, bottom + 1, __ATOMIC_RELAXED);
+    return LBM_POOL_EMPTY;
+  }
+  piece = deque->pieces[bottom];
+  if (top == bottom) {
+    /* the last piece: a thief may be after it too */
+    if (!__atomic_compare_exchange_n(&deque->top, &top, top + 1, 0,
+                                     __ATOMIC_SEQ_CST, __ATOMIC_RELAXED)) piece = LBM_POOL_EMPTY;
+    __atomic_store_n(&deque->bottom, bottom + 1, __ATOMIC_RELAXED);
+  }
+  return piece;
+}
+
+/* another thread steals the piece at the top; returns it,
+** LBM_POOL_EMPTY or LBM_POOL_ABORT */
+static inline int lbm_pool_deque_steal(lbm_pool_deque* deque)
+{
+  int top, bottom, piece;
+
+  top = __atomic_load_n(&deque->top, __ATOMIC_ACQUIRE);
+  __atomic_thread_fence(__ATOMIC_SEQ_CST);
+  bottom = __atomic_load_n(&deque->bottom, __ATOMIC_ACQUIRE);
+  if (top >= bottom) return LBM_POOL_EMPTY;
+  piece = __atomic_load_n(&deque->pieces[top], __ATOMIC_RELAXED);
+  if (!__atomic_compare_exchange_n(&deque->top, &top, top + 1, 0,
+                                   __ATOMIC_SEQ_CST, __ATOMIC_RELAXED)) return LBM_POOL_ABORT;
+  return piece;
+}
+
+/* pin the calling thread, thread tid of the pool, to the tid'th cpu it may run on */
+static inline void lbm_pool_pin(const lbm_pool* pool, const int tid)
+{
+#ifdef CPU_SET
+  cpu_set_t allowed, cpu;
+  int ii, nth = -1;
+
+  if (!pool->pinned || sched_getaffinity(0, sizeof(allowed), &allowed) != 0) return;
+  for (ii = 0; ii < CPU_SETSIZE; ii++) {
+    if (CPU_ISSET(ii, &allowed) && ++nth == tid) {
+      CPU_ZERO(&cpu);
+      CPU_SET(ii, &cpu);
+      sched_setaffinity(0, sizeof(cpu), &cpu);
+      return;
+    }
+  }
+#endif
+}
+
+static inline void* lbm_pool_worker(void* arg)
+{
+  lbm_pool* pool = ((lbm_pool_local*)arg)->pool;
+  const int tid = ((lbm_pool_local*)arg)->tid;
+  long seen = 0;                /* runs done */
+
+  lbm_pool_pin(pool, tid);
+  for (;;) {
+    pthread_mutex_lock(&pool->lock);
+    while (pool->generation == seen && !pool->stop) pthread_cond_wait(&pool->cond, &pool->lock);
+    if (pool->stop) {
+      pthread_mutex_unlock(&pool->lock);
+      return NULL;
+    }
+    seen = pool->generation;
+    pthread_mutex_unlock(&pool->lock);
+
+    pool->fn(pool, tid, pool->arg);
+    lbm_pool_barrier(pool, tid);
+  }
+}
+
+/* start a pool of nthreads threads, the caller as thread 0; returns 0,
+** or -1 if they cannot be started */
+static inline int lbm_pool_start(lbm_pool* pool, const int nthreads)
+{
+  int ii;
+#ifdef CPU_SET
+  cpu_set_t allowed;
+#endif
+
+  pool->nthreads = (nthreads > 1) ? nthreads : 1;
+  pool->generation = 0;
+  pool->stop = 0;
+  pool->count = 0;
+  pool->sense = 0;
+  pool->pinned = 0;
+#ifdef CPU_SET
+  /* one thread to a cpu, unless they would have to share */
+  if (sched_getaffinity(0, sizeof(allowed), &allowed) == 0)
+    pool->pinned = pool->nthreads <= CPU_COUNT(&allowed);
+#endif
+  pool->threads = (pthread_t*)malloc(sizeof(pthread_t) * pool->nthreads);
+  pool->local = (lbm_pool_local*)calloc(pool->nthreads, sizeof(lbm_pool_local));
+  if (pool->threads == NULL || pool->local == NULL) return -1;
+  pthread_mutex_init(&pool->lock, NULL);
+  pthread_cond_init(&pool->cond, NULL);
+
+  for (ii = 0; ii < pool->nthreads; ii++) {
+    pool->local[ii].tid = ii;
+    pool->local[ii].pool = pool;
+  }
+  for (ii = 1; ii < pool->nthreads; ii++) {
+    if (pthread_create(&pool->threads[ii], NULL, lbm_pool_worker, &pool->local[ii]) != 0)
+      return -1;
+  }
+  return 0;
+}
+
+/* run fn on every thread of the pool, and return once they all have */
+static inline void lbm_pool_run(lbm_pool* pool, lbm_pool_fn fn, void* arg)
+{
+  pthread_mutex_lock(&pool->lock);
+  pool->fn = fn;
+  pool->arg = arg;
+  pool->generation++;
+  pthread_cond_broadcast(&pool->cond);
+  pthread_mutex_unlock(&pool->lock);
+
+  fn(pool, 0, arg);
+  lbm_pool_barrier(pool, 0);
+}
+
+/* stop the threads of the pool */
+static inline void lbm_pool_finish(lbm_pool* pool)
+{
+  int ii;
+
+  pthread_mutex_lock(&pool->lock);
+  pool->stop = 1;
+  pthread_cond_broadcast(&pool->cond);
+  pthread_mutex_unlock(&pool->lock);
+  for (ii = 1; ii < pool->nthreads; ii++) pthread_join(pool->threads[ii], NULL);
+  pthread_cond_destroy(&pool->cond);
+  pthread_mutex_destroy(&pool->lock);
+  free(pool->threads);
+  free(pool->local);
+}
+
+#endif
@@ -0,0 +1,78 @@
+/*
+** Sums of a fixed shape for the reductions of the d2q9-bgk solvers.
+**
+** An OpenMP reduction(+:) or a sum over the MPI ranks adds up partial
+** sums in an order that depends on how many threads or ranks there
+** are, and float addition does not associate: the last bits of the
+** average velocity change with the thread and rank count. Instead,
+** each row of the grid is summed from left to right into its own
+** lbm_sum, by whichever thread or rank holds the row, and
+** lbm_sum_rows adds up the rows pairwise, in a tree that depends only
+** on the number of rows. The sum comes out the same, to the bit, for
+** any number of threads and ranks.
+**
+** Built with -DLBM_REDUCE_COMPENSATED, an lbm_sum also carries the low
+** order bits each addition loses (Neumaier's variant of Kahan
+** summation), which go back into the total at the end.
+*/
+
+#ifndef LBM_REDUCE_H
+#define LBM_REDUCE_H
+
+#include<math.h>
+
+typedef struct {
+  float sum;   /* running sum */
+  float comp;  /* the bits lost from sum, when compensated */
+} lbm_sum;
+
+static inline lbm_sum lbm_sum_zero(void)
+{
+  const lbm_sum zero = { 0.0f, 0.0f };
+  return zero;
+}
+
+static inline void lbm_sum_add(lbm_sum* s, const float value)
+{
+#ifdef LBM_REDUCE_COMPENSATED
+  const float total = s->sum + value;
+
+  /* what is lost is the low part of the smaller of the two */
+  if (fabsf(s->sum) >= fabsf(value)) s->comp += (s->sum - total) + value;
+  else s->comp += (value - total) + s->sum;
+  s->sum = total;
+#else
+  s->sum += value;
+#endif
+}
+
+static inline void lbm_sum_merge(lbm_sum* s, const lbm_sum other)
+{
+  lbm_sum_add(s, other.sum);
+  s->comp += other.comp;
+}
+
+static inline float lbm_sum_value(const lbm_sum s)
+{
+#ifdef LBM_REDUCE_COMPENSATED
+  return s.sum + s.comp;
+#else
+  return s.sum;
+#endif
+}
+
+/* add up the sums of n rows pairwise, in place, and return the total */
+static inline float lbm_sum_rows(lbm_sum* rows, const int n)
+{
+  int stride, ii;
+
+  if (n < 1) return 0.0f;
+  for (stride = 1; stride < n; stride *= 2) {
+    for (ii = 0; ii + stride < n; ii += 2 * stride) {
+      lbm_sum_merge(&rows[ii], rows[ii + stride]);
+    }
+  }
+  return lbm_sum_value(rows[0]);
+}
+
+#endif
@@ -0,0 +1,182 @@
+/*
+** Detection of a steady state, to stop the d2q9-bgk solvers early.
+**
+** The flow is taken as steady once the av. velocity has changed by
+** less than a tolerance, relative to its latest value, over a window
+** of timesteps: the max less the min of the last window of them. As a
+** further test the velocity field may be sampled every so many
+** timesteps, and its relative change in the L2 norm between the last
+** two samples must then be under the tolerance too.
+**
+** The settings are optional lines of the parameter file, after omega:
+**
+**   tolerance   0 (the default) runs all of maxIters
+**   window      timesteps over which the av. velocity is measured (1000)
+**   l2 stride   timesteps between samples of the field, 0 for none (0)
+**
+** so a parameter file without them reads as it always has.
+*/
+
+#ifndef LBM_STEADY_H
+#define LBM_STEADY_H
+
+#include<stdio.h>
+#include<stdlib.h>
+#include<string.h>
+#include<math.h>
+
+#define LBM_STEADY_WINDOW  1000  /* default window */
+
+typedef struct {
+  float  tolerance;   /* relative change to stop below, 0 for none */
+  int    window;      /* timesteps the av. velocity is measured over */
+  int    l2_stride;   /* timesteps between samples of the field, 0 for none */
+  float* history;     /* the last window av. velocities, a ring */
+  int    count;       /* av. velocities added */
+  int    ncells;      /* cells in a sample of the field */
+  float* last_u;      /* u_x then u_y at the last sample */
+  int    samples;     /* samples of the field taken */
+  double l2_change;   /* relative change between the last two samples */
+} lbm_steady;
+
+/* read the optional lines of the parameter file; returns 0, or -1
+** with the name of the line that could not be read in *what */
+static inline int lbm_steady_read(FILE* fp, lbm_steady* steady, const char** what)
+{
+  int retval;
+
+  memset(steady, 0, sizeof(*steady));
+  steady->window = LBM_STEADY_WINDOW;
+
+  if ((retval = fscanf(fp, "%f\n", &steady->tolerance)) == EOF) return 0;
+  *what = "tolerance";
+  if (retval != 1 || steady->tolerance < 0.0f) return -1;
+  if ((retval = fscanf(fp, "%d\n", &steady->window)) == EOF) return 0;
+  *what = "window";
+  if (retval != 1 || steady->window < 1) return -1;
+  if ((retval = fscanf(fp, "%d\n", &steady->l2_stride)) == EOF) return 0;
+  *what = "l2 stride";
+  if (retval != 1 || steady->l2_stride < 0) return -1;
+
+  return 0;
+}
+
+/* allocate the history, and the last sample of a field of ncells cells;
+** returns 0, or -1 if out of memory */
+static inline int lbm_steady_init(lbm_steady* steady, const int ncells)
+{
+  steady->count = 0;
+  steady->samples = 0;
+  steady->ncells = ncells;
+  if (steady->tolerance <= 0.0f) return 0;
+  steady->history = (float*)malloc(sizeof(float) * steady->window);
+  if (steady->history == NULL) return -1;
+  if (steady->l2_stride) {
+    steady->last_u = (float*)malloc(sizeof(float) * 2 * (size_t)ncells);
+    if (steady->last_u == NULL) return -1;
+  }
+  return 0;
+}
+
+static inline void lbm_steady_free(lbm_steady* steady)
+{
+  free(steady->history);
+  free(steady->last_u);
+  steady->history = steady->last_u = NULL;
+}
+
+/* put back the samples of the field taken before a checkpoint: samples
+** of them, l2_change between the last two, and last_u, the last (NULL
+** if none); a detection without samples ignores them */
+static inline void lbm_steady_resume(lbm_steady* steady, const int samples, const double l2_change,
+                                     const float* last_u)
+{
+  if (steady->last_u == NULL || last_u == NULL) return;
+  memcpy(steady->last_u, last_u, sizeof(float) * 2 * (size_t)steady->ncells);
+  steady->samples = samples;
+  steady->l2_change = l2_change;
+}
+
+static inline void lbm_steady_add(lbm_steady* steady, const float av_vel)
+{
+  steady->history[steady->count++ % steady->window] = av_vel;
+}
+
+/* TRUE if the field is due to be sampled after this many timesteps */
+static inline int lbm_steady_sample_due(const lbm_steady* steady, const int iterations)
+{
+  return steady->tolerance > 0.0f && steady->l2_stride && iterations % steady->l2_stride == 0;
+}
+
+/* sums[0] += the squares of the change of the field since the last
+** sample, sums[1] += the squares of the field; the field is kept for
+** the next sample. Ranks holding parts of the grid add up their sums
+** before lbm_steady_sampled. */
+static inline void lbm_steady_field_sums(lbm_steady* steady, const float* u_x, const float* u_y,
+                                         double sums[2])
+{
+  float* last_x = steady->last_u;
+  float* last_y = steady->last_u + steady->ncells;
+  double du;
+  int    ii;
+
+  for (ii = 0; ii < steady->ncells; ii++) {
+    du = (double)u_x[ii] - last_x[ii];
+    sums[0] += du * du;
+    du = (double)u_y[ii] - last_y[ii];
+    sums[0] += du * du;
+    sums[1] += (double)u_x[ii] * u_x[ii] + (double)u_y[ii] * u_y[ii];
+  }
+  memcpy(last_x, u_x, sizeof(float) * steady->ncells);
+  memcpy(last_y, u_y, sizeof(float) * steady->ncells);
+}
+
+/* record a sample of the field from the sums over the whole grid */
+static inline void lbm_steady_sampled(lbm_steady* steady, const double sums[2])
+{
+  if (steady->samples++ > 0) {
+    steady->l2_change = (sums[1] > 0.0) ? sqrt(sums[0] / sums[1]) : (sums[0] > 0.0) ? HUGE_VAL : 0.0;
+  }
+}
+
+/* take a sample of the whole field */
+static inline void lbm_steady_sample(lbm_steady* steady, const float* u_x, const float* u_y)
+{
+  double sums[2] = { 0.0, 0.0 };
+
+  lbm_steady_field_sums(steady, u_x, u_y, sums);
+  lbm_steady_sampled(steady, sums);
+}
+
+/* TRUE once the flow is steady */
+static inline int lbm_steady_converged(const lbm_steady* steady)
+{
+  float lo, hi, latest;
+  int   ii;
+
+  if (steady->tolerance <= 0.0f || steady->count < steady->window) return 0;
+  if (steady->l2_stride && (steady->samples < 2 || steady->l2_change >= steady->tolerance)) return 0;
+
+  latest = steady->history[(steady->count - 1) % steady->window];
+  lo = hi = latest;
+  for (ii = 0; ii < steady->window; ii++) {
+    if (steady->history[ii] < lo) lo = steady->history[ii];
+    if (steady->history[ii] > hi) hi = steady->history[ii];
+  }
+  return hi - lo <= steady->tolerance * fabsf(latest);
+}
+
+/* put back the av. velocities of the window before timestep start, of
+** the av. velocities of every timestep before it (as a checkpoint holds
+** them), as a run resumed there would have them */
+static inline void lbm_steady_replay(lbm_steady* steady, const float* av_vels, const int start)
+{
+  int ii;
+
+  if (steady->tolerance <= 0.0f) return;
+  for (ii = (start > steady->window) ? start - steady->window : 0; ii < start; ii++) {
+    lbm_steady_add(steady, av_vels[ii]);
+  }
+}
+
+#endif
@@ -0,0 +1,344 @@
+/*
+** Formatting of the text output of the d2q9-bgk solvers without
+** printf, so that threads can format disjoint parts of a file into
+** their own buffers.
+**
+** lbm_format_e12 writes a float exactly as printf("%.12E") does. A
+** float is a 24 bit mantissa times a power of two, so the value scaled
+** by a power of ten to thirteen digits is an exact ratio of integers:
+** the quotient gives the digits and the remainder decides the rounding,
+** half to even, as glibc rounds an exact tie in the default rounding
+** mode. Values down to about 1E-19 fit in 128 bit integers; smaller
+** ones take a slower path through a small big integer type.
+*/
+
+#ifndef LBM_TEXT_H
+#define LBM_TEXT_H
+
+#include<stdio.h>
+#include<string.h>
+#include<stdint.h>
+#include<math.h>
+
+#define LBM_E12_DIGITS  13   /* significant digits of %.12E */
+#define LBM_E12_MAX     20   /* longest %.12E of a float, with the NUL */
+#define LBM_INT_MAX     12   /* longest %d of an int, with the NUL */
+
+/* final_state.dat: "%d %d %.12E %.12E %.12E %d\n" */
+#define LBM_STATE_LINE_MAX  (3 * LBM_INT_MAX + 3 * LBM_E12_MAX)
+/* av_vels.dat: "%d:\t%.12E\n" */
+#define LBM_AVVELS_LINE_MAX (LBM_INT_MAX + LBM_E12_MAX + 3)
+
+/* enough 32 bit limbs for m * 10^45 (denormals) and m * 2^104 (FLT_MAX) */
+#define LBM_BN_LIMBS    10
+
+/* unsigned big integer, least significant limb first */
+typedef struct {
+  int      n;                    /* no. of limbs in use */
+  uint32_t d[LBM_BN_LIMBS];
+} lbm_bignum;
+
+static inline void lbm_bn_set(lbm_bignum* a, const uint32_t value)
+{
+  a->d[0] = value;
+  a->n = (value != 0);
+}
+
+static inline void lbm_bn_mul_small(lbm_bignum* a, const uint32_t factor)
+{
+  uint64_t carry = 0;
+  int ii;
+
+  for (ii = 0; ii < a->n; ii++) {
+    carry += (uint64_t)a->d[ii] * factor;
+    a->d[ii] = (uint32_t)carry;
+    carry >>= 32;
+  }
+  if (carry) a->d[a->n++] = (uint32_t)carry;
+}
+
+static inline void lbm_bn_mul_pow10(lbm_bignum* a, int power)
+{
+  for (; power >= 9; power -= 9) lbm_bn_mul_small(a, 1000000000u);
+  for (; power > 0; power--) lbm_bn_mul_small(a, 10u);
+}
+
+static inline void lbm_bn_shl(lbm_bignum* a, const int bits)
+{
+  const int limbs = bits / 32;
+  const int shift = bits % 32;
+  int ii;
+
+  if (a->n == 0) return;
+  if (shift) {
+    uint32_t carry = 0;
+    for (ii = 0; ii < a->n; ii++) {
+      const uint32_t next = a->d[ii] >> (32 - shift);
+      a->d[ii] = (a->d[ii] << shift) | carry;
+      carry = next;
+    }
+    if (carry) a->d[a->n++] = carry;
+  }
+  if (limbs) {
+    for (ii = a->n - 1; ii >= 0; ii--) a->d[ii + limbs] = a->d[ii];
+    for (ii = 0; ii < limbs; ii++) a->d[ii] = 0;
+    a->n += limbs;
+  }
+}
+
+static inline int lbm_bn_cmp(const lbm_bignum* a, const lbm_bignum* b)
+{
+  int ii;
+
+  if (a->n != b->n) return (a->n < b->n) ? -1 : 1;
+  for (ii = a->n - 1; ii >= 0; ii--) {
+    if (a->d[ii] != b->d[ii]) return (a->d[ii] < b->d[ii]) ? -1 : 1;
+  }
+
+  return 0;
+}
+
+/* a -= b, for a >= b */
+static inline void lbm_bn_sub(lbm_bignum* a, const lbm_bignum* b)
+{
+  int64_t borrow = 0;
+  int ii;
+
+  for (ii = 0; ii < a->n; ii++) {
+    borrow += (int64_t)a->d[ii] - (ii < b->n ? b->d[ii] : 0);
+    a->d[ii] = (uint32_t)borrow;
+    borrow >>= 32;
+  }
+  while (a->n > 0 && a->d[a->n - 1] == 0) a->n--;
+}
+
+/* write value as "%d" would; returns the no. of chars, without a NUL */
+static inline int lbm_format_int(char* out, const int value)
+{
+  char     digits[LBM_INT_MAX];
+  unsigned magnitude = (value < 0) ? 0u - (unsigned)value : (unsigned)value;
+  int      nn = 0, len = 0;
+
+  do {
+    digits[nn++] = '0' + magnitude % 10;
+    magnitude /= 10;
+  } while (magnitude);
+  if (value < 0) out[len++] = '-';
+  while (nn) out[len++] = digits[--nn];
+
+  return len;
+}
+
+/* 10^19, the largest power of ten in 64 bits, to build the larger ones from */
+#define LBM_E19  ((unsigned __int128)10000000000000000000ull)
+
+/*
+** The thirteen digits of mant * 2^e2 as an integer in [10^12, 10^13),
+** rounded half to even, for a decimal exponent exp10 guessed to within
+** one; returns 0 if the value is out of reach of 128 bit arithmetic.
+*/
+static inline int lbm_e12_u128(const uint32_t mant, const int e2, int* exp10, uint64_t* digits)
+{
+  /* powers of ten up to 10^38, constant, so any thread may format */
+  static const unsigned __int128 pow10[39] = {
+    1ull, 10ull, 100ull, 1000ull, 10000ull, 100000ull, 1000000ull, 10000000ull, 100000000ull,
+    1000000000ull, 10000000000ull, 100000000000ull, 1000000000000ull, 10000000000000ull,
+    100000000000000ull, 1000000000000000ull, 10000000000000000ull, 100000000000000000ull,
+    1000000000000000000ull, 10000000000000000000ull, LBM_E19 * 10ull, LBM_E19 * 100ull,
+    LBM_E19 * 1000ull, LBM_E19 * 10000ull, LBM_E19 * 100000ull, LBM_E19 * 1000000ull,
+    LBM_E19 * 10000000ull, LBM_E19 * 100000000ull, LBM_E19 * 1000000000ull,
+    LBM_E19 * 10000000000ull, LBM_E19 * 100000000000ull, LBM_E19 * 1000000000000ull,
+    LBM_E19 * 10000000000000ull, LBM_E19 * 100000000000000ull, LBM_E19 * 1000000000000000ull,
+    LBM_E19 * 10000000000000000ull, LBM_E19 * 100000000000000000ull,
+    LBM_E19 * 1000000000000000000ull, LBM_E19 * 10000000000000000000ull
+  };
+  const uint64_t lower = 1000000000000ull;   /* 10^12 */
+  const uint64_t upper = 10000000000000ull;  /* 10^13 */
+  unsigned __int128 num, den, quot, rem;
+  int kk, tries;
+
+  for (tries = 0; tries < 3; tries++) {
+    kk = 12 - *exp10;              /* scale by 10^kk */
+    if (kk >= 0) {
+      if (kk > 31 || e2 <= -128) return 0;
+      num = (unsigned __int128)mant * pow10[kk];
+      if (e2 >= 0) {
+        num <<= e2;
+        quot = num;
+        rem = 0;
+        den = 1;
+      }
+      else {
+        quot = num >> -e2;
+        rem = num - (quot << -e2);
+        den = (unsigned __int128)1 << -e2;
+      }
+    }
+    else {
+      if (-kk > 38 || e2 < 0) return 0;
+      num = (unsigned __int128)mant << e2;
+      den = pow10[-kk];
+      quot = num / den;
+      rem = num - quot * den;
+    }
+    if (quot < lower) (*exp10)--;
+    else if (quot >= upper) (*exp10)++;
+    else break;
+  }
+  if (tries == 3) return 0;
+
+  /* round half to even on the remainder */
+  if (2 * rem > den || (2 * rem == den && (quot & 1))) quot++;
+  if (quot == upper) {
+    quot = lower;
+    (*exp10)++;
+  }
+  *digits = (uint64_t)quot;
+
+  return 1;
+}
+
+/*
+** The same for any float, through big integers: |value| = r / s is
+** scaled by a power of ten into [1, 10) and the digits are generated
+** by repeated subtraction.
+*/
+static inline void lbm_e12_bignum(const uint32_t mant, const int e2, int* exp10, char* digits)
+{
+  lbm_bignum r, s, t;
+  int ii, cmp;
+
+  lbm_bn_set(&r, mant);
+  lbm_bn_set(&s, 1);
+  if (e2 > 0) lbm_bn_shl(&r, e2);
+  else lbm_bn_shl(&s, -e2);
+
+  /* the estimate of the decimal exponent is out by at most one */
+  if (*exp10 > 0) lbm_bn_mul_pow10(&s, *exp10);
+  else lbm_bn_mul_pow10(&r, -*exp10);
+  if (lbm_bn_cmp(&r, &s) < 0) {
+    lbm_bn_mul_small(&r, 10);
+    (*exp10)--;
+  }
+  else {
+    t = s;
+    lbm_bn_mul_small(&t, 10);
+    if (lbm_bn_cmp(&r, &t) >= 0) {
+      s = t;
+      (*exp10)++;
+    }
+  }
+
+  /* generate the digits; r is left holding the remainder */
+  for (ii = 0; ii < LBM_E12_DIGITS; ii++) {
+    int digit = 0;
+    while (lbm_bn_cmp(&r, &s) >= 0) {
+      lbm_bn_sub(&r, &s);
+      digit++;
+    }
+    digits[ii] = digit;
+    if (ii < LBM_E12_DIGITS - 1) lbm_bn_mul_small(&r, 10);
+  }
+
+  /* round half to even on the remainder */
+  lbm_bn_mul_small(&r, 2);
+  cmp = lbm_bn_cmp(&r, &s);
+  if (cmp > 0 || (cmp == 0 && (digits[LBM_E12_DIGITS - 1] & 1))) {
+    for (ii = LBM_E12_DIGITS - 1; ii >= 0 && digits[ii] == 9; ii--) digits[ii] = 0;
+    if (ii >= 0) digits[ii]++;
+    else {
+      digits[0] = 1;
+      (*exp10)++;
+    }
+  }
+}
+
+/* write value as "%.12E" would; returns the no. of chars, without a NUL */
+static inline int lbm_format_e12(char* out, const float value)
+{
+  char     digits[LBM_E12_DIGITS];
+  uint64_t quot;
+  uint32_t bits, mant;
+  int      biased, e2, exp10, ii, len = 0;
+
+  memcpy(&bits, &value, sizeof(bits));
+  biased = (bits >> 23) & 0xff;
+  mant = bits & 0x7fffff;
+
+  /* inf and nan are spelt by the C library */
+  if (biased == 0xff) {
+    char buf[LBM_E12_MAX];
+    len = snprintf(buf, sizeof(buf), "%.12E", value);
+    memcpy(out, buf, len);
+    return len;
+  }
+  if (bits >> 31) out[len++] = '-';
+  if (biased == 0 && mant == 0) {
+    memcpy(out + len, "0.000000000000E+00", 18);
+    return len + 18;
+  }
+
+  /* |value| = mant * 2^e2, with a decimal exponent out by at most one */
+  if (biased) mant |= 0x800000;
+  e2 = biased ? biased - 150 : -149;
+  exp10 = (int)floor(log10((double)mant) + e2 * 0.30102999566398119521);
+
+  if (lbm_e12_u128(mant, e2, &exp10, &quot)) {
+    for (ii = LBM_E12_DIGITS - 1; ii >= 0; ii--) {
+      digits[ii] = quot % 10;
+      quot /= 10;
+    }
+  }
+  else {
+    lbm_e12_bignum(mant, e2, &exp10, digits);
+  }
+
+  out[len++] = '0' + digits[0];
+  out[len++] = '.';
+  for (ii = 1; ii < LBM_E12_DIGITS; ii++) out[len++] = '0' + digits[ii];
+  out[len++] = 'E';
+  out[len++] = (exp10 < 0) ? '-' : '+';
+  if (exp10 < 0) exp10 = -exp10;
+  out[len++] = '0' + exp10 / 10;
+  out[len++] = '0' + exp10 % 10;
+
+  return len;
+}
+
+/* one line of final_state.dat; returns its length */
+static inline int lbm_format_state_line(char* out, const int ii, const int jj, const float u_x,
+                                        const float u_y, const float pressure, const int obstacle)
+{
+  int len = 0;
+
+  len += lbm_format_int(out + len, ii);
+  out[len++] = ' ';
+  len += lbm_format_int(out + len, jj);
+  out[len++] = ' ';
+  len += lbm_format_e12(out + len, u_x);
+  out[len++] = ' ';
+  len += lbm_format_e12(out + len, u_y);
+  out[len++] = ' ';
+  len += lbm_format_e12(out + len, pressure);
+  out[len++] = ' ';
+  len += lbm_format_int(out + len, obstacle);
+  out[len++] = '\n';
+
+  return len;
+}
+
+/* one line of av_vels.dat; returns its length */
+static inline int lbm_format_avvels_line(char* out, const int ii, const float av_vel)
+{
+  int len = 0;
+
+  len += lbm_format_int(out + len, ii);
+  out[len++] = ':';
+  out[len++] = '\t';
+  len += lbm_format_e12(out + len, av_vel);
+  out[len++] = '\n';
+
+  return len;
+}
+
+#endif
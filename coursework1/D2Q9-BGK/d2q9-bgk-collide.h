@@ -0,0 +1,114 @@
+/*
+** The rebound and collision of rows first to last-1 of the grid: the
+** body of rebound_or_collision() in d2q9-bgk.c, with params its
+** argument, and of the kernels d2q9-bgk.exe --jit compiles for a run,
+** with params a static const holding the width of the grid, omega and
+** the populations at rest of the run, which the compiler folds in.
+** Either way LOAD, STORE, NSPEEDS and t_speed are defined before it.
+*/
+
+  int ii,jj,kk;                 /* generic counters */
+  const float c_sq = 1.0/3.0;  /* square of speed of sound */
+  const float w0 = 4.0/9.0;    /* weighting factor */
+  const float w1 = 1.0/9.0;    /* weighting factor */
+  const float w2 = 1.0/36.0;   /* weighting factor */
+  float u_x,u_y;               /* av. velocities in x and y directions */
+  float u[NSPEEDS];            /* directional velocities */
+  float d_equ[NSPEEDS];        /* equilibrium densities */
+  float u_sq;                  /* squared velocity */
+  float local_density;         /* sum of densities in a particular cell */
+  float speeds[NSPEEDS];       /* densities of the cell, widened to float */
+
+  /* loop over the cells of the rows
+  ** NB the collision step is called after
+  ** the propagate step and so values of interest
+  ** are in the scratch-space grid */
+  for(ii=first;ii<last;ii++) {
+    for(jj=0;jj<params.nx;jj++) {
+      /* if the cell contains an obstacle */
+      if(obstacles[ii*params.nx + jj]) {
+          /* called after propagate, so taking values from scratch space
+          ** mirroring, and writing into main grid; opposite directions
+          ** have the same weight, so the values move as they are stored */
+          cells[ii*params.nx + jj].speeds[1] = tmp_cells[ii*params.nx + jj].speeds[3];
+          cells[ii*params.nx + jj].speeds[2] = tmp_cells[ii*params.nx + jj].speeds[4];
+          cells[ii*params.nx + jj].speeds[3] = tmp_cells[ii*params.nx + jj].speeds[1];
+          cells[ii*params.nx + jj].speeds[4] = tmp_cells[ii*params.nx + jj].speeds[2];
+          cells[ii*params.nx + jj].speeds[5] = tmp_cells[ii*params.nx + jj].speeds[7];
+          cells[ii*params.nx + jj].speeds[6] = tmp_cells[ii*params.nx + jj].speeds[8];
+          cells[ii*params.nx + jj].speeds[7] = tmp_cells[ii*params.nx + jj].speeds[5];
+          cells[ii*params.nx + jj].speeds[8] = tmp_cells[ii*params.nx + jj].speeds[6];
+      } else {
+          /* compute local density total */
+          local_density = 0.0;
+          for(kk=0;kk<NSPEEDS;kk++) {
+            speeds[kk] = LOAD(tmp_cells[ii*params.nx + jj],kk);
+            local_density += speeds[kk];
+          }
+          /* compute x velocity component */
+          u_x = (speeds[1] + 
+                 speeds[5] + 
+                 speeds[8]
+                 - (speeds[3] + 
+                    speeds[6] + 
+                    speeds[7]))
+            / local_density;
+          /* compute y velocity component */
+          u_y = (speeds[2] + 
+                 speeds[5] + 
+                 speeds[6]
+                 - (speeds[4] + 
+                    speeds[7] + 
+                    speeds[8]))
+            / local_density;
+          /* velocity squared */ 
+          u_sq = u_x * u_x + u_y * u_y;
+          /* directional velocity components */
+          u[1] =   u_x;        /* east */
+          u[2] =         u_y;  /* north */
+          u[3] = - u_x;        /* west */
+          u[4] =       - u_y;  /* south */
+          u[5] =   u_x + u_y;  /* north-east */
+          u[6] = - u_x + u_y;  /* north-west */
+          u[7] = - u_x - u_y;  /* south-west */
+          u[8] =   u_x - u_y;  /* south-east */
+          /* equilibrium densities */
+          /* zero velocity density: weight w0 */
+          d_equ[0] = w0 * local_density * (1.0 - u_sq * (1.0 / (2.0 * c_sq)));
+          /* axis speeds: weight w1 */
+          d_equ[1] = w1 * local_density * (1.0 + u[1] * (1.0 / c_sq)
+                           + (u[1] * u[1]) * (1.0 / (2.0 * c_sq * c_sq))
+                           - u_sq * (1.0 / (2.0 * c_sq)));
+          d_equ[2] = w1 * local_density * (1.0 + u[2] * (1.0 / c_sq)
+                           + (u[2] * u[2]) * (1.0 / (2.0 * c_sq * c_sq))
+                           - u_sq * (1.0 / (2.0 * c_sq)));
+          d_equ[3] = w1 * local_density * (1.0 + u[3] * (1.0 / c_sq)
+                           + (u[3] * u[3]) * (1.0 / (2.0 * c_sq * c_sq))
+                           - u_sq * (1.0 / (2.0 * c_sq)));
+          d_equ[4] = w1 * local_density * (1.0 + u[4] * (1.0 / c_sq)
+                           + (u[4] * u[4]) * (1.0 / (2.0 * c_sq * c_sq))
+                           - u_sq * (1.0 / (2.0 * c_sq)));
+          /* diagonal speeds: weight w2 */
+          d_equ[5] = w2 * local_density * (1.0 + u[5] * (1.0 / c_sq)
+                           + (u[5] * u[5]) * (1.0 / (2.0 * c_sq * c_sq))
+                           - u_sq * (1.0 / (2.0 * c_sq)));
+          d_equ[6] = w2 * local_density * (1.0 + u[6] * (1.0 / c_sq)
+                           + (u[6] * u[6]) * (1.0 / (2.0 * c_sq * c_sq))
+                           - u_sq * (1.0 / (2.0 * c_sq)));
+          d_equ[7] = w2 * local_density * (1.0 + u[7] * (1.0 / c_sq)
+                           + (u[7] * u[7]) * (1.0 / (2.0 * c_sq * c_sq))
+                           - u_sq * (1.0 / (2.0 * c_sq)));
+          d_equ[8] = w2 * local_density * (1.0 + u[8] * (1.0 / c_sq)
+                           + (u[8] * u[8]) * (1.0 / (2.0 * c_sq * c_sq))
+                           - u_sq * (1.0 / (2.0 * c_sq)));
+          /* relaxation step */
+          for(kk=0;kk<NSPEEDS;kk++) {
+            STORE(cells[ii*params.nx + jj],kk, (speeds[kk]
+                               + params.omega * 
+                               (d_equ[kk] - speeds[kk])));
+          }
+      }
+    }
+  }
+
+  return EXIT_SUCCESS;
@@ -0,0 +1,633 @@
+/*
+** Code to run an ensemble of d2q9-bgk lattice boltzmann simulations,
+** one geometry at several (accel, omega) pairs, in a single sweep of
+** the grid.
+**
+** The 'speeds' in each cell are numbered as follows:
+**
+** 6 2 5
+**  \|/
+** 3-0-1
+**  /|\
+** 7 4 8
+**
+** Each 'speed' of a cell holds a small vector, one lane per member of
+** the ensemble:
+**
+**  --- --- --- --- --- --- --- --- --- ---
+** | speed 0: m0 m1 ... | speed 1: m0 ... | ...
+**  --- --- --- --- --- --- --- --- --- ---
+**
+** so the obstacles and the neighbour indices are worked out once for
+** all the members, propagation moves a whole vector at a time and the
+** collision runs over the lanes, each with its own accel and omega, in
+** SIMD. The width is fixed when built, MEMBERS lanes (make MEMBERS=16,
+** 8 by default); an ensemble of fewer members fills the spare lanes
+** with copies of its last member, which are not written out.
+**
+** The names of the input parameter, obstacle and ensemble files are
+** passed on the command line, e.g.:
+**
+**   d2q9-bgk-ensemble.exe input.params obstacles.dat ensemble.txt
+**
+** The parameter file is that of d2q9-bgk.exe; the ensemble file has a
+** line 'accel omega' per member, which replace those of the parameter
+** file. Member m, counting from 0, writes av_vels_<m>.dat and
+** final_state_<m>.dat with m in two digits (av_vels_00.dat for the
+** first), as d2q9-bgk.exe would have for its parameters, to the bit.
+*/
+
+#include<stdio.h>
+#include<stdlib.h>
+#include<string.h>
+#include<time.h>
+#include<sys/time.h>
+#include<sys/resource.h>
+#include<omp.h>
+#include"lbm_io.h"
+#include"lbm_reduce.h"
+
+#define NSPEEDS         9
+#define FINALSTATEFILE  "final_state_%02d.dat"
+#define AVVELSFILE      "av_vels_%02d.dat"
+
+#ifndef MEMBERS
+#define MEMBERS         8     /* lanes of a cell, the most members of an ensemble */
+#endif
+
+/* struct to hold the parameter values */
+typedef struct {
+  int    nx;            /* no. of cells in x-direction */
+  int    ny;            /* no. of cells in y-direction */
+  int    maxIters;      /* no. of iterations */
+  int    reynolds_dim;  /* dimension for Reynolds number */
+  int    members;       /* no. of members of the ensemble */
+  float density;       /* density per link */
+  float accel[MEMBERS]; /* density redistribution of each lane */
+  float omega[MEMBERS]; /* relaxation parameter of each lane */
+} t_param;
+
+/* one 'speed' value of a cell, for every lane */
+typedef struct {
+  float m[MEMBERS];
+} t_lanes;
+
+/* struct to hold the 'speed' values */
+typedef struct {
+  t_lanes speeds[NSPEEDS];
+} t_speed;
+
+enum boolean { FALSE, TRUE };
+
+/*
+** function prototypes
+*/
+
+/* load params, allocate memory, load obstacles & initialise fluid particle densities */
+int initialise(const char* paramfile, const char* obstaclefile, const char* ensemblefile,
+           t_param* params, t_speed** cells_ptr, t_speed** tmp_cells_ptr,
+           int** obstacles_ptr, float** av_vels_ptr);
+
+/*
+** The main calculation methods.
+** timestep calls, in order, the functions:
+** accelerate_flow() & propagate_and_collide(), which leaves
+** the next state of the grid in tmp_cells
+*/
+int timestep(const t_param params, t_speed* cells, t_speed* tmp_cells, int* obstacles);
+int accelerate_flow(const t_param params, t_speed* cells, int* obstacles);
+int propagate_and_collide(const t_param params, t_speed* cells, t_speed* tmp_cells, int* obstacles);
+int write_values(const t_param params, t_speed* cells, int* obstacles, float* av_vels);
+
+/* finalise, including freeing up allocated memory */
+int finalise(const t_param* params, t_speed** cells_ptr, t_speed** tmp_cells_ptr,
+         int** obstacles_ptr, float** av_vels_ptr);
+
+/* compute the average velocity of every lane */
+void av_velocity(const t_param params, t_speed* cells, int* obstacles, float* av_u_x);
+
+/* calculate the Reynolds number of a member */
+float calc_reynolds(const t_param params, const int member, const float av_vel);
+
+/* utility functions */
+void die(const char* message, const int line, const char *file);
+void usage(const char* exe);
+
+/*
+** main program:
+** initialise, timestep loop, finalise
+*/
+int main(int argc, char* argv[])
+{
+  char*    paramfile;         /* name of the input parameter file */
+  char*    obstaclefile;      /* name of a the input obstacle file */
+  char*    ensemblefile;      /* name of the file of the members' accel and omega */
+  t_param  params;            /* struct to hold parameter values */
+  t_speed* cells     = NULL;  /* grid containing fluid densities */
+  t_speed* tmp_cells = NULL;  /* scratch space */
+  int*     obstacles = NULL;  /* grid indicating which cells are blocked */
+  float*   av_vels   = NULL;  /* a record of the av. velocity of each lane, per timestep */
+  t_speed* swap;              /* to exchange the grids */
+  float    av_vel[MEMBERS];   /* the av. velocities of the last timestep */
+  int      ii,mm;             /* generic counters */
+  struct timeval timstr;      /* structure to hold elapsed time */
+  struct rusage ru;           /* structure to hold CPU time--system and user */
+  double tic,toc;             /* floating point numbers to calculate elapsed wallclock time */
+  double usrtim;              /* floating point number to record elapsed user CPU time */
+  double systim;              /* floating point number to record elapsed system CPU time */
+
+  /* parse the command line */
+  if(argc != 4) usage(argv[0]);
+  paramfile = argv[1];
+  obstaclefile = argv[2];
+  ensemblefile = argv[3];
+
+  /* initialise our data structures and load values from file */
+  initialise(paramfile, obstaclefile, ensemblefile, &params, &cells, &tmp_cells, &obstacles, &av_vels);
+
+  /* iterate for maxIters timesteps */
+  gettimeofday(&timstr,NULL);
+  tic=timstr.tv_sec+(timstr.tv_usec/1000000.0);
+
+  for (ii=0;ii<params.maxIters;ii++) {
+    timestep(params,cells,tmp_cells,obstacles);
+    swap = cells;
+    cells = tmp_cells;
+    tmp_cells = swap;
+    av_velocity(params,cells,obstacles,&av_vels[ii*MEMBERS]);
+#ifdef DEBUG
+    printf("==timestep: %d==\n",ii);
+    for (mm=0;mm<params.members;mm++) printf("member %d av velocity: %.12E\n", mm, av_vels[ii*MEMBERS + mm]);
+#endif
+  }
+
+  gettimeofday(&timstr,NULL);
+  toc=timstr.tv_sec+(timstr.tv_usec/1000000.0);
+  getrusage(RUSAGE_SELF, &ru);
+  timstr=ru.ru_utime;
+  usrtim=timstr.tv_sec+(timstr.tv_usec/1000000.0);
+  timstr=ru.ru_stime;
+  systim=timstr.tv_sec+(timstr.tv_usec/1000000.0);
+
+  /* write final values and free memory */
+  printf("==done==\n");
+  av_velocity(params,cells,obstacles,av_vel);
+  for (mm=0;mm<params.members;mm++) {
+    printf("Member %d (accel %g, omega %g) Reynolds number:\t%.12E\n", mm,
+           params.accel[mm], params.omega[mm], calc_reynolds(params,mm,av_vel[mm]));
+  }
+  printf("Elapsed time:\t\t\t%.6lf (s)\n", toc-tic);
+  printf("Elapsed user CPU time:\t\t%.6lf (s)\n", usrtim);
+  printf("Elapsed system CPU time:\t%.6lf (s)\n", systim);
+  printf("Cell updates per second:\t%.3lf M per member, %.3lf M in all\n",
+         (double)params.nx * params.ny * params.maxIters / (toc-tic) / 1.0e6,
+         (double)params.nx * params.ny * params.maxIters * params.members / (toc-tic) / 1.0e6);
+  write_values(params,cells,obstacles,av_vels);
+  finalise(&params, &cells, &tmp_cells, &obstacles, &av_vels);
+
+  return EXIT_SUCCESS;
+}
+
+int timestep(const t_param params, t_speed* cells, t_speed* tmp_cells, int* obstacles)
+{
+  accelerate_flow(params,cells,obstacles);
+  propagate_and_collide(params,cells,tmp_cells,obstacles);
+  return EXIT_SUCCESS;
+}
+
+int accelerate_flow(const t_param params, t_speed* cells, int* obstacles)
+{
+  int ii,mm;            /* generic counters */
+  float w1[MEMBERS];   /* weighting factors of each lane */
+  float w2[MEMBERS];
+  t_speed* cell;        /* the first cell of a row */
+
+  /* compute weighting factors */
+  for(mm=0;mm<MEMBERS;mm++) {
+    w1[mm] = params.density * params.accel[mm] / 9.0;
+    w2[mm] = params.density * params.accel[mm] / 36.0;
+  }
+
+  /* modify the first column of the grid */
+#pragma omp parallel for private(mm, cell)
+  for(ii=0;ii<params.ny;ii++) {
+    if (obstacles[ii*params.nx]) continue;
+    cell = &cells[ii*params.nx];
+    /* in each lane, if we don't send a density negative */
+#pragma omp simd
+    for(mm=0;mm<MEMBERS;mm++) {
+      if( (cell->speeds[3].m[mm] - w1[mm]) > 0.0 &&
+          (cell->speeds[6].m[mm] - w2[mm]) > 0.0 &&
+          (cell->speeds[7].m[mm] - w2[mm]) > 0.0 ) {
+        /* increase 'east-side' densities */
+        cell->speeds[1].m[mm] += w1[mm];
+        cell->speeds[5].m[mm] += w2[mm];
+        cell->speeds[8].m[mm] += w2[mm];
+        /* decrease 'west-side' densities */
+        cell->speeds[3].m[mm] -= w1[mm];
+        cell->speeds[6].m[mm] -= w2[mm];
+        cell->speeds[7].m[mm] -= w2[mm];
+      }
+    }
+  }
+
+  return EXIT_SUCCESS;
+}
+
+/* relax a 'speed' of weight w, along which the velocity is u, towards
+** its equilibrium; in the arithmetic of d2q9-bgk.exe, so that each lane
+** comes out as its run would (for the centre, u = 0 adds exact zeros) */
+static inline float relax(const float speed, const float w, const float local_density,
+                          const float u, const float u_sq, const float omega)
+{
+  const float c_sq = 1.0/3.0;  /* square of speed of sound */
+  float d_equ;                 /* equilibrium density */
+
+  d_equ = w * local_density * (1.0 + u * (1.0 / c_sq)
+                               + (u * u) * (1.0 / (2.0 * c_sq * c_sq))
+                               - u_sq * (1.0 / (2.0 * c_sq)));
+  return speed + omega * (d_equ - speed);
+}
+
+/*
+** The lanes make a cell nine times MEMBERS floats, so a grid soon
+** outgrows the caches; rather than propagate into the scratch space and
+** read it back to collide, each cell pulls its 'speeds' in from its
+** neighbours and collides them, and the result goes to the scratch
+** space, which becomes the grid for the next timestep.
+*/
+int propagate_and_collide(const t_param params, t_speed* cells, t_speed* tmp_cells, int* obstacles)
+{
+  int ii,jj,kk,mm;              /* generic counters */
+  int x_e,x_w,y_n,y_s;          /* indices of neighbouring cells */
+  const float w0 = 4.0/9.0;    /* weighting factor */
+  const float w1 = 1.0/9.0;    /* weighting factor */
+  const float w2 = 1.0/36.0;   /* weighting factor */
+  float u_x,u_y;               /* av. velocities in x and y directions */
+  float u_sq;                  /* squared velocity */
+  float local_density;         /* sum of densities in a particular cell */
+  t_speed  cell;                /* the cell after propagation */
+  t_speed* in;
+  t_speed* out;                 /* the cell after collision */
+
+  /* loop over _all_ cells */
+#pragma omp parallel for private(jj, kk, mm, x_e, x_w, y_n, y_s, u_x, u_y, u_sq, local_density, cell, in, out)
+  for(ii=0;ii<params.ny;ii++) {
+    in = &cell;
+    for(jj=0;jj<params.nx;jj++) {
+      /* determine indices of axis-direction neighbours
+      ** respecting periodic boundary conditions (wrap around) */
+      y_n = (ii + 1) % params.ny;
+      x_e = (jj + 1) % params.nx;
+      y_s = (ii == 0) ? (ii + params.ny - 1) : (ii - 1);
+      x_w = (jj == 0) ? (jj + params.nx - 1) : (jj - 1);
+      /* pull in the densities travelling into this cell; every lane
+      ** moves together */
+      in->speeds[0] = cells[ii *params.nx + jj].speeds[0];   /* central cell, no movement */
+      in->speeds[1] = cells[ii *params.nx + x_w].speeds[1];  /* east, from the west */
+      in->speeds[2] = cells[y_s*params.nx + jj].speeds[2];   /* north, from the south */
+      in->speeds[3] = cells[ii *params.nx + x_e].speeds[3];  /* west, from the east */
+      in->speeds[4] = cells[y_n*params.nx + jj].speeds[4];   /* south, from the north */
+      in->speeds[5] = cells[y_s*params.nx + x_w].speeds[5];  /* north-east, from the south-west */
+      in->speeds[6] = cells[y_s*params.nx + x_e].speeds[6];  /* north-west, from the south-east */
+      in->speeds[7] = cells[y_n*params.nx + x_e].speeds[7];  /* south-west, from the north-east */
+      in->speeds[8] = cells[y_n*params.nx + x_w].speeds[8];  /* south-east, from the north-west */
+      out = &tmp_cells[ii*params.nx + jj];
+      /* if the cell contains an obstacle */
+      if(obstacles[ii*params.nx + jj]) {
+        /* mirroring */
+        out->speeds[0] = in->speeds[0];
+        out->speeds[1] = in->speeds[3];
+        out->speeds[2] = in->speeds[4];
+        out->speeds[3] = in->speeds[1];
+        out->speeds[4] = in->speeds[2];
+        out->speeds[5] = in->speeds[7];
+        out->speeds[6] = in->speeds[8];
+        out->speeds[7] = in->speeds[5];
+        out->speeds[8] = in->speeds[6];
+        continue;
+      }
+      /* the lanes are independent simulations, so they go in SIMD;
+      ** each computes just as d2q9-bgk.exe does */
+#pragma omp simd private(kk, u_x, u_y, u_sq, local_density)
+      for(mm=0;mm<MEMBERS;mm++) {
+        /* compute local density total */
+        local_density = 0.0;
+        for(kk=0;kk<NSPEEDS;kk++) {
+          local_density += in->speeds[kk].m[mm];
+        }
+        /* compute x velocity component */
+        u_x = (in->speeds[1].m[mm] +
+               in->speeds[5].m[mm] +
+               in->speeds[8].m[mm]
+               - (in->speeds[3].m[mm] +
+                  in->speeds[6].m[mm] +
+                  in->speeds[7].m[mm]))
+          / local_density;
+        /* compute y velocity component */
+        u_y = (in->speeds[2].m[mm] +
+               in->speeds[5].m[mm] +
+               in->speeds[6].m[mm]
+               - (in->speeds[4].m[mm] +
+                  in->speeds[7].m[mm] +
+                  in->speeds[8].m[mm]))
+          / local_density;
+        /* velocity squared */
+        u_sq = u_x * u_x + u_y * u_y;
+        /* equilibrium densities along each direction, and relaxation */
+        out->speeds[0].m[mm] = relax(in->speeds[0].m[mm], w0, local_density,   0.0f,      u_sq, params.omega[mm]);
+        out->speeds[1].m[mm] = relax(in->speeds[1].m[mm], w1, local_density,   u_x,       u_sq, params.omega[mm]);  /* east */
+        out->speeds[2].m[mm] = relax(in->speeds[2].m[mm], w1, local_density,         u_y, u_sq, params.omega[mm]);  /* north */
+        out->speeds[3].m[mm] = relax(in->speeds[3].m[mm], w1, local_density, - u_x,       u_sq, params.omega[mm]);  /* west */
+        out->speeds[4].m[mm] = relax(in->speeds[4].m[mm], w1, local_density,       - u_y, u_sq, params.omega[mm]);  /* south */
+        out->speeds[5].m[mm] = relax(in->speeds[5].m[mm], w2, local_density,   u_x + u_y, u_sq, params.omega[mm]);  /* north-east */
+        out->speeds[6].m[mm] = relax(in->speeds[6].m[mm], w2, local_density, - u_x + u_y, u_sq, params.omega[mm]);  /* north-west */
+        out->speeds[7].m[mm] = relax(in->speeds[7].m[mm], w2, local_density, - u_x - u_y, u_sq, params.omega[mm]);  /* south-west */
+        out->speeds[8].m[mm] = relax(in->speeds[8].m[mm], w2, local_density,   u_x - u_y, u_sq, params.omega[mm]);  /* south-east */
+      }
+    }
+  }
+
+  return EXIT_SUCCESS;
+}
+
+int initialise(const char* paramfile, const char* obstaclefile, const char* ensemblefile,
+           t_param* params, t_speed** cells_ptr, t_speed** tmp_cells_ptr,
+           int** obstacles_ptr, float** av_vels_ptr)
+{
+  char   message[1024];  /* message buffer */
+  FILE   *fp;            /* file pointer */
+  int    ii,kk,mm;       /* generic counters */
+  long   line;           /* line no. of an error in the obstacle file */
+  int    retval;         /* to hold return value for checking */
+  float  accel, omega;   /* of a member */
+  float  rest[NSPEEDS];  /* the 'speed' values of the fluid at rest */
+
+  /* open the parameter file */
+  fp = fopen(paramfile,"r");
+  if (fp == NULL) {
+    sprintf(message,"could not open input parameter file: %s", paramfile);
+    die(message,__LINE__,__FILE__);
+  }
+
+  /* read in the parameter values; accel and omega are the ensemble's */
+  retval = fscanf(fp,"%d\n",&(params->nx));
+  if(retval != 1) die ("could not read param file: nx",__LINE__,__FILE__);
+  retval = fscanf(fp,"%d\n",&(params->ny));
+  if(retval != 1) die ("could not read param file: ny",__LINE__,__FILE__);
+  retval = fscanf(fp,"%d\n",&(params->maxIters));
+  if(retval != 1) die ("could not read param file: maxIters",__LINE__,__FILE__);
+  retval = fscanf(fp,"%d\n",&(params->reynolds_dim));
+  if(retval != 1) die ("could not read param file: reynolds_dim",__LINE__,__FILE__);
+  retval = fscanf(fp,"%f\n",&(params->density));
+  if(retval != 1) die ("could not read param file: density",__LINE__,__FILE__);
+
+  /* and close up the file */
+  fclose(fp);
+
+  /* read the members, one 'accel omega' line each */
+  fp = fopen(ensemblefile,"r");
+  if (fp == NULL) {
+    sprintf(message,"could not open ensemble file: %s", ensemblefile);
+    die(message,__LINE__,__FILE__);
+  }
+  params->members = 0;
+  while ((retval = fscanf(fp,"%f %f\n", &accel, &omega)) != EOF) {
+    if (retval != 2) {
+      sprintf(message,"could not read ensemble file: member %d", params->members);
+      die(message,__LINE__,__FILE__);
+    }
+    if (params->members == MEMBERS) {
+      sprintf(message,"more than %d members in the ensemble; rebuild with a larger MEMBERS", MEMBERS);
+      die(message,__LINE__,__FILE__);
+    }
+    params->accel[params->members] = accel;
+    params->omega[params->members] = omega;
+    params->members++;
+  }
+  fclose(fp);
+  if (params->members == 0) die("no members in the ensemble file",__LINE__,__FILE__);
+  /* the spare lanes repeat the last member */
+  for(mm=params->members;mm<MEMBERS;mm++) {
+    params->accel[mm] = params->accel[params->members - 1];
+    params->omega[mm] = params->omega[params->members - 1];
+  }
+
+  /* main grid */
+  *cells_ptr = (t_speed*)malloc(sizeof(t_speed)*(params->ny*params->nx));
+  if (*cells_ptr == NULL)
+    die("cannot allocate memory for cells",__LINE__,__FILE__);
+
+  /* 'helper' grid, used as scratch space */
+  *tmp_cells_ptr = (t_speed*)malloc(sizeof(t_speed)*(params->ny*params->nx));
+  if (*tmp_cells_ptr == NULL)
+    die("cannot allocate memory for tmp_cells",__LINE__,__FILE__);
+
+  /* the map of obstacles */
+  *obstacles_ptr = (int*)calloc(params->ny*params->nx, sizeof(int));
+  if (*obstacles_ptr == NULL)
+    die("cannot allocate column memory for obstacles",__LINE__,__FILE__);
+
+  /* the av. velocities of every lane, for every timestep */
+  *av_vels_ptr = (float*)malloc(sizeof(float)*params->maxIters*MEMBERS);
+  if (*av_vels_ptr == NULL)
+    die("cannot allocate memory for av_vels",__LINE__,__FILE__);
+
+  /* initialise densities, the same in every lane */
+  rest[0] = params->density * 4.0/9.0;
+  for(kk=1;kk<5;kk++) rest[kk] = params->density      /9.0;
+  for(kk=5;kk<NSPEEDS;kk++) rest[kk] = params->density      /36.0;
+
+  for(ii=0;ii<params->ny*params->nx;ii++) {
+    for(kk=0;kk<NSPEEDS;kk++) {
+      for(mm=0;mm<MEMBERS;mm++) {
+        (*cells_ptr)[ii].speeds[kk].m[mm] = rest[kk];
+      }
+    }
+  }
+
+  /* one map of obstacles serves every member */
+  if (lbm_is_binary(obstaclefile)) {
+    retval = lbm_read_obstacles(obstaclefile, params->nx, params->ny, 0, params->ny, *obstacles_ptr, NULL);
+    if (retval != LBM_OK) die(lbm_strerror(retval),__LINE__,__FILE__);
+  }
+  else {
+    /* read-in the blocked cells list */
+    retval = lbm_parse_obstacles(obstaclefile, params->nx, params->ny, *obstacles_ptr, NULL, &line);
+    if (retval == LBM_EOPEN) {
+      sprintf(message,"could not open input obstacles file: %s", obstaclefile);
+      die(message,__LINE__,__FILE__);
+    }
+    if (retval != LBM_OK) {
+      sprintf(message,"%s (line %ld of %s)", lbm_strerror(retval), line, obstaclefile);
+      die(message,__LINE__,__FILE__);
+    }
+  }
+
+  return EXIT_SUCCESS;
+}
+
+int finalise(const t_param* params, t_speed** cells_ptr, t_speed** tmp_cells_ptr,
+         int** obstacles_ptr, float** av_vels_ptr)
+{
+  /*
+  ** free up allocated memory
+  */
+  free(*cells_ptr);
+  *cells_ptr = NULL;
+
+  free(*tmp_cells_ptr);
+  *tmp_cells_ptr = NULL;
+
+  free(*obstacles_ptr);
+  *obstacles_ptr = NULL;
+
+  free(*av_vels_ptr);
+  *av_vels_ptr = NULL;
+
+  return EXIT_SUCCESS;
+}
+
+void av_velocity(const t_param params, t_speed* cells, int* obstacles, float* av_u_x)
+{
+  int    ii,jj,kk,mm;    /* generic counters */
+  int    tot_cells = 0;  /* no. of cells used in calculation */
+  float local_density;  /* total density in cell */
+  lbm_sum tot_u_x[MEMBERS];  /* accumulated x-components of velocity in a row, by lane */
+  lbm_sum* rows;        /* the sums of the rows, lane by lane */
+  t_speed* cell;        /* the cell being summed */
+
+  rows = (lbm_sum*)malloc(sizeof(lbm_sum) * params.ny * MEMBERS);
+  if (rows == NULL) die("cannot allocate memory for row sums",__LINE__,__FILE__);
+
+  /* loop over all non-blocked cells; each lane sums its rows in the
+  ** order of d2q9-bgk.exe (see lbm_reduce.h) */
+#pragma omp parallel for reduction(+:tot_cells) private(jj, kk, mm, local_density, tot_u_x, cell)
+  for(ii=0;ii<params.ny;ii++) {
+    for(mm=0;mm<MEMBERS;mm++) tot_u_x[mm] = lbm_sum_zero();
+    for(jj=0;jj<params.nx;jj++) {
+      /* ignore occupied cells */
+      if(obstacles[ii*params.nx + jj]) continue;
+      cell = &cells[ii*params.nx + jj];
+#pragma omp simd private(kk, local_density)
+      for(mm=0;mm<MEMBERS;mm++) {
+        /* local density total */
+        local_density = 0.0;
+        for(kk=0;kk<NSPEEDS;kk++) {
+          local_density += cell->speeds[kk].m[mm];
+        }
+        /* x-component of velocity */
+        lbm_sum_add(&tot_u_x[mm], (cell->speeds[1].m[mm] +
+                cell->speeds[5].m[mm] +
+                cell->speeds[8].m[mm]
+                - (cell->speeds[3].m[mm] +
+                   cell->speeds[6].m[mm] +
+                   cell->speeds[7].m[mm])) /
+          local_density);
+      }
+      /* increase counter of inspected cells */
+      ++tot_cells;
+    }
+    for(mm=0;mm<MEMBERS;mm++) rows[mm*params.ny + ii] = tot_u_x[mm];
+  }
+
+  for(mm=0;mm<MEMBERS;mm++) {
+    av_u_x[mm] = lbm_sum_rows(&rows[mm*params.ny], params.ny) / (float)tot_cells;
+  }
+  free(rows);
+}
+
+float calc_reynolds(const t_param params, const int member, const float av_vel)
+{
+  const float viscosity = 1.0 / 6.0 * (2.0 / params.omega[member] - 1.0);
+
+  return av_vel * params.reynolds_dim / viscosity;
+}
+
+int write_values(const t_param params, t_speed* cells, int* obstacles, float* av_vels)
+{
+  FILE* fp;                     /* file pointer */
+  char path[64];                /* name of a member's output file */
+  int ii,jj,kk,mm;              /* generic counters */
+  const float c_sq = 1.0/3.0;  /* sq. of speed of sound */
+  float local_density;         /* per grid cell sum of densities */
+  float pressure;              /* fluid pressure in grid cell */
+  float u_x;                   /* x-component of velocity in grid cell */
+  float u_y;                   /* y-component of velocity in grid cell */
+  t_speed* cell;                /* the cell being written */
+
+  for(mm=0;mm<params.members;mm++) {
+    sprintf(path, FINALSTATEFILE, mm);
+    fp = fopen(path,"w");
+    if (fp == NULL) {
+      die("could not open file output file",__LINE__,__FILE__);
+    }
+
+    for(ii=0;ii<params.ny;ii++) {
+      for(jj=0;jj<params.nx;jj++) {
+        cell = &cells[ii*params.nx + jj];
+        /* an occupied cell */
+        if(obstacles[ii*params.nx + jj]) {
+          u_x = u_y = 0.0;
+          pressure = params.density * c_sq;
+        }
+        /* no obstacle */
+        else {
+          local_density = 0.0;
+          for(kk=0;kk<NSPEEDS;kk++) {
+            local_density += cell->speeds[kk].m[mm];
+          }
+          /* compute x velocity component */
+          u_x = (cell->speeds[1].m[mm] +
+                 cell->speeds[5].m[mm] +
+                 cell->speeds[8].m[mm]
+                 - (cell->speeds[3].m[mm] +
+                    cell->speeds[6].m[mm] +
+                    cell->speeds[7].m[mm]))
+            / local_density;
+          /* compute y velocity component */
+          u_y = (cell->speeds[2].m[mm] +
+                 cell->speeds[5].m[mm] +
+                 cell->speeds[6].m[mm]
+                 - (cell->speeds[4].m[mm] +
+                    cell->speeds[7].m[mm] +
+                    cell->speeds[8].m[mm]))
+            / local_density;
+          /* compute pressure */
+          pressure = local_density * c_sq;
+        }
+        /* write to file */
+        fprintf(fp,"%d %d %.12E %.12E %.12E %d\n",ii,jj,u_x,u_y,pressure,obstacles[ii*params.nx + jj]);
+      }
+    }
+
+    fclose(fp);
+
+    sprintf(path, AVVELSFILE, mm);
+    fp = fopen(path,"w");
+    if (fp == NULL) {
+      die("could not open file output file",__LINE__,__FILE__);
+    }
+    for (ii=0;ii<params.maxIters;ii++) {
+      fprintf(fp,"%d:\t%.12E\n", ii, av_vels[ii*MEMBERS + mm]);
+    }
+
+    fclose(fp);
+  }
+
+  return EXIT_SUCCESS;
+}
+
+void die(const char* message, const int line, const char *file)
+{
+  fprintf(stderr, "Error at line %d of file %s:\n", line, file);
+  fprintf(stderr, "%s\n",message);
+  fflush(stderr);
+  exit(EXIT_FAILURE);
+}
+
+void usage(const char* exe)
+{
+  fprintf(stderr, "Usage: %s <paramfile> <obstaclefile> <ensemblefile>\n", exe);
+  exit(EXIT_FAILURE);
+}
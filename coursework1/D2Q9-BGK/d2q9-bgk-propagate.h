@@ -0,0 +1,79 @@
+/*
+** The acceleration of the first column, and the propagation, of rows
+** first to last-1 of the grid: the body of accelerate_flow_and_propagate()
+** in d2q9-bgk.c, and of the timestep of the d2q9_bgk solver in
+** d2q9-bgk-solver.cpp, which never mirrors (mirror_row -1). The
+** 'speeds' of the rows go from cells to tmp_cells, where
+** d2q9-bgk-collide.h collides them back from. Either way LOAD, STORE,
+** NSPEEDS and t_speed are defined before it, and params holds the
+** grid, density, accel, mirror_row and the populations at rest.
+*/
+
+  int ii,jj;            /* generic counters */
+  int x_e,x_w,y_n,y_s;  /* indices of neighbouring cells */
+  int mirror_n,mirror_s;  /* TRUE if the row is at a line of mirror symmetry */
+  float w1,w2;  /* weighting factors */
+  
+  /* compute weighting factors */
+  w1 = params.density * params.accel / 9.0;
+  w2 = params.density * params.accel / 36.0;
+
+  /* loop over the cells of the rows */
+  for(ii=first;ii<last;ii++) {
+    mirror_n = params.mirror_row >= 0 && ii == params.ny - 1;
+    mirror_s = params.mirror_row >= 0 && ii == 0;
+    /* if the cell is not occupied and
+    ** we don't send a density negative */
+    if( !obstacles[ii*params.nx] && 
+        (LOAD(cells[ii*params.nx],3) - w1) > 0.0 &&
+        (LOAD(cells[ii*params.nx],6) - w2) > 0.0 &&
+        (LOAD(cells[ii*params.nx],7) - w2) > 0.0 ) {
+      /* increase 'east-side' densities */
+      STORE(cells[ii*params.nx],1, LOAD(cells[ii*params.nx],1) + w1);
+      STORE(cells[ii*params.nx],5, LOAD(cells[ii*params.nx],5) + w2);
+      STORE(cells[ii*params.nx],8, LOAD(cells[ii*params.nx],8) + w2);
+      /* decrease 'west-side' densities */
+      STORE(cells[ii*params.nx],3, LOAD(cells[ii*params.nx],3) - w1);
+      STORE(cells[ii*params.nx],6, LOAD(cells[ii*params.nx],6) - w2);
+      STORE(cells[ii*params.nx],7, LOAD(cells[ii*params.nx],7) - w2);
+    }
+    for(jj=0;jj<params.nx;jj++) {
+      /* determine indices of axis-direction neighbours
+      ** respecting periodic boundary conditions (wrap around) */
+      y_n = (ii + 1) % params.ny;
+      x_e = (jj + 1) % params.nx;
+      y_s = (ii == 0) ? (ii + params.ny - 1) : (ii - 1);
+      x_w = (jj == 0) ? (jj + params.nx - 1) : (jj - 1);
+      /* propagate densities to neighbouring cells, following
+      ** appropriate directions of travel and writing into
+      ** scratch space grid; they move as they are stored */
+      tmp_cells[ii *params.nx + jj].speeds[0]  = cells[ii*params.nx + jj].speeds[0]; /* central cell, */
+                                                                                     /* no movement   */
+      tmp_cells[ii *params.nx + x_e].speeds[1] = cells[ii*params.nx + jj].speeds[1]; /* east */
+      tmp_cells[ii *params.nx + x_w].speeds[3] = cells[ii*params.nx + jj].speeds[3]; /* west */
+      /* across a line of mirror symmetry, at either end of half a grid,
+      ** the densities come back into the row with y reversed */
+      if (mirror_n) {
+        tmp_cells[ii *params.nx + jj].speeds[4]  = cells[ii*params.nx + jj].speeds[2]; /* north */
+        tmp_cells[ii *params.nx + x_e].speeds[8] = cells[ii*params.nx + jj].speeds[5]; /* north-east */
+        tmp_cells[ii *params.nx + x_w].speeds[7] = cells[ii*params.nx + jj].speeds[6]; /* north-west */
+      }
+      else {
+        tmp_cells[y_n*params.nx + jj].speeds[2]  = cells[ii*params.nx + jj].speeds[2]; /* north */
+        tmp_cells[y_n*params.nx + x_e].speeds[5] = cells[ii*params.nx + jj].speeds[5]; /* north-east */
+        tmp_cells[y_n*params.nx + x_w].speeds[6] = cells[ii*params.nx + jj].speeds[6]; /* north-west */
+      }
+      if (mirror_s) {
+        tmp_cells[ii *params.nx + jj].speeds[2]  = cells[ii*params.nx + jj].speeds[4]; /* south */
+        tmp_cells[ii *params.nx + x_w].speeds[6] = cells[ii*params.nx + jj].speeds[7]; /* south-west */
+        tmp_cells[ii *params.nx + x_e].speeds[5] = cells[ii*params.nx + jj].speeds[8]; /* south-east */
+      }
+      else {
+        tmp_cells[y_s*params.nx + jj].speeds[4]  = cells[ii*params.nx + jj].speeds[4]; /* south */
+        tmp_cells[y_s*params.nx + x_w].speeds[7] = cells[ii*params.nx + jj].speeds[7]; /* south-west */
+        tmp_cells[y_s*params.nx + x_e].speeds[8] = cells[ii*params.nx + jj].speeds[8]; /* south-east */
+      }
+    }
+  }
+
+  return EXIT_SUCCESS;
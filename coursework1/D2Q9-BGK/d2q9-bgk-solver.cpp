@@ -0,0 +1,339 @@
+/*
+** The d2q9-bgk simulation of d2q9-bgk-solver.h. The kernels are those
+** of d2q9-bgk.exe, from the same headers: each timestep a team of
+** threads, each on its own block of rows, accelerates the first column
+** and propagates the 'speeds' into the scratch grid
+** (d2q9-bgk-propagate.h), and after a barrier rebounds or collides them
+** back into the grid (d2q9-bgk-collide.h).
+**
+** The 'speeds' in each cell are numbered as follows:
+**
+** 6 2 5
+**  \|/
+** 3-0-1
+**  /|\
+** 7 4 8
+*/
+
+#include<cstdlib>
+#include<cstring>
+#include<stdexcept>
+#include<string>
+#include<omp.h>
+#include"lbm_reduce.h"
+#include"d2q9-bgk-solver.h"
+
+#define NSPEEDS         9
+
+/* the parameters the kernels read, as d2q9-bgk.exe holds them; the
+** solver never mirrors the grid */
+typedef struct {
+  int    nx;            /* no. of cells in x-direction */
+  int    ny;            /* no. of cells in y-direction */
+  float density;       /* density per link */
+  float accel;         /* density redistribution */
+  float omega;         /* relaxation parameter */
+  float rest[NSPEEDS];  /* the 'speed' values of the fluid at rest */
+  int    mirror_row;    /* -1, not mirrored */
+} t_param;
+
+typedef d2q9_speed t_speed;
+
+/* one 'speed' value of a cell widened to float, and a float stored into one;
+** the 16 bit deviations are taken from the params in scope */
+#define LOAD(cell,kk)         LBM_LOAD((cell).speeds[kk], params.rest[kk])
+#define STORE(cell,kk,value)  ((cell).speeds[kk] = LBM_STORE((value), params.rest[kk]))
+
+static int accelerate_flow_and_propagate(const t_param params, t_speed* cells, t_speed* tmp_cells,
+                                         const int* obstacles, const int first, const int last)
+{
+#include"d2q9-bgk-propagate.h"
+}
+
+static int rebound_or_collision(const t_param params, t_speed* cells, t_speed* tmp_cells,
+                                const int* obstacles, const int first, const int last)
+{
+#include"d2q9-bgk-collide.h"
+}
+
+/* the params of the kernels, for the solver's */
+static t_param kernel_params(const d2q9_params& params, const float rest[NSPEEDS])
+{
+  t_param kernel;
+
+  kernel.nx = params.nx;
+  kernel.ny = params.ny;
+  kernel.density = params.density;
+  kernel.accel = params.accel;
+  kernel.omega = params.omega;
+  memcpy(kernel.rest, rest, sizeof(kernel.rest));
+  kernel.mirror_row = -1;
+  return kernel;
+}
+
+void d2q9_bgk::init(const char* storage, const int deviates)
+{
+  if (strcmp(storage, LBM_STORAGE_NAME) != 0 || deviates != LBM_DEVIATES)
+    throw std::invalid_argument("d2q9_bgk: the program and the library are built with different STORAGE");
+  check(params_);
+  if (threads_ < 1) throw std::invalid_argument("d2q9_bgk: threads must be at least 1");
+  cells_.resize((size_t)params_.ny * params_.nx);
+  tmp_cells_.resize((size_t)params_.ny * params_.nx);
+  av_vels_.reserve(params_.maxIters);
+  u_x_.resize((size_t)params_.ny * params_.nx);
+  u_y_.resize((size_t)params_.ny * params_.nx);
+  pressure_.resize((size_t)params_.ny * params_.nx);
+  reset();
+}
+
+void d2q9_bgk::check(const d2q9_params& params) const
+{
+  if (params.nx < 1 || params.ny < 1 || params.maxIters < 0)
+    throw std::invalid_argument("d2q9_bgk: the grid must have cells, and maxIters be at least 0");
+  if (obstacles_ == NULL) throw std::invalid_argument("d2q9_bgk: no obstacles");
+}
+
+void d2q9_bgk::reset()
+{
+  int ii,kk;                    /* generic counters */
+
+  rest_[0] = params_.density * 4.0/9.0;
+  for(kk=1;kk<5;kk++) rest_[kk] = params_.density      /9.0;
+  for(kk=5;kk<NSPEEDS;kk++) rest_[kk] = params_.density      /36.0;
+  const t_param params = kernel_params(params_, rest_);
+  t_speed* cells = cells_.data();
+#pragma omp parallel for private(kk) num_threads(threads_)
+  for(ii=0;ii<params.ny*params.nx;ii++) {
+    for(kk=0;kk<NSPEEDS;kk++) STORE(cells[ii],kk, params.rest[kk]);
+  }
+  av_vels_.clear();
+  fields_current_ = false;
+}
+
+void d2q9_bgk::reset(const float accel, const float omega)
+{
+  params_.accel = accel;
+  params_.omega = omega;
+  reset();
+}
+
+void d2q9_bgk::reset(const d2q9_params& params, const int* obstacles)
+{
+  if (params.nx != params_.nx || params.ny != params_.ny || params.maxIters != params_.maxIters)
+    throw std::invalid_argument("d2q9_bgk: a reset must keep the grid size and maxIters");
+  if (obstacles == NULL) throw std::invalid_argument("d2q9_bgk: no obstacles");
+  params_ = params;
+  obstacles_ = obstacles;
+  reset();
+}
+
+void d2q9_bgk::step(const int n)
+{
+  int ii;                       /* generic counter */
+
+  if (n < 0 || n > params_.maxIters - iterations())
+    throw std::invalid_argument("d2q9_bgk: step past maxIters");
+  for (ii = 0; ii < n; ii++) {
+    timestep();
+    av_vels_.push_back(av_velocity());
+  }
+  if (n) fields_current_ = false;
+}
+
+/*
+** Each thread accelerates and propagates its rows, and once every
+** thread has, rebounds or collides the same rows, as timestep() of
+** d2q9-bgk.exe does.
+*/
+void d2q9_bgk::timestep()
+{
+  const t_param params = kernel_params(params_, rest_);
+  t_speed* cells = cells_.data();
+  t_speed* tmp_cells = tmp_cells_.data();
+  const int* obstacles = obstacles_;
+
+#pragma omp parallel num_threads(threads_)
+  {
+    const int tid = omp_get_thread_num();
+    const int nthreads = omp_get_num_threads();
+    const int first = (int)((long)params.ny * tid / nthreads);     /* the rows of this thread */
+    const int last = (int)((long)params.ny * (tid + 1) / nthreads);
+
+    accelerate_flow_and_propagate(params,cells,tmp_cells,obstacles,first,last);
+#pragma omp barrier
+    rebound_or_collision(params,cells,tmp_cells,obstacles,first,last);
+  }
+}
+
+float d2q9_bgk::av_velocity() const
+{
+  const t_param params = kernel_params(params_, rest_);
+  const t_speed* cells = cells_.data();
+  const int* obstacles = obstacles_;
+  int    ii,jj,kk;       /* generic counters */
+  int    tot_cells = 0;  /* no. of cells used in calculation */
+  float local_density;  /* total density in cell */
+  lbm_sum tot_u_x;      /* accumulated x-components of velocity in a row */
+  float speeds[NSPEEDS];  /* densities of the cell, widened to float */
+  std::vector<lbm_sum> rows(params.ny);  /* the sums of the rows */
+
+  /* loop over all non-blocked cells, a row at a time (see lbm_reduce.h) */
+#pragma omp parallel for reduction(+:tot_cells) private(jj, kk, local_density, tot_u_x, speeds) num_threads(threads_)
+  for(ii=0;ii<params.ny;ii++) {
+    tot_u_x = lbm_sum_zero();
+    for(jj=0;jj<params.nx;jj++) {
+      /* ignore occupied cells */
+      if(!obstacles[ii*params.nx + jj]) {
+        /* local density total */
+        local_density = 0.0;
+        for(kk=0;kk<NSPEEDS;kk++) {
+          speeds[kk] = LOAD(cells[ii*params.nx + jj],kk);
+          local_density += speeds[kk];
+        }
+        /* x-component of velocity */
+        lbm_sum_add(&tot_u_x, (speeds[1] +
+                speeds[5] +
+                speeds[8]
+                - (speeds[3] +
+                   speeds[6] +
+                   speeds[7])) /
+          local_density);
+        /* increase counter of inspected cells */
+        ++tot_cells;
+      }
+    }
+    rows[ii] = tot_u_x;
+  }
+
+  return lbm_sum_rows(rows.data(), params.ny) / (float)tot_cells;
+}
+
+float d2q9_bgk::reynolds() const
+{
+  const float viscosity = 1.0 / 6.0 * (2.0 / params_.omega - 1.0);
+
+  return av_velocity() * params_.reynolds_dim / viscosity;
+}
+
+/* the velocity and pressure of every cell, as d2q9-bgk.exe writes them */
+void d2q9_bgk::fields()
+{
+  const t_param params = kernel_params(params_, rest_);
+  const t_speed* cells = cells_.data();
+  const int* obstacles = obstacles_;
+  float* u_x = u_x_.data();
+  float* u_y = u_y_.data();
+  float* pressure = pressure_.data();
+  int ii,kk;                    /* generic counters */
+  const float c_sq = 1.0/3.0;  /* sq. of speed of sound */
+  float local_density;         /* per grid cell sum of densities */
+  float speeds[NSPEEDS];       /* densities of the cell, widened to float */
+
+  if (fields_current_) return;
+#pragma omp parallel for private(kk, local_density, speeds) num_threads(threads_)
+  for(ii=0;ii<params.ny*params.nx;ii++) {
+    /* an occupied cell */
+    if(obstacles[ii]) {
+      u_x[ii] = u_y[ii] = 0.0;
+      pressure[ii] = params.density * c_sq;
+    }
+    /* no obstacle */
+    else {
+      local_density = 0.0;
+      for(kk=0;kk<NSPEEDS;kk++) {
+        speeds[kk] = LOAD(cells[ii],kk);
+        local_density += speeds[kk];
+      }
+      /* compute x velocity component */
+      u_x[ii] = (speeds[1] +
+                 speeds[5] +
+                 speeds[8]
+                 - (speeds[3] +
+                    speeds[6] +
+                    speeds[7]))
+        / local_density;
+      /* compute y velocity component */
+      u_y[ii] = (speeds[2] +
+                 speeds[5] +
+                 speeds[6]
+                 - (speeds[4] +
+                    speeds[7] +
+                    speeds[8]))
+        / local_density;
+      /* compute pressure */
+      pressure[ii] = local_density * c_sq;
+    }
+  }
+  fields_current_ = true;
+}
+
+/*
+** The solver from C. A d2q9_solver is a d2q9_bgk; the exceptions are
+** caught here and made a NULL or -1, with the reason in a string that
+** lasts until the thread makes another solver.
+*/
+d2q9_solver* d2q9_solver_make(const d2q9_params* params, const int* obstacles, const int threads,
+                              const char* storage, const int deviates, const char** why)
+{
+  static thread_local std::string reason;  /* what the last one failed on */
+
+  try {
+    return reinterpret_cast<d2q9_solver*>(new d2q9_bgk(*params, obstacles, threads, storage, deviates));
+  }
+  catch (const std::exception& e) {
+    reason = e.what();
+    *why = reason.c_str();
+    return NULL;
+  }
+}
+
+void d2q9_solver_free(d2q9_solver* solver)
+{
+  delete reinterpret_cast<d2q9_bgk*>(solver);
+}
+
+int d2q9_solver_step(d2q9_solver* solver, const int n)
+{
+  try {
+    reinterpret_cast<d2q9_bgk*>(solver)->step(n);
+  }
+  catch (const std::invalid_argument&) {
+    return -1;
+  }
+  return 0;
+}
+
+int d2q9_solver_iterations(const d2q9_solver* solver)
+{
+  return reinterpret_cast<const d2q9_bgk*>(solver)->iterations();
+}
+
+const float* d2q9_solver_av_vels(const d2q9_solver* solver)
+{
+  return reinterpret_cast<const d2q9_bgk*>(solver)->av_vels();
+}
+
+const float* d2q9_solver_u_x(d2q9_solver* solver)
+{
+  return reinterpret_cast<d2q9_bgk*>(solver)->u_x();
+}
+
+const float* d2q9_solver_u_y(d2q9_solver* solver)
+{
+  return reinterpret_cast<d2q9_bgk*>(solver)->u_y();
+}
+
+const float* d2q9_solver_pressure(d2q9_solver* solver)
+{
+  return reinterpret_cast<d2q9_bgk*>(solver)->pressure();
+}
+
+const d2q9_speed* d2q9_solver_cells(const d2q9_solver* solver)
+{
+  return reinterpret_cast<const d2q9_bgk*>(solver)->cells();
+}
+
+float d2q9_solver_reynolds(const d2q9_solver* solver)
+{
+  return reinterpret_cast<const d2q9_bgk*>(solver)->reynolds();
+}
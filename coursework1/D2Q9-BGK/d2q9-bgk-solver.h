@@ -0,0 +1,158 @@
+/*
+** A d2q9-bgk lattice boltzmann simulation as a C++ object, to be run
+** in-process, many at a time if need be, with no files in or out:
+**
+**   d2q9_params params = { nx, ny, maxIters, reynolds_dim, density, accel, omega };
+**   d2q9_bgk solver(params, obstacles);   // obstacles: nx*ny ints, 1 if blocked
+**   solver.step(params.maxIters);
+**   solver.av_vels()[t];                  // av. velocity after timestep t
+**   solver.u_x()[ii*nx + jj];             // the fields of the grid as it is now
+**   solver.reset(accel, omega);           // and again, with no new memory
+**
+** A timestep is the propagate and collision of d2q9-bgk.exe, compiled
+** from the same d2q9-bgk-propagate.h and d2q9-bgk-collide.h, in the
+** storage of the 'speeds' the library is built with (make lib
+** STORAGE=..., see lbm_half.h), so every bit of the av. velocities and
+** the fields is that of d2q9-bgk.exe --no-mirror built the same way.
+** A program must be compiled with the storage flags of the library;
+** the constructor checks that it was. The obstacles are not copied;
+** they are read, and must live, as long as the solver uses them, and
+** may be shared by any number of solvers. The pointers the accessors
+** return stay valid, and are never reallocated, for the life of the
+** solver: the fields are filled in place the first time they are
+** asked for after a step, and av_vels has room for maxIters timesteps.
+**
+** Errors are thrown: std::invalid_argument for parameters or a reset
+** that do not fit the solver, or a program of another storage, and
+** std::bad_alloc if it cannot be made. Built into libd2q9-bgk.a (make
+** lib); d2q9-bgk-sweep.exe is a driver over it.
+**
+** From C the solver is a d2q9_solver, made by d2q9_solver_new, which
+** returns NULL, and why, rather than throwing, and used through the
+** d2q9_solver_ functions, one for each member above. d2q9-bgk.exe is a
+** driver over it so: a run by rows of a grid it does not mirror, with
+** no checkpoints, snapshots, restart, warm start, --jit or --timeline,
+** is stepped by the solver. The rest (tiles, work stealing, mirroring,
+** the output on the way) needs the grid in d2q9-bgk.exe's own pool of
+** threads, which runs them on the same d2q9-bgk-propagate.h and
+** d2q9-bgk-collide.h.
+*/
+
+#ifndef D2Q9_BGK_SOLVER_H
+#define D2Q9_BGK_SOLVER_H
+
+#include"lbm_half.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* the parameters of a simulation, as in the parameter file */
+typedef struct {
+  int   nx;             /* no. of cells in x-direction */
+  int   ny;             /* no. of cells in y-direction */
+  int   maxIters;       /* no. of timesteps av_vels has room for */
+  int   reynolds_dim;   /* dimension for Reynolds number */
+  float density;        /* density per link */
+  float accel;          /* density redistribution */
+  float omega;          /* relaxation parameter */
+} d2q9_params;
+
+/* the 'speed' values of a cell, in float or 16 bits (see lbm_half.h) */
+typedef struct {
+  lbm_store speeds[9];
+} d2q9_speed;
+
+/* the solver, from C */
+typedef struct d2q9_solver d2q9_solver;
+
+/* d2q9_solver_new, given the storage the program was compiled with */
+d2q9_solver* d2q9_solver_make(const d2q9_params* params, const int* obstacles, const int threads,
+                              const char* storage, const int deviates, const char** why);
+static inline d2q9_solver* d2q9_solver_new(const d2q9_params* params, const int* obstacles,
+                                           const int threads, const char** why)
+{
+  return d2q9_solver_make(params, obstacles, threads, LBM_STORAGE_NAME, LBM_DEVIATES, why);
+}
+void d2q9_solver_free(d2q9_solver* solver);
+/* 0, or -1 if it would step past maxIters */
+int d2q9_solver_step(d2q9_solver* solver, const int n);
+int d2q9_solver_iterations(const d2q9_solver* solver);
+const float* d2q9_solver_av_vels(const d2q9_solver* solver);
+const float* d2q9_solver_u_x(d2q9_solver* solver);
+const float* d2q9_solver_u_y(d2q9_solver* solver);
+const float* d2q9_solver_pressure(d2q9_solver* solver);
+const d2q9_speed* d2q9_solver_cells(const d2q9_solver* solver);
+float d2q9_solver_reynolds(const d2q9_solver* solver);
+
+#ifdef __cplusplus
+}
+
+#include<vector>
+
+class d2q9_bgk {
+public:
+  /* a simulation of the fluid at rest, run on threads threads */
+  d2q9_bgk(const d2q9_params& params, const int* obstacles, const int threads = 1)
+    : params_(params), obstacles_(obstacles), threads_(threads)
+  { init(LBM_STORAGE_NAME, LBM_DEVIATES); }
+
+  /* run n timesteps, no more than maxIters in all */
+  void step(const int n);
+
+  /* back to the fluid at rest and no timesteps, with the same
+  ** parameters, with a new accel and omega, or with new parameters and
+  ** obstacles of the same size of grid and maxIters */
+  void reset();
+  void reset(const float accel, const float omega);
+  void reset(const d2q9_params& params, const int* obstacles);
+
+  const d2q9_params& params() const { return params_; }
+  int iterations() const { return (int)av_vels_.size(); }
+  /* the av. velocity after each of the timesteps run */
+  const float* av_vels() const { return av_vels_.data(); }
+  /* the velocity and pressure of each cell, by row, as the grid is now */
+  const float* u_x() { fields(); return u_x_.data(); }
+  const float* u_y() { fields(); return u_y_.data(); }
+  const float* pressure() { fields(); return pressure_.data(); }
+  /* the Reynolds number of the last timestep run */
+  float reynolds() const;
+  /* the 'speed' values of each cell, by row, as the grid is now */
+  const d2q9_speed* cells() const { return cells_.data(); }
+
+private:
+  /* a solver for a program compiled with the storage given */
+  d2q9_bgk(const d2q9_params& params, const int* obstacles, const int threads,
+           const char* storage, const int deviates)
+    : params_(params), obstacles_(obstacles), threads_(threads)
+  { init(storage, deviates); }
+  friend d2q9_solver* d2q9_solver_make(const d2q9_params*, const int*, const int, const char*,
+                                       const int, const char**);
+
+  d2q9_bgk(const d2q9_bgk&);             /* not copyable */
+  d2q9_bgk& operator=(const d2q9_bgk&);
+
+  /* the rest of the constructor, given the storage the program was
+  ** compiled with */
+  void init(const char* storage, const int deviates);
+  void check(const d2q9_params& params) const;
+  void timestep();
+  float av_velocity() const;
+  void fields();
+
+  d2q9_params          params_;
+  const int*           obstacles_;      /* not owned */
+  int                  threads_;        /* threads of the loops */
+  float                rest_[9];        /* the 'speed' values of the fluid at rest */
+  std::vector<d2q9_speed> cells_;       /* grid containing fluid densities */
+  std::vector<d2q9_speed> tmp_cells_;   /* scratch space, propagated into */
+  std::vector<float>   av_vels_;        /* a record of the av. velocity of each timestep */
+  std::vector<float>   u_x_;            /* the fields, filled when asked for */
+  std::vector<float>   u_y_;
+  std::vector<float>   pressure_;
+  bool                 fields_current_; /* true if they are of the grid as it is */
+};
+
+#endif
+
+#endif
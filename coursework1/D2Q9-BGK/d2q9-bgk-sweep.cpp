@@ -0,0 +1,392 @@
+/*
+** Code to sweep a d2q9-bgk lattice boltzmann simulation over a list of
+** (accel, omega) pairs, one geometry, as a farm of tasks in a single
+** process rather than a run of d2q9-bgk.exe per pair.
+**
+** The 'speeds' in each cell are numbered as follows:
+**
+** 6 2 5
+**  \|/
+** 3-0-1
+**  /|\
+** 7 4 8
+**
+** The names of the input parameter, obstacle and sweep files are
+** passed on the command line, e.g.:
+**
+**   d2q9-bgk-sweep.exe input.params obstacles.dat sweep.txt
+**
+** The parameter file is that of d2q9-bgk.exe; the sweep file has a line
+** 'accel omega' per task (as the ensemble file of d2q9-bgk-ensemble.exe
+** does), which replace those of the parameter file. The obstacle file
+** is parsed once, and the one map is shared, read only, by every task.
+** Task t writes av_vels.dat and final_state.dat to sweep_<t>/, as
+** d2q9-bgk.exe --no-mirror of the same STORAGE would have for its
+** parameters, to the bit.
+**
+** The tasks go through a work queue. Each runs on a team of threads
+** sized to the grid, about one thread per SWEEP_CELLS cells, and as
+** many teams as fit run at once, each taking the next task as it
+** finishes the last.
+**
+** The simulations are d2q9_bgk solvers (d2q9-bgk-solver.h), one made
+** per team and reset for each of its tasks, so the grids are allocated
+** once a team rather than once a task.
+**
+** Built with -DSWEEP_MPI (make mpi), the tasks are farmed out over MPI
+** ranks, master-worker: the master hands out the index of the next task
+** to whichever team of the workers asks, and the workers each parse the
+** obstacles once and run teams of threads as above. A single rank runs
+** every task itself.
+*/
+
+#include<stdio.h>
+#include<stdlib.h>
+#include<string.h>
+#include<errno.h>
+#include<time.h>
+#include<sys/time.h>
+#include<sys/stat.h>
+#include<omp.h>
+#include<stdexcept>
+#ifdef SWEEP_MPI
+#include"mpi.h"
+#endif
+#include"lbm_io.h"
+#include"d2q9-bgk-solver.h"
+
+#define SWEEPDIR        "sweep_%04d"
+#define FINALSTATEFILE  "final_state.dat"
+#define AVVELSFILE      "av_vels.dat"
+#define SWEEP_CELLS     16384  /* cells per thread of a task */
+#define MASTER          0      /* rank of the master */
+#define TAG_READY       1      /* a worker's team asks for a task */
+#define TAG_TASK        2      /* the master's answer, -1 for no more */
+
+/* struct to hold the list of tasks */
+typedef struct {
+  int    ntasks;        /* no. of tasks */
+  float* accel;         /* accel of each task */
+  float* omega;         /* omega of each task */
+  int    next;          /* index of the next task to run */
+} t_sweep;
+
+enum boolean { FALSE, TRUE };
+
+/*
+** function prototypes
+*/
+
+/* load params, the tasks and the obstacles shared by all of them */
+int initialise(const char* paramfile, const char* obstaclefile, const char* sweepfile,
+           d2q9_params* params, t_sweep* sweep, int** obstacles_ptr);
+
+/* the index of the next task to run, or -1 once there are none */
+int next_task(t_sweep* sweep);
+
+/* run one task on the solver of a team, writing its outputs */
+void run_task(d2q9_bgk& solver, const int* obstacles, const t_sweep* sweep, const int task);
+int write_values(const char* dir, d2q9_bgk& solver, const int* obstacles);
+
+/* utility functions */
+void die(const char* message, const int line, const char *file);
+void usage(const char* exe);
+
+/*
+** main program:
+** initialise, run the tasks, finalise
+*/
+int main(int argc, char* argv[])
+{
+  d2q9_params params;         /* struct to hold parameter values */
+  t_sweep  sweep;             /* the tasks */
+  int*     obstacles = NULL;  /* grid indicating which cells are blocked, shared by the tasks */
+  int      threads;           /* threads of a team */
+  int      teams;             /* teams running at once */
+  int      task;              /* task being run */
+  int      rank = MASTER;     /* rank of this process */
+  int      nproc = 1;         /* no. of ranks */
+  struct timeval timstr;      /* structure to hold elapsed time */
+  double tic,toc;             /* floating point numbers to calculate elapsed wallclock time */
+#ifdef SWEEP_MPI
+  int      provided;          /* thread support of the MPI library */
+  int      stops;             /* teams of the workers yet to be told to stop */
+  int      slots;             /* teams of this rank */
+  int*     all_slots = NULL;  /* teams of each rank */
+  int      ii;                /* generic counter */
+  MPI_Status status;          /* struct used by MPI_Recv */
+
+  /* the teams of a worker take turns to talk to the master */
+  MPI_Init_thread(&argc, &argv, MPI_THREAD_SERIALIZED, &provided);
+  if (provided < MPI_THREAD_SERIALIZED) die("the MPI library cannot be called from threads",__LINE__,__FILE__);
+  MPI_Comm_rank(MPI_COMM_WORLD, &rank);
+  MPI_Comm_size(MPI_COMM_WORLD, &nproc);
+#endif
+
+  /* parse the command line */
+  if(argc != 4) usage(argv[0]);
+
+  /* initialise our data structures and load values from file */
+  initialise(argv[1], argv[2], argv[3], &params, &sweep, &obstacles);
+
+  /* a thread per SWEEP_CELLS cells, and as many teams as fit */
+  threads = params.nx * params.ny / SWEEP_CELLS;
+  if (threads < 1) threads = 1;
+  if (threads > omp_get_max_threads()) threads = omp_get_max_threads();
+  teams = omp_get_max_threads() / threads;
+  if (teams > sweep.ntasks) teams = sweep.ntasks;
+  omp_set_max_active_levels(2);
+
+  gettimeofday(&timstr,NULL);
+  tic=timstr.tv_sec+(timstr.tv_usec/1000000.0);
+
+#ifdef SWEEP_MPI
+  /* the master learns how many teams will ask it for tasks */
+  slots = (rank == MASTER) ? 0 : teams;
+  if (rank == MASTER) all_slots = (int*)malloc(sizeof(int) * nproc);
+  MPI_Gather(&slots, 1, MPI_INT, all_slots, 1, MPI_INT, MASTER, MPI_COMM_WORLD);
+  if (rank == MASTER && nproc > 1) {
+    /* hand out the tasks in order to whichever team asks, then a -1 to each team */
+    for (stops = 0, ii = 1; ii < nproc; ii++) stops += all_slots[ii];
+    while (stops > 0) {
+      MPI_Recv(&slots, 1, MPI_INT, MPI_ANY_SOURCE, TAG_READY, MPI_COMM_WORLD, &status);
+      task = next_task(&sweep);
+      if (task < 0) stops--;
+      MPI_Send(&task, 1, MPI_INT, status.MPI_SOURCE, TAG_TASK, MPI_COMM_WORLD);
+    }
+  }
+  else
+#endif
+  {
+#pragma omp parallel num_threads(teams) private(task)
+    {
+      try {
+        d2q9_bgk solver(params, obstacles, threads);
+        while ((task = next_task(&sweep)) >= 0) {
+          run_task(solver, obstacles, &sweep, task);
+        }
+      }
+      catch (const std::exception& error) {
+        die(error.what(),__LINE__,__FILE__);
+      }
+    }
+  }
+
+#ifdef SWEEP_MPI
+  MPI_Barrier(MPI_COMM_WORLD);
+  free(all_slots);
+#endif
+  gettimeofday(&timstr,NULL);
+  toc=timstr.tv_sec+(timstr.tv_usec/1000000.0);
+
+  if (rank == MASTER) {
+    printf("==done==\n");
+    printf("Tasks:\t\t\t\t%d on %d rank(s), %d team(s) of %d thread(s) each\n",
+           sweep.ntasks, nproc, teams, threads);
+    printf("Elapsed time:\t\t\t%.6lf (s)\n", toc-tic);
+  }
+
+  free(sweep.accel);
+  free(sweep.omega);
+  free(obstacles);
+#ifdef SWEEP_MPI
+  MPI_Finalize();
+#endif
+
+  return EXIT_SUCCESS;
+}
+
+int next_task(t_sweep* sweep)
+{
+  int task;             /* the task taken */
+
+#ifdef SWEEP_MPI
+  int rank;             /* rank of this process */
+  int nproc;            /* no. of ranks */
+  int ready = 1;        /* contents of a request */
+  MPI_Status status;    /* struct used by MPI_Recv */
+
+  MPI_Comm_rank(MPI_COMM_WORLD, &rank);
+  MPI_Comm_size(MPI_COMM_WORLD, &nproc);
+  if (rank != MASTER) {
+    /* ask the master, one team at a time */
+#pragma omp critical (sweep_mpi)
+    {
+      MPI_Send(&ready, 1, MPI_INT, MASTER, TAG_READY, MPI_COMM_WORLD);
+      MPI_Recv(&task, 1, MPI_INT, MASTER, TAG_TASK, MPI_COMM_WORLD, &status);
+    }
+    return task;
+  }
+#endif
+#pragma omp atomic capture
+  task = sweep->next++;
+
+  return (task < sweep->ntasks) ? task : -1;
+}
+
+void run_task(d2q9_bgk& solver, const int* obstacles, const t_sweep* sweep, const int task)
+{
+  const d2q9_params& params = solver.params();
+  char     dir[64];             /* directory of the task's outputs */
+  struct timeval timstr;        /* structure to hold elapsed time */
+  double tic,toc;               /* floating point numbers to calculate elapsed wallclock time */
+
+  gettimeofday(&timstr,NULL);
+  tic=timstr.tv_sec+(timstr.tv_usec/1000000.0);
+
+  solver.reset(sweep->accel[task], sweep->omega[task]);
+  solver.step(params.maxIters);
+
+  gettimeofday(&timstr,NULL);
+  toc=timstr.tv_sec+(timstr.tv_usec/1000000.0);
+
+  sprintf(dir, SWEEPDIR, task);
+  write_values(dir,solver,obstacles);
+  printf("Task %d (accel %g, omega %g) Reynolds number:\t%.12E\t%.6lf (s)\n", task,
+         params.accel, params.omega, solver.reynolds(), toc-tic);
+  fflush(stdout);
+}
+
+int initialise(const char* paramfile, const char* obstaclefile, const char* sweepfile,
+           d2q9_params* params, t_sweep* sweep, int** obstacles_ptr)
+{
+  char   message[1024];  /* message buffer */
+  FILE   *fp;            /* file pointer */
+  long   line;           /* line no. of an error in the obstacle file */
+  int    retval;         /* to hold return value for checking */
+  int    size = 0;       /* no. of tasks there is room for */
+  float  accel, omega;   /* of a task */
+
+  /* open the parameter file */
+  fp = fopen(paramfile,"r");
+  if (fp == NULL) {
+    sprintf(message,"could not open input parameter file: %s", paramfile);
+    die(message,__LINE__,__FILE__);
+  }
+
+  /* read in the parameter values; accel and omega are the tasks' */
+  retval = fscanf(fp,"%d\n",&(params->nx));
+  if(retval != 1) die ("could not read param file: nx",__LINE__,__FILE__);
+  retval = fscanf(fp,"%d\n",&(params->ny));
+  if(retval != 1) die ("could not read param file: ny",__LINE__,__FILE__);
+  retval = fscanf(fp,"%d\n",&(params->maxIters));
+  if(retval != 1) die ("could not read param file: maxIters",__LINE__,__FILE__);
+  retval = fscanf(fp,"%d\n",&(params->reynolds_dim));
+  if(retval != 1) die ("could not read param file: reynolds_dim",__LINE__,__FILE__);
+  retval = fscanf(fp,"%f\n",&(params->density));
+  if(retval != 1) die ("could not read param file: density",__LINE__,__FILE__);
+
+  /* and close up the file */
+  fclose(fp);
+
+  /* read the tasks, one 'accel omega' line each */
+  fp = fopen(sweepfile,"r");
+  if (fp == NULL) {
+    sprintf(message,"could not open sweep file: %s", sweepfile);
+    die(message,__LINE__,__FILE__);
+  }
+  memset(sweep, 0, sizeof(*sweep));
+  while ((retval = fscanf(fp,"%f %f\n", &accel, &omega)) != EOF) {
+    if (retval != 2) {
+      sprintf(message,"could not read sweep file: task %d", sweep->ntasks);
+      die(message,__LINE__,__FILE__);
+    }
+    if (sweep->ntasks == size) {
+      size = size ? 2 * size : 64;
+      sweep->accel = (float*)realloc(sweep->accel, sizeof(float) * size);
+      sweep->omega = (float*)realloc(sweep->omega, sizeof(float) * size);
+      if (sweep->accel == NULL || sweep->omega == NULL)
+        die("cannot allocate memory for the tasks",__LINE__,__FILE__);
+    }
+    sweep->accel[sweep->ntasks] = accel;
+    sweep->omega[sweep->ntasks] = omega;
+    sweep->ntasks++;
+  }
+  fclose(fp);
+  if (sweep->ntasks == 0) die("no tasks in the sweep file",__LINE__,__FILE__);
+
+  /* the map of obstacles, read once for all the tasks */
+  *obstacles_ptr = (int*)calloc(params->ny*params->nx, sizeof(int));
+  if (*obstacles_ptr == NULL)
+    die("cannot allocate column memory for obstacles",__LINE__,__FILE__);
+
+  if (lbm_is_binary(obstaclefile)) {
+    retval = lbm_read_obstacles(obstaclefile, params->nx, params->ny, 0, params->ny, *obstacles_ptr, NULL);
+    if (retval != LBM_OK) die(lbm_strerror(retval),__LINE__,__FILE__);
+  }
+  else {
+    /* read-in the blocked cells list */
+    retval = lbm_parse_obstacles(obstaclefile, params->nx, params->ny, *obstacles_ptr, NULL, &line);
+    if (retval == LBM_EOPEN) {
+      sprintf(message,"could not open input obstacles file: %s", obstaclefile);
+      die(message,__LINE__,__FILE__);
+    }
+    if (retval != LBM_OK) {
+      sprintf(message,"%s (line %ld of %s)", lbm_strerror(retval), line, obstaclefile);
+      die(message,__LINE__,__FILE__);
+    }
+  }
+
+  return EXIT_SUCCESS;
+}
+
+int write_values(const char* dir, d2q9_bgk& solver, const int* obstacles)
+{
+  const d2q9_params& params = solver.params();
+  const float* u_x = solver.u_x();            /* the fields of the final state */
+  const float* u_y = solver.u_y();
+  const float* pressure = solver.pressure();
+  const float* av_vels = solver.av_vels();
+  FILE* fp;                     /* file pointer */
+  char path[128];               /* name of an output file */
+  int ii,jj;                    /* generic counters */
+
+  if (mkdir(dir, 0777) != 0 && errno != EEXIST) {
+    die("could not create the directory of a task",__LINE__,__FILE__);
+  }
+
+  sprintf(path, "%s/%s", dir, FINALSTATEFILE);
+  fp = fopen(path,"w");
+  if (fp == NULL) {
+    die("could not open file output file",__LINE__,__FILE__);
+  }
+
+  for(ii=0;ii<params.ny;ii++) {
+    for(jj=0;jj<params.nx;jj++) {
+      fprintf(fp,"%d %d %.12E %.12E %.12E %d\n",ii,jj,u_x[ii*params.nx + jj],u_y[ii*params.nx + jj],
+              pressure[ii*params.nx + jj],obstacles[ii*params.nx + jj]);
+    }
+  }
+
+  fclose(fp);
+
+  sprintf(path, "%s/%s", dir, AVVELSFILE);
+  fp = fopen(path,"w");
+  if (fp == NULL) {
+    die("could not open file output file",__LINE__,__FILE__);
+  }
+  for (ii=0;ii<solver.iterations();ii++) {
+    fprintf(fp,"%d:\t%.12E\n", ii, av_vels[ii]);
+  }
+
+  fclose(fp);
+
+  return EXIT_SUCCESS;
+}
+
+void die(const char* message, const int line, const char *file)
+{
+  fprintf(stderr, "Error at line %d of file %s:\n", line, file);
+  fprintf(stderr, "%s\n",message);
+  fflush(stderr);
+#ifdef SWEEP_MPI
+  MPI_Abort(MPI_COMM_WORLD, EXIT_FAILURE);
+#endif
+  exit(EXIT_FAILURE);
+}
+
+void usage(const char* exe)
+{
+  fprintf(stderr, "Usage: %s <paramfile> <obstaclefile> <sweepfile>\n", exe);
+  exit(EXIT_FAILURE);
+}
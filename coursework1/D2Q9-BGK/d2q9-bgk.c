@@ -45,19 +45,168 @@
 **
 **   d2q9-bgk.exe input.params obstacles.dat
 **
+** The obstacle file may also be in the binary format of lbm_io.h,
+** which is recognised by its header. Passing --binary writes the
+** final state in binary to final_state.bin instead of as text.
+**
+** All output other than the final state goes through a background
+** thread, so the timestep loop only stalls to copy into its buffers:
+** av_vels.dat is streamed out in chunks as the run goes,
+** --snapshot <iters> writes u_x, u_y and pressure every <iters>
+** timesteps to snapshot_<timestep>.dat (or .bin, with --binary), and
+** --checkpoint <iters> saves the lattice to checkpoint.bin.
+**
+** --restart <checkpointfile> resumes a run from a checkpoint of the
+** same parameters and obstacles. The checkpoint holds the av. velocity
+** of every timestep before it, and av_vels.dat is written afresh from
+** them, so a run can resume in a directory of its own; the resumed run
+** continues bit for bit as the original would have.
+**
+** --warm-start <factor> first runs the same geometry on a grid
+** coarser by factor in each direction, a coarse cell blocked if any
+** cell it covers is, until it is steady (or for a quarter of maxIters,
+** all it runs without a tolerance to stop it). The run
+** then starts from the equilibrium of the coarse flow, interpolated
+** to the grid, instead of from rest. The coarse timesteps cost about
+** 1/factor^2 of one on the grid, which is reported.
+**
+** The 'speeds' may be stored in 16 bits, as halves or bfloat16s, and
+** optionally as deviations from the fluid at rest (make STORAGE=fp16,
+** STORAGE=bf16, DEVIATION=1; see lbm_half.h). They are widened to
+** float for the arithmetic. Checkpoints hold them widened to floats as
+** they are stored, deviations and all, so a build of the same storage
+** resumes from the very same bits; another build rounds them to its own.
+**
+** The average velocities are summed row by row in a fixed order (see
+** lbm_reduce.h), so av_vels.dat comes out the same for any number of
+** threads; make COMPENSATED=1 also compensates the sums.
+**
+** Optional lines at the end of the parameter file stop the run once
+** the flow is steady (see lbm_steady.h); the outputs are then written
+** for the timesteps run, and the timestep it stopped at is reported.
+**
+** If the obstacles are mirror symmetric in y, about a line between
+** two rows (and so, the grid being periodic, about a second line half
+** the grid away), the flow is too, as it starts at rest and the
+** acceleration is the same in every row. Only the half of the grid
+** between the two lines is then simulated, with specular reflection
+** at both, and the outputs are mirrored back to the whole grid. The
+** halves of a whole grid run are mirror images only to within
+** rounding, so the outputs agree with it to the tolerance of
+** check_results rather than to the bit; --no-mirror runs the whole
+** grid. Checkpoints of a mirrored run hold the half grid.
+**
+** A run by rows, of a grid not mirrored, with no checkpoints,
+** snapshots, restart, warm start, --jit or --timeline, is stepped by
+** the d2q9_bgk solver of d2q9-bgk-solver.h (libd2q9-bgk.a), this a
+** driver over it: writing the av. velocities and testing for a steady
+** state as it goes, and writing the final state at the end. The rest
+** need the grid as it goes, and run on the same kernels here.
+**
+** The timestep loop runs on a pool of threads started once (see
+** lbm_pool.h), as many as OpenMP would use, rather than in a parallel
+** region per phase: each thread propagates, collides and sums the
+** av. velocity of the same block of rows every timestep, with a spin
+** barrier between the phases. With --tiles <rows> it runs instead as a
+** graph of tiles of about that many rows, each tile waiting only on
+** the tiles either side of it, with no barrier at all; with --steal
+** <rows> the tiles are dealt out by work stealing, for grids whose
+** rows cost more in some parts than others. --timeline <iters>
+** records what each thread does in the first <iters> timesteps to
+** timeline.dat, and reports the time each was busy and waiting.
+**
+** On a small grid a thread's block is so few rows that the barriers
+** cost more than the work, and the run is slower on many threads than
+** on one. So the pool is as many threads as OpenMP would use, but no
+** more than one per 8192 cells and 4 rows of the grid, so that a grid
+** too small to share out runs on one; or --threads <n>, as many as
+** that. --threads auto times how many pay for themselves: a few
+** timesteps, on a copy of the grid, every run that has no tuning of the
+** grid to go on (the timings are not kept; --tune keeps them), with
+** 1, 2, 4, ... threads up to as many as OpenMP would use, by
+** rows and by tiles (just by tiles, or just by rows, with --tiles or
+** --steal, and --tiles 0), and keeps the fastest; more threads, or
+** tiles, must be 5% faster than fewer, or rows, so it never does worse
+** than one thread by more than the noise.
+**
+** --tune times more layouts: tiles of several sizes, by dataflow and
+** by stealing, at each number of threads, and then the fastest with
+** the rows summed a few at a time, straight after they are collided,
+** rather than all of a block once it is. Only --tune writes the trials
+** down, to tuning.dat (--tuning <file>, or --calibration <file> as it
+** was called, keeps them elsewhere), a line each, by CPU model,
+** storage, grid size and number of threads, in place of those of an
+** earlier tuning of the same; the runs after with --threads auto, or
+** with none of --threads, --tiles and --steal, take the layout from
+** there and report the times of the rest.
+** The storage of the cells is fixed when it is built, and so is tuned
+** by building it each way (make STORAGE=...) and comparing the times.
+**
+** --jit <dir> compiles the collision for the run, with the width of the
+** grid, omega and the populations at rest as constants, using the
+** compiler and flags this was built with, into a shared object cached
+** in dir by a hash of its source, and loads it with dlopen(). It is
+** used if it collides the grid to the same bits as the generic kernel,
+** and the speedup of the collision is reported; if there is no
+** compiler, the generic kernel is used.
+**
 ** Be sure to adjust the grid dimensions in the parameter file
 ** if you choose a different obstacle file.
 */
 
+#define _GNU_SOURCE  /* for pinning the threads of the pool */
 #include<stdio.h>
 #include<stdlib.h>
+#include<math.h>
 #include<time.h>
 #include<sys/time.h>
 #include<sys/resource.h>
+#include<string.h>
+#include<omp.h>
+#include<pthread.h>
+#include<dlfcn.h>
+#include<errno.h>
+#include<sys/wait.h>
+#include"lbm_io.h"
+#include"lbm_text.h"
+#include"lbm_half.h"
+#include"lbm_reduce.h"
+#include"lbm_steady.h"
+#include"lbm_pool.h"
+#include"d2q9-bgk-solver.h"
 
 #define NSPEEDS         9
 #define FINALSTATEFILE  "final_state.dat"
+#define FINALSTATEBIN   "final_state.bin"
 #define AVVELSFILE      "av_vels.dat"
+#define CHECKPOINTFILE  "checkpoint.bin"
+#define SNAPSHOTFILE    "snapshot_%07d.dat"
+#define SNAPSHOTBIN     "snapshot_%07d.bin"
+#define AVVELS_CHUNK    4096  /* av. velocities per write to av_vels.dat */
+#define TIMELINEFILE    "timeline.dat"
+#define WARM_FRACTION   4     /* the warm start runs at most maxIters over this */
+#define TUNINGFILE      "tuning.dat"
+#define CALIBRATE_TIME  0.02  /* seconds each layout is timed for, at least */
+#define CALIBRATE_GAIN  1.05  /* how much faster more threads, or tiles, must be */
+#define CALIBRATE_TILES 4     /* tiles per thread of the tiled layouts timed */
+#define CALIBRATE_FUSE  8     /* rows summed at a time, tried after one, when tuning */
+#define TUNE_TRIALS     256   /* most trials of a tuning */
+#define LAYOUT_CELLS    8192  /* cells a thread needs, untimed, to pay for its barriers */
+#define LAYOUT_ROWS     4     /* and rows */
+#define JITSOURCE       "%s/collide_%016llx.c"   /* the kernels of --jit, by hash */
+#define JITOBJECT       "%s/collide_%016llx.so"
+
+/* how the kernels of --jit are compiled: as this was (see the Makefile),
+** with d2q9-bgk-collide.h in JIT_DIR and lbm_half.h in JIT_DIR/../../LBM_common */
+#ifndef JIT_CC
+#define JIT_CC          "cc"
+#endif
+#ifndef JIT_CFLAGS
+#define JIT_CFLAGS      "-O3"
+#endif
+#ifndef JIT_DIR
+#define JIT_DIR         "."
+#endif
 
 /* struct to hold the parameter values */
 typedef struct {
@@ -68,13 +217,150 @@ typedef struct {
   float density;       /* density per link */
   float accel;         /* density redistribution */
   float omega;         /* relaxation parameter */
+  float rest[NSPEEDS];  /* the 'speed' values of the fluid at rest */
+  int    full_ny;       /* rows of the whole grid; twice ny if mirrored */
+  int    mirror_row;    /* row of the whole grid that is row 0, if mirrored, else -1 */
 } t_param;
 
-/* struct to hold the 'speed' values */
+/* struct to hold the 'speed' values, in float or 16 bits (see lbm_half.h) */
 typedef struct {
-  float speeds[NSPEEDS];
+  lbm_store speeds[NSPEEDS];
 } t_speed;
 
+/* a rebound_or_collision() compiled for the run by --jit */
+typedef int (*t_collide)(t_speed* cells, t_speed* tmp_cells, int* obstacles,
+                         const int first, const int last);
+
+/* one 'speed' value of a cell widened to float, and a float stored into one;
+** the 16 bit deviations are taken from the params in scope */
+#define LOAD(cell,kk)         LBM_LOAD((cell).speeds[kk], params.rest[kk])
+#define STORE(cell,kk,value)  ((cell).speeds[kk] = LBM_STORE((value), params.rest[kk]))
+
+/* struct to hold the fields written to the output files */
+typedef struct {
+  int    nx;            /* no. of cells in x-direction */
+  float* u_x;           /* x-component of velocity in each grid cell */
+  float* u_y;           /* y-component of velocity in each grid cell */
+  float* pressure;      /* fluid pressure in each grid cell */
+  int*   obstacles;     /* grid indicating which cells are blocked */
+} t_output;
+
+/* kinds of job for the output thread */
+enum { JOB_AVVELS, JOB_SNAPSHOT, JOB_CHECKPOINT };
+#define NJOBS           5  /* two av. velocity chunks, two snapshots, one checkpoint */
+
+/* struct to hold a buffer handed to the output thread */
+typedef struct {
+  int      kind;        /* JOB_* */
+  int      queued;      /* TRUE from submission until written */
+  long     seq;         /* order of submission, which is the order of writing */
+  int      iteration;   /* first timestep of the av. velocities, or timesteps done */
+  int      count;       /* no. of av. velocities held */
+  float*   av_vels;     /* JOB_AVVELS: up to AVVELS_CHUNK av. velocities */
+  float*   u_x;         /* JOB_SNAPSHOT: the derived fields */
+  float*   u_y;
+  float*   pressure;
+  float*   cells;       /* JOB_CHECKPOINT: copy of the grid, widened to float */
+  int      samples;     /* and of the samples of the field for the steady state test, */
+  double   l2_change;
+  float*   last_u;      /* the last of them if any */
+} t_job;
+
+/* struct to hold the state of the output thread */
+typedef struct {
+  pthread_t       thread;
+  pthread_mutex_t lock;
+  pthread_cond_t  cond;        /* signalled whenever a job is queued or written */
+  t_job           jobs[NJOBS];
+  int             next[3];     /* job of each kind to fill next */
+  long            seq;         /* no. of jobs submitted */
+  int             done;        /* TRUE once no more jobs will be queued */
+  t_job*          av_job;      /* chunk of av. velocities being filled */
+  t_param         params;      /* parameters of the run */
+  int*            obstacles;   /* grid indicating which cells are blocked */
+  uint64_t        obstacles_hash; /* lbm_hash_obstacles of it, for checkpoints */
+  int             binary;      /* write snapshots in binary */
+  int             avvels_fd;   /* av_vels.dat */
+  off_t           avvels_end;  /* bytes of av_vels.dat written */
+  float*          history;     /* every av. velocity written, if checkpointing */
+  int             nhistory;    /* no. of them */
+  int             history_size;  /* no. allocated */
+} t_writer;
+
+/* phases of a timestep in the timeline */
+enum { PHASE_PROPAGATE, PHASE_COLLIDE, PHASE_WAIT, PHASE_OUTPUT };
+#define TIMELINE_EVENTS  8  /* events of a thread per timestep, and per tile */
+
+/* struct to hold a phase of a timestep on one thread */
+typedef struct {
+  int    iteration;     /* the timestep */
+  int    phase;         /* PHASE_* */
+  int    tile;          /* the tile, or -1 for all the thread's rows */
+  double start;         /* wallclock times */
+  double end;
+} t_event;
+
+/* struct to hold the phases of the first timesteps, thread by thread */
+typedef struct {
+  int      steps;       /* timesteps to record, 0 for none */
+  int      capacity;    /* events of each thread */
+  int*     count;       /* events recorded by each thread */
+  int*     stolen;      /* tiles stolen by each thread */
+  t_event* events;      /* capacity of them for each thread in turn */
+  double   origin;      /* wallclock time the loop started */
+} t_timeline;
+
+/* struct to hold the state of the timestep loop, shared by the threads of the pool */
+typedef struct {
+  t_param     params;       /* parameters of the run */
+  t_speed*    cells;        /* grid containing fluid densities */
+  t_speed*    tmp_cells;    /* scratch space */
+  int*        obstacles;    /* grid indicating which cells are blocked */
+  int         fluid_cells;  /* no. of cells not blocked */
+  /* the row sums, fields and snapshot are kept for the last two
+  ** timesteps, by parity, as the dataflow loop adds up one behind */
+  lbm_sum*    rows[2];      /* sums of the x-components of velocity of the rows */
+  float*      u_x[2];       /* fields filled by the av. velocity pass, when due */
+  float*      u_y[2];
+  float*      pressure[2];
+  float*      sample_u_x;   /* the field, when sampled outside a snapshot */
+  float*      sample_u_y;
+  float*      sample_pressure;
+  t_job*      job[2];       /* snapshot being filled, or NULL */
+  t_writer*   writer;       /* the output thread */
+  lbm_steady* steady;       /* detection of a steady state */
+  int         start;        /* first timestep to run */
+  int         snapshot_every;    /* timesteps between snapshots, 0 for none */
+  int         checkpoint_every;  /* timesteps between checkpoints, 0 for none */
+  int         iterations;   /* timesteps run */
+  int         stop;         /* TRUE once the flow is steady */
+  int            ntiles;      /* tiles of rows, 0 for the barrier loop */
+  int            steal;       /* TRUE to deal out the tiles by work stealing, else by dataflow */
+  int            fuse_rows;   /* rows collided before they are summed, 0 for all at once */
+  t_collide      collide;     /* the kernel compiled for the run, or NULL */
+  lbm_pool_deque* deques[2];  /* tiles of each thread to propagate, and to collide */
+  lbm_pool_flag* propagated;  /* timesteps each tile has been propagated */
+  lbm_pool_flag* collided;    /* and collided */
+  lbm_pool_flag  begun;       /* timesteps begun by thread 0 */
+  lbm_pool_flag  ended;       /* and ended */
+  t_timeline     timeline;    /* phases of the first timesteps */
+} t_loop;
+
+/* struct to hold how the timestep loop is laid out on the pool */
+typedef struct {
+  int threads;          /* threads of the pool, 0 to calibrate */
+  int tile_rows;        /* rows of a tile, 0 for the barrier loop, -1 to calibrate */
+  int steal;            /* TRUE to deal out the tiles by work stealing */
+  int fuse_rows;        /* rows collided before they are summed, 0 for all at once */
+} t_layout;
+
+/* struct to hold a layout timed, as kept in the tuning database */
+typedef struct {
+  t_layout layout;
+  double   time;        /* seconds per timestep */
+  int      chosen;      /* TRUE for the one chosen */
+} t_trial;
+
 enum boolean { FALSE, TRUE };
 
 /*
@@ -84,21 +370,122 @@ enum boolean { FALSE, TRUE };
 /* load params, allocate memory, load obstacles & initialise fluid particle densities */
 int initialise(const char* paramfile, const char* obstaclefile,
            t_param* params, t_speed** cells_ptr, t_speed** tmp_cells_ptr, 
-           int** obstacles_ptr, float** av_vels_ptr);
+           int** obstacles_ptr, lbm_steady* steady);
 
 /* 
 ** The main calculation methods.
 ** timestep calls, in order, the functions:
 ** accelerate_flow(), propagate(), rebound() & collision()
+** on rows first to last-1 of the grid, which a thread of the pool
+** or of an OpenMP team works on.
 */
 int timestep(const t_param params, t_speed* cells, t_speed* tmp_cells, int* obstacles);
-int accelerate_flow_and_propagate(const t_param params, t_speed* cells, t_speed* tmp_cells, int* obstacles);
-int rebound_or_collision(const t_param params, t_speed* cells, t_speed* tmp_cells, int* obstacles);
-int write_values(const t_param params, t_speed* cells, int* obstacles, float* av_vels);
+int accelerate_flow_and_propagate(const t_param params, t_speed* cells, t_speed* tmp_cells, int* obstacles,
+                                  const int first, const int last);
+int rebound_or_collision(const t_param params, t_speed* cells, t_speed* tmp_cells, int* obstacles,
+                         const int first, const int last);
+
+/* compile rebound_or_collision() for the grid width, omega and rest
+** populations of the run into a shared object in dir, if it is not
+** there already, and load it; returns it, or NULL with the reason */
+t_collide jit_compile(const t_param params, const char* dir, const char** why);
+/* the kernel of --jit, if it can be compiled and does the same as
+** rebound_or_collision(), and the speedup, reported */
+t_collide jit_kernel(const t_param params, int* obstacles, const char* dir);
+/* seconds per collision of the whole grid, by the kernel or the generic one */
+double time_collide(const t_param params, t_collide collide, t_speed* cells,
+                    t_speed* tmp_cells, int* obstacles);
+
+/* the timestep loop, run by every thread of the pool, with barriers
+** between the phases, as a graph of tiles of rows, or with the tiles
+** dealt out by work stealing */
+void timestep_run(lbm_pool* pool, const int tid, void* arg);
+void timestep_loop(lbm_pool* pool, const int tid, void* arg);
+void timestep_dataflow(lbm_pool* pool, const int tid, void* arg);
+void timestep_steal(lbm_pool* pool, const int tid, void* arg);
+double steal_tiles(t_loop* loop, lbm_pool* pool, const int tid, const int iteration,
+                   const int phase, double t);
+double dataflow_end(t_loop* loop, const int iteration, double t);
+int tile_order(const int kk, const int first, const int last, const int ends_first);
+void collide_rows(t_loop* loop, const int iteration, const int first, const int last);
+int timestep_fields(const t_loop* loop, const int iteration);
+int timestep_hold(const t_loop* loop, const int iteration);
+/* thread 0's part of a timestep: before it, choose where the fields go,
+** and after it, the av. velocity, output and test for a steady state */
+void timestep_begin(t_loop* loop, const int iteration);
+void timestep_end(t_loop* loop, const int iteration);
+/* the timestep loop of a plain run by rows, on the d2q9_bgk solver of
+** d2q9-bgk-solver.h; returns the timesteps run */
+int solver_loop(const t_param params, t_speed* cells, int* obstacles, const int threads,
+                t_writer* writer, lbm_steady* steady);
+
+/* choose the threads of the pool, rows or tiles, and how many rows to
+** collide before summing them, for the grid of the loop, from the tuning
+** database or by timing them; returns where the choice came from, and
+** the trials it was chosen from */
+const char* choose_layout(t_loop* loop, t_layout* layout, const int max_threads,
+                          const char* path, const int calibrate, const int tune,
+                          t_trial* trials, int* ntrials);
+void write_tuning(const char* path, const char* cpu, const t_param params, const int max_threads,
+                  const t_layout* asked, const t_trial* trials, const int ntrials);
+int time_trial(const t_loop* loop, t_trial* trial, t_speed* cells, t_speed* tmp_cells,
+               t_trial* trials, int* ntrials, const int best);
+double time_layout(const t_loop* loop, const t_layout* layout, t_speed* cells,
+                   t_speed* tmp_cells);
+void cpu_model(char* model, const int len);
+void write_layout(const t_layout* layout, const int ntiles, const char* chosen,
+                  const t_trial* trials, const int ntrials);
+/* set up, and free, the tiles of a layout */
+void loop_tiles(t_loop* loop, const t_layout* layout, const int nthreads);
+void loop_tiles_free(t_loop* loop, const int nthreads);
+
+/* the timeline of the phases of the loop, on each thread */
+double timeline_now(const t_loop* loop);
+double timeline_mark(t_loop* loop, const int tid, const int iteration, const int phase,
+                     const int tile, const double start);
+void timeline_stolen(t_loop* loop, const int tid, const int iteration);
+void write_timeline(const t_loop* loop, const int nthreads);
+int write_values(const t_param params, t_speed* cells, int* obstacles, int* full_obstacles,
+                 const int binary);
+
+/* write nlines lines of text to a file, formatted in parallel if asked */
+void write_lines(const char* path, const int nlines, const int line_max,
+                 int (*format_line)(char* out, const int line, const t_output* output),
+                 const t_output* output, const int parallel);
+int format_state_line(char* out, const int line, const t_output* output);
+void write_at(const int fd, const char* buffer, const size_t len, const off_t offset);
+
+/* the output thread, fed from the timestep loop */
+void output_start(t_writer* writer, const t_param params, int* obstacles, const int binary,
+                  const int checkpoints, const float* av_vels, const int start);
+t_job* output_acquire(t_writer* writer, const int kind);
+void output_submit(t_writer* writer, t_job* job);
+void output_av_vel(t_writer* writer, const int iteration, const float av_vel);
+void output_checkpoint(t_writer* writer, t_speed* cells, const lbm_steady* steady,
+                       const int iteration);
+void output_finish(t_writer* writer);
+void* output_thread(void* arg);
+void output_write(t_writer* writer, t_job* job);
+
+/* resume the run from a checkpoint */
+int restart(const char* restartfile, const t_param params, t_speed* cells, int* obstacles,
+            lbm_steady* steady, float** av_vels);
+
+/* simulate half the grid if the obstacles are mirror symmetric in y;
+** returns TRUE if they are */
+int mirror_domain(t_param* params, t_speed** cells_ptr, t_speed** tmp_cells_ptr,
+                  int** obstacles_ptr, int** full_obstacles_ptr);
+
+/* mirror fields of the half grid, in the first rows, to the whole grid */
+void mirror_fields(const t_param params, float* u_x, float* u_y, float* pressure);
+
+/* start from the flow of a coarser grid; returns the coarse timesteps run */
+int warm_start(const t_param params, t_speed* cells, int* obstacles, const lbm_steady* steady,
+               const int factor);
 
 /* finalise, including freeing up allocated memory */
 int finalise(const t_param* params, t_speed** cells_ptr, t_speed** tmp_cells_ptr,
-         int** obstacles_ptr, float** av_vels_ptr);
+         int** obstacles_ptr);
 
 /* Sum all the densities in the grid.
 ** The total should remain constant from one timestep to the next. */
@@ -107,6 +494,20 @@ float total_density(const t_param params, t_speed* cells);
 /* compute average velocity */
 float av_velocity(const t_param params, t_speed* cells, int* obstacles);
 
+/* sum the x-components of velocity of rows first to last-1 into rows[];
+** returns the no. of cells not blocked */
+int av_velocity_rows(const t_param params, t_speed* cells, int* obstacles, lbm_sum* rows,
+                     const int first, const int last);
+
+/* the same, and the velocity and pressure of every cell of the rows */
+int av_velocity_fields_rows(const t_param params, t_speed* cells, int* obstacles,
+                            float* u_x, float* u_y, float* pressure, lbm_sum* rows,
+                            const int first, const int last);
+
+/* compute average velocity, and the velocity and pressure of every cell in the same pass */
+float av_velocity_fields(const t_param params, t_speed* cells, int* obstacles,
+                         float* u_x, float* u_y, float* pressure);
+
 /* calculate Reynolds number */
 float calc_reynolds(const t_param params, t_speed* cells, int* obstacles);
 
@@ -126,39 +527,172 @@ int main(int argc, char* argv[])
   t_speed* cells     = NULL;  /* grid containing fluid densities */
   t_speed* tmp_cells = NULL;  /* scratch space */
   int*     obstacles = NULL;  /* grid indicating which cells are blocked */
-  float*  av_vels   = NULL;  /* a record of the av. velocity computed for each timestep */
+  int*     full_obstacles;    /* the same, of the whole grid when only half is simulated */
+  int      mirror = TRUE;     /* simulate half a mirror symmetric grid */
   int      ii;                /* generic counter */
   struct timeval timstr;      /* structure to hold elapsed time */
   struct rusage ru;           /* structure to hold CPU time--system and user */
   double tic,toc;             /* floating point numbers to calculate elapsed wallclock time */
   double usrtim;              /* floating point number to record elapsed user CPU time */
   double systim;              /* floating point number to record elapsed system CPU time */
+  int      binary = FALSE;    /* write the final state in binary */
+  int      checkpoint_every = 0;  /* timesteps between checkpoints, 0 for none */
+  int      snapshot_every = 0;    /* timesteps between snapshots, 0 for none */
+  char*    restartfile = NULL;    /* checkpoint to resume from */
+  int      start = 0;             /* first timestep to run */
+  float*   av_vels = NULL;        /* av. velocities before it */
+  t_writer writer;                /* the output thread */
+  lbm_steady steady;              /* detection of a steady state */
+  lbm_pool pool;                  /* the threads of the timestep loop */
+  t_loop   loop;                  /* the state they share */
+  float*   u_x = NULL;            /* the field, when sampled outside a snapshot */
+  float*   u_y = NULL;
+  float*   pressure = NULL;
+  int      warm_factor = 0;       /* coarsening of the warm start, 0 for none */
+  int      warm_iters = 0;        /* coarse timesteps of the warm start */
+  double   warm_time = 0.0;       /* wallclock time of the warm start */
+  t_layout layout = { 0, -1, FALSE, 0 };  /* threads, and rows or tiles, if asked for */
+  int      calibrate = FALSE;     /* time the layouts, with --threads auto */
+  char*    tuningfile = TUNINGFILE;  /* the tuning database */
+  int      tune = FALSE;          /* time every layout again */
+  t_trial  trials[TUNE_TRIALS];   /* the layouts timed */
+  int      ntrials;
+  const char* chosen;             /* where the layout came from */
+  char*    jitdir = NULL;         /* where the kernels of --jit are kept, or NULL */
+  int      timeline_steps = 0;    /* timesteps of the timeline, 0 for none */
+  int      driven;                /* TRUE if the solver of d2q9-bgk-solver.h runs it */
 
   /* parse the command line */
-  if(argc != 3) {
+  if(argc < 3) {
     usage(argv[0]);
   }
   else{
     paramfile = argv[1];
     obstaclefile = argv[2];
   }
+  for (ii = 3; ii < argc; ii++) {
+    if (!strcmp(argv[ii], "--binary")) binary = TRUE;
+    else if (!strcmp(argv[ii], "--checkpoint") && ii + 1 < argc) checkpoint_every = atoi(argv[++ii]);
+    else if (!strcmp(argv[ii], "--snapshot") && ii + 1 < argc) snapshot_every = atoi(argv[++ii]);
+    else if (!strcmp(argv[ii], "--restart") && ii + 1 < argc) restartfile = argv[++ii];
+    else if (!strcmp(argv[ii], "--warm-start") && ii + 1 < argc) warm_factor = atoi(argv[++ii]);
+    else if (!strcmp(argv[ii], "--no-mirror")) mirror = FALSE;
+    else if (!strcmp(argv[ii], "--tiles") && ii + 1 < argc && !layout.steal)
+      layout.tile_rows = atoi(argv[++ii]);
+    else if (!strcmp(argv[ii], "--steal") && ii + 1 < argc && layout.tile_rows < 0) {
+      layout.tile_rows = atoi(argv[++ii]);
+      layout.steal = TRUE;
+    }
+    else if (!strcmp(argv[ii], "--threads") && ii + 1 < argc) {
+      ii++;
+      calibrate = !strcmp(argv[ii], "auto");
+      layout.threads = calibrate ? 0 : (atoi(argv[ii]) > 0) ? atoi(argv[ii]) : -1;
+    }
+    else if (!strcmp(argv[ii], "--tuning") && ii + 1 < argc) tuningfile = argv[++ii];
+    else if (!strcmp(argv[ii], "--calibration") && ii + 1 < argc) {
+      /* the name of --tuning when it held just the calibration */
+      tuningfile = argv[++ii];
+      calibrate = TRUE;
+    }
+    else if (!strcmp(argv[ii], "--tune")) tune = TRUE;
+    else if (!strcmp(argv[ii], "--jit") && ii + 1 < argc) jitdir = argv[++ii];
+    else if (!strcmp(argv[ii], "--timeline") && ii + 1 < argc) timeline_steps = atoi(argv[++ii]);
+    else usage(argv[0]);
+  }
+  if (checkpoint_every < 0 || snapshot_every < 0 || timeline_steps < 0 || layout.threads < 0 ||
+      layout.tile_rows < -1 || (layout.steal && layout.tile_rows < 0))
+    usage(argv[0]);
+  if (warm_factor == 1 || warm_factor < 0 || (warm_factor && restartfile != NULL)) usage(argv[0]);
 
   /* initialise our data structures and load values from file */
-  initialise(paramfile, obstaclefile, &params, &cells, &tmp_cells, &obstacles, &av_vels);
+  initialise(paramfile, obstaclefile, &params, &cells, &tmp_cells, &obstacles, &steady);
+  full_obstacles = obstacles;
+  if (mirror && mirror_domain(&params, &cells, &tmp_cells, &obstacles, &full_obstacles))
+    printf("Mirror symmetric:\t\tsimulating rows %d to %d of %d\n", params.mirror_row,
+           (params.mirror_row + params.ny - 1) % params.full_ny, params.full_ny);
+  if (lbm_steady_init(&steady, params.ny*params.nx) != 0)
+    die("cannot allocate memory for steady state detection",__LINE__,__FILE__);
+  if (steady.history != NULL && steady.l2_stride) {
+    u_x = (float*)malloc(sizeof(float)*(params.ny*params.nx));
+    u_y = (float*)malloc(sizeof(float)*(params.ny*params.nx));
+    pressure = (float*)malloc(sizeof(float)*(params.ny*params.nx));
+    if (u_x == NULL || u_y == NULL || pressure == NULL)
+      die("cannot allocate memory for steady state detection",__LINE__,__FILE__);
+  }
+  if (restartfile != NULL) start = restart(restartfile, params, cells, full_obstacles, &steady, &av_vels);
+  if (warm_factor) {
+    gettimeofday(&timstr,NULL);
+    tic=timstr.tv_sec+(timstr.tv_usec/1000000.0);
+    warm_iters = warm_start(params, cells, obstacles, &steady, warm_factor);
+    gettimeofday(&timstr,NULL);
+    warm_time=timstr.tv_sec+(timstr.tv_usec/1000000.0) - tic;
+  }
+  /* the window of av. velocities before the checkpoint */
+  if (av_vels != NULL) lbm_steady_replay(&steady, av_vels, start);
+  output_start(&writer, params, full_obstacles, binary, checkpoint_every > 0, av_vels, start);
+  free(av_vels);
+
+  loop.params = params;
+  loop.cells = cells;
+  loop.tmp_cells = tmp_cells;
+  loop.obstacles = obstacles;
+  loop.fluid_cells = 0;
+  for (ii = 0; ii < params.ny*params.nx; ii++) loop.fluid_cells += !obstacles[ii];
+  for (ii = 0; ii < 2; ii++) {
+    loop.rows[ii] = (lbm_sum*)malloc(sizeof(lbm_sum) * params.ny);
+    if (loop.rows[ii] == NULL) die("cannot allocate memory for row sums",__LINE__,__FILE__);
+    loop.u_x[ii] = loop.u_y[ii] = loop.pressure[ii] = NULL;
+    loop.job[ii] = NULL;
+  }
+  loop.sample_u_x = u_x;
+  loop.sample_u_y = u_y;
+  loop.sample_pressure = pressure;
+  loop.writer = &writer;
+  loop.steady = &steady;
+  loop.start = start;
+  loop.snapshot_every = snapshot_every;
+  loop.checkpoint_every = checkpoint_every;
+  loop.iterations = params.maxIters;
+  loop.stop = FALSE;
+  /* a checkpoint taken as the flow became steady resumes steady */
+  if (lbm_steady_converged(&steady)) loop.iterations = loop.params.maxIters = start;
+  loop.timeline.steps = 0;
+  loop.collide = (jitdir != NULL) ? jit_kernel(params, obstacles, jitdir) : NULL;
+  chosen = choose_layout(&loop, &layout, omp_get_max_threads(), tuningfile, calibrate, tune,
+                         trials, &ntrials);
+  /* a run by rows with nothing to do on the way but write the av.
+  ** velocities, and test for a steady state, is the solver's */
+  driven = !layout.tile_rows && !layout.fuse_rows && params.mirror_row < 0 &&
+           !checkpoint_every && !snapshot_every && restartfile == NULL && !warm_factor &&
+           loop.collide == NULL && !timeline_steps;
+  loop.ntiles = 0;
+  if (!driven) {
+    if (lbm_pool_start(&pool, layout.threads) != 0)
+      die("could not start the threads of the timestep loop",__LINE__,__FILE__);
+    loop_tiles(&loop, &layout, pool.nthreads);
+  }
+  write_layout(&layout, loop.ntiles, chosen, trials, ntrials);
+  loop.timeline.steps = timeline_steps;
+  if (timeline_steps) {
+    loop.timeline.capacity = timeline_steps * TIMELINE_EVENTS * (loop.ntiles ? loop.ntiles : 1);
+    loop.timeline.count = (int*)calloc(pool.nthreads, sizeof(int));
+    loop.timeline.stolen = (int*)calloc(pool.nthreads, sizeof(int));
+    loop.timeline.events = (t_event*)malloc(sizeof(t_event) * loop.timeline.capacity * pool.nthreads);
+    if (loop.timeline.count == NULL || loop.timeline.stolen == NULL || loop.timeline.events == NULL)
+      die("cannot allocate memory for the timeline",__LINE__,__FILE__);
+  }
 
   /* iterate for maxIters timesteps */
   gettimeofday(&timstr,NULL);
   tic=timstr.tv_sec+(timstr.tv_usec/1000000.0);
 
-  for (ii=0;ii<params.maxIters;ii++) {
-    timestep(params,cells,tmp_cells,obstacles);
-    av_vels[ii] = av_velocity(params,cells,obstacles);
-#ifdef DEBUG
-    printf("==timestep: %d==\n",ii);
-    printf("av velocity: %.12E\n", av_vels[ii]);
-    printf("tot density: %.12E\n",total_density(params,cells));
-#endif
+  if (driven) loop.iterations = solver_loop(params, cells, obstacles, layout.threads, &writer, &steady);
+  else {
+    loop.timeline.origin = timeline_now(&loop);
+    lbm_pool_run(&pool, timestep_run, &loop);
+    lbm_pool_finish(&pool);
   }
+  output_finish(&writer);
   gettimeofday(&timstr,NULL);
   toc=timstr.tv_sec+(timstr.tv_usec/1000000.0);
   getrusage(RUSAGE_SELF, &ru);
@@ -169,194 +703,1098 @@ int main(int argc, char* argv[])
 
   /* write final values and free memory */
   printf("==done==\n");
+  if (loop.iterations < params.maxIters)
+    printf("Steady state after:\t\t%d timesteps\n", loop.iterations);
   printf("Reynolds number:\t\t%.12E\n",calc_reynolds(params,cells,obstacles));
   printf("Elapsed time:\t\t\t%.6lf (s)\n", toc-tic);
+  if (warm_factor) {
+    printf("Warm start:\t\t\t%d timesteps on %dx%d, the work of %.1f timesteps\n",
+           warm_iters, params.nx / warm_factor, params.ny / warm_factor,
+           (double)warm_iters / ((double)warm_factor * warm_factor));
+    printf("Warm start time:\t\t%.6lf (s)\n", warm_time);
+  }
   printf("Elapsed user CPU time:\t\t%.6lf (s)\n", usrtim);
   printf("Elapsed system CPU time:\t%.6lf (s)\n", systim);
-  write_values(params,cells,obstacles,av_vels);
-  finalise(&params, &cells, &tmp_cells, &obstacles, &av_vels);
+  if (timeline_steps) {
+    write_timeline(&loop, pool.nthreads);
+    free(loop.timeline.count);
+    free(loop.timeline.stolen);
+    free(loop.timeline.events);
+  }
+  if (!driven) loop_tiles_free(&loop, pool.nthreads);
+  free(loop.rows[0]);
+  free(loop.rows[1]);
+  write_values(params,cells,obstacles,full_obstacles,binary);
+  if (full_obstacles != obstacles) free(full_obstacles);
+  finalise(&params, &cells, &tmp_cells, &obstacles);
+  lbm_steady_free(&steady);
+  free(u_x);
+  free(u_y);
+  free(pressure);
   
   return EXIT_SUCCESS;
 }
 
-int timestep(const t_param params, t_speed* cells, t_speed* tmp_cells, int* obstacles)
+/* the timestep loop of the layout: by rows, by dataflow, or by stealing */
+void timestep_run(lbm_pool* pool, const int tid, void* arg)
+{
+  t_loop* loop = (t_loop*)arg;
+
+  if (!loop->ntiles) timestep_loop(pool, tid, arg);
+  else if (loop->steal) timestep_steal(pool, tid, arg);
+  else timestep_dataflow(pool, tid, arg);
+}
+
+/*
+** The timestep loop. Each thread works on its own block of rows, and
+** the barriers keep the phases apart: every row must be propagated
+** before any is collided, and collided before the next propagate. The
+** av. velocity of a row is summed as it is collided, by the same
+** thread, and thread 0 adds the rows up and hands them to the output
+** thread while the others go on with the next timestep. Checkpoints,
+** and the test for a steady state, need the grid as it is after the
+** timestep, so on those the others wait for thread 0 to finish.
+*/
+void timestep_loop(lbm_pool* pool, const int tid, void* arg)
+{
+  t_loop* loop = (t_loop*)arg;
+  const t_param params = loop->params;
+  int ii;                       /* timestep */
+  int first,last;               /* the rows of this thread */
+  int hold;                     /* TRUE if the others wait for thread 0 */
+  double t;                     /* time the last phase ended, for the timeline */
+
+  lbm_pool_rows(params.ny, tid, pool->nthreads, &first, &last);
+  t = timeline_now(loop);
+  for (ii=loop->start;ii<params.maxIters;ii++) {
+    accelerate_flow_and_propagate(params,loop->cells,loop->tmp_cells,loop->obstacles,first,last);
+    t = timeline_mark(loop, tid, ii, PHASE_PROPAGATE, -1, t);
+    if (tid == 0) {
+      timestep_begin(loop, ii);
+      t = timeline_mark(loop, tid, ii, PHASE_OUTPUT, -1, t);
+    }
+    lbm_pool_barrier(pool, tid);
+    t = timeline_mark(loop, tid, ii, PHASE_WAIT, -1, t);
+
+    collide_rows(loop, ii, first, last);
+    t = timeline_mark(loop, tid, ii, PHASE_COLLIDE, -1, t);
+    lbm_pool_barrier(pool, tid);
+    t = timeline_mark(loop, tid, ii, PHASE_WAIT, -1, t);
+
+    hold = timestep_hold(loop, ii);
+    if (tid == 0) {
+      timestep_end(loop, ii);
+      t = timeline_mark(loop, tid, ii, PHASE_OUTPUT, -1, t);
+    }
+    if (hold) {
+      lbm_pool_barrier(pool, tid);
+      t = timeline_mark(loop, tid, ii, PHASE_WAIT, -1, t);
+      if (loop->stop) break;
+    }
+  }
+}
+
+/*
+** The timestep loop as a graph of tiles of rows, with no barriers. The
+** collision of a tile needs only the propagation of the tiles either
+** side (which push into its edge rows) as well as its own, and the
+** propagation of a tile, in the next timestep, only the collision of
+** those three (it reads its own rows, and writes into the edge rows of
+** the others, which they must have finished with). A flag per tile
+** counts the timesteps it has been propagated, and another collided,
+** and a thread takes each of its tiles on as soon as the flags of the
+** neighbours say it can; a slow thread holds back its neighbours, and
+** them theirs, rather than all the threads at every step.
+**
+** The tiles at the ends of a thread's block are the ones its
+** neighbours wait for, so it propagates those first and collides them
+** last. The sums of the rows are kept for two timesteps, so thread 0
+** can add up those of a timestep one behind, once every tile has been
+** collided, and the others never wait for it; except on checkpoints and
+** tests for a steady state, which need the grid as it is after the
+** timestep.
+*/
+void timestep_dataflow(lbm_pool* pool, const int tid, void* arg)
+{
+  t_loop* loop = (t_loop*)arg;
+  const t_param params = loop->params;
+  const int ntiles = loop->ntiles;
+  int ii;                       /* timestep */
+  int kk;                       /* generic counter */
+  int first,last;               /* the tiles of this thread */
+  int tile;                     /* a tile */
+  int row_first,row_last;       /* its rows */
+  int pending = -1;             /* timestep thread 0 has still to end, or -1 */
+  double t;                     /* time the last phase ended, for the timeline */
+
+  lbm_pool_rows(ntiles, tid, pool->nthreads, &first, &last);
+  t = timeline_now(loop);
+  for (ii=loop->start;ii<params.maxIters;ii++) {
+    for (kk = first; kk < last; kk++) {
+      tile = tile_order(kk, first, last, TRUE);
+      lbm_pool_wait(&loop->collided[(tile + ntiles - 1) % ntiles], ii);
+      lbm_pool_wait(&loop->collided[tile], ii);
+      lbm_pool_wait(&loop->collided[(tile + 1) % ntiles], ii);
+      t = timeline_mark(loop, tid, ii, PHASE_WAIT, tile, t);
+      lbm_pool_rows(params.ny, tile, ntiles, &row_first, &row_last);
+      accelerate_flow_and_propagate(params,loop->cells,loop->tmp_cells,loop->obstacles,
+                                    row_first,row_last);
+      lbm_pool_post(&loop->propagated[tile], ii + 1);
+      t = timeline_mark(loop, tid, ii, PHASE_PROPAGATE, tile, t);
+    }
+    if (tid == 0) {
+      timestep_begin(loop, ii);
+      lbm_pool_post(&loop->begun, ii + 1);
+      t = timeline_mark(loop, tid, ii, PHASE_OUTPUT, -1, t);
+    }
+
+    /* where the fields go, and the sums of two timesteps ago added up */
+    if (timestep_fields(loop, ii)) lbm_pool_wait(&loop->begun, ii + 1);
+    lbm_pool_wait(&loop->ended, ii - 1);
+    for (kk = first; kk < last; kk++) {
+      tile = tile_order(kk, first, last, FALSE);
+      lbm_pool_wait(&loop->propagated[(tile + ntiles - 1) % ntiles], ii + 1);
+      lbm_pool_wait(&loop->propagated[(tile + 1) % ntiles], ii + 1);
+      t = timeline_mark(loop, tid, ii, PHASE_WAIT, tile, t);
+      lbm_pool_rows(params.ny, tile, ntiles, &row_first, &row_last);
+      collide_rows(loop, ii, row_first, row_last);
+      lbm_pool_post(&loop->collided[tile], ii + 1);
+      t = timeline_mark(loop, tid, ii, PHASE_COLLIDE, tile, t);
+    }
+
+    if (tid == 0) {
+      if (pending >= 0) t = dataflow_end(loop, pending, t);
+      pending = ii;
+      if (timestep_hold(loop, ii)) {
+        t = dataflow_end(loop, ii, t);
+        pending = -1;
+      }
+    }
+    if (timestep_hold(loop, ii)) {
+      lbm_pool_wait(&loop->ended, ii + 1);
+      t = timeline_mark(loop, tid, ii, PHASE_WAIT, -1, t);
+      if (loop->stop) break;
+    }
+  }
+  if (tid == 0 && pending >= 0) dataflow_end(loop, pending, t);
+}
+
+/*
+** The timestep loop with the rows dealt out as tiles by work stealing,
+** for grids where some rows cost more than others: a row across a
+** solid bar is mostly rebounds, which are cheap, and an open row all
+** collisions. Each thread's deque is filled every timestep with the
+** same block of tiles, so they stay in its cache, and it takes them
+** in order; once it has run out it steals, from the top of the deques
+** of the threads nearest to it, tiles the owners have not got to yet.
+** The phases are kept apart by barriers, as in the barrier loop, and
+** a deque is refilled for the next timestep while the other phase is
+** running, when no thread takes from it.
+*/
+void timestep_steal(lbm_pool* pool, const int tid, void* arg)
+{
+  t_loop* loop = (t_loop*)arg;
+  const t_param params = loop->params;
+  int ii;                       /* timestep */
+  int first,last;               /* the tiles of this thread */
+  double t;                     /* time the last phase ended, for the timeline */
+
+  lbm_pool_rows(loop->ntiles, tid, pool->nthreads, &first, &last);
+  lbm_pool_deque_fill(&loop->deques[0][tid], first, last);
+  lbm_pool_deque_fill(&loop->deques[1][tid], first, last);
+  t = timeline_now(loop);
+  for (ii=loop->start;ii<params.maxIters;ii++) {
+    t = steal_tiles(loop, pool, tid, ii, PHASE_PROPAGATE, t);
+    if (tid == 0) {
+      timestep_begin(loop, ii);
+      t = timeline_mark(loop, tid, ii, PHASE_OUTPUT, -1, t);
+    }
+    lbm_pool_barrier(pool, tid);
+    t = timeline_mark(loop, tid, ii, PHASE_WAIT, -1, t);
+    lbm_pool_deque_fill(&loop->deques[0][tid], first, last);
+
+    t = steal_tiles(loop, pool, tid, ii, PHASE_COLLIDE, t);
+    lbm_pool_barrier(pool, tid);
+    t = timeline_mark(loop, tid, ii, PHASE_WAIT, -1, t);
+    lbm_pool_deque_fill(&loop->deques[1][tid], first, last);
+
+    if (tid == 0) {
+      timestep_end(loop, ii);
+      t = timeline_mark(loop, tid, ii, PHASE_OUTPUT, -1, t);
+    }
+    if (timestep_hold(loop, ii)) {
+      lbm_pool_barrier(pool, tid);
+      t = timeline_mark(loop, tid, ii, PHASE_WAIT, -1, t);
+      if (loop->stop) break;
+    }
+  }
+}
+
+/* run the tiles of a phase, this thread's own and then any it can
+** steal, until every deque of the phase is empty */
+double steal_tiles(t_loop* loop, lbm_pool* pool, const int tid, const int iteration,
+                   const int phase, double t)
+{
+  const t_param params = loop->params;
+  lbm_pool_deque* deques = loop->deques[phase == PHASE_COLLIDE];
+  int tile;                     /* a tile */
+  int row_first,row_last;       /* its rows */
+  int kk;                       /* generic counter */
+  int victim;                   /* thread stolen from */
+
+  for (;;) {
+    tile = lbm_pool_deque_take(&deques[tid]);
+    /* the nearest threads first, either side, whose tiles are the nearest rows */
+    for (kk = 1; tile == LBM_POOL_EMPTY && kk < pool->nthreads; kk++) {
+      victim = (kk % 2) ? tid + (kk + 1) / 2 : tid - kk / 2;
+      victim = (victim + pool->nthreads) % pool->nthreads;
+      while ((tile = lbm_pool_deque_steal(&deques[victim])) == LBM_POOL_ABORT) lbm_pool_pause();
+      if (tile != LBM_POOL_EMPTY) timeline_stolen(loop, tid, iteration);
+    }
+    if (tile == LBM_POOL_EMPTY) return t;
+
+    lbm_pool_rows(params.ny, tile, loop->ntiles, &row_first, &row_last);
+    if (phase == PHASE_PROPAGATE)
+      accelerate_flow_and_propagate(params,loop->cells,loop->tmp_cells,loop->obstacles,
+                                    row_first,row_last);
+    else
+      collide_rows(loop, iteration, row_first, row_last);
+    t = timeline_mark(loop, tid, iteration, phase, tile, t);
+  }
+}
+
+/* thread 0 ends a timestep of the dataflow loop once every tile has
+** been collided; returns the time it finished */
+double dataflow_end(t_loop* loop, const int iteration, double t)
+{
+  int kk;                       /* generic counter */
+
+  for (kk = 0; kk < loop->ntiles; kk++) lbm_pool_wait(&loop->collided[kk], iteration + 1);
+  t = timeline_mark(loop, 0, iteration, PHASE_WAIT, -1, t);
+  timestep_end(loop, iteration);
+  lbm_pool_post(&loop->ended, iteration + 1);
+  return timeline_mark(loop, 0, iteration, PHASE_OUTPUT, -1, t);
+}
+
+/* the kk'th tile of first to last-1 in the order a thread works on
+** them: the two at the ends first if ends_first, and otherwise last */
+int tile_order(const int kk, const int first, const int last, const int ends_first)
+{
+  const int nn = last - first;
+  const int ii = kk - first;
+
+  if (nn <= 2) return kk;
+  if (ends_first) return (ii == 0) ? first : (ii == 1) ? last - 1 : first + ii - 1;
+  return (ii < nn - 2) ? first + 1 + ii : (ii == nn - 2) ? first : last - 1;
+}
+
+/* collide rows first to last-1, and sum their av. velocity, filling
+** the fields if they are due; the sums are of each row, so the same
+** whatever the chunks */
+void collide_rows(t_loop* loop, const int iteration, const int first, const int last)
+{
+  const t_param params = loop->params;
+  const int pp = iteration & 1;  /* which of the two timesteps kept */
+  const int fields = timestep_fields(loop, iteration);
+  int row,end;                  /* rows of a chunk */
+
+  /* in chunks of fuse_rows, summed while they are still in cache */
+  for (row = first; row < last; row = end) {
+    end = (loop->fuse_rows && row + loop->fuse_rows < last) ? row + loop->fuse_rows : last;
+    if (loop->collide != NULL) loop->collide(loop->cells,loop->tmp_cells,loop->obstacles,row,end);
+    else rebound_or_collision(params,loop->cells,loop->tmp_cells,loop->obstacles,row,end);
+    if (fields)
+      av_velocity_fields_rows(params,loop->cells,loop->obstacles,loop->u_x[pp],loop->u_y[pp],
+                              loop->pressure[pp],loop->rows[pp],row,end);
+    else
+      av_velocity_rows(params,loop->cells,loop->obstacles,loop->rows[pp],row,end);
+  }
+}
+
+/* TRUE if the velocity and pressure of every cell are wanted after the timestep */
+int timestep_fields(const t_loop* loop, const int iteration)
+{
+  return (loop->snapshot_every && (iteration + 1) % loop->snapshot_every == 0) ||
+         lbm_steady_sample_due(loop->steady, iteration + 1);
+}
+
+/* TRUE if thread 0 needs the grid as it is after the timestep */
+int timestep_hold(const t_loop* loop, const int iteration)
+{
+#ifdef DEBUG
+  return TRUE;
+#endif
+  return loop->steady->history != NULL ||
+         (loop->checkpoint_every && (iteration + 1) % loop->checkpoint_every == 0);
+}
+
+void timestep_begin(t_loop* loop, const int iteration)
+{
+  const int pp = iteration & 1;  /* which of the two timesteps kept */
+  t_job* job;                   /* a snapshot for the output thread */
+
+  loop->job[pp] = NULL;
+  if (loop->snapshot_every && (iteration + 1) % loop->snapshot_every == 0) {
+    /* the snapshot is filled by the av. velocity pass */
+    job = output_acquire(loop->writer, JOB_SNAPSHOT);
+    loop->job[pp] = job;
+    loop->u_x[pp] = job->u_x;
+    loop->u_y[pp] = job->u_y;
+    loop->pressure[pp] = job->pressure;
+  }
+  else if (lbm_steady_sample_due(loop->steady, iteration + 1)) {
+    loop->u_x[pp] = loop->sample_u_x;
+    loop->u_y[pp] = loop->sample_u_y;
+    loop->pressure[pp] = loop->sample_pressure;
+  }
+}
+
+void timestep_end(t_loop* loop, const int iteration)
+{
+  const t_param params = loop->params;
+  const int pp = iteration & 1;  /* which of the two timesteps kept */
+  t_job* job = loop->job[pp];   /* the snapshot of the timestep, or NULL */
+  float av_vel;                 /* the av. velocity of the timestep */
+
+  if (loop->writer == NULL) return;  /* a layout being timed */
+  av_vel = lbm_sum_rows(loop->rows[pp], params.ny) / (float)loop->fluid_cells;
+  if (lbm_steady_sample_due(loop->steady, iteration + 1))
+    lbm_steady_sample(loop->steady, loop->u_x[pp], loop->u_y[pp]);
+  if (job != NULL) {
+    mirror_fields(params, job->u_x, job->u_y, job->pressure);
+    job->iteration = iteration + 1;
+    output_submit(loop->writer, job);
+    loop->job[pp] = NULL;
+  }
+  output_av_vel(loop->writer, iteration, av_vel);
+  if (loop->checkpoint_every && (iteration + 1) % loop->checkpoint_every == 0)
+    output_checkpoint(loop->writer, loop->cells, loop->steady, iteration + 1);
+  if (loop->steady->history != NULL) {
+    lbm_steady_add(loop->steady, av_vel);
+    if (lbm_steady_converged(loop->steady)) {
+      loop->iterations = iteration + 1;
+      loop->stop = TRUE;
+    }
+  }
+#ifdef DEBUG
+  printf("==timestep: %d==\n",iteration);
+  printf("av velocity: %.12E\n", av_vel);
+  printf("tot density: %.12E\n",total_density(params,loop->cells));
+#endif
+}
+
+/*
+** The timestep loop of a run by rows, not mirrored, with no more to
+** write than the av. velocities and the final state: the d2q9_bgk
+** solver steps the grid, from the fluid at rest, on threads threads,
+** and the av. velocity of each timestep goes to the output thread and
+** the test for a steady state, as timestep_end() sends it. The grid it
+** ends with is copied into cells, for the final state.
+*/
+int solver_loop(const t_param params, t_speed* cells, int* obstacles, const int threads,
+                t_writer* writer, lbm_steady* steady)
+{
+  d2q9_params solver_params;    /* the parameters, as the solver takes them */
+  d2q9_solver* solver;
+  const char* why;              /* why it could not be made */
+  const float* av_vels;         /* the av. velocity of each timestep */
+  int ii;                       /* timestep */
+
+  solver_params.nx = params.nx;
+  solver_params.ny = params.ny;
+  solver_params.maxIters = params.maxIters;
+  solver_params.reynolds_dim = params.reynolds_dim;
+  solver_params.density = params.density;
+  solver_params.accel = params.accel;
+  solver_params.omega = params.omega;
+  solver = d2q9_solver_new(&solver_params, obstacles, threads, &why);
+  if (solver == NULL) die(why,__LINE__,__FILE__);
+  av_vels = d2q9_solver_av_vels(solver);
+
+  for (ii=0;ii<params.maxIters;ii++) {
+    d2q9_solver_step(solver, 1);
+    if (lbm_steady_sample_due(steady, ii + 1))
+      lbm_steady_sample(steady, d2q9_solver_u_x(solver), d2q9_solver_u_y(solver));
+    output_av_vel(writer, ii, av_vels[ii]);
+    if (steady->history != NULL) {
+      lbm_steady_add(steady, av_vels[ii]);
+      if (lbm_steady_converged(steady)) {
+        ii++;
+        break;
+      }
+    }
+  }
+  memcpy(cells, d2q9_solver_cells(solver), sizeof(t_speed)*(params.ny*params.nx));
+  d2q9_solver_free(solver);
+
+  return ii;
+}
+
+/*
+** The kernel of --jit. The source is a few lines defining params as a
+** static const, and the types and macros rebound_or_collision() uses,
+** around d2q9-bgk-collide.h, its body; with the width of the grid a
+** constant the compiler can unroll and vectorise the rows to it, and
+** omega and the populations at rest are folded in. It is compiled, by
+** the compiler and with the flags this was, into dir, named by a hash
+** of the source, the headers it includes, the compiler and the flags,
+** so a later run of the same parameters loads it without compiling,
+** and a change to any of them never loads a stale one. It is compiled
+** under a name of its own and renamed, so runs at the same time can
+** share the directory. The compiler is run directly, not by a shell,
+** with the blank separated words of JIT_CC and JIT_CFLAGS.
+*/
+t_collide jit_compile(const t_param params, const char* dir, const char** why)
+{
+  char source[2048];            /* the source of the kernel */
+  char path[1024];              /* where it is written */
+  char object[1024];            /* the shared object */
+  char partial[1100];           /* the shared object, while it is compiled */
+  char words[1024];             /* the compiler and its flags, */
+  char includes[2][1024];       /* the directories of the headers, */
+  char* args[64];               /* and the arguments they make */
+  unsigned long long hash = 14695981039346656037ULL;  /* FNV-1a, of: */
+  const char* parts[3] = { source, JIT_CC, JIT_CFLAGS };
+  const char* headers[2] = { JIT_DIR "/d2q9-bgk-collide.h", JIT_DIR "/../../LBM_common/lbm_half.h" };
+  void* handle;                 /* the shared object, loaded */
+  t_collide collide;
+  FILE* fp;
+  pid_t pid;                    /* the compiler */
+  int status;                   /* of the compiler */
+  int fd;                       /* /dev/null, for its messages */
+  int ch;                       /* a character of a header */
+  int ii,kk;                    /* generic counters */
+
+  snprintf(source, sizeof(source),
+           "/* rebound_or_collision() of d2q9-bgk.c, for a grid %d wide and omega %g */\n"
+           "#include<stdlib.h>\n"
+           "#include\"lbm_half.h\"\n"
+           "#define NSPEEDS 9\n"
+           "#define LOAD(cell,kk)         LBM_LOAD((cell).speeds[kk], params.rest[kk])\n"
+           "#define STORE(cell,kk,value)  ((cell).speeds[kk] = LBM_STORE((value), params.rest[kk]))\n"
+           "typedef struct { lbm_store speeds[NSPEEDS]; } t_speed;\n"
+           "static const struct { int nx; float omega; float rest[NSPEEDS]; } params =\n"
+           "  { %d, %af, { %af, %af, %af, %af, %af, %af, %af, %af, %af } };\n"
+           "int collide(t_speed* cells, t_speed* tmp_cells, int* obstacles,\n"
+           "            const int first, const int last)\n"
+           "{\n"
+           "#include\"d2q9-bgk-collide.h\"\n"
+           "}\n",
+           params.nx, params.omega, params.nx, params.omega,
+           params.rest[0], params.rest[1], params.rest[2], params.rest[3], params.rest[4],
+           params.rest[5], params.rest[6], params.rest[7], params.rest[8]);
+  for (ii = 0; ii < 3; ii++) {
+    for (kk = 0; parts[ii][kk]; kk++) {
+      hash ^= (unsigned char)parts[ii][kk];
+      hash *= 1099511628211ULL;
+    }
+  }
+  for (ii = 0; ii < 2; ii++) {
+    fp = fopen(headers[ii], "r");
+    if (fp == NULL) {
+      *why = "cannot read the headers of the kernel";
+      return NULL;
+    }
+    while ((ch = getc(fp)) != EOF) {
+      hash ^= (unsigned char)ch;
+      hash *= 1099511628211ULL;
+    }
+    fclose(fp);
+  }
+  snprintf(path, sizeof(path), JITSOURCE, dir, hash);
+  snprintf(object, sizeof(object), JITOBJECT, dir, hash);
+
+  if (access(object, R_OK) != 0) {
+    if (mkdir(dir, 0777) != 0 && errno != EEXIST) {
+      *why = "cannot make the directory of the kernels";
+      return NULL;
+    }
+    fp = fopen(path, "w");
+    if (fp == NULL || fputs(source, fp) == EOF || fclose(fp) != 0) {
+      *why = "cannot write the source of the kernel";
+      return NULL;
+    }
+    snprintf(partial, sizeof(partial), "%s.%d", object, (int)getpid());
+    snprintf(words, sizeof(words), "%s %s", JIT_CC, JIT_CFLAGS);
+    snprintf(includes[0], sizeof(includes[0]), "-I%s", JIT_DIR);
+    snprintf(includes[1], sizeof(includes[1]), "-I%s/../../LBM_common", JIT_DIR);
+    ii = 0;
+    for (args[ii] = strtok(words, " \t"); args[ii] != NULL && ii < 56; args[ii] = strtok(NULL, " \t"))
+      ii++;
+    args[ii++] = "-fPIC";
+    args[ii++] = "-shared";
+    args[ii++] = includes[0];
+    args[ii++] = includes[1];
+    args[ii++] = path;
+    args[ii++] = "-o";
+    args[ii++] = partial;
+    args[ii] = NULL;
+    fflush(stdout);
+    pid = fork();
+    if (pid == 0) {
+      if ((fd = open("/dev/null", O_WRONLY)) >= 0) dup2(fd, 2);
+      execvp(args[0], args);
+      _exit(127);
+    }
+    if (pid < 0 || waitpid(pid, &status, 0) != pid || !WIFEXITED(status) ||
+        WEXITSTATUS(status) != 0) {
+      unlink(partial);
+      *why = "no compiler, or the kernel did not compile";
+      return NULL;
+    }
+    if (rename(partial, object) != 0) {
+      unlink(partial);
+      *why = "cannot move the kernel into place";
+      return NULL;
+    }
+  }
+
+  handle = dlopen(object, RTLD_NOW | RTLD_LOCAL);
+  if (handle == NULL) {
+    *why = "cannot load the kernel";
+    return NULL;
+  }
+  *(void**)&collide = dlsym(handle, "collide");
+  if (collide == NULL) *why = "the kernel has no collide()";
+  return collide;
+}
+
+/*
+** The kernel of --jit is used only if it collides a grid to the same
+** bits as rebound_or_collision() does; it would differ only if the two
+** were built differently, which the hash should rule out. The grid is
+** a scratch one around the obstacles, not the grid at rest, which
+** collides to itself: each population is off its rest value by a few
+** percent, differently in each cell and direction, so that the cells
+** have velocities. Otherwise, and if it cannot be compiled, the generic
+** kernel is.
+*/
+t_collide jit_kernel(const t_param params, int* obstacles, const char* dir)
+{
+  const size_t size = sizeof(t_speed)*(params.ny*params.nx);
+  t_collide collide;            /* the kernel compiled */
+  const char* why = NULL;       /* why it cannot be */
+  t_speed* generic;             /* a copy of the grid collided by each */
+  t_speed* jit;
+  t_speed* tmp_cells;           /* the grid collided from */
+  double generic_time,jit_time; /* seconds per collision of the grid */
+  int ii,kk;                    /* generic counters */
+
+  collide = jit_compile(params, dir, &why);
+  if (collide == NULL) {
+    printf("JIT kernel:\t\t\tnone, %s; the generic kernel is used\n", why);
+    return NULL;
+  }
+  generic = (t_speed*)malloc(size);
+  jit = (t_speed*)malloc(size);
+  tmp_cells = (t_speed*)malloc(size);
+  if (generic == NULL || jit == NULL || tmp_cells == NULL)
+    die("cannot allocate memory for the JIT kernel",__LINE__,__FILE__);
+  for(ii=0;ii<params.ny*params.nx;ii++) {
+    for(kk=0;kk<NSPEEDS;kk++) {
+      STORE(tmp_cells[ii],kk, params.rest[kk] * (1.0f + 0.05f * sinf(0.37f * ii + 1.3f * kk)));
+    }
+  }
+  memcpy(generic, tmp_cells, size);
+  memcpy(jit, tmp_cells, size);
+  rebound_or_collision(params, generic, tmp_cells, obstacles, 0, params.ny);
+  collide(jit, tmp_cells, obstacles, 0, params.ny);
+  if (memcmp(generic, jit, size) != 0) {
+    printf("JIT kernel:\t\t\tnone, it differs from the generic kernel, which is used\n");
+    collide = NULL;
+  }
+  else {
+    generic_time = time_collide(params, NULL, generic, tmp_cells, obstacles);
+    jit_time = time_collide(params, collide, jit, tmp_cells, obstacles);
+    printf("JIT kernel:\t\t\tcollision %.2f times the speed of the generic kernel"
+           " (%.4f against %.4f ms)\n", generic_time / jit_time, jit_time * 1000.0,
+           generic_time * 1000.0);
+  }
+  free(generic);
+  free(jit);
+  free(tmp_cells);
+
+  return collide;
+}
+
+double time_collide(const t_param params, t_collide collide, t_speed* cells,
+                    t_speed* tmp_cells, int* obstacles)
+{
+  int calls = 0;                /* collisions of the grid timed */
+  double tic,time;
+
+  tic = omp_get_wtime();
+  do {
+    if (collide != NULL) collide(cells, tmp_cells, obstacles, 0, params.ny);
+    else rebound_or_collision(params, cells, tmp_cells, obstacles, 0, params.ny);
+    calls++;
+    time = omp_get_wtime() - tic;
+  } while (time < CALIBRATE_TIME);
+
+  return time / calls;
+}
+
+/*
+** The layout of the timestep loop. Unless calibrate or tune, it is the
+** threads asked for; with no layout asked for at all, the one the
+** tuning database holds for the grid; and otherwise as many threads as
+** OpenMP would use up to a thread per LAYOUT_CELLS cells and
+** LAYOUT_ROWS rows, by rows unless tiles were asked for. With calibrate
+** it is taken from the tuning database,
+** from the last trials there for this CPU model, storage, grid size,
+** number of threads OpenMP would use and layout asked for, and
+** otherwise timed: a few timesteps of each of
+** the candidate layouts, on a copy of the grid, from 1 thread up. More
+** threads, tiles rather than rows, or rows summed in chunks rather than
+** all at once, are kept only if they are CALIBRATE_GAIN faster than the
+** best so far. The trials of a tuning are written to the database.
+**
+** Without --tune the candidates are rows and tiles of about a quarter
+** of each thread's rows, which is enough to choose how many threads
+** to use; --tune times them all again, with tiles of a half, a quarter
+** and an eighth, by dataflow and by stealing, and then chunks of rows
+** to sum in the fastest of those.
+*/
+const char* choose_layout(t_loop* loop, t_layout* layout, const int max_threads,
+                          const char* path, const int calibrate, const int tune,
+                          t_trial* trials, int* ntrials)
+{
+  const t_param params = loop->params;
+  const int most = (max_threads < params.ny) ? max_threads : params.ny;  /* threads worth a row */
+  const t_layout asked = *layout;  /* what was asked for, the key as well as the CPU */
+  char cpu[256];                /* the model of the CPU */
+  char line_cpu[256];           /* a line of the database: */
+  char storage[32];
+  int nx,ny,max;                /* what it is for, */
+  t_layout key;
+  long stamp,latest = -1;       /* when it was tuned */
+  t_trial trial;                /* and a layout timed */
+  int best = -1;                /* the fastest trial */
+  int threads;                  /* threads of a trial */
+  int kind;                     /* rows, tiles by dataflow, or tiles by stealing */
+  int per;                      /* tiles per thread */
+  t_speed* cells;               /* the copy of the grid timed on */
+  t_speed* tmp_cells;
+  FILE* fp;
+  int ii;                       /* generic counter */
+
+  *ntrials = 0;
+  if (!calibrate && !tune && layout->threads) {
+    if (layout->tile_rows < 0) layout->tile_rows = 0;
+    return "as asked";
+  }
+  if (!tune && most <= 1) {
+    if (layout->tile_rows < 0) layout->tile_rows = 0;
+    layout->threads = 1;
+    return "only one thread";
+  }
+
+  /* a run with no layout asked for takes a tuning of one too */
+  cpu_model(cpu, sizeof(cpu));
+  fp = (tune || (!calibrate && asked.tile_rows >= 0)) ? NULL : fopen(path, "r");
+  if (fp != NULL) {
+    while (fscanf(fp, "%255s %31s %d %d %d %d %d %d %ld %d %d %d %d %lf %d\n", line_cpu, storage,
+                  &nx, &ny, &max, &key.threads, &key.tile_rows, &key.steal, &stamp,
+                  &trial.layout.threads, &trial.layout.tile_rows, &trial.layout.steal,
+                  &trial.layout.fuse_rows, &trial.time, &trial.chosen) == 15) {
+      if (strcmp(line_cpu, cpu) || strcmp(storage, LBM_STORAGE_NAME) || nx != params.nx ||
+          ny != params.ny || max != max_threads || key.threads != asked.threads ||
+          key.tile_rows != asked.tile_rows || key.steal != asked.steal || stamp < latest ||
+          trial.layout.threads < 1 || trial.layout.threads > max ||
+          trial.layout.tile_rows < 0 || trial.layout.fuse_rows < 0)
+        continue;
+      /* the trials of the latest tuning */
+      if (stamp > latest) {
+        latest = stamp;
+        *ntrials = 0;
+        best = -1;
+      }
+      if (*ntrials < TUNE_TRIALS) {
+        if (trial.chosen) best = *ntrials;
+        trials[(*ntrials)++] = trial;
+      }
+    }
+    fclose(fp);
+  }
+  if (best >= 0) {
+    *layout = trials[best].layout;
+    return path;
+  }
+  if (!calibrate && !tune) {
+    if (layout->tile_rows < 0) layout->tile_rows = 0;
+    /* as many threads as have LAYOUT_CELLS cells and LAYOUT_ROWS rows each */
+    threads = params.ny * params.nx / LAYOUT_CELLS;
+    if (threads > params.ny / LAYOUT_ROWS) threads = params.ny / LAYOUT_ROWS;
+    if (threads > max_threads) threads = max_threads;
+    layout->threads = (threads > 1) ? threads : 1;
+    return "by the size of the grid";
+  }
+
+  *ntrials = 0;
+  cells = (t_speed*)malloc(sizeof(t_speed)*(params.ny*params.nx));
+  tmp_cells = (t_speed*)malloc(sizeof(t_speed)*(params.ny*params.nx));
+  if (cells == NULL || tmp_cells == NULL)
+    die("cannot allocate memory for the calibration",__LINE__,__FILE__);
+  memcpy(cells, loop->cells, sizeof(t_speed)*(params.ny*params.nx));
+  memcpy(tmp_cells, loop->cells, sizeof(t_speed)*(params.ny*params.nx));
+  trial.layout.fuse_rows = 0;
+  trial.chosen = FALSE;
+  for (threads = asked.threads ? asked.threads : 1; ;
+       threads = (threads * 2 < most) ? threads * 2 : most) {
+    trial.layout.threads = threads;
+    for (kind = 0; kind < 3; kind++) {
+      /* the kind asked for; otherwise rows, and tiles if more than one thread */
+      if (asked.tile_rows >= 0 && kind != (!asked.tile_rows ? 0 : asked.steal ? 2 : 1)) continue;
+      if (asked.tile_rows < 0 && kind && (threads == 1 || (kind == 2 && !tune))) continue;
+      trial.layout.steal = (kind == 2);
+      for (per = tune ? 2 : CALIBRATE_TILES; per <= (tune ? 8 : CALIBRATE_TILES); per *= 2) {
+        if (asked.tile_rows >= 0) trial.layout.tile_rows = asked.tile_rows;
+        else if (!kind) trial.layout.tile_rows = 0;
+        else {
+          trial.layout.tile_rows = params.ny / (threads * per);
+          if (trial.layout.tile_rows < 1) trial.layout.tile_rows = 1;
+        }
+        /* rows, or the tiles asked for, once, and tiles once for each size */
+        if (*ntrials && trials[*ntrials - 1].layout.threads == threads &&
+            trials[*ntrials - 1].layout.tile_rows == trial.layout.tile_rows &&
+            trials[*ntrials - 1].layout.steal == trial.layout.steal)
+          continue;
+        best = time_trial(loop, &trial, cells, tmp_cells, trials, ntrials, best);
+      }
+    }
+    if (asked.threads || threads == most) break;
+  }
+  /* the rows of the fastest summed in chunks, a row, then a few rows, at a time */
+  for (ii = 1; tune && ii <= CALIBRATE_FUSE; ii *= CALIBRATE_FUSE) {
+    trial.layout = trials[best].layout;
+    trial.layout.fuse_rows = ii;
+    best = time_trial(loop, &trial, cells, tmp_cells, trials, ntrials, best);
+  }
+  free(cells);
+  free(tmp_cells);
+  trials[best].chosen = TRUE;
+
+  if (tune) write_tuning(path, cpu, params, max_threads, &asked, trials, *ntrials);
+  *layout = trials[best].layout;
+  return tune ? "tuned" : "calibrated";
+}
+
+/* replace the lines of the tuning database for the same CPU, storage,
+** grid, threads and layout asked for with the trials of a tuning */
+void write_tuning(const char* path, const char* cpu, const t_param params, const int max_threads,
+                  const t_layout* asked, const t_trial* trials, const int ntrials)
+{
+  char tmppath[4096];           /* the database rewritten */
+  char line[1024];              /* a line of the database: */
+  char line_cpu[256];
+  char storage[32];
+  int nx,ny,max;                /* what it is for */
+  t_layout key;
+  const long stamp = (long)time(NULL);  /* when it was tuned */
+  FILE* in;
+  FILE* out;
+  int ii;                       /* generic counter */
+
+  if (snprintf(tmppath, sizeof(tmppath), "%s.tmp", path) >= (int)sizeof(tmppath) ||
+      (out = fopen(tmppath, "w")) == NULL) {
+    fprintf(stderr, "could not add the tuning to %s\n", path);
+    return;
+  }
+  in = fopen(path, "r");
+  while (in != NULL && fgets(line, sizeof(line), in) != NULL) {
+    if (sscanf(line, "%255s %31s %d %d %d %d %d %d", line_cpu, storage, &nx, &ny, &max,
+               &key.threads, &key.tile_rows, &key.steal) == 8 &&
+        !strcmp(line_cpu, cpu) && !strcmp(storage, LBM_STORAGE_NAME) && nx == params.nx &&
+        ny == params.ny && max == max_threads && key.threads == asked->threads &&
+        key.tile_rows == asked->tile_rows && key.steal == asked->steal)
+      continue;
+    fputs(line, out);
+  }
+  if (in != NULL) fclose(in);
+  for (ii = 0; ii < ntrials; ii++)
+    fprintf(out, "%s %s %d %d %d %d %d %d %ld %d %d %d %d %.6e %d\n", cpu, LBM_STORAGE_NAME,
+            params.nx, params.ny, max_threads, asked->threads, asked->tile_rows, asked->steal,
+            stamp, trials[ii].layout.threads, trials[ii].layout.tile_rows,
+            trials[ii].layout.steal, trials[ii].layout.fuse_rows, trials[ii].time,
+            trials[ii].chosen);
+  if (fclose(out) != 0 || rename(tmppath, path) != 0) {
+    unlink(tmppath);
+    fprintf(stderr, "could not add the tuning to %s\n", path);
+  }
+}
+
+/* time a trial layout and add it to the trials, if there is room;
+** returns the fastest of them so far, best, unless this one beats it
+** by CALIBRATE_GAIN */
+int time_trial(const t_loop* loop, t_trial* trial, t_speed* cells, t_speed* tmp_cells,
+               t_trial* trials, int* ntrials, const int best)
+{
+  if (*ntrials == TUNE_TRIALS) return best;
+  trial->time = time_layout(loop, &trial->layout, cells, tmp_cells);
+  trials[(*ntrials)++] = *trial;
+  if (best < 0 || trial->time * CALIBRATE_GAIN < trials[best].time) return *ntrials - 1;
+  return best;
+}
+
+/* seconds per timestep of the loop laid out on a new pool, run on
+** cells and tmp_cells with no output, after a timestep to warm up */
+double time_layout(const t_loop* loop, const t_layout* layout, t_speed* cells,
+                   t_speed* tmp_cells)
+{
+  t_loop trial = *loop;         /* the loop, without its output */
+  lbm_steady steady;            /* none */
+  lbm_pool pool;                /* the threads timed */
+  int steps = 1;                /* timesteps of a run */
+  int warm = FALSE;             /* TRUE after the first run */
+  double tic,time;
+
+  memset(&steady, 0, sizeof(steady));
+  trial.cells = cells;
+  trial.tmp_cells = tmp_cells;
+  trial.writer = NULL;
+  trial.steady = &steady;
+  trial.start = 0;
+  trial.snapshot_every = 0;
+  trial.checkpoint_every = 0;
+  trial.stop = FALSE;
+  trial.timeline.steps = 0;
+  if (lbm_pool_start(&pool, layout->threads) != 0)
+    die("could not start the threads of the calibration",__LINE__,__FILE__);
+  loop_tiles(&trial, layout, pool.nthreads);
+  for (;;) {
+    trial.params.maxIters = trial.start + steps;
+    tic = omp_get_wtime();
+    lbm_pool_run(&pool, timestep_run, &trial);
+    time = omp_get_wtime() - tic;
+    /* the flags of the tiles are left at maxIters, the next start */
+    trial.start = trial.params.maxIters;
+    if (warm && time >= CALIBRATE_TIME) break;
+    if (warm) steps *= 2;
+    warm = TRUE;
+  }
+  lbm_pool_finish(&pool);
+  loop_tiles_free(&trial, pool.nthreads);
+
+  return time / steps;
+}
+
+/* the model name of the CPU, from /proc/cpuinfo, with the blanks made
+** underscores; or "unknown" */
+void cpu_model(char* model, const int len)
+{
+  char line[1024];              /* a line of /proc/cpuinfo */
+  char* value;                  /* after the colon */
+  FILE* fp;
+  int ii;                       /* generic counter */
+
+  snprintf(model, len, "unknown");
+  fp = fopen("/proc/cpuinfo", "r");
+  if (fp == NULL) return;
+  while (fgets(line, sizeof(line), fp) != NULL) {
+    if (strncmp(line, "model name", 10) || (value = strchr(line, ':')) == NULL) continue;
+    for (value++; *value == ' ' || *value == '\t'; value++);
+    value[strcspn(value, "\n")] = '\0';
+    if (*value) snprintf(model, len, "%s", value);
+    break;
+  }
+  fclose(fp);
+  for (ii = 0; model[ii]; ii++) {
+    if (model[ii] == ' ' || model[ii] == '\t') model[ii] = '_';
+  }
+}
+
+/* the layout of the loop, and the best of each kind of the trials for
+** each number of threads */
+void write_layout(const t_layout* layout, const int ntiles, const char* chosen,
+                  const t_trial* trials, const int ntrials)
+{
+  int threads;                  /* a number of threads */
+  double best[3];               /* the fastest of the trials of each kind */
+  int kind;                     /* rows, tiles by dataflow, or tiles by stealing */
+  int ii,jj;                    /* generic counters */
+
+  printf("Timestep loop:\t\t\t%d threads, ", layout->threads);
+  if (!ntiles) printf("by rows");
+  else printf("%d tiles of %d rows%s", ntiles, layout->tile_rows, layout->steal ? ", stolen" : "");
+  if (layout->fuse_rows) printf(", summed %d rows at a time", layout->fuse_rows);
+  printf(" (%s)\n", chosen);
+  if (!ntrials) return;
+
+  printf("Trials (ms per timestep):\tthreads      rows  dataflow     steal\n");
+  for (ii = 0; ii < ntrials; ii++) {
+    /* each number of threads once, in the order tried */
+    threads = trials[ii].layout.threads;
+    for (jj = 0; jj < ii && trials[jj].layout.threads != threads; jj++);
+    if (jj < ii) continue;
+    best[0] = best[1] = best[2] = 0.0;
+    for (jj = ii; jj < ntrials; jj++) {
+      if (trials[jj].layout.threads != threads) continue;
+      kind = !trials[jj].layout.tile_rows ? 0 : trials[jj].layout.steal ? 2 : 1;
+      if (best[kind] == 0.0 || trials[jj].time < best[kind]) best[kind] = trials[jj].time;
+    }
+    printf("\t\t\t\t%7d", threads);
+    for (kind = 0; kind < 3; kind++) {
+      if (best[kind] == 0.0) printf("         -");
+      else printf("%10.4f", best[kind] * 1000.0);
+    }
+    printf("\n");
+  }
+}
+
+void loop_tiles(t_loop* loop, const t_layout* layout, const int nthreads)
+{
+  const t_param params = loop->params;
+  int ii,jj;                    /* generic counters */
+
+  loop->ntiles = 0;
+  loop->steal = layout->steal;
+  loop->fuse_rows = layout->fuse_rows;
+  loop->propagated = loop->collided = NULL;
+  loop->deques[0] = loop->deques[1] = NULL;
+  if (layout->tile_rows) {
+    loop->ntiles = (params.ny >= layout->tile_rows) ? params.ny / layout->tile_rows : 1;
+    loop->propagated = (lbm_pool_flag*)aligned_alloc(LBM_POOL_LINE, sizeof(lbm_pool_flag) * loop->ntiles);
+    loop->collided = (lbm_pool_flag*)aligned_alloc(LBM_POOL_LINE, sizeof(lbm_pool_flag) * loop->ntiles);
+    if (loop->propagated == NULL || loop->collided == NULL)
+      die("cannot allocate memory for the tiles",__LINE__,__FILE__);
+    for (ii = 0; ii < loop->ntiles; ii++) {
+      lbm_pool_post(&loop->propagated[ii], loop->start);
+      lbm_pool_post(&loop->collided[ii], loop->start);
+    }
+  }
+  lbm_pool_post(&loop->begun, loop->start);
+  lbm_pool_post(&loop->ended, loop->start);
+  if (loop->steal) {
+    for (ii = 0; ii < 2; ii++) {
+      loop->deques[ii] = (lbm_pool_deque*)aligned_alloc(LBM_POOL_LINE, sizeof(lbm_pool_deque) * nthreads);
+      if (loop->deques[ii] == NULL) die("cannot allocate memory for the tiles",__LINE__,__FILE__);
+      for (jj = 0; jj < nthreads; jj++) {
+        if (lbm_pool_deque_init(&loop->deques[ii][jj], loop->ntiles) != 0)
+          die("cannot allocate memory for the tiles",__LINE__,__FILE__);
+      }
+    }
+  }
+}
+
+void loop_tiles_free(t_loop* loop, const int nthreads)
+{
+  int ii,jj;                    /* generic counters */
+
+  for (ii = 0; ii < 2 && loop->steal; ii++) {
+    for (jj = 0; jj < nthreads; jj++) lbm_pool_deque_free(&loop->deques[ii][jj]);
+    free(loop->deques[ii]);
+  }
+  free(loop->propagated);
+  free(loop->collided);
+}
+
+/* the time, if the timeline is being recorded */
+double timeline_now(const t_loop* loop)
+{
+  return loop->timeline.steps ? omp_get_wtime() : 0.0;
+}
+
+/* record a phase of a timestep, from start until now, in the timeline
+** if it is one of the first timesteps; returns the time */
+double timeline_mark(t_loop* loop, const int tid, const int iteration, const int phase,
+                     const int tile, const double start)
+{
+  t_timeline* timeline = &loop->timeline;
+  t_event* event;
+  double now;
+
+  if (iteration - loop->start >= timeline->steps) return 0.0;
+  now = omp_get_wtime();
+  if (timeline->count[tid] < timeline->capacity) {
+    event = &timeline->events[(size_t)tid * timeline->capacity + timeline->count[tid]++];
+    event->iteration = iteration;
+    event->phase = phase;
+    event->tile = tile;
+    event->start = start;
+    event->end = now;
+  }
+  return now;
+}
+
+/* count a tile stolen, if the timestep is in the timeline */
+void timeline_stolen(t_loop* loop, const int tid, const int iteration)
 {
-  accelerate_flow_and_propagate(params,cells,tmp_cells,obstacles);
-  rebound_or_collision(params,cells,tmp_cells,obstacles);
-  return EXIT_SUCCESS; 
+  if (iteration - loop->start < loop->timeline.steps) loop->timeline.stolen[tid]++;
 }
 
-int accelerate_flow_and_propagate(const t_param params, t_speed* cells, t_speed* tmp_cells, int* obstacles)
+/* write the timeline to TIMELINEFILE, and report the time spent waiting */
+void write_timeline(const t_loop* loop, const int nthreads)
 {
-  int ii,jj;            /* generic counters */
-  int x_e,x_w,y_n,y_s;  /* indices of neighbouring cells */
-  float w1,w2;  /* weighting factors */
-  
-  /* compute weighting factors */
-  w1 = params.density * params.accel / 9.0;
-  w2 = params.density * params.accel / 36.0;
+  static const char* names[] = { "propagate", "collide", "wait", "output" };
+  const t_timeline* timeline = &loop->timeline;
+  const t_event* event;
+  FILE*  fp;                    /* file pointer */
+  double busy = 0.0, waiting = 0.0;  /* time of the threads, and of it waiting */
+  double first, last;           /* the events of a thread */
+  double idle;                  /* time the thread waited */
+  int    ii,jj;                 /* generic counters */
 
-  /* loop over _all_ cells */
-#pragma omp parallel for shared(tmp_cells) private(jj, x_e, x_w, y_n, y_s) firstprivate(cells, w1, w2)
-  for(ii=0;ii<params.ny;ii++) {
-    /* if the cell is not occupied and
-    ** we don't send a density negative */
-    if( !obstacles[ii*params.nx] && 
-        (cells[ii*params.nx].speeds[3] - w1) > 0.0 &&
-        (cells[ii*params.nx].speeds[6] - w2) > 0.0 &&
-        (cells[ii*params.nx].speeds[7] - w2) > 0.0 ) {
-      /* increase 'east-side' densities */
-      cells[ii*params.nx].speeds[1] += w1;
-      cells[ii*params.nx].speeds[5] += w2;
-      cells[ii*params.nx].speeds[8] += w2;
-      /* decrease 'west-side' densities */
-      cells[ii*params.nx].speeds[3] -= w1;
-      cells[ii*params.nx].speeds[6] -= w2;
-      cells[ii*params.nx].speeds[7] -= w2;
-    }
-    for(jj=0;jj<params.nx;jj++) {
-      /* determine indices of axis-direction neighbours
-      ** respecting periodic boundary conditions (wrap around) */
-      y_n = (ii + 1) % params.ny;
-      x_e = (jj + 1) % params.nx;
-      y_s = (ii == 0) ? (ii + params.ny - 1) : (ii - 1);
-      x_w = (jj == 0) ? (jj + params.nx - 1) : (jj - 1);
-      /* propagate densities to neighbouring cells, following
-      ** appropriate directions of travel and writing into
-      ** scratch space grid */
-      tmp_cells[ii *params.nx + jj].speeds[0]  = cells[ii*params.nx + jj].speeds[0]; /* central cell, */
-                                                                                     /* no movement   */
-      tmp_cells[ii *params.nx + x_e].speeds[1] = cells[ii*params.nx + jj].speeds[1]; /* east */
-      tmp_cells[y_n*params.nx + jj].speeds[2]  = cells[ii*params.nx + jj].speeds[2]; /* north */
-      tmp_cells[ii *params.nx + x_w].speeds[3] = cells[ii*params.nx + jj].speeds[3]; /* west */
-      tmp_cells[y_s*params.nx + jj].speeds[4]  = cells[ii*params.nx + jj].speeds[4]; /* south */
-      tmp_cells[y_n*params.nx + x_e].speeds[5] = cells[ii*params.nx + jj].speeds[5]; /* north-east */
-      tmp_cells[y_n*params.nx + x_w].speeds[6] = cells[ii*params.nx + jj].speeds[6]; /* north-west */
-      tmp_cells[y_s*params.nx + x_w].speeds[7] = cells[ii*params.nx + jj].speeds[7]; /* south-west */      
-      tmp_cells[y_s*params.nx + x_e].speeds[8] = cells[ii*params.nx + jj].speeds[8]; /* south-east */      
+  fp = fopen(TIMELINEFILE, "w");
+  if (fp == NULL) die("could not open file output file",__LINE__,__FILE__);
+  fprintf(fp, "# thread timestep phase tile start(us) end(us)\n");
+  for (ii = 0; ii < nthreads; ii++) {
+    first = last = timeline->origin;
+    idle = 0.0;
+    for (jj = 0; jj < timeline->count[ii]; jj++) {
+      event = &timeline->events[(size_t)ii * timeline->capacity + jj];
+      fprintf(fp, "%d %d %s %d %.3f %.3f\n", ii, event->iteration, names[event->phase], event->tile,
+              (event->start - timeline->origin) * 1e6, (event->end - timeline->origin) * 1e6);
+      if (event->phase == PHASE_WAIT) idle += event->end - event->start;
+      last = event->end;
     }
+    printf("Thread %d:\t\t\t%.1f%% busy, %.1f%% waiting, %d tiles stolen\n", ii,
+           (last > first) ? 100.0 * (last - first - idle) / (last - first) : 0.0,
+           (last > first) ? 100.0 * idle / (last - first) : 0.0, timeline->stolen[ii]);
+    busy += last - first;
+    waiting += idle;
   }
-
-  return EXIT_SUCCESS;
+  fclose(fp);
+  printf("Waiting:\t\t\t%.1f%% of the threads' time, in the first %d timesteps\n",
+         (busy > 0.0) ? 100.0 * waiting / busy : 0.0, timeline->steps);
 }
 
-int rebound_or_collision(const t_param params, t_speed* cells, t_speed* tmp_cells, int* obstacles)
-{
-  int ii,jj,kk;                 /* generic counters */
-  const float c_sq = 1.0/3.0;  /* square of speed of sound */
-  const float w0 = 4.0/9.0;    /* weighting factor */
-  const float w1 = 1.0/9.0;    /* weighting factor */
-  const float w2 = 1.0/36.0;   /* weighting factor */
-  float u_x,u_y;               /* av. velocities in x and y directions */
-  float u[NSPEEDS];            /* directional velocities */
-  float d_equ[NSPEEDS];        /* equilibrium densities */
-  float u_sq;                  /* squared velocity */
-  float local_density;         /* sum of densities in a particular cell */
-
-  /* loop over the cells in the grid
-  ** NB the collision step is called after
-  ** the propagate step and so values of interest
-  ** are in the scratch-space grid */
-#pragma omp parallel for shared(cells) firstprivate(tmp_cells, obstacles) private(jj, kk, u_x, u_y, u, d_equ, u_sq, local_density)
-  for(ii=0;ii<params.ny;ii++) {
-    for(jj=0;jj<params.nx;jj++) {
-      /* if the cell contains an obstacle */
-      if(obstacles[ii*params.nx + jj]) {
-          /* called after propagate, so taking values from scratch space
-          ** mirroring, and writing into main grid */
-          cells[ii*params.nx + jj].speeds[1] = tmp_cells[ii*params.nx + jj].speeds[3];
-          cells[ii*params.nx + jj].speeds[2] = tmp_cells[ii*params.nx + jj].speeds[4];
-          cells[ii*params.nx + jj].speeds[3] = tmp_cells[ii*params.nx + jj].speeds[1];
-          cells[ii*params.nx + jj].speeds[4] = tmp_cells[ii*params.nx + jj].speeds[2];
-          cells[ii*params.nx + jj].speeds[5] = tmp_cells[ii*params.nx + jj].speeds[7];
-          cells[ii*params.nx + jj].speeds[6] = tmp_cells[ii*params.nx + jj].speeds[8];
-          cells[ii*params.nx + jj].speeds[7] = tmp_cells[ii*params.nx + jj].speeds[5];
-          cells[ii*params.nx + jj].speeds[8] = tmp_cells[ii*params.nx + jj].speeds[6];
-      } else {
-          /* compute local density total */
-          local_density = 0.0;
-          for(kk=0;kk<NSPEEDS;kk++) {
-            local_density += tmp_cells[ii*params.nx + jj].speeds[kk];
-          }
-          /* compute x velocity component */
-          u_x = (tmp_cells[ii*params.nx + jj].speeds[1] + 
-                 tmp_cells[ii*params.nx + jj].speeds[5] + 
-                 tmp_cells[ii*params.nx + jj].speeds[8]
-                 - (tmp_cells[ii*params.nx + jj].speeds[3] + 
-                    tmp_cells[ii*params.nx + jj].speeds[6] + 
-                    tmp_cells[ii*params.nx + jj].speeds[7]))
-            / local_density;
-          /* compute y velocity component */
-          u_y = (tmp_cells[ii*params.nx + jj].speeds[2] + 
-                 tmp_cells[ii*params.nx + jj].speeds[5] + 
-                 tmp_cells[ii*params.nx + jj].speeds[6]
-                 - (tmp_cells[ii*params.nx + jj].speeds[4] + 
-                    tmp_cells[ii*params.nx + jj].speeds[7] + 
-                    tmp_cells[ii*params.nx + jj].speeds[8]))
-            / local_density;
-          /* velocity squared */ 
-          u_sq = u_x * u_x + u_y * u_y;
-          /* directional velocity components */
-          u[1] =   u_x;        /* east */
-          u[2] =         u_y;  /* north */
-          u[3] = - u_x;        /* west */
-          u[4] =       - u_y;  /* south */
-          u[5] =   u_x + u_y;  /* north-east */
-          u[6] = - u_x + u_y;  /* north-west */
-          u[7] = - u_x - u_y;  /* south-west */
-          u[8] =   u_x - u_y;  /* south-east */
-          /* equilibrium densities */
-          /* zero velocity density: weight w0 */
-          d_equ[0] = w0 * local_density * (1.0 - u_sq * (1.0 / (2.0 * c_sq)));
-          /* axis speeds: weight w1 */
-          d_equ[1] = w1 * local_density * (1.0 + u[1] * (1.0 / c_sq)
-                           + (u[1] * u[1]) * (1.0 / (2.0 * c_sq * c_sq))
-                           - u_sq * (1.0 / (2.0 * c_sq)));
-          d_equ[2] = w1 * local_density * (1.0 + u[2] * (1.0 / c_sq)
-                           + (u[2] * u[2]) * (1.0 / (2.0 * c_sq * c_sq))
-                           - u_sq * (1.0 / (2.0 * c_sq)));
-          d_equ[3] = w1 * local_density * (1.0 + u[3] * (1.0 / c_sq)
-                           + (u[3] * u[3]) * (1.0 / (2.0 * c_sq * c_sq))
-                           - u_sq * (1.0 / (2.0 * c_sq)));
-          d_equ[4] = w1 * local_density * (1.0 + u[4] * (1.0 / c_sq)
-                           + (u[4] * u[4]) * (1.0 / (2.0 * c_sq * c_sq))
-                           - u_sq * (1.0 / (2.0 * c_sq)));
-          /* diagonal speeds: weight w2 */
-          d_equ[5] = w2 * local_density * (1.0 + u[5] * (1.0 / c_sq)
-                           + (u[5] * u[5]) * (1.0 / (2.0 * c_sq * c_sq))
-                           - u_sq * (1.0 / (2.0 * c_sq)));
-          d_equ[6] = w2 * local_density * (1.0 + u[6] * (1.0 / c_sq)
-                           + (u[6] * u[6]) * (1.0 / (2.0 * c_sq * c_sq))
-                           - u_sq * (1.0 / (2.0 * c_sq)));
-          d_equ[7] = w2 * local_density * (1.0 + u[7] * (1.0 / c_sq)
-                           + (u[7] * u[7]) * (1.0 / (2.0 * c_sq * c_sq))
-                           - u_sq * (1.0 / (2.0 * c_sq)));
-          d_equ[8] = w2 * local_density * (1.0 + u[8] * (1.0 / c_sq)
-                           + (u[8] * u[8]) * (1.0 / (2.0 * c_sq * c_sq))
-                           - u_sq * (1.0 / (2.0 * c_sq)));
-          /* relaxation step */
-          for(kk=0;kk<NSPEEDS;kk++) {
-            cells[ii*params.nx + jj].speeds[kk] = (tmp_cells[ii*params.nx + jj].speeds[kk]
-                               + params.omega * 
-                               (d_equ[kk] - tmp_cells[ii*params.nx + jj].speeds[kk]));
-          }
-      }
-    }
-  }
+/* a timestep in an OpenMP team, for the grids outside the timestep loop */
+int timestep(const t_param params, t_speed* cells, t_speed* tmp_cells, int* obstacles)
+{
+#pragma omp parallel
+  {
+    int first,last;             /* the rows of this thread */
 
+    lbm_pool_rows(params.ny, omp_get_thread_num(), omp_get_num_threads(), &first, &last);
+    accelerate_flow_and_propagate(params,cells,tmp_cells,obstacles,first,last);
+#pragma omp barrier
+    rebound_or_collision(params,cells,tmp_cells,obstacles,first,last);
+  }
   return EXIT_SUCCESS; 
 }
 
+int accelerate_flow_and_propagate(const t_param params, t_speed* cells, t_speed* tmp_cells, int* obstacles,
+                                  const int first, const int last)
+{
+#include"d2q9-bgk-propagate.h"
+}
+
+int rebound_or_collision(const t_param params, t_speed* cells, t_speed* tmp_cells, int* obstacles,
+                         const int first, const int last)
+{
+#include"d2q9-bgk-collide.h"
+}
+
 int initialise(const char* paramfile, const char* obstaclefile,
            t_param* params, t_speed** cells_ptr, t_speed** tmp_cells_ptr, 
-           int** obstacles_ptr, float** av_vels_ptr)
+           int** obstacles_ptr, lbm_steady* steady)
 {
   char   message[1024];  /* message buffer */
   FILE   *fp;            /* file pointer */
-  int    ii,jj;          /* generic counters */
-  int    xx,yy;          /* generic array indices */
-  int    blocked;        /* indicates whether a cell is blocked by an obstacle */ 
+  int    ii,jj,kk;       /* generic counters */
+  long   line;           /* line no. of an error in the obstacle file */
   int    retval;         /* to hold return value for checking */
+  const char* what;      /* optional parameter that could not be read */
   float w0,w1,w2;       /* weighting factors */
 
   /* open the parameter file */
@@ -381,6 +1819,12 @@ int initialise(const char* paramfile, const char* obstaclefile,
   if(retval != 1) die ("could not read param file: accel",__LINE__,__FILE__);
   retval = fscanf(fp,"%f\n",&(params->omega));
   if(retval != 1) die ("could not read param file: omega",__LINE__,__FILE__);
+  params->full_ny = params->ny;
+  params->mirror_row = -1;
+  if (lbm_steady_read(fp, steady, &what) != 0) {
+    sprintf(message,"could not read param file: %s", what);
+    die(message,__LINE__,__FILE__);
+  }
 
   /* and close up the file */
   fclose(fp);
@@ -423,67 +1867,50 @@ int initialise(const char* paramfile, const char* obstaclefile,
   w0 = params->density * 4.0/9.0;
   w1 = params->density      /9.0;
   w2 = params->density      /36.0;
+  params->rest[0] = w0;
+  for(kk=1;kk<5;kk++) params->rest[kk] = w1;
+  for(kk=5;kk<NSPEEDS;kk++) params->rest[kk] = w2;
 
   for(ii=0;ii<params->ny;ii++) {
     for(jj=0;jj<params->nx;jj++) {
       /* centre */
-      (*cells_ptr)[ii*params->nx + jj].speeds[0] = w0;
+      (*cells_ptr)[ii*params->nx + jj].speeds[0] = LBM_STORE(w0, params->rest[0]);
       /* axis directions */
-      (*cells_ptr)[ii*params->nx + jj].speeds[1] = w1;
-      (*cells_ptr)[ii*params->nx + jj].speeds[2] = w1;
-      (*cells_ptr)[ii*params->nx + jj].speeds[3] = w1;
-      (*cells_ptr)[ii*params->nx + jj].speeds[4] = w1;
+      (*cells_ptr)[ii*params->nx + jj].speeds[1] = LBM_STORE(w1, params->rest[1]);
+      (*cells_ptr)[ii*params->nx + jj].speeds[2] = LBM_STORE(w1, params->rest[2]);
+      (*cells_ptr)[ii*params->nx + jj].speeds[3] = LBM_STORE(w1, params->rest[3]);
+      (*cells_ptr)[ii*params->nx + jj].speeds[4] = LBM_STORE(w1, params->rest[4]);
       /* diagonals */
-      (*cells_ptr)[ii*params->nx + jj].speeds[5] = w2;
-      (*cells_ptr)[ii*params->nx + jj].speeds[6] = w2;
-      (*cells_ptr)[ii*params->nx + jj].speeds[7] = w2;
-      (*cells_ptr)[ii*params->nx + jj].speeds[8] = w2;
-    }
-  }
-
-  /* first set all cells in obstacle array to zero */ 
-  for(ii=0;ii<params->ny;ii++) {
-    for(jj=0;jj<params->nx;jj++) {
-      (*obstacles_ptr)[ii*params->nx + jj] = 0;
+      (*cells_ptr)[ii*params->nx + jj].speeds[5] = LBM_STORE(w2, params->rest[5]);
+      (*cells_ptr)[ii*params->nx + jj].speeds[6] = LBM_STORE(w2, params->rest[6]);
+      (*cells_ptr)[ii*params->nx + jj].speeds[7] = LBM_STORE(w2, params->rest[7]);
+      (*cells_ptr)[ii*params->nx + jj].speeds[8] = LBM_STORE(w2, params->rest[8]);
     }
   }
 
-  /* open the obstacle data file */
-  fp = fopen(obstaclefile,"r");
-  if (fp == NULL) {
-    sprintf(message,"could not open input obstacles file: %s", obstaclefile);
-    die(message,__LINE__,__FILE__);
+  /* a binary obstacle file is a dense map, loaded in one go */
+  if (lbm_is_binary(obstaclefile)) {
+    retval = lbm_read_obstacles(obstaclefile, params->nx, params->ny, 0, params->ny, *obstacles_ptr, NULL);
+    if (retval != LBM_OK) die(lbm_strerror(retval),__LINE__,__FILE__);
   }
-
-  /* read-in the blocked cells list */
-  while( (retval = fscanf(fp,"%d %d %d\n", &xx, &yy, &blocked)) != EOF) {
-    /* some checks */
-    if ( retval != 3)
-      die("expected 3 values per line in obstacle file",__LINE__,__FILE__);
-    if ( xx<0 || xx>params->nx-1 )
-      die("obstacle x-coord out of range",__LINE__,__FILE__);
-    if ( yy<0 || yy>params->ny-1 )
-      die("obstacle y-coord out of range",__LINE__,__FILE__);
-    if ( blocked != 1 ) 
-      die("obstacle blocked value should be 1",__LINE__,__FILE__);
-    /* assign to array */
-    (*obstacles_ptr)[yy*params->nx + xx] = blocked;
+  else {
+    /* read-in the blocked cells list */
+    retval = lbm_parse_obstacles(obstaclefile, params->nx, params->ny, *obstacles_ptr, NULL, &line);
+    if (retval == LBM_EOPEN) {
+      sprintf(message,"could not open input obstacles file: %s", obstaclefile);
+      die(message,__LINE__,__FILE__);
+    }
+    if (retval != LBM_OK) {
+      sprintf(message,"%s (line %ld of %s)", lbm_strerror(retval), line, obstaclefile);
+      die(message,__LINE__,__FILE__);
+    }
   }
-  
-  /* and close the file */
-  fclose(fp);
-
-  /* 
-  ** allocate space to hold a record of the avarage velocities computed 
-  ** at each timestep
-  */
-  *av_vels_ptr = (float*)malloc(sizeof(float)*params->maxIters);
 
   return EXIT_SUCCESS;
 }
 
 int finalise(const t_param* params, t_speed** cells_ptr, t_speed** tmp_cells_ptr,
-         int** obstacles_ptr, float** av_vels_ptr)
+         int** obstacles_ptr)
 {
   /* 
   ** free up allocated memory
@@ -497,48 +1924,148 @@ int finalise(const t_param* params, t_speed** cells_ptr, t_speed** tmp_cells_ptr
   free(*obstacles_ptr);
   *obstacles_ptr = NULL;
 
-  free(*av_vels_ptr);
-  *av_vels_ptr = NULL;
-
   return EXIT_SUCCESS;
 }
 
 float av_velocity(const t_param params, t_speed* cells, int* obstacles)
+{
+  int    tot_cells = 0;  /* no. of cells used in calculation */
+  lbm_sum* rows;        /* the sums of the rows */
+  float av_u_x;         /* average x-component of velocity */
+
+  rows = (lbm_sum*)malloc(sizeof(lbm_sum) * params.ny);
+  if (rows == NULL) die("cannot allocate memory for row sums",__LINE__,__FILE__);
+
+#pragma omp parallel reduction(+:tot_cells)
+  {
+    int first,last;             /* the rows of this thread */
+
+    lbm_pool_rows(params.ny, omp_get_thread_num(), omp_get_num_threads(), &first, &last);
+    tot_cells += av_velocity_rows(params,cells,obstacles,rows,first,last);
+  }
+
+  av_u_x = lbm_sum_rows(rows, params.ny) / (float)tot_cells;
+  free(rows);
+
+  return av_u_x;
+}
+
+int av_velocity_rows(const t_param params, t_speed* cells, int* obstacles, lbm_sum* rows,
+                     const int first, const int last)
 {
   int    ii,jj,kk;       /* generic counters */
   int    tot_cells = 0;  /* no. of cells used in calculation */
   float local_density;  /* total density in cell */
-  float tot_u_x;        /* accumulated x-components of velocity */
-
-  /* initialise */
-  tot_u_x = 0.0;
+  lbm_sum tot_u_x;      /* accumulated x-components of velocity in a row */
+  float speeds[NSPEEDS];  /* densities of the cell, widened to float */
 
   /* loop over all non-blocked cells */
-#pragma omp parallel for reduction(+:tot_u_x, tot_cells) firstprivate(cells, obstacles) private(jj, kk, local_density)
-  for(ii=0;ii<params.ny;ii++) {
+  for(ii=first;ii<last;ii++) {
+    tot_u_x = lbm_sum_zero();
     for(jj=0;jj<params.nx;jj++) {
       /* ignore occupied cells */
       if(!obstacles[ii*params.nx + jj]) {
           /* local density total */
           local_density = 0.0;
           for(kk=0;kk<NSPEEDS;kk++) {
-            local_density += cells[ii*params.nx + jj].speeds[kk];
+            speeds[kk] = LOAD(cells[ii*params.nx + jj],kk);
+            local_density += speeds[kk];
           }
           /* x-component of velocity */
-          tot_u_x += (cells[ii*params.nx + jj].speeds[1] + 
-                  cells[ii*params.nx + jj].speeds[5] + 
-                  cells[ii*params.nx + jj].speeds[8]
-                  - (cells[ii*params.nx + jj].speeds[3] + 
-                     cells[ii*params.nx + jj].speeds[6] + 
-                     cells[ii*params.nx + jj].speeds[7])) / 
-            local_density;
+          lbm_sum_add(&tot_u_x, (speeds[1] + 
+                  speeds[5] + 
+                  speeds[8]
+                  - (speeds[3] + 
+                     speeds[6] + 
+                     speeds[7])) / 
+            local_density);
           /* increase counter of inspected cells */
           ++tot_cells;
       }
     }
+    rows[ii] = tot_u_x;
+  }
+
+  return tot_cells;
+}
+
+float av_velocity_fields(const t_param params, t_speed* cells, int* obstacles,
+                         float* u_x, float* u_y, float* pressure)
+{
+  int    tot_cells = 0;  /* no. of cells used in calculation */
+  lbm_sum* rows;        /* the sums of the rows */
+  float av_u_x;         /* average x-component of velocity */
+
+  rows = (lbm_sum*)malloc(sizeof(lbm_sum) * params.ny);
+  if (rows == NULL) die("cannot allocate memory for row sums",__LINE__,__FILE__);
+
+#pragma omp parallel reduction(+:tot_cells)
+  {
+    int first,last;             /* the rows of this thread */
+
+    lbm_pool_rows(params.ny, omp_get_thread_num(), omp_get_num_threads(), &first, &last);
+    tot_cells += av_velocity_fields_rows(params,cells,obstacles,u_x,u_y,pressure,rows,first,last);
+  }
+
+  av_u_x = lbm_sum_rows(rows, params.ny) / (float)tot_cells;
+  free(rows);
+
+  return av_u_x;
+}
+
+int av_velocity_fields_rows(const t_param params, t_speed* cells, int* obstacles,
+                            float* u_x, float* u_y, float* pressure, lbm_sum* rows,
+                            const int first, const int last)
+{
+  int    ii,jj,kk;       /* generic counters */
+  int    tot_cells = 0;  /* no. of cells used in calculation */
+  const float c_sq = 1.0/3.0;  /* sq. of speed of sound */
+  float local_density;  /* total density in cell */
+  lbm_sum tot_u_x;      /* accumulated x-components of velocity in a row */
+  float speeds[NSPEEDS];  /* densities of the cell, widened to float */
+
+  /* loop over all cells, accumulating over the non-blocked ones */
+  for(ii=first;ii<last;ii++) {
+    tot_u_x = lbm_sum_zero();
+    for(jj=0;jj<params.nx;jj++) {
+      /* an occupied cell */
+      if(obstacles[ii*params.nx + jj]) {
+          u_x[ii*params.nx + jj] = u_y[ii*params.nx + jj] = 0.0;
+          pressure[ii*params.nx + jj] = params.density * c_sq;
+      }
+      /* no obstacle */
+      else {
+          local_density = 0.0;
+          for(kk=0;kk<NSPEEDS;kk++) {
+            speeds[kk] = LOAD(cells[ii*params.nx + jj],kk);
+            local_density += speeds[kk];
+          }
+          /* compute x velocity component */
+          u_x[ii*params.nx + jj] = (speeds[1] + 
+                 speeds[5] +
+                 speeds[8]
+                 - (speeds[3] + 
+                speeds[6] + 
+                speeds[7]))
+            / local_density;
+          /* compute y velocity component */
+          u_y[ii*params.nx + jj] = (speeds[2] + 
+                 speeds[5] + 
+                 speeds[6]
+                 - (speeds[4] + 
+                speeds[7] + 
+                speeds[8]))
+            / local_density;
+          /* compute pressure */
+          pressure[ii*params.nx + jj] = local_density * c_sq;
+          lbm_sum_add(&tot_u_x, u_x[ii*params.nx + jj]);
+          ++tot_cells;
+      }
+    }
+    rows[ii] = tot_u_x;
   }
 
-  return tot_u_x / (float)tot_cells;
+  return tot_cells;
 }
 
 float calc_reynolds(const t_param params, t_speed* cells, int* obstacles)
@@ -556,7 +2083,7 @@ float total_density(const t_param params, t_speed* cells)
   for(ii=0;ii<params.ny;ii++) {
     for(jj=0;jj<params.nx;jj++) {
       for(kk=0;kk<NSPEEDS;kk++) {
-          total += cells[ii*params.nx + jj].speeds[kk];
+          total += LOAD(cells[ii*params.nx + jj],kk);
       }
     }
   }
@@ -564,71 +2091,626 @@ float total_density(const t_param params, t_speed* cells)
   return total;
 }
 
-int write_values(const t_param params, t_speed* cells, int* obstacles, float* av_vels)
+int write_values(const t_param params, t_speed* cells, int* obstacles, int* full_obstacles,
+                 const int binary)
 {
-  FILE* fp;                     /* file pointer */
-  int ii,jj,kk;                 /* generic counters */
-  const float c_sq = 1.0/3.0;  /* sq. of speed of sound */
-  float local_density;         /* per grid cell sum of densities */
-  float pressure;              /* fluid pressure in grid cell */
-  float u_x;                   /* x-component of velocity in grid cell */
-  float u_y;                   /* y-component of velocity in grid cell */
+  t_output output;              /* fields for the text writer */
+  int retval;                   /* to hold return value for checking */
+  float* pressure;             /* fluid pressure in each grid cell */
+  float* u_x;                  /* x-component of velocity in each grid cell */
+  float* u_y;                  /* y-component of velocity in each grid cell */
 
-  fp = fopen(FINALSTATEFILE,"w");
-  if (fp == NULL) {
+  pressure = (float*)malloc(sizeof(float)*(params.full_ny*params.nx));
+  u_x = (float*)malloc(sizeof(float)*(params.full_ny*params.nx));
+  u_y = (float*)malloc(sizeof(float)*(params.full_ny*params.nx));
+  if (pressure == NULL || u_x == NULL || u_y == NULL)
+    die("cannot allocate memory for output",__LINE__,__FILE__);
+  av_velocity_fields(params,cells,obstacles,u_x,u_y,pressure);
+  mirror_fields(params,u_x,u_y,pressure);
+
+  if (binary) {
+    retval = lbm_write_state(FINALSTATEBIN, params.nx, params.full_ny, u_x, u_y, pressure, full_obstacles);
+    if (retval != LBM_OK) die(lbm_strerror(retval),__LINE__,__FILE__);
+  }
+  else {
+    output.nx = params.nx;
+    output.u_x = u_x;
+    output.u_y = u_y;
+    output.pressure = pressure;
+    output.obstacles = full_obstacles;
+    write_lines(FINALSTATEFILE, params.full_ny*params.nx, LBM_STATE_LINE_MAX, format_state_line, &output, TRUE);
+  }
+  free(pressure);
+  free(u_x);
+  free(u_y);
+
+  return EXIT_SUCCESS;
+}
+
+/*
+** Each thread formats a contiguous block of lines into its own buffer,
+** then, once every thread knows the length of the blocks before its
+** own, writes its buffer at that offset with a single pwrite. The
+** formatting matches fprintf to the byte (see lbm_text.h).
+*/
+void write_lines(const char* path, const int nlines, const int line_max,
+                 int (*format_line)(char* out, const int line, const t_output* output),
+                 const t_output* output, const int parallel)
+{
+  size_t* lengths;              /* no. of bytes formatted by each thread */
+  int     fd;                   /* file descriptor */
+
+  fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+  if (fd < 0) {
     die("could not open file output file",__LINE__,__FILE__);
   }
+  lengths = (size_t*)calloc(omp_get_max_threads(), sizeof(size_t));
+  if (lengths == NULL) die("cannot allocate memory for output",__LINE__,__FILE__);
+
+#pragma omp parallel if(parallel)
+  {
+    const int tid = omp_get_thread_num();
+    const int nthreads = omp_get_num_threads();
+    const int first = (int)((long)nlines * tid / nthreads);
+    const int last = (int)((long)nlines * (tid + 1) / nthreads);
+    char*   buffer;             /* this thread's block of text */
+    size_t  len = 0;            /* bytes in the buffer */
+    off_t   offset = 0;         /* where the block starts in the file */
+    int     ii;
+
+    buffer = (char*)malloc((size_t)(last - first) * line_max + 1);
+    if (buffer == NULL) die("cannot allocate memory for output",__LINE__,__FILE__);
+    for (ii = first; ii < last; ii++) {
+      len += format_line(buffer + len, ii, output);
+    }
+    lengths[tid] = len;
+
+#pragma omp barrier
+    for (ii = 0; ii < tid; ii++) offset += lengths[ii];
+    write_at(fd, buffer, len, offset);
+    free(buffer);
+  }
+
+  free(lengths);
+  if (close(fd) != 0) die("could not write output file",__LINE__,__FILE__);
+}
+
+/* "%d %d %.12E %.12E %.12E %d\n" */
+int format_state_line(char* out, const int line, const t_output* output)
+{
+  return lbm_format_state_line(out, line / output->nx, line % output->nx, output->u_x[line],
+                               output->u_y[line], output->pressure[line], output->obstacles[line]);
+}
+
+/* write all of a buffer at an offset in a file */
+void write_at(const int fd, const char* buffer, const size_t len, const off_t offset)
+{
+  size_t  done;                 /* bytes written so far */
+  ssize_t written;
+
+  for (done = 0; done < len; done += written) {
+    written = pwrite(fd, buffer + done, len - done, offset + done);
+    if (written < 0) die("could not write output file",__LINE__,__FILE__);
+  }
+}
+
+/*
+** The output thread writes the jobs handed to it in the order they were
+** submitted, so av_vels.dat always holds every timestep up to the last
+** checkpoint written. Each kind of job has its own buffers, two of them
+** for av. velocities and snapshots, so that the timestep loop fills one
+** while the other is written and only waits if the thread falls behind.
+** If the run checkpoints, the thread keeps every av. velocity for the
+** checkpoints to hold. On a restart, av_vels.dat is written afresh from
+** the av_vels of the start timesteps before the checkpoint.
+*/
+void output_start(t_writer* writer, const t_param params, int* obstacles, const int binary,
+                  const int checkpoints, const float* av_vels, const int start)
+{
+  static const int kinds[NJOBS] = { JOB_AVVELS, JOB_AVVELS, JOB_SNAPSHOT, JOB_SNAPSHOT, JOB_CHECKPOINT };
+  char*  text;                  /* av. velocities before the checkpoint as text */
+  size_t len;                   /* bytes of text */
+  int    ii,jj;                 /* generic counters */
+
+  memset(writer, 0, sizeof(*writer));
+  writer->params = params;
+  writer->obstacles = obstacles;
+  writer->obstacles_hash = lbm_hash_obstacles(obstacles, (size_t)params.full_ny*params.nx);
+  writer->binary = binary;
+  for (ii = 0; ii < NJOBS; ii++) {
+    writer->jobs[ii].kind = kinds[ii];
+    if (kinds[ii] == JOB_AVVELS) {
+      writer->jobs[ii].av_vels = (float*)malloc(sizeof(float)*AVVELS_CHUNK);
+      if (writer->jobs[ii].av_vels == NULL) die("cannot allocate memory for output",__LINE__,__FILE__);
+    }
+  }
+
+  writer->avvels_fd = open(AVVELSFILE, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+  if (writer->avvels_fd < 0) die("could not open file output file",__LINE__,__FILE__);
+  if (start) {
+    text = (char*)malloc((size_t)AVVELS_CHUNK * LBM_AVVELS_LINE_MAX);
+    if (text == NULL) die("cannot allocate memory for output",__LINE__,__FILE__);
+    for (ii = 0; ii < start; ii += AVVELS_CHUNK) {
+      for (jj = ii, len = 0; jj < start && jj < ii + AVVELS_CHUNK; jj++) {
+        len += lbm_format_avvels_line(text + len, jj, av_vels[jj]);
+      }
+      write_at(writer->avvels_fd, text, len, writer->avvels_end);
+      writer->avvels_end += len;
+    }
+    free(text);
+  }
+  if (checkpoints) {
+    writer->history_size = (start > AVVELS_CHUNK) ? start : AVVELS_CHUNK;
+    writer->history = (float*)malloc(sizeof(float)*writer->history_size);
+    if (writer->history == NULL) die("cannot allocate memory for output",__LINE__,__FILE__);
+    if (start) memcpy(writer->history, av_vels, sizeof(float)*start);
+    writer->nhistory = start;
+  }
+
+  pthread_mutex_init(&writer->lock, NULL);
+  pthread_cond_init(&writer->cond, NULL);
+  if (pthread_create(&writer->thread, NULL, output_thread, writer) != 0)
+    die("could not start the output thread",__LINE__,__FILE__);
+}
+
+/* the next buffer of a kind, once the output thread is done with it */
+t_job* output_acquire(t_writer* writer, const int kind)
+{
+  static const int first[] = { 0, 2, 4 };  /* first job of each kind */
+  static const int count[] = { 2, 2, 1 };  /* no. of jobs of each kind */
+  const t_param params = writer->params;
+  t_job* job = &writer->jobs[first[kind] + writer->next[kind]];
+
+  writer->next[kind] = (writer->next[kind] + 1) % count[kind];
+  pthread_mutex_lock(&writer->lock);
+  while (job->queued) pthread_cond_wait(&writer->cond, &writer->lock);
+  pthread_mutex_unlock(&writer->lock);
+
+  /* snapshot and checkpoint buffers are only allocated if used */
+  if (kind == JOB_SNAPSHOT && job->u_x == NULL) {
+    job->u_x = (float*)malloc(sizeof(float)*(params.full_ny*params.nx));
+    job->u_y = (float*)malloc(sizeof(float)*(params.full_ny*params.nx));
+    job->pressure = (float*)malloc(sizeof(float)*(params.full_ny*params.nx));
+    if (job->u_x == NULL || job->u_y == NULL || job->pressure == NULL)
+      die("cannot allocate memory for snapshot",__LINE__,__FILE__);
+  }
+  if (kind == JOB_CHECKPOINT && job->cells == NULL) {
+    job->cells = (float*)malloc(sizeof(float)*NSPEEDS*(params.ny*params.nx));
+    if (job->cells == NULL) die("cannot allocate memory for checkpoint",__LINE__,__FILE__);
+  }
+
+  return job;
+}
+
+void output_submit(t_writer* writer, t_job* job)
+{
+  pthread_mutex_lock(&writer->lock);
+  job->seq = writer->seq++;
+  job->queued = TRUE;
+  pthread_cond_broadcast(&writer->cond);
+  pthread_mutex_unlock(&writer->lock);
+}
+
+/* record the av. velocity of a timestep, handing them over a chunk at a time */
+void output_av_vel(t_writer* writer, const int iteration, const float av_vel)
+{
+  if (writer->av_job == NULL) {
+    writer->av_job = output_acquire(writer, JOB_AVVELS);
+    writer->av_job->iteration = iteration;
+    writer->av_job->count = 0;
+  }
+  writer->av_job->av_vels[writer->av_job->count++] = av_vel;
+  if (writer->av_job->count == AVVELS_CHUNK) {
+    output_submit(writer, writer->av_job);
+    writer->av_job = NULL;
+  }
+}
+
+/* copy the grid after iteration timesteps, and the samples of the field
+** taken, for the output thread to save */
+void output_checkpoint(t_writer* writer, t_speed* cells, const lbm_steady* steady,
+                       const int iteration)
+{
+  const t_param params = writer->params;
+  t_job* job;
+  int    ii,jj,kk;              /* generic counters */
+
+  /* the av. velocities so far go out first */
+  if (writer->av_job != NULL) {
+    output_submit(writer, writer->av_job);
+    writer->av_job = NULL;
+  }
 
+  job = output_acquire(writer, JOB_CHECKPOINT);
+#pragma omp parallel for private(jj, kk)
   for(ii=0;ii<params.ny;ii++) {
     for(jj=0;jj<params.nx;jj++) {
-      /* an occupied cell */
-      if(obstacles[ii*params.nx + jj]) {
-          u_x = u_y = 0.0;
-          pressure = params.density * c_sq;
+      for(kk=0;kk<NSPEEDS;kk++) {
+        job->cells[(ii*params.nx + jj)*NSPEEDS + kk] = LBM_WIDEN(cells[ii*params.nx + jj].speeds[kk]);
       }
-      /* no obstacle */
-      else {
-          local_density = 0.0;
-          for(kk=0;kk<NSPEEDS;kk++) {
-            local_density += cells[ii*params.nx + jj].speeds[kk];
-          }
-          /* compute x velocity component */
-          u_x = (cells[ii*params.nx + jj].speeds[1] + 
-                 cells[ii*params.nx + jj].speeds[5] +
-                 cells[ii*params.nx + jj].speeds[8]
-                 - (cells[ii*params.nx + jj].speeds[3] + 
-                cells[ii*params.nx + jj].speeds[6] + 
-                cells[ii*params.nx + jj].speeds[7]))
-            / local_density;
-          /* compute y velocity component */
-          u_y = (cells[ii*params.nx + jj].speeds[2] + 
-                 cells[ii*params.nx + jj].speeds[5] + 
-                 cells[ii*params.nx + jj].speeds[6]
-                 - (cells[ii*params.nx + jj].speeds[4] + 
-                cells[ii*params.nx + jj].speeds[7] + 
-                cells[ii*params.nx + jj].speeds[8]))
-            / local_density;
-          /* compute pressure */
-          pressure = local_density * c_sq;
+    }
+  }
+  job->samples = (steady->last_u != NULL) ? steady->samples : 0;
+  job->l2_change = steady->l2_change;
+  if (job->samples) {
+    if (job->last_u == NULL) job->last_u = (float*)malloc(sizeof(float)*2*steady->ncells);
+    if (job->last_u == NULL) die("cannot allocate memory for checkpoint",__LINE__,__FILE__);
+    memcpy(job->last_u, steady->last_u, sizeof(float)*2*steady->ncells);
+  }
+  job->iteration = iteration;
+  output_submit(writer, job);
+}
+
+/* hand over the last av. velocities and wait for everything to be written */
+void output_finish(t_writer* writer)
+{
+  int ii;                       /* generic counter */
+
+  if (writer->av_job != NULL) {
+    output_submit(writer, writer->av_job);
+    writer->av_job = NULL;
+  }
+  pthread_mutex_lock(&writer->lock);
+  writer->done = TRUE;
+  pthread_cond_broadcast(&writer->cond);
+  pthread_mutex_unlock(&writer->lock);
+  pthread_join(writer->thread, NULL);
+
+  if (close(writer->avvels_fd) != 0) die("could not write output file",__LINE__,__FILE__);
+  free(writer->history);
+  for (ii = 0; ii < NJOBS; ii++) {
+    free(writer->jobs[ii].av_vels);
+    free(writer->jobs[ii].u_x);
+    free(writer->jobs[ii].u_y);
+    free(writer->jobs[ii].pressure);
+    free(writer->jobs[ii].cells);
+    free(writer->jobs[ii].last_u);
+  }
+  pthread_cond_destroy(&writer->cond);
+  pthread_mutex_destroy(&writer->lock);
+}
+
+void* output_thread(void* arg)
+{
+  t_writer* writer = (t_writer*)arg;
+  t_job* job;
+  int    ii;                    /* generic counter */
+
+  pthread_mutex_lock(&writer->lock);
+  for (;;) {
+    /* the oldest job queued */
+    job = NULL;
+    for (ii = 0; ii < NJOBS; ii++) {
+      if (writer->jobs[ii].queued && (job == NULL || writer->jobs[ii].seq < job->seq))
+        job = &writer->jobs[ii];
+    }
+    if (job == NULL) {
+      if (writer->done) break;
+      pthread_cond_wait(&writer->cond, &writer->lock);
+      continue;
+    }
+    pthread_mutex_unlock(&writer->lock);
+    output_write(writer, job);
+    pthread_mutex_lock(&writer->lock);
+    job->queued = FALSE;
+    pthread_cond_broadcast(&writer->cond);
+  }
+  pthread_mutex_unlock(&writer->lock);
+
+  return NULL;
+}
+
+void output_write(t_writer* writer, t_job* job)
+{
+  const t_param params = writer->params;
+  lbm_checkpoint info;          /* the run a checkpoint belongs to */
+  t_output output;              /* fields for the text writer */
+  char   path[64];              /* snapshot file name */
+  char*  text;                  /* av. velocities as text */
+  size_t len = 0;               /* bytes of text */
+  int    retval;                /* to hold return value for checking */
+  int    ii;                    /* generic counter */
+
+  switch (job->kind) {
+  case JOB_AVVELS:
+    text = (char*)malloc((size_t)job->count * LBM_AVVELS_LINE_MAX);
+    if (text == NULL) die("cannot allocate memory for output",__LINE__,__FILE__);
+    for (ii = 0; ii < job->count; ii++) {
+      len += lbm_format_avvels_line(text + len, job->iteration + ii, job->av_vels[ii]);
+    }
+    write_at(writer->avvels_fd, text, len, writer->avvels_end);
+    writer->avvels_end += len;
+    free(text);
+    if (writer->history != NULL) {
+      if (writer->nhistory + job->count > writer->history_size) {
+        writer->history_size = 2 * (writer->nhistory + job->count);
+        writer->history = (float*)realloc(writer->history, sizeof(float)*writer->history_size);
+        if (writer->history == NULL) die("cannot allocate memory for output",__LINE__,__FILE__);
       }
-      /* write to file */
-      fprintf(fp,"%d %d %.12E %.12E %.12E %d\n",ii,jj,u_x,u_y,pressure,obstacles[ii*params.nx + jj]);
+      memcpy(writer->history + writer->nhistory, job->av_vels, sizeof(float)*job->count);
+      writer->nhistory += job->count;
+    }
+    break;
+
+  case JOB_SNAPSHOT:
+    /* formatted by this thread alone, leaving the cores to the timestep loop */
+    sprintf(path, writer->binary ? SNAPSHOTBIN : SNAPSHOTFILE, job->iteration);
+    if (writer->binary) {
+      retval = lbm_write_state(path, params.nx, params.full_ny, job->u_x, job->u_y, job->pressure,
+                               writer->obstacles);
+      if (retval != LBM_OK) die(lbm_strerror(retval),__LINE__,__FILE__);
     }
+    else {
+      output.nx = params.nx;
+      output.u_x = job->u_x;
+      output.u_y = job->u_y;
+      output.pressure = job->pressure;
+      output.obstacles = writer->obstacles;
+      write_lines(path, params.full_ny*params.nx, LBM_STATE_LINE_MAX, format_state_line, &output, FALSE);
+    }
+    break;
+
+  case JOB_CHECKPOINT:
+    memset(&info, 0, sizeof(info));
+    info.iteration = job->iteration;
+    info.max_iters = params.maxIters;
+    info.reynolds_dim = params.reynolds_dim;
+    info.density = params.density;
+    info.accel = params.accel;
+    info.omega = params.omega;
+    info.obstacles = writer->obstacles_hash;
+    info.deviation = LBM_DEVIATES;
+    info.samples = job->samples;
+    info.l2_change = job->l2_change;
+    /* the av. velocities up to it were all submitted before it */
+    if (writer->nhistory != job->iteration)
+      die("av. velocities missing from the checkpoint",__LINE__,__FILE__);
+    retval = lbm_write_checkpoint(CHECKPOINTFILE, params.nx, params.ny, NSPEEDS, &info,
+                                  job->cells, writer->history, job->last_u);
+    if (retval != LBM_OK) die(lbm_strerror(retval),__LINE__,__FILE__);
+    break;
   }
+}
 
-  fclose(fp);
+/*
+** Load the grid from a checkpoint of a run with the same parameters
+** (maxIters may have been raised since) and the same obstacles, the
+** whole grid of them if mirrored, the samples of the field for the
+** steady state test, and the av. velocities before it into a freshly
+** allocated *av_vels, and return the no. of
+** timesteps it had done. Checkpoints hold the speeds widened to float
+** as they were stored, and 16 bits widened to a float narrow back to
+** the same bits, so a checkpoint of the same storage is loaded exactly;
+** a checkpoint of deviations is loaded into a build of whole values,
+** or the other way round, by adding or taking off the rest values.
+*/
+int restart(const char* restartfile, const t_param params, t_speed* cells, int* obstacles,
+            lbm_steady* steady, float** av_vels)
+{
+  lbm_checkpoint info;          /* the run the checkpoint belongs to */
+  float* speeds;                /* the grid as saved */
+  float* last_u;                /* the last sample of the field, or NULL */
+  int ii,kk;                    /* generic counters */
+  int retval;                   /* to hold return value for checking */
 
-  fp = fopen(AVVELSFILE,"w");
-  if (fp == NULL) {
-    die("could not open file output file",__LINE__,__FILE__);
+  speeds = (float*)malloc(sizeof(float)*NSPEEDS*(params.ny*params.nx));
+  if (speeds == NULL) die("cannot allocate memory for checkpoint",__LINE__,__FILE__);
+  retval = lbm_read_checkpoint(restartfile, params.nx, params.ny, NSPEEDS, params.maxIters,
+                               lbm_hash_obstacles(obstacles, (size_t)params.full_ny*params.nx),
+                               &info, speeds, av_vels, &last_u);
+  if (retval != LBM_OK) die(lbm_strerror(retval),__LINE__,__FILE__);
+  /* before any of the run is changed */
+  if ((int)info.reynolds_dim != params.reynolds_dim || info.density != params.density ||
+      info.accel != params.accel || info.omega != params.omega)
+    die("checkpoint was taken with different parameters",__LINE__,__FILE__);
+  for(ii=0;ii<params.ny*params.nx;ii++) {
+    for(kk=0;kk<NSPEEDS;kk++) {
+      if (info.deviation == LBM_DEVIATES) cells[ii].speeds[kk] = LBM_NARROW(speeds[ii*NSPEEDS + kk]);
+      else if (info.deviation) STORE(cells[ii],kk, speeds[ii*NSPEEDS + kk] + params.rest[kk]);
+      else STORE(cells[ii],kk, speeds[ii*NSPEEDS + kk]);
+    }
   }
-  for (ii=0;ii<params.maxIters;ii++) {
-    fprintf(fp,"%d:\t%.12E\n", ii, av_vels[ii]);
+  free(speeds);
+  lbm_steady_resume(steady, info.samples, info.l2_change, last_u);
+  free(last_u);
+
+  return info.iteration;
+}
+
+/*
+** A reflection of the rows, row ii to row (axis - ii) mod ny, that
+** maps the obstacles onto themselves, with axis odd so that the line
+** falls between two rows, leaves the rows from (axis + 1) / 2 up to
+** the second line, half the grid away, as a half that mirrors to the
+** other. The grid is cut down to that half.
+*/
+int mirror_domain(t_param* params, t_speed** cells_ptr, t_speed** tmp_cells_ptr,
+                  int** obstacles_ptr, int** full_obstacles_ptr)
+{
+  const int nx = params->nx;
+  const int ny = params->ny;
+  int* full = *obstacles_ptr;   /* obstacles of the whole grid */
+  int* half;                    /* obstacles of the half simulated */
+  int  axis;                    /* twice the row of the line of symmetry */
+  int  ii,jj;                   /* generic counters */
+
+  if (ny % 2 || ny < 4) return FALSE;
+  for (axis = 1; axis < ny; axis += 2) {
+    for (ii = 0; ii < ny; ii++) {
+      if (memcmp(&full[ii*nx], &full[((axis - ii + ny) % ny)*nx], sizeof(int)*nx)) break;
+    }
+    if (ii == ny) break;
   }
+  if (axis >= ny) return FALSE;
 
-  fclose(fp);
+  params->full_ny = ny;
+  params->ny = ny / 2;
+  params->mirror_row = (axis + 1) / 2;
+  half = (int*)malloc(sizeof(int)*(params->ny*nx));
+  if (half == NULL) die("cannot allocate memory for obstacles",__LINE__,__FILE__);
+  for (ii = 0; ii < params->ny; ii++) {
+    for (jj = 0; jj < nx; jj++) {
+      half[ii*nx + jj] = full[((params->mirror_row + ii) % ny)*nx + jj];
+    }
+  }
+  *obstacles_ptr = half;
+  *full_obstacles_ptr = full;
 
-  return EXIT_SUCCESS;
+  /* the cells are all at rest as yet, so the first half will do */
+  *cells_ptr = (t_speed*)realloc(*cells_ptr, sizeof(t_speed)*(params->ny*nx));
+  *tmp_cells_ptr = (t_speed*)realloc(*tmp_cells_ptr, sizeof(t_speed)*(params->ny*nx));
+  if (*cells_ptr == NULL || *tmp_cells_ptr == NULL)
+    die("cannot allocate memory for cells",__LINE__,__FILE__);
+
+  return TRUE;
+}
+
+void mirror_fields(const t_param params, float* u_x, float* u_y, float* pressure)
+{
+  const size_t bytes = sizeof(float)*(params.ny*params.nx);
+  const int axis = 2 * params.mirror_row - 1;   /* as in mirror_domain */
+  float* half;                  /* copy of the fields of the half grid */
+  int    ii,jj,hh;              /* generic counters, and row of the half */
+  int    flip;                  /* TRUE if the row is the mirror image of one simulated */
+
+  if (params.mirror_row < 0) return;
+  half = (float*)malloc(3 * bytes);
+  if (half == NULL) die("cannot allocate memory for output",__LINE__,__FILE__);
+  memcpy(half, u_x, bytes);
+  memcpy(half + params.ny*params.nx, u_y, bytes);
+  memcpy(half + 2*params.ny*params.nx, pressure, bytes);
+
+#pragma omp parallel for private(jj, hh, flip)
+  for (ii = 0; ii < params.full_ny; ii++) {
+    hh = (ii - params.mirror_row + params.full_ny) % params.full_ny;
+    flip = hh >= params.ny;
+    if (flip) hh = (axis - ii - params.mirror_row + 2 * params.full_ny) % params.full_ny;
+    for (jj = 0; jj < params.nx; jj++) {
+      u_x[ii*params.nx + jj] = half[hh*params.nx + jj];
+      u_y[ii*params.nx + jj] = flip ? -half[(params.ny + hh)*params.nx + jj]
+                                    : half[(params.ny + hh)*params.nx + jj];
+      pressure[ii*params.nx + jj] = half[(2*params.ny + hh)*params.nx + jj];
+    }
+  }
+  free(half);
+}
+
+int warm_start(const t_param params, t_speed* cells, int* obstacles, const lbm_steady* steady,
+               const int factor)
+{
+  static const int   cx[NSPEEDS] = { 0, 1, 0, -1,  0, 1, -1, -1,  1 };  /* directions of the speeds */
+  static const int   cy[NSPEEDS] = { 0, 0, 1,  0, -1, 1,  1, -1, -1 };
+  static const float w[NSPEEDS] = { 4.0/9.0, 1.0/9.0, 1.0/9.0, 1.0/9.0, 1.0/9.0,
+                                    1.0/36.0, 1.0/36.0, 1.0/36.0, 1.0/36.0 };  /* weighting factors */
+  const float c_sq = 1.0/3.0;   /* sq. of speed of sound */
+  t_param  coarse = params;     /* parameters of the coarse grid */
+  t_speed* coarse_cells;        /* the coarse grid */
+  t_speed* coarse_tmp;          /* its scratch space */
+  int*     coarse_obstacles;    /* its obstacles */
+  float*   u_x;                 /* the coarse flow */
+  float*   u_y;
+  float*   pressure;
+  lbm_steady coarse_steady;     /* detection of a steady state on the coarse grid */
+  int      iters;               /* coarse timesteps run */
+  int      ii,jj,kk;            /* generic counters */
+  int      i0,i1,j0,j1;         /* the coarse cells around a cell */
+  float    y,x,fy,fx;           /* a cell's position on the coarse grid */
+  float    local_density;       /* interpolated density */
+  float    ux,uy,u_sq,cu;       /* interpolated velocity */
+
+  if (params.nx % factor || params.ny % factor)
+    die("the grid size must be a multiple of the warm start factor",__LINE__,__FILE__);
+  coarse.nx = params.nx / factor;
+  coarse.ny = params.ny / factor;
+  coarse_cells = (t_speed*)malloc(sizeof(t_speed)*(coarse.ny*coarse.nx));
+  coarse_tmp = (t_speed*)malloc(sizeof(t_speed)*(coarse.ny*coarse.nx));
+  coarse_obstacles = (int*)calloc(coarse.ny*coarse.nx, sizeof(int));
+  u_x = (float*)malloc(sizeof(float)*(coarse.ny*coarse.nx));
+  u_y = (float*)malloc(sizeof(float)*(coarse.ny*coarse.nx));
+  pressure = (float*)malloc(sizeof(float)*(coarse.ny*coarse.nx));
+  if (coarse_cells == NULL || coarse_tmp == NULL || coarse_obstacles == NULL ||
+      u_x == NULL || u_y == NULL || pressure == NULL)
+    die("cannot allocate memory for the warm start",__LINE__,__FILE__);
+
+  /* a coarse cell is blocked if any of the cells it covers is, so thin walls stay */
+  for(ii=0;ii<params.ny;ii++) {
+    for(jj=0;jj<params.nx;jj++) {
+      if (obstacles[ii*params.nx + jj]) coarse_obstacles[(ii/factor)*coarse.nx + jj/factor] = 1;
+    }
+  }
+  for(ii=0;ii<coarse.ny*coarse.nx;ii++) {
+    for(kk=0;kk<NSPEEDS;kk++) {
+      STORE(coarse_cells[ii],kk, params.rest[kk]);
+    }
+  }
+
+  /* run the coarse grid until it is steady, with the same tolerance and
+  ** window but no samples of the field, or for a fraction of maxIters */
+  coarse_steady = *steady;
+  coarse_steady.history = coarse_steady.last_u = NULL;
+  coarse_steady.l2_stride = 0;
+  if (lbm_steady_init(&coarse_steady, 0) != 0)
+    die("cannot allocate memory for the warm start",__LINE__,__FILE__);
+  for (iters=0;iters<params.maxIters / WARM_FRACTION;) {
+    timestep(coarse,coarse_cells,coarse_tmp,coarse_obstacles);
+    iters++;
+    if (coarse_steady.history != NULL) {
+      lbm_steady_add(&coarse_steady, av_velocity(coarse,coarse_cells,coarse_obstacles));
+      if (lbm_steady_converged(&coarse_steady)) break;
+    }
+  }
+  av_velocity_fields(coarse,coarse_cells,coarse_obstacles,u_x,u_y,pressure);
+
+  /* each open cell starts from the equilibrium of the coarse flow,
+  ** interpolated bilinearly between the centres of the coarse cells
+  ** around it, across the periodic boundaries; blocked cells start
+  ** at rest */
+#pragma omp parallel for private(jj, kk, i0, i1, j0, j1, y, x, fy, fx, local_density, ux, uy, u_sq, cu)
+  for(ii=0;ii<params.ny;ii++) {
+    y = (ii + 0.5f) / factor - 0.5f;
+    i0 = (int)floorf(y);
+    fy = y - i0;
+    i1 = (i0 + 1) % coarse.ny;
+    i0 = (i0 + coarse.ny) % coarse.ny;
+    /* half a grid ends at lines of mirror symmetry, not wrapping round */
+    if (params.mirror_row >= 0 && y < 0.0f) i0 = 0;
+    if (params.mirror_row >= 0 && y > coarse.ny - 1) i1 = coarse.ny - 1;
+    for(jj=0;jj<params.nx;jj++) {
+      if (obstacles[ii*params.nx + jj]) {
+        for(kk=0;kk<NSPEEDS;kk++) {
+          STORE(cells[ii*params.nx + jj],kk, params.rest[kk]);
+        }
+        continue;
+      }
+      x = (jj + 0.5f) / factor - 0.5f;
+      j0 = (int)floorf(x);
+      fx = x - j0;
+      j1 = (j0 + 1) % coarse.nx;
+      j0 = (j0 + coarse.nx) % coarse.nx;
+#define BILINEAR(field) ((1.0f - fy) * ((1.0f - fx) * field[i0*coarse.nx + j0] + fx * field[i0*coarse.nx + j1]) + \
+                         fy * ((1.0f - fx) * field[i1*coarse.nx + j0] + fx * field[i1*coarse.nx + j1]))
+      local_density = BILINEAR(pressure) / c_sq;
+      ux = BILINEAR(u_x);
+      uy = BILINEAR(u_y);
+#undef BILINEAR
+      u_sq = ux * ux + uy * uy;
+      for(kk=0;kk<NSPEEDS;kk++) {
+        cu = cx[kk] * ux + cy[kk] * uy;
+        STORE(cells[ii*params.nx + jj],kk, w[kk] * local_density
+              * (1.0f + cu / c_sq + (cu * cu) / (2.0f * c_sq * c_sq) - u_sq / (2.0f * c_sq)));
+      }
+    }
+  }
+
+  lbm_steady_free(&coarse_steady);
+  free(coarse_cells);
+  free(coarse_tmp);
+  free(coarse_obstacles);
+  free(u_x);
+  free(u_y);
+  free(pressure);
+
+  return iters;
 }
 
 void die(const char* message, const int line, const char *file)
@@ -641,6 +2723,10 @@ void die(const char* message, const int line, const char *file)
 
 void usage(const char* exe)
 {
-  fprintf(stderr, "Usage: %s <paramfile> <obstaclefile>\n", exe);
+  fprintf(stderr, "Usage: %s <paramfile> <obstaclefile> [--binary] [--snapshot <iters>]"
+          " [--checkpoint <iters>] [--restart <checkpointfile> | --warm-start <factor>]"
+          " [--no-mirror] [--tiles <rows> | --steal <rows>] [--timeline <iters>]"
+          " [--threads <n> | auto] [--tune] [--tuning <file> | --calibration <file>]"
+          " [--jit <dir>]\n", exe);
   exit(EXIT_FAILURE);
 }
@@ -45,6 +45,21 @@
 **
 **   d2q9-bgk.exe input.params obstacles.dat
 **
+** The obstacle file may also be in the binary format of lbm_io.h,
+** which is recognised by its header. Passing --binary writes the
+** final state in binary to final_state.bin instead of as text.
+**
+** The average velocities are summed row by row in a fixed order (see
+** lbm_reduce.h): the master gathers the sums of the rows of every
+** rank, so av_vels.dat comes out the same for any number of ranks and
+** threads. make COMPENSATED=1 also compensates the sums.
+**
+** Optional lines at the end of the parameter file stop the run once
+** the flow is steady (see lbm_steady.h): the master decides from its
+** av. velocities, and the sums of a sample of the field over every
+** rank, and tells the others. The outputs are then written for the
+** timesteps run, and the timestep it stopped at is reported.
+**
 ** Be sure to adjust the grid dimensions in the parameter file
 ** if you choose a different obstacle file.
 */
@@ -54,12 +69,17 @@
 #include<time.h>
 #include<sys/time.h>
 #include<sys/resource.h>
+#include<string.h>
 #include "mpi.h"
+#include "lbm_io.h"
+#include "lbm_reduce.h"
+#include "lbm_steady.h"
 
 #define MASTER 0
 #define NUMPARAMS 7
 #define NSPEEDS         9
 #define FINALSTATEFILE  "final_state.dat"
+#define FINALSTATEBIN   "final_state.bin"
 #define AVVELSFILE      "av_vels.dat"
 
 /* struct to hold the parameter values */
@@ -87,7 +107,8 @@ enum boolean { FALSE, TRUE };
 /* load params, allocate memory, load obstacles & initialise fluid particle densities */
 int initialise(const char* paramfile, const char* obstaclefile,
                t_param* params, t_speed** cells_ptr, t_speed** tmp_cells_ptr,
-               int** obstacles_ptr, float** av_vels_ptr, int size, int rank, int* distribution);
+               int** obstacles_ptr, float** av_vels_ptr, int size, int rank, int* distribution,
+               lbm_steady* steady);
 
 /* 
 ** The main calculation methods.
@@ -99,7 +120,7 @@ int accelerate_flow(const t_param params, t_speed* cells, const int* obstacles);
 int synchronise(const t_param params, t_speed* cells, const int size, const int rank, const MPI_Datatype cells_type, MPI_Request* req0, MPI_Request* req1, MPI_Request* req2, MPI_Request* req3);
 int propagate(const t_param params, const t_speed* cells, t_speed* tmp_cells, MPI_Request* req0, MPI_Request* req1, MPI_Request* req2, MPI_Request* req3);
 int rebound_or_collision(const t_param params, t_speed* cells, const t_speed* tmp_cells, const int* obstacles);
-int write_values(const t_param params, const t_speed* cells, int* obstacles, const float* av_vels, const int size, const int rank, const int distribution);
+int write_values(const t_param params, const t_speed* cells, int* obstacles, const float* av_vels, const int size, const int rank, const int distribution, const int binary);
 
 /* finalise, including freeing up allocated memory */
 int finalise(const t_param* params, t_speed** cells_ptr, t_speed** tmp_cells_ptr,
@@ -109,11 +130,14 @@ int finalise(const t_param* params, t_speed** cells_ptr, t_speed** tmp_cells_ptr
 ** The total should remain constant from one timestep to the next. */
 float total_density(const t_param params, const t_speed* cells);
 
+/* compute the velocity of every cell in the rows of this rank */
+void velocity_field(const t_param params, const t_speed* cells, const int* obstacles, float* u_x, float* u_y);
+
 /* compute average velocity */
-float av_velocity(const t_param params, const t_speed* cells, const int* obstacles, const int size, const int rank);
+float av_velocity(const t_param params, const t_speed* cells, const int* obstacles, const int size, const int rank, const int distribution);
 
 /* calculate Reynolds number */
-float calc_reynolds(const t_param params, const t_speed* cells, const int* obstacles, const int size, const int rank);
+float calc_reynolds(const t_param params, const t_speed* cells, const int* obstacles, const int size, const int rank, const int distribution);
 
 /* utility functions */
 void die(const char* message, const int line, const char *file);
@@ -145,21 +169,38 @@ int main(int argc, char* argv[])
   MPI_Datatype types_cells[1];
   int block_length_cells[1];
   int distribution;
+  int binary = FALSE;         /* write the final state in binary */
+  lbm_steady steady;          /* detection of a steady state */
+  int converged = FALSE;      /* TRUE once the master finds the flow steady */
+  int iterations;             /* timesteps run */
+  double sums[2];             /* sums of squares of a sample of the field */
+  float* u_x = NULL;          /* the field of this rank, when sampled */
+  float* u_y = NULL;
 
   /* parse the command line */
-  if(argc != 3) {
+  if(argc < 3) {
     usage(argv[0]);
   }
   else{
     paramfile = argv[1];
     obstaclefile = argv[2];
   }
+  for (ii = 3; ii < argc; ii++) {
+    if (!strcmp(argv[ii], "--binary")) binary = TRUE;
+    else usage(argv[0]);
+  }
   MPI_Init(&argc, &argv);
   MPI_Comm_size(MPI_COMM_WORLD, &size);
   MPI_Comm_rank(MPI_COMM_WORLD, &rank);
 
   /* initialise our data structures and load values from file */
-  initialise(paramfile, obstaclefile, &params, &cells, &tmp_cells, &obstacles, &av_vels, size, rank, &distribution);
+  initialise(paramfile, obstaclefile, &params, &cells, &tmp_cells, &obstacles, &av_vels, size, rank, &distribution, &steady);
+  if (steady.l2_stride && steady.tolerance > 0.0f) {
+      u_x = (float*)malloc(sizeof(float) * params.ny * params.nx);
+      u_y = (float*)malloc(sizeof(float) * params.ny * params.nx);
+      if (u_x == NULL || u_y == NULL)
+          die("cannot allocate memory for steady state detection",__LINE__,__FILE__);
+  }
 
   if (rank == MASTER) {
       /* iterate for maxIters timesteps */
@@ -173,11 +214,31 @@ int main(int argc, char* argv[])
   MPI_Type_create_struct(1, block_length_cells, displacements_cells, types_cells, &cells_type);
   MPI_Type_commit(&cells_type);
 
+  iterations = params.maxIters;
   for (ii=0;ii<params.maxIters;ii++) {
     timestep(params,cells,tmp_cells,obstacles, size, rank, cells_type);
     
-    tmp_av_vels = av_velocity(params,cells,obstacles, size, rank);
+    tmp_av_vels = av_velocity(params,cells,obstacles, size, rank, distribution);
     if (rank == MASTER) av_vels[ii] = tmp_av_vels;
+    if (steady.tolerance > 0.0f) {
+        if (lbm_steady_sample_due(&steady, ii + 1)) {
+            sums[0] = sums[1] = 0.0;
+            velocity_field(params,cells,obstacles,u_x,u_y);
+            lbm_steady_field_sums(&steady, u_x, u_y, sums);
+            if (size > 1)
+                MPI_Reduce((rank == MASTER) ? MPI_IN_PLACE : sums, sums, 2, MPI_DOUBLE, MPI_SUM, MASTER, MPI_COMM_WORLD);
+            lbm_steady_sampled(&steady, sums);
+        }
+        if (rank == MASTER) {
+            lbm_steady_add(&steady, tmp_av_vels);
+            converged = lbm_steady_converged(&steady);
+        }
+        if (size > 1) MPI_Bcast(&converged, 1, MPI_INT, MASTER, MPI_COMM_WORLD);
+        if (converged) {
+            iterations = ii + 1;
+            break;
+        }
+    }
 #ifdef DEBUG
     float density = total_density(params,cells);
     if (rank == MASTER) {
@@ -197,17 +258,23 @@ int main(int argc, char* argv[])
       timstr=ru.ru_stime;        
       systim=timstr.tv_sec+(timstr.tv_usec/1000000.0);
   }
-  float reynolds = calc_reynolds(params,cells,obstacles, size, rank);
+  float reynolds = calc_reynolds(params,cells,obstacles, size, rank, distribution);
   if (rank == MASTER) {
       /* write final values and free memory */
       printf("==done==\n");
+      if (iterations < params.maxIters) printf("Steady state after:\t\t%d timesteps\n", iterations);
       printf("Reynolds number:\t\t%.12E\n",reynolds);
       printf("Elapsed time:\t\t\t%.6lf (s)\n", toc-tic);
       printf("Elapsed user CPU time:\t\t%.6lf (s)\n", usrtim);
       printf("Elapsed system CPU time:\t%.6lf (s)\n", systim);
   }
-  write_values(params,cells,obstacles,av_vels,size,rank,distribution);
+  /* the outputs cover the timesteps run */
+  params.maxIters = iterations;
+  write_values(params,cells,obstacles,av_vels,size,rank,distribution,binary);
   finalise(&params, &cells, &tmp_cells, &obstacles, &av_vels);
+  lbm_steady_free(&steady);
+  free(u_x);
+  free(u_y);
   
   MPI_Finalize();
   
@@ -422,17 +489,20 @@ int rebound_or_collision(const t_param params, t_speed* cells, const t_speed* tm
 
 int initialise(const char* paramfile, const char* obstaclefile,
                t_param* params, t_speed** cells_ptr, t_speed** tmp_cells_ptr,
-               int** obstacles_ptr, float** av_vels_ptr, int size, int rank, int* distribution)
+               int** obstacles_ptr, float** av_vels_ptr, int size, int rank, int* distribution,
+               lbm_steady* steady)
 {
   char   message[1024];  /* message buffer */
   FILE   *fp;            /* file pointer */
   int    ii,jj;          /* generic counters */
-  int    xx,yy;          /* generic array indices */
-  int    blocked;        /* indicates whether a cell is blocked by an obstacle */ 
+  long   line;           /* line no. of an error in the obstacle file */
   int    retval;         /* to hold return value for checking */
+  const char* what;      /* optional parameter that could not be read */
   float w0,w1,w2;       /* weighting factors */
   MPI_Aint base_addr, addr;
-  int remainder = 0;
+  int* all_obstacles = NULL;  /* the whole obstacle map, on the master */
+  int* send_cnts = NULL;
+  int* send_disp = NULL;
 
   if (rank == MASTER) {
       /* open the parameter file */
@@ -457,6 +527,10 @@ int initialise(const char* paramfile, const char* obstaclefile,
       if(retval != 1) die ("could not read param file: accel",__LINE__,__FILE__);
       retval = fscanf(fp,"%f\n",&(params->omega));
       if(retval != 1) die ("could not read param file: omega",__LINE__,__FILE__);
+      if (lbm_steady_read(fp, steady, &what) != 0) {
+        sprintf(message,"could not read param file: %s", what);
+        die(message,__LINE__,__FILE__);
+      }
     
       /* and close up the file */
       fclose(fp);
@@ -512,8 +586,7 @@ int initialise(const char* paramfile, const char* obstaclefile,
       MPI_Bcast(&send_params, 1, params_type, MASTER, MPI_COMM_WORLD);
       
       if (rank == MASTER) {
-          remainder = params->ny % size;
-          params->ny = send_params.ny + remainder;
+          params->ny = send_params.ny + params->ny % size;
       } else {
           params->nx = send_params.nx;
           params->ny = send_params.ny;
@@ -527,6 +600,14 @@ int initialise(const char* paramfile, const char* obstaclefile,
       MPI_Type_free(&params_type);
   }
 
+  /* the steady state settings, for every rank */
+  if (rank != MASTER) memset(steady, 0, sizeof(*steady));
+  MPI_Bcast(&steady->tolerance, 1, MPI_FLOAT, MASTER, MPI_COMM_WORLD);
+  MPI_Bcast(&steady->window, 1, MPI_INT, MASTER, MPI_COMM_WORLD);
+  MPI_Bcast(&steady->l2_stride, 1, MPI_INT, MASTER, MPI_COMM_WORLD);
+  if (lbm_steady_init(steady, params->ny*params->nx) != 0)
+    die("cannot allocate memory for steady state detection",__LINE__,__FILE__);
+
   /* 
   ** Allocate memory.
   **
@@ -584,87 +665,51 @@ int initialise(const char* paramfile, const char* obstaclefile,
     }
   }
 
-  /* first set all cells in obstacle array to zero */ 
-#pragma omp parallel for shared(obstacles_ptr) private(jj) firstprivate(params)
-  for(ii=0;ii<params->ny;ii++) {
-    for(jj=0;jj<params->nx;jj++) {
-      (*obstacles_ptr)[ii*params->nx + jj] = 0;
-    }
-  }
-  
-  MPI_Aint displacements_obstacles[3];
-  MPI_Datatype types_obstacles[3];
-  MPI_Datatype obstacles_type;
-  int block_lengths_obstacles[3];
-
-  MPI_Address(&xx, &base_addr);
-  displacements_obstacles[0] = 0;
-  types_obstacles[0] = MPI_INT;
-  block_lengths_obstacles[0] = 1;
-  MPI_Address(&yy, &addr);
-  displacements_obstacles[1] = addr - base_addr;
-  types_obstacles[1] = MPI_INT;
-  block_lengths_obstacles[1] = 1;
-  MPI_Address(&blocked, &addr);
-  displacements_obstacles[2] = addr - base_addr;
-  types_obstacles[2] = MPI_INT;
-  block_lengths_obstacles[2] = 1;
-  MPI_Type_create_struct(3, block_lengths_obstacles, displacements_obstacles, types_obstacles, &obstacles_type);
-  MPI_Type_commit(&obstacles_type);
-
+  /* the master loads the whole obstacle map, from either format,
+  ** and scatters the bands of rows to their ranks */
   if (rank == MASTER) {
-      /* open the obstacle data file */
-      fp = fopen(obstaclefile,"r");
-      if (fp == NULL) {
-          sprintf(message,"could not open input obstacles file: %s", obstaclefile);
-          die(message,__LINE__,__FILE__);
-      }
-
-      /* read-in the blocked cells list */
-      while( (retval = fscanf(fp,"%d %d %d\n", &xx, &yy, &blocked)) != EOF) {
-        /* some checks */
-          if ( retval != 3)
-              die("expected 3 values per line in obstacle file",__LINE__,__FILE__);
-          if ( xx<0 || xx>params->nx-1 )
-              die("obstacle x-coord out of range",__LINE__,__FILE__);
-          if ( blocked != 1 ) 
-              die("obstacle blocked value should be 1",__LINE__,__FILE__);
-          if (yy > params->ny - 1) {
-              int dest = (yy - remainder) / (*distribution);
-              yy = (yy - remainder) % (*distribution);
-              MPI_Send(&xx, 1, obstacles_type, dest, 0, MPI_COMM_WORLD);
-          } else {
-              if ( yy<0 )
-                  die("obstacle y-coord out of range",__LINE__,__FILE__);
-              /* assign to array */
-              (*obstacles_ptr)[yy*params->nx + xx] = blocked;
+      const int all_rows = (size > 1) ? params->ny + (size - 1) * (*distribution) : params->ny;
+      all_obstacles = (int*)malloc(sizeof(int) * all_rows * params->nx);
+      send_cnts = (int*)malloc(size * sizeof(int));
+      send_disp = (int*)malloc(size * sizeof(int));
+      if (all_obstacles == NULL || send_cnts == NULL || send_disp == NULL)
+          die("cannot allocate memory for obstacles",__LINE__,__FILE__);
+      if (lbm_is_binary(obstaclefile)) {
+          retval = lbm_read_obstacles(obstaclefile, params->nx, all_rows, 0, all_rows, all_obstacles, NULL);
+          if (retval != LBM_OK) die(lbm_strerror(retval),__LINE__,__FILE__);
+      } else {
+          /* read-in the blocked cells list */
+          retval = lbm_parse_obstacles(obstaclefile, params->nx, all_rows, all_obstacles, NULL, &line);
+          if (retval == LBM_EOPEN) {
+              sprintf(message,"could not open input obstacles file: %s", obstaclefile);
+              die(message,__LINE__,__FILE__);
+          }
+          if (retval != LBM_OK) {
+              sprintf(message,"%s (line %ld of %s)", lbm_strerror(retval), line, obstaclefile);
+              die(message,__LINE__,__FILE__);
           }
       }
-
-      /* and close the file */
-      fclose(fp);
-      xx = -1;
+      /* the master holds the first rows, including the remainder */
+      send_cnts[0] = params->ny * params->nx;
+      send_disp[0] = 0;
       for (ii = 1; ii < size; ii++) {
-          MPI_Send(&xx, 1, obstacles_type, ii, 0, MPI_COMM_WORLD);
+          send_cnts[ii] = (*distribution) * params->nx;
+          send_disp[ii] = send_disp[ii - 1] + send_cnts[ii - 1];
       }
+  }
+  MPI_Scatterv(all_obstacles, send_cnts, send_disp, MPI_INT,
+               *obstacles_ptr, params->ny * params->nx, MPI_INT, MASTER, MPI_COMM_WORLD);
+  free(all_obstacles);
+  free(send_cnts);
+  free(send_disp);
 
+  if (rank == MASTER) {
       /* 
       ** allocate space to hold a record of the avarage velocities computed 
       ** at each timestep
       */
       *av_vels_ptr = (float*)malloc(sizeof(float)*params->maxIters);
-  } else {
-      MPI_Status status;
-      MPI_Recv(&xx, 1, obstacles_type, MASTER, 0, MPI_COMM_WORLD, &status);
-      while (xx != -1) {
-          if ( yy<0 || yy>params->ny-1 )
-              die("obstacle y-coord out of range",__LINE__,__FILE__);
-          /* assign to array */
-          (*obstacles_ptr)[yy*params->nx + xx] = blocked;
-          MPI_Recv(&xx, 1, obstacles_type, MASTER, 0, MPI_COMM_WORLD, &status);
-      }
   }
-  MPI_Type_free(&obstacles_type);
 
   return EXIT_SUCCESS;
 }
@@ -690,36 +735,39 @@ int finalise(const t_param* params, t_speed** cells_ptr, t_speed** tmp_cells_ptr
   return EXIT_SUCCESS;
 }
 
-float av_velocity(const t_param params, const t_speed* cells, const int* obstacles, const int size, const int rank)
+float av_velocity(const t_param params, const t_speed* cells, const int* obstacles, const int size, const int rank, const int distribution)
 {
   int    ii,jj,kk;       /* generic counters */
   int    tot_cells, tmp_cells = 0;  /* no. of cells used in calculation */
   float local_density;  /* total density in cell */
-  float tot_u_x, tmp_u_x;        /* accumulated x-components of velocity */
-  MPI_Status status;
-  MPI_Datatype av_vel_type;
-  MPI_Datatype types_av_vel[2];
-  MPI_Aint base_addr, addr;
-  MPI_Aint displacements_av_vel[2];
-  int block_lengths_av_vel[2];
-
-  MPI_Address(&tmp_u_x, &base_addr);
-  displacements_av_vel[0] = 0;
-  block_lengths_av_vel[0] = 1;
-  types_av_vel[0] = MPI_FLOAT;
-  MPI_Address(&tmp_cells, &addr);
-  displacements_av_vel[1] = addr - base_addr;
-  block_lengths_av_vel[1] = 1;
-  types_av_vel[1] = MPI_INT;
-  MPI_Type_create_struct(2, block_lengths_av_vel, displacements_av_vel, types_av_vel, &av_vel_type);
-  MPI_Type_commit(&av_vel_type);
-
-  /* initialise */
-  tmp_u_x = 0.0;
+  lbm_sum tmp_u_x;      /* accumulated x-components of velocity in a row */
+  lbm_sum* rows;        /* the sums of the rows, of every rank on the master */
+  int    all_rows = params.ny;    /* no. of rows in rows */
+  int*   recv_cnts = NULL;        /* floats of row sums from each rank */
+  int*   recv_disp = NULL;        /* where they go in rows */
+  float  av_u_x = 0;    /* average x-component of velocity */
+
+  /* the master holds the first rows, and the rest have distribution each */
+  if (rank == MASTER && size > 1) {
+      all_rows = params.ny + (size - 1) * distribution;
+      recv_cnts = (int*)malloc(size * sizeof(int));
+      recv_disp = (int*)malloc(size * sizeof(int));
+      if (recv_cnts == NULL || recv_disp == NULL)
+          die("cannot allocate memory for row sums",__LINE__,__FILE__);
+      recv_cnts[0] = 2 * params.ny;
+      recv_disp[0] = 0;
+      for (ii = 1; ii < size; ii++) {
+          recv_cnts[ii] = 2 * distribution;
+          recv_disp[ii] = recv_disp[ii - 1] + recv_cnts[ii - 1];
+      }
+  }
+  rows = (lbm_sum*)malloc(sizeof(lbm_sum) * all_rows);
+  if (rows == NULL) die("cannot allocate memory for row sums",__LINE__,__FILE__);
 
   /* loop over all non-blocked cells */
-#pragma omp parallel for reduction(+:tmp_u_x, tmp_cells) firstprivate(cells, obstacles) private(jj, kk, local_density)
+#pragma omp parallel for reduction(+:tmp_cells) firstprivate(cells, obstacles) private(jj, kk, local_density, tmp_u_x)
   for(ii=1;ii<=params.ny;ii++) {
+    tmp_u_x = lbm_sum_zero();
     for(jj=0;jj<params.nx;jj++) {
       /* ignore occupied cells */
       if(!obstacles[(ii - 1)*params.nx + jj]) {
@@ -729,40 +777,83 @@ float av_velocity(const t_param params, const t_speed* cells, const int* obstacl
           local_density += cells[ii*params.nx + jj].speeds[kk];
         }
         /* x-component of velocity */
-        tmp_u_x += (cells[ii*params.nx + jj].speeds[1] +
+        lbm_sum_add(&tmp_u_x, (cells[ii*params.nx + jj].speeds[1] +
                     cells[ii*params.nx + jj].speeds[5] +
                     cells[ii*params.nx + jj].speeds[8]
                     - (cells[ii*params.nx + jj].speeds[3] +
                        cells[ii*params.nx + jj].speeds[6] +
                        cells[ii*params.nx + jj].speeds[7])) /
-          local_density;
+          local_density);
         /* increase counter of inspected cells */
         ++tmp_cells;
       }
     }
+    rows[ii - 1] = tmp_u_x;
   }
-  if (rank == MASTER) {
-      tot_u_x = tmp_u_x;
+
+  /* the master adds up the rows of every rank, in the same tree whatever
+  ** their number; the counts of cells are integers, so any order will do */
+  if (size > 1) {
+      MPI_Gatherv((rank == MASTER) ? MPI_IN_PLACE : rows, 2 * params.ny, MPI_FLOAT,
+                  rows, recv_cnts, recv_disp, MPI_FLOAT, MASTER, MPI_COMM_WORLD);
+      MPI_Reduce(&tmp_cells, &tot_cells, 1, MPI_INT, MPI_SUM, MASTER, MPI_COMM_WORLD);
+  } else {
       tot_cells = tmp_cells;
-      for (ii = 1; ii < size; ii++) {
-          MPI_Recv(&tmp_u_x, 1, av_vel_type, ii, 0, MPI_COMM_WORLD, &status);
-          tot_u_x += tmp_u_x;
-          tot_cells += tmp_cells;
+  }
+  if (rank == MASTER) {
+      av_u_x = lbm_sum_rows(rows, all_rows) / (float)tot_cells;
+  }
+  free(rows);
+  free(recv_cnts);
+  free(recv_disp);
+
+  return av_u_x;
+}
+
+void velocity_field(const t_param params, const t_speed* cells, const int* obstacles, float* u_x, float* u_y)
+{
+  int    ii,jj,kk;       /* generic counters */
+  float local_density;  /* total density in cell */
+
+#pragma omp parallel for firstprivate(cells, obstacles) private(jj, kk, local_density)
+  for(ii=1;ii<=params.ny;ii++) {
+    for(jj=0;jj<params.nx;jj++) {
+      /* an occupied cell */
+      if(obstacles[(ii - 1)*params.nx + jj]) {
+        u_x[(ii - 1)*params.nx + jj] = u_y[(ii - 1)*params.nx + jj] = 0.0;
       }
-      MPI_Type_free(&av_vel_type);
-      return tot_u_x / (float)tot_cells;
-  } else {
-      MPI_Send(&tmp_u_x, 1, av_vel_type, MASTER, 0, MPI_COMM_WORLD);
-      MPI_Type_free(&av_vel_type);
-      return 0;
+      /* no obstacle */
+      else {
+        local_density = 0.0;
+        for(kk=0;kk<NSPEEDS;kk++) {
+          local_density += cells[ii*params.nx + jj].speeds[kk];
+        }
+        /* compute x velocity component */
+        u_x[(ii - 1)*params.nx + jj] = (cells[ii*params.nx + jj].speeds[1] +
+               cells[ii*params.nx + jj].speeds[5] +
+               cells[ii*params.nx + jj].speeds[8]
+               - (cells[ii*params.nx + jj].speeds[3] +
+                  cells[ii*params.nx + jj].speeds[6] +
+                  cells[ii*params.nx + jj].speeds[7]))
+          / local_density;
+        /* compute y velocity component */
+        u_y[(ii - 1)*params.nx + jj] = (cells[ii*params.nx + jj].speeds[2] +
+               cells[ii*params.nx + jj].speeds[5] +
+               cells[ii*params.nx + jj].speeds[6]
+               - (cells[ii*params.nx + jj].speeds[4] +
+                  cells[ii*params.nx + jj].speeds[7] +
+                  cells[ii*params.nx + jj].speeds[8]))
+          / local_density;
+      }
+    }
   }
 }
 
-float calc_reynolds(const t_param params, const t_speed* cells, const int* obstacles, const int size, const int rank)
+float calc_reynolds(const t_param params, const t_speed* cells, const int* obstacles, const int size, const int rank, const int distribution)
 {
   const float viscosity = 1.0 / 6.0 * (2.0 / params.omega - 1.0);
   
-  return av_velocity(params,cells,obstacles, size, rank) * params.reynolds_dim / viscosity;
+  return av_velocity(params,cells,obstacles, size, rank, distribution) * params.reynolds_dim / viscosity;
 }
 
 float total_density(const t_param params, const t_speed* cells)
@@ -782,7 +873,7 @@ float total_density(const t_param params, const t_speed* cells)
   return total;
 }
 
-int write_values(const t_param params, const t_speed* cells, int* obstacles, const float* av_vels, const int size, const int rank, const int distribution)
+int write_values(const t_param params, const t_speed* cells, int* obstacles, const float* av_vels, const int size, const int rank, const int distribution, const int binary)
 {
   FILE* fp = NULL;                     /* file pointer */
   int ii,jj,kk;                 /* generic counters */
@@ -863,11 +954,17 @@ int write_values(const t_param params, const t_speed* cells, int* obstacles, con
   MPI_Gatherv(obstacles, send_cells, MPI_INT, recv_obstacles, recv_cnts, recv_disp, MPI_INT, MASTER, MPI_COMM_WORLD);
 
   if (rank == MASTER) {
-      fp = fopen(FINALSTATEFILE, "w");
-      for (ii = 0; ii < recv_cells; ii++) {
-          fprintf(fp,"%d %d %.12E %.12E %.12E %d\n",ii / params.nx,ii % params.nx,recv_u_x[ii],recv_u_y[ii],recv_pressure[ii],recv_obstacles[ii]);
+      if (binary) {
+          int retval = lbm_write_state(FINALSTATEBIN, params.nx, recv_cells / params.nx,
+                                       recv_u_x, recv_u_y, recv_pressure, recv_obstacles);
+          if (retval != LBM_OK) die(lbm_strerror(retval),__LINE__,__FILE__);
+      } else {
+          fp = fopen(FINALSTATEFILE, "w");
+          for (ii = 0; ii < recv_cells; ii++) {
+              fprintf(fp,"%d %d %.12E %.12E %.12E %d\n",ii / params.nx,ii % params.nx,recv_u_x[ii],recv_u_y[ii],recv_pressure[ii],recv_obstacles[ii]);
+          }
+          fclose(fp);
       }
-      fclose(fp);
       fp = fopen(AVVELSFILE,"w");
       if (fp == NULL) {
         die("could not open file output file",__LINE__,__FILE__);
@@ -892,6 +989,6 @@ void die(const char* message, const int line, const char *file)
 
 void usage(const char* exe)
 {
-  fprintf(stderr, "Usage: %s <paramfile> <obstaclefile>\n", exe);
+  fprintf(stderr, "Usage: %s <paramfile> <obstaclefile> [--binary]\n", exe);
   exit(EXIT_FAILURE);
 }
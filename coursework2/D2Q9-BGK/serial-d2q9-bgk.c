@@ -54,6 +54,7 @@
 #include<time.h>
 #include<sys/time.h>
 #include<sys/resource.h>
+#include"lbm_io.h"
 
 #define NSPEEDS         9
 #define FINALSTATEFILE  "final_state.dat"
@@ -366,8 +367,7 @@ int initialise(const char* paramfile, const char* obstaclefile,
   char   message[1024];  /* message buffer */
   FILE   *fp;            /* file pointer */
   int    ii,jj;          /* generic counters */
-  int    xx,yy;          /* generic array indices */
-  int    blocked;        /* indicates whether a cell is blocked by an obstacle */ 
+  long   line;           /* line no. of an error in the obstacle file */
   int    retval;         /* to hold return value for checking */
   float w0,w1,w2;       /* weighting factors */
 
@@ -453,37 +453,16 @@ int initialise(const char* paramfile, const char* obstaclefile,
     }
   }
 
-  /* first set all cells in obstacle array to zero */ 
-  for(ii=0;ii<params->ny;ii++) {
-    for(jj=0;jj<params->nx;jj++) {
-      (*obstacles_ptr)[ii*params->nx + jj] = 0;
-    }
-  }
-
-  /* open the obstacle data file */
-  fp = fopen(obstaclefile,"r");
-  if (fp == NULL) {
+  /* read-in the blocked cells list */
+  retval = lbm_parse_obstacles(obstaclefile, params->nx, params->ny, *obstacles_ptr, NULL, &line);
+  if (retval == LBM_EOPEN) {
     sprintf(message,"could not open input obstacles file: %s", obstaclefile);
     die(message,__LINE__,__FILE__);
   }
-
-  /* read-in the blocked cells list */
-  while( (retval = fscanf(fp,"%d %d %d\n", &xx, &yy, &blocked)) != EOF) {
-    /* some checks */
-    if ( retval != 3)
-      die("expected 3 values per line in obstacle file",__LINE__,__FILE__);
-    if ( xx<0 || xx>params->nx-1 )
-      die("obstacle x-coord out of range",__LINE__,__FILE__);
-    if ( yy<0 || yy>params->ny-1 )
-      die("obstacle y-coord out of range",__LINE__,__FILE__);
-    if ( blocked != 1 ) 
-      die("obstacle blocked value should be 1",__LINE__,__FILE__);
-    /* assign to array */
-    (*obstacles_ptr)[yy*params->nx + xx] = blocked;
+  if (retval != LBM_OK) {
+    sprintf(message,"%s (line %ld of %s)", lbm_strerror(retval), line, obstaclefile);
+    die(message,__LINE__,__FILE__);
   }
-  
-  /* and close the file */
-  fclose(fp);
 
   /* 
   ** allocate space to hold a record of the avarage velocities computed 
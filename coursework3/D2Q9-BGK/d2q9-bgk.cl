@@ -1,9 +1,68 @@
 
 #define NSPEEDS         9
 
+/*
+** The host may fix the grid size and the parameters at build time
+** (-D NX=... -D NY=... -D OMEGA=... -D ACCEL_W1=... -D ACCEL_W2=...),
+** so that the index arithmetic and the constants can be folded by the
+** compiler. Without them the kernels take the grid size from the
+** NDRange and the parameters from their arguments.
+*/
+#if defined(NX) && defined(NY)
+#define GRID_NX NX
+#define GRID_NY NY
+#else
+#define GRID_NX ((int)get_global_size(1))
+#define GRID_NY ((int)get_global_size(0))
+#endif
+
+#ifdef OMEGA
+#define RELAX OMEGA
+#else
+#define RELAX omega
+#endif
+
+/*
+** The host may store the 'speeds' in 16 bits (-D LBM_STORAGE_FP16 or
+** -D LBM_STORAGE_BF16, as in lbm_half.h): they are read into float
+** with vload_half, or by shifting a bfloat16 into the top of a float,
+** and rounded back to nearest even as they are stored. They only move
+** in the propagate step, so they are copied there as they are stored.
+** With -D LBM_STORAGE_DEVIATION the 16 bits hold the difference from
+** the fluid at rest, -D REST_W0, REST_W1 and REST_W2 for the centre,
+** axis and diagonal 'speeds'.
+*/
+#if defined(LBM_STORAGE_FP16)
+typedef ushort t_store;
+inline float widen(const ushort bits) { return vload_half(0, (const half*)&bits); }
+inline ushort narrow(const float value) { ushort bits; vstore_half_rte(value, 0, (half*)&bits); return bits; }
+#elif defined(LBM_STORAGE_BF16)
+typedef ushort t_store;
+inline float widen(const ushort bits) { return as_float((uint)bits << 16); }
+inline ushort narrow(const float value)
+{
+  const uint bits = as_uint(value);
+  if ((bits & 0x7fffffff) > 0x7f800000) return (bits >> 16) | 0x40;  /* keep a nan a nan */
+  return (bits + 0x7fff + ((bits >> 16) & 1)) >> 16;
+}
+#else
+typedef float t_store;
+#define widen(value)  (value)
+#define narrow(value) (value)
+#endif
+
+#ifdef LBM_STORAGE_DEVIATION
+#define REST(kk)  ((kk) == 0 ? REST_W0 : (kk) < 5 ? REST_W1 : REST_W2)
+#define LOAD(cell,kk)        (widen((cell).speeds[kk]) + REST(kk))
+#define STORE(cell,kk,value) ((cell).speeds[kk] = narrow((value) - REST(kk)))
+#else
+#define LOAD(cell,kk)        widen((cell).speeds[kk])
+#define STORE(cell,kk,value) ((cell).speeds[kk] = narrow(value))
+#endif
+
 /* struct to hold the 'speed' values */
 typedef struct {
-  float speeds[NSPEEDS];
+  t_store speeds[NSPEEDS];
 } t_speed;
 
 __kernel void accelerate_flow_and_propagate(const float density, const float accel, __global t_speed *cells, __global t_speed *tmp_cells, __global int *obstacles)
@@ -14,12 +73,17 @@ __kernel void accelerate_flow_and_propagate(const float density, const float acc
   t_speed cell;
   ii = get_global_id(0);
   jj = get_global_id(1);
-  ny = get_global_size(0);
-  nx = get_global_size(1);
+  ny = GRID_NY;
+  nx = GRID_NX;
   
   /* compute weighting factors */
+#if defined(ACCEL_W1) && defined(ACCEL_W2)
+  w1 = ACCEL_W1;
+  w2 = ACCEL_W2;
+#else
   w1 = native_divide(density * accel, 9.0);
   w2 = native_divide(density * accel, 36.0);
+#endif
 
   for (kk = 0; kk < NSPEEDS; kk++) {
     cell.speeds[kk] = cells[ii * nx + jj].speeds[kk];
@@ -29,17 +93,17 @@ __kernel void accelerate_flow_and_propagate(const float density, const float acc
   ** we don't send a density negative */
   if( jj == 0 &&
       !obstacles[ii*nx + jj] && 
-      (cell.speeds[3] - w1) > 0.0 &&
-      (cell.speeds[6] - w2) > 0.0 &&
-      (cell.speeds[7] - w2) > 0.0 ) {
+      (LOAD(cell,3) - w1) > 0.0 &&
+      (LOAD(cell,6) - w2) > 0.0 &&
+      (LOAD(cell,7) - w2) > 0.0 ) {
     /* increase 'east-side' densities */
-    cell.speeds[1] += w1;
-    cell.speeds[5] += w2;
-    cell.speeds[8] += w2;
+    STORE(cell,1, LOAD(cell,1) + w1);
+    STORE(cell,5, LOAD(cell,5) + w2);
+    STORE(cell,8, LOAD(cell,8) + w2);
     /* decrease 'west-side' densities */
-    cell.speeds[3] -= w1;
-    cell.speeds[6] -= w2;
-    cell.speeds[7] -= w2;
+    STORE(cell,3, LOAD(cell,3) - w1);
+    STORE(cell,6, LOAD(cell,6) - w2);
+    STORE(cell,7, LOAD(cell,7) - w2);
   }
 
   /* determine indices of axis-direction neighbours
@@ -63,6 +127,87 @@ __kernel void accelerate_flow_and_propagate(const float density, const float acc
   tmp_cells[y_s*nx + x_e].speeds[8] = cell.speeds[8]; /* south-east */   
 }
 
+/*
+** Tiled variant of accelerate_flow_and_propagate: each work-group
+** loads its tile of the grid plus a one cell halo into local memory,
+** accelerating the cells of the first column on the way, and every
+** work-item then pulls its nine densities from the neighbours in the
+** tile, so the stores to tmp_cells are contiguous. The NDRange may be
+** padded up to a multiple of the work-group size; the work-items past
+** the edge of the grid only help to load the tile.
+*/
+__kernel void accelerate_flow_and_propagate_tiled(const float density, const float accel, __global t_speed *cells, __global t_speed *tmp_cells, __global int *obstacles, const int width, const int height, __local t_speed *tile)
+{
+#if defined(NX) && defined(NY)
+  const int nx = NX;
+  const int ny = NY;
+#else
+  const int nx = width;
+  const int ny = height;
+#endif
+  const int ly = get_local_size(0);
+  const int lx = get_local_size(1);
+  const int tx = lx + 2;                   /* row length of the tile */
+  const int ii = get_global_id(0);
+  const int jj = get_global_id(1);
+  const int row0 = get_group_id(0) * ly - 1;  /* grid row of tile row 0 */
+  const int col0 = get_group_id(1) * lx - 1;  /* grid column of tile column 0 */
+  int tt,kk,y,x;
+  float w1,w2;  /* weighting factors */
+  t_speed cell;
+
+  /* compute weighting factors */
+#if defined(ACCEL_W1) && defined(ACCEL_W2)
+  w1 = ACCEL_W1;
+  w2 = ACCEL_W2;
+#else
+  w1 = native_divide(density * accel, 9.0);
+  w2 = native_divide(density * accel, 36.0);
+#endif
+
+  /* load the tile and its halo, wrapping around the edges of the grid */
+  for (tt = get_local_id(0) * lx + get_local_id(1); tt < (ly + 2) * tx; tt += ly * lx) {
+    y = ((row0 + tt / tx) % ny + ny) % ny;
+    x = ((col0 + tt % tx) % nx + nx) % nx;
+    for (kk = 0; kk < NSPEEDS; kk++) {
+      cell.speeds[kk] = cells[y * nx + x].speeds[kk];
+    }
+    /* if the cell is not occupied and
+    ** we don't send a density negative */
+    if( x == 0 &&
+        !obstacles[y*nx + x] &&
+        (LOAD(cell,3) - w1) > 0.0 &&
+        (LOAD(cell,6) - w2) > 0.0 &&
+        (LOAD(cell,7) - w2) > 0.0 ) {
+      /* increase 'east-side' densities */
+      STORE(cell,1, LOAD(cell,1) + w1);
+      STORE(cell,5, LOAD(cell,5) + w2);
+      STORE(cell,8, LOAD(cell,8) + w2);
+      /* decrease 'west-side' densities */
+      STORE(cell,3, LOAD(cell,3) - w1);
+      STORE(cell,6, LOAD(cell,6) - w2);
+      STORE(cell,7, LOAD(cell,7) - w2);
+    }
+    tile[tt] = cell;
+  }
+  barrier(CLK_LOCAL_MEM_FENCE);
+
+  if (ii >= ny || jj >= nx) return;
+
+  /* pull each density from the neighbour it travels from */
+  tt = (get_local_id(0) + 1) * tx + get_local_id(1) + 1;
+  cell.speeds[0] = tile[tt].speeds[0];           /* central cell, no movement */
+  cell.speeds[1] = tile[tt - 1].speeds[1];       /* east, from the west */
+  cell.speeds[2] = tile[tt - tx].speeds[2];      /* north, from the south */
+  cell.speeds[3] = tile[tt + 1].speeds[3];       /* west, from the east */
+  cell.speeds[4] = tile[tt + tx].speeds[4];      /* south, from the north */
+  cell.speeds[5] = tile[tt - tx - 1].speeds[5];  /* north-east, from the south-west */
+  cell.speeds[6] = tile[tt - tx + 1].speeds[6];  /* north-west, from the south-east */
+  cell.speeds[7] = tile[tt + tx + 1].speeds[7];  /* south-west, from the north-east */
+  cell.speeds[8] = tile[tt + tx - 1].speeds[8];  /* south-east, from the north-west */
+  tmp_cells[ii * nx + jj] = cell;
+}
+
 __kernel void rebound_or_collision(const float omega, __global t_speed *cells, __global t_speed *tmp_cells, __global int *obstacles)
 {
   int ii,jj,kk;                 /* generic counters */
@@ -75,10 +220,11 @@ __kernel void rebound_or_collision(const float omega, __global t_speed *cells, _
   float u[NSPEEDS];            /* directional velocities */
   float u_sq;                  /* squared velocity */
   float local_density;         /* sum of densities in a particular cell */
+  float speeds[NSPEEDS];       /* densities of the cell, widened to float */
 
   ii = get_global_id(0);
   jj = get_global_id(1);
-  nx = get_global_size(1);
+  nx = GRID_NX;
 
   t_speed tmp;
   t_speed cell;
@@ -93,7 +239,8 @@ __kernel void rebound_or_collision(const float omega, __global t_speed *cells, _
   /* if the cell contains an obstacle */
   if(obstacles[ii * nx + jj]) {
       /* called after propagate, so taking values from scratch space
-      ** mirroring, and writing into main grid */
+      ** mirroring, and writing into main grid; opposite directions
+      ** have the same weight, so the values move as they are stored */
       cell.speeds[1] = tmp.speeds[3];
       cell.speeds[2] = tmp.speeds[4];
       cell.speeds[3] = tmp.speeds[1];
@@ -106,23 +253,24 @@ __kernel void rebound_or_collision(const float omega, __global t_speed *cells, _
       /* compute local density total */
       local_density = 0.0;
       for(kk=0;kk<NSPEEDS;kk++) {
-        local_density += tmp.speeds[kk];
+        speeds[kk] = LOAD(tmp,kk);
+        local_density += speeds[kk];
       }
       /* compute x velocity component */
-      u_x = native_divide((tmp.speeds[1] +
-               tmp.speeds[5] +
-               tmp.speeds[8]
-               - (tmp.speeds[3] +
-                  tmp.speeds[6] +
-                  tmp.speeds[7]))
+      u_x = native_divide((speeds[1] +
+               speeds[5] +
+               speeds[8]
+               - (speeds[3] +
+                  speeds[6] +
+                  speeds[7]))
         , local_density);
       /* compute y velocity component */
-      u_y = native_divide((tmp.speeds[2] +
-               tmp.speeds[5] +
-               tmp.speeds[6]
-               - (tmp.speeds[4] +
-                  tmp.speeds[7] +
-                  tmp.speeds[8])),
+      u_y = native_divide((speeds[2] +
+               speeds[5] +
+               speeds[6]
+               - (speeds[4] +
+                  speeds[7] +
+                  speeds[8])),
          local_density);
       /* velocity squared */
           u_sq = u_x * u_x + u_y * u_y;
@@ -166,9 +314,9 @@ __kernel void rebound_or_collision(const float omega, __global t_speed *cells, _
                        - u_sq * (1.0 / (2.0 * c_sq)));
       /* relaxation step */
       for(kk=0;kk<NSPEEDS;kk++) {
-        cell.speeds[kk] = (tmp.speeds[kk]
-                           + omega *
-                           (u[kk] - tmp.speeds[kk]));
+        STORE(cell,kk, (speeds[kk]
+                           + RELAX *
+                           (u[kk] - speeds[kk])));
       }
    }
    for (kk = 0; kk < NSPEEDS; kk++) {
@@ -180,22 +328,29 @@ __kernel void sum_velocity(__global t_speed *cells, global int *obstacles, __loc
   int global_index = get_global_id(0);
   int kk;
   float local_density;
+  float speeds[NSPEEDS];
   float accumulator = 0;
+#if defined(NX) && defined(NY)
+  const int ncells = NX * NY;
+#else
+  const int ncells = length;
+#endif
   // Loop sequentially over chunks of input vector
-  while (global_index < length) {
+  while (global_index < ncells) {
     if (!obstacles[global_index]) {
        /* local density total */
       local_density = 0.0;
       for(kk=0;kk<NSPEEDS;kk++) {
-        local_density += cells[global_index].speeds[kk];
+        speeds[kk] = LOAD(cells[global_index],kk);
+        local_density += speeds[kk];
       }
       /* x-component of velocity */
-      accumulator += (cells[global_index].speeds[1] +
-                  cells[global_index].speeds[5] +
-                  cells[global_index].speeds[8]
-                  - (cells[global_index].speeds[3] +
-                     cells[global_index].speeds[6] +
-                     cells[global_index].speeds[7])) /
+      accumulator += (speeds[1] +
+                  speeds[5] +
+                  speeds[8]
+                  - (speeds[3] +
+                     speeds[6] +
+                     speeds[7])) /
         local_density;
     }
     global_index += get_global_size(0);
@@ -45,6 +45,48 @@
 **
 **   d2q9-bgk.exe input.params obstacles.dat
 **
+** The work-group sizes of the kernels are read from the tuning
+** file, if it holds an entry for the current device and grid size.
+** Passing --tune benchmarks the candidate work-group sizes first
+** and stores the fastest configuration for later runs:
+**
+**   d2q9-bgk.exe input.params obstacles.dat --tune
+**
+** Passing --profile enables event profiling on the command queue
+** and reports a per-kernel timing breakdown at exit; with
+** --profile-json <file> the breakdown is also written as JSON.
+**
+** On devices that share memory with the host (CPU devices) the grid
+** is used in place through CL_MEM_USE_HOST_PTR and mapped for host
+** access instead of being copied; --copy and --zero-copy override
+** the choice made from CL_DEVICE_HOST_UNIFIED_MEMORY.
+**
+** The kernels are compiled with the grid size and the parameters
+** as constants (-D NX, NY, OMEGA, ACCEL_W1, ACCEL_W2); --generic
+** builds them with runtime arguments instead. Compiled programs are
+** cached in the working directory, as d2q9-bgk-<hash>.clbin, keyed by
+** the kernel source, the build options and the device and driver; like
+** d2q9-bgk.cl and d2q9-bgk.tune they are found there, so runs from
+** another directory compile, and cache, their own.
+**
+** Passing --tiled swaps accelerate_flow_and_propagate for a variant
+** that streams through a tile of the grid in local memory; it has its
+** own entries in the tuning file.
+**
+** The obstacle file may also be in the binary format of lbm_io.h,
+** which is recognised by its header. Passing --binary writes the
+** final state in binary to final_state.bin instead of as text.
+**
+** Built with make STORAGE=fp16 or STORAGE=bf16 (and DEVIATION=1) the
+** 'speeds' are kept in 16 bits on host and device alike, see
+** lbm_half.h; the kernels widen them to float for the arithmetic.
+**
+** Optional lines at the end of the parameter file stop the run once
+** the flow is steady (see lbm_steady.h). The av. velocity is read
+** back every timestep anyway; a sample of the field reads back the
+** grid. The outputs are then written for the timesteps run, and the
+** timestep it stopped at is reported.
+**
 ** Be sure to adjust the grid dimensions in the parameter file
 ** if you choose a different obstacle file.
 */
@@ -61,19 +103,36 @@
 #include<sys/resource.h>
 #include<cstdlib>
 #include<cstdio>
+#include<cstring>
+#include<fstream>
+#include<sstream>
+#include<string>
+#include<new>
+#include<iterator>
 #include"err_code.c"
+#include"lbm_io.h"
+#include"lbm_half.h"
+#include"lbm_steady.h"
 
 #define NSPEEDS         9
 #define FINALSTATEFILE  "final_state.dat"
+#define FINALSTATEBIN   "final_state.bin"
 #define AVVELSFILE      "av_vels.dat"
+#define TUNINGFILE      "d2q9-bgk.tune"
+#define KERNELFILE      "d2q9-bgk.cl"
+#define BINARYCACHE     "d2q9-bgk-%016llx.clbin"
 
 #ifndef DEVICE
 #define DEVICE CL_DEVICE_TYPE_DEFAULT
 #endif
 
+/* default work-group configuration of sum_velocity */
 #define NGROUPS 100
 #define NUNITS  64
 
+#define TUNE_ITERS      10  /* timed launches per tuning candidate */
+#define TUNE_MIN_UNITS  16  /* smallest work-group size worth trying */
+
 /* struct to hold the parameter values */
 typedef struct {
   int    nx;            /* no. of cells in x-direction */
@@ -84,39 +143,130 @@ typedef struct {
   float density;       /* density per link */
   float accel;         /* density redistribution */
   float omega;         /* relaxation parameter */
+  float rest[NSPEEDS];  /* the 'speed' values of the fluid at rest */
 } t_param;
 
-/* struct to hold the 'speed' values */
+/* struct to hold the 'speed' values, in float or 16 bits (see lbm_half.h) */
 typedef struct {
-  float speeds[NSPEEDS];
+  lbm_store speeds[NSPEEDS];
 } t_speed;
 
+/* one 'speed' value of a cell widened to float; the 16 bit deviations
+** are taken from the params in scope */
+#define LOAD(cell,kk)         LBM_LOAD((cell).speeds[kk], params.rest[kk])
+
+/* kinds of command timed in profiling mode */
+enum { PROF_PROPAGATE, PROF_COLLISION, PROF_SUM_VELOCITY, PROF_READ_VELOCITY, PROF_READ_CELLS, NPROF };
+
+/* struct to accumulate the event timings of one kind of command */
+typedef struct {
+  const char* name;     /* kernel or transfer name */
+  int      count;       /* no. of commands recorded */
+  double   bytes;       /* bytes moved per command */
+  cl_ulong queued;      /* total ns between CL_PROFILING_COMMAND_QUEUED and SUBMIT */
+  cl_ulong submitted;   /* total ns between SUBMIT and START */
+  cl_ulong run;         /* total ns between START and END */
+} t_profile;
+
+/* struct to hold the work-group configuration of the kernels */
+typedef struct {
+  int tiled;            /* propagate with accelerate_flow_and_propagate_tiled */
+  int prop_local[2];    /* local size of accelerate_flow_and_propagate (rows, cols) */
+  int coll_local[2];    /* local size of rebound_or_collision (rows, cols) */
+  int ngroups;          /* no. of work-groups of sum_velocity */
+  int nunits;           /* no. of work-items per work-group of sum_velocity */
+} t_tuning;
+
+/* allocator handing out page-aligned blocks, so that a CL_MEM_USE_HOST_PTR
+** buffer can wrap the grid in place instead of copying it */
+template <typename T>
+struct page_allocator {
+  typedef T value_type;
+  page_allocator() {}
+  template <typename U> page_allocator(const page_allocator<U> &) {}
+  T* allocate(std::size_t n)
+  {
+    void* ptr = NULL;
+    const std::size_t page = sysconf(_SC_PAGESIZE);
+    /* whole pages, as some runtimes only use host memory in place if it is */
+    if (posix_memalign(&ptr, page, ((n * sizeof(T) + page - 1) / page) * page) != 0)
+      throw std::bad_alloc();
+    return static_cast<T*>(ptr);
+  }
+  void deallocate(T* ptr, std::size_t) { free(ptr); }
+};
+template <typename T, typename U>
+bool operator==(const page_allocator<T> &, const page_allocator<U> &) { return true; }
+template <typename T, typename U>
+bool operator!=(const page_allocator<T> &, const page_allocator<U> &) { return false; }
+
+/* the grid lives in page-aligned host memory */
+typedef std::vector<t_speed, page_allocator<t_speed> > t_cells;
+
 enum boolean { FALSE, TRUE };
 
+/* how the grid is shared between host and device */
+enum { MEM_AUTO, MEM_COPY, MEM_ZERO_COPY };
+
 /*
 ** function prototypes
 */
 
 /* load params, allocate memory, load obstacles & initialise fluid particle densities */
 int initialise(const char* paramfile, const char* obstaclefile,
-               t_param* params, std::vector<t_speed> & cells_ptr,
-               std::vector<int> & obstacles_ptr, float** av_vels_ptr);
+               t_param* params, t_cells & cells_ptr,
+               std::vector<int> & obstacles_ptr, float** av_vels_ptr, lbm_steady* steady);
 
-int write_values(const t_param params, std::vector<t_speed> & cells, std::vector<int> & obstacles, float* av_vels);
+int write_values(const t_param params, const t_speed* cells, std::vector<int> & obstacles, float* av_vels, const int binary);
 
 /* finalise, including freeing up allocated memory */
-int finalise(const t_param* params, std::vector<t_speed> & cells_ptr,
+int finalise(const t_param* params, t_cells & cells_ptr,
              std::vector<int> & obstacles_ptr, float** av_vels_ptr);
 
+/* compute the velocity of every cell on the host */
+void velocity_field(const t_param params, const t_speed* cells, std::vector<int> & obstacles, float* u_x, float* u_y);
+
 /* Sum all the densities in the grid.
 ** The total should remain constant from one timestep to the next. */
-float total_density(const t_param params, std::vector<t_speed> & cells);
+float total_density(const t_param params, const t_speed* cells);
 
-/* compute average velocity */
-float av_velocity(const t_param params, cl::Buffer cell_buf, cl::Buffer obs_buf, cl::Kernel sum_velocity, cl::Buffer loc_vel, cl::CommandQueue queue, float *results);
+/* compute average velocity; profile may be NULL */
+float av_velocity(const t_param params, cl::Buffer cell_buf, cl::Buffer obs_buf, cl::Kernel sum_velocity, cl::Buffer loc_vel, cl::CommandQueue queue, const t_tuning tuning, float *results, t_profile* profile);
 
 /* calculate Reynolds number */
-float calc_reynolds(const t_param params, cl::Buffer cell_buf, cl::Buffer obs_buf, cl::Kernel sum_velocity, cl::Buffer loc_vel, cl::CommandQueue queue, float *results);
+float calc_reynolds(const t_param params, cl::Buffer cell_buf, cl::Buffer obs_buf, cl::Kernel sum_velocity, cl::Buffer loc_vel, cl::CommandQueue queue, const t_tuning tuning, float *results);
+
+/* make the device's grid readable on the host; returns where to read it,
+** the mapping in *mapped, or cells after a copy with *mapped NULL */
+const t_speed* acquire_cells(const t_param params, cl::CommandQueue queue, cl::Buffer cell_buf,
+                             t_cells & cells, const int zero_copy, cl::Event* event, void** mapped);
+void release_cells(cl::CommandQueue queue, cl::Buffer cell_buf, void* mapped);
+
+/* profiling: set up the counters, add a completed event, report at exit */
+void init_profile(const t_param params, const t_tuning tuning, t_profile* profile);
+void record_event(t_profile* profile, const cl::Event & event);
+void report_profile(const t_param params, const t_profile* profile, const char* jsonfile);
+
+/* work-group configuration: a valid default, the tuning file, and the autotuner */
+void default_tuning(const t_param params, const cl::Device & device, cl::Kernel propagate,
+                    cl::Kernel collision, cl::Kernel sum_velocity, t_tuning* tuning);
+int valid_tuning(const t_param params, const cl::Device & device, cl::Kernel propagate,
+                 cl::Kernel collision, cl::Kernel sum_velocity, const t_tuning tuning);
+int load_tuning(const char* tuningfile, const std::string & device_name,
+                const t_param params, t_tuning* tuning);
+int save_tuning(const char* tuningfile, const std::string & device_name,
+                const t_param params, const t_tuning tuning, const std::vector<std::string> & trials);
+int tune_kernels(const t_param params, cl::Context context, const cl::Device & device, cl::CommandQueue queue,
+                 cl::Kernel propagate, cl::Kernel collision, cl::Kernel sum_velocity,
+                 t_cells & cells, cl::Buffer obs_buf, t_tuning* tuning);
+
+/* the grid rounded up to whole work-groups, as the tiled kernel needs */
+cl::NDRange padded_range(const t_param params, const int* local);
+
+/* build the kernels, specialised to the grid and parameters unless generic,
+** reusing a cached binary when one matches */
+cl::Program build_program(const t_param params, cl::Context context, const cl::Device & device,
+                          const int generic);
 
 /* utility functions */
 void die(const char* message, const int line, const char *file);
@@ -131,7 +281,7 @@ int main(int argc, char* argv[])
   char*    paramfile;         /* name of the input parameter file */
   char*    obstaclefile;      /* name of a the input obstacle file */
   t_param  params;            /* struct to hold parameter values */
-  std::vector<t_speed> cells;  /* grid containing fluid densities */
+  t_cells cells;  /* grid containing fluid densities */
   cl::Buffer cell_buf;
   cl::Buffer tmp_buf;
   std::vector<int> obstacles;  /* grid indicating which cells are blocked */
@@ -144,73 +294,150 @@ int main(int argc, char* argv[])
   double tic,toc;             /* floating point numbers to calculate elapsed wallclock time */
   double usrtim;              /* floating point number to record elapsed user CPU time */
   double systim;              /* floating point number to record elapsed system CPU time */
+  int      tune = FALSE;      /* benchmark the work-group sizes before running */
+  int      profile = FALSE;   /* time every command with OpenCL events */
+  int      memory = MEM_AUTO; /* copy the grid to the device, or use it in place */
+  int      zero_copy;         /* the grid buffer wraps cells */
+  int      generic = FALSE;   /* build the kernels without compile-time constants */
+  int      tiled = FALSE;     /* propagate through local memory tiles */
+  int      binary = FALSE;    /* write the final state in binary */
+  void*    mapped;            /* host mapping of the grid buffer */
+  const t_speed* host_cells;  /* where the host reads the grid */
+  char*    profilefile = NULL; /* optional JSON dump of the profile */
+  t_tuning tuning;            /* work-group configuration of the kernels */
+  t_profile prof[NPROF];      /* per-kernel event timings */
+  cl::Event prop_event, coll_event, read_event;
+  lbm_steady steady;          /* detection of a steady state */
+  int      iterations;        /* timesteps run */
 
   /* parse the command line */
-  if(argc != 3) {
+  if(argc < 3) {
     usage(argv[0]);
   }
   else{
     paramfile = argv[1];
     obstaclefile = argv[2];
   }
+  for (ii = 3; ii < argc; ii++) {
+    if (!strcmp(argv[ii], "--tune")) tune = TRUE;
+    else if (!strcmp(argv[ii], "--profile")) profile = TRUE;
+    else if (!strcmp(argv[ii], "--copy")) memory = MEM_COPY;
+    else if (!strcmp(argv[ii], "--zero-copy")) memory = MEM_ZERO_COPY;
+    else if (!strcmp(argv[ii], "--generic")) generic = TRUE;
+    else if (!strcmp(argv[ii], "--tiled")) tiled = TRUE;
+    else if (!strcmp(argv[ii], "--binary")) binary = TRUE;
+    else if (!strcmp(argv[ii], "--profile-json") && ii + 1 < argc) {
+      profile = TRUE;
+      profilefile = argv[++ii];
+    }
+    else usage(argv[0]);
+  }
 
   /* initialise our data structures and load values from file */
-  initialise(paramfile, obstaclefile, &params, cells, obstacles, &av_vels);
+  initialise(paramfile, obstaclefile, &params, cells, obstacles, &av_vels, &steady);
+  if (lbm_steady_init(&steady, params.ny*params.nx) != 0)
+    die("cannot allocate memory for steady state detection",__LINE__,__FILE__);
   
   try {
       // Create a context
       cl::Context context(DEVICE);
 
-      // Load in kernel source, creating a program object for the context
-
-      cl::Program program(context, util::loadProgram("d2q9-bgk.cl"));
-       try
-       {
-           program.build(context.getInfo<CL_CONTEXT_DEVICES>(), "-cl-mad-enable");
-       }
-       catch (cl::Error error)
-       {
-          // If it was a build error then show the error
-          if (error.err() == CL_BUILD_PROGRAM_FAILURE)
-           {
-               std::vector<cl::Device> devices;
-               devices = context.getInfo<CL_CONTEXT_DEVICES>();
-               std::string built = program.getBuildInfo<CL_PROGRAM_BUILD_LOG>(devices[0]);
-               std::cerr << built << "\n";
-           }
-           throw error;
-       }
-
-      // Get the command queue
-      cl::CommandQueue queue(context);
-
-      // Create the kernel functor
- 
-      auto accelerate_flow_and_propagate = cl::make_kernel<float, float, cl::Buffer, cl::Buffer, cl::Buffer>(program, "accelerate_flow_and_propagate");
-      auto rebound_or_collision = cl::make_kernel<float, cl::Buffer, cl::Buffer, cl::Buffer>(program, "rebound_or_collision");
+      cl::Device device = context.getInfo<CL_CONTEXT_DEVICES>()[0];
+
+      // Build the kernels for the device, or load them from the cache
+      cl::Program program = build_program(params, context, device, generic);
+
+      // Get the command queue, with event timestamps if profiling
+      cl::CommandQueue queue(context, profile ? CL_QUEUE_PROFILING_ENABLE : 0);
+      std::string device_name = device.getInfo<CL_DEVICE_NAME>();
+      zero_copy = (memory == MEM_AUTO) ? (device.getInfo<CL_DEVICE_HOST_UNIFIED_MEMORY>() == CL_TRUE)
+                                       : (memory == MEM_ZERO_COPY);
+
+      // Create the kernels and their functors
+      cl::Kernel propagate_kernel(program, tiled ? "accelerate_flow_and_propagate_tiled" : "accelerate_flow_and_propagate");
+      cl::Kernel collision_kernel(program, "rebound_or_collision");
       cl::Kernel sum_velocity(program, "sum_velocity");
+      auto accelerate_flow_and_propagate = cl::make_kernel<float, float, cl::Buffer, cl::Buffer, cl::Buffer>(propagate_kernel);
+      auto accelerate_flow_and_propagate_tiled = cl::make_kernel<float, float, cl::Buffer, cl::Buffer, cl::Buffer, int, int, cl::LocalSpaceArg>(propagate_kernel);
+      auto rebound_or_collision = cl::make_kernel<float, cl::Buffer, cl::Buffer, cl::Buffer>(collision_kernel);
       obs_buf = cl::Buffer(context, begin(obstacles), end(obstacles), true);
-      tmp_buf = cl::Buffer(context, CL_MEM_READ_WRITE, sizeof(t_speed) * params.nx * params.ny);
-      loc_vel = cl::Buffer(context, CL_MEM_READ_WRITE, sizeof(float) * NGROUPS);
-      const int work_size = params.nx/5;
-      float results[NGROUPS];
+      /* the host never reads the scratch grid, so let the runtime place it */
+      tmp_buf = cl::Buffer(context, CL_MEM_READ_WRITE | (zero_copy ? CL_MEM_ALLOC_HOST_PTR : 0), sizeof(t_speed) * params.nx * params.ny);
+
+      // Pick the work-group sizes: benchmark them, take them from
+      // the tuning file, or fall back to a valid default
+      tuning.tiled = tiled;
+      if (tune) {
+        tune_kernels(params, context, device, queue, propagate_kernel, collision_kernel, sum_velocity, cells, obs_buf, &tuning);
+      }
+      else if (load_tuning(TUNINGFILE, device_name, params, &tuning) != EXIT_SUCCESS ||
+               !valid_tuning(params, device, propagate_kernel, collision_kernel, sum_velocity, tuning)) {
+        default_tuning(params, device, propagate_kernel, collision_kernel, sum_velocity, &tuning);
+      }
+      printf("Grid memory:\t\t\t%s\n", zero_copy ? "zero-copy (host pointer)" : "copy");
+      printf("Work-groups:\t\t\tpropagate%s %dx%d, collision %dx%d, sum_velocity %dx%d\n",
+             tiled ? " (tiled)" : "", tuning.prop_local[0], tuning.prop_local[1],
+             tuning.coll_local[0], tuning.coll_local[1], tuning.ngroups, tuning.nunits);
+      const cl::NDRange global(params.ny, params.nx);
+      const cl::NDRange prop_global = padded_range(params, tuning.prop_local);
+      const cl::NDRange prop_local(tuning.prop_local[0], tuning.prop_local[1]);
+      const cl::LocalSpaceArg prop_tile = cl::Local(sizeof(t_speed) * (tuning.prop_local[0] + 2) * (tuning.prop_local[1] + 2));
+      const cl::NDRange coll_local(tuning.coll_local[0], tuning.coll_local[1]);
+      loc_vel = cl::Buffer(context, CL_MEM_READ_WRITE, sizeof(float) * tuning.ngroups);
+      std::vector<float> results(tuning.ngroups);
+      std::vector<float> u_x, u_y;  /* the field, when sampled */
+      if (steady.last_u != NULL) {
+        u_x.resize(params.nx * params.ny);
+        u_y.resize(params.nx * params.ny);
+      }
+      init_profile(params, tuning, prof);
 
       /* iterate for maxIters timesteps */
       gettimeofday(&timstr,NULL);
       tic=timstr.tv_sec+(timstr.tv_usec/1000000.0);
-      cell_buf = cl::Buffer(context, begin(cells), end(cells), true);
+      if (zero_copy) {
+        cell_buf = cl::Buffer(context, CL_MEM_READ_WRITE | CL_MEM_USE_HOST_PTR, sizeof(t_speed) * params.nx * params.ny, &cells[0]);
+      }
+      else {
+        cell_buf = cl::Buffer(context, begin(cells), end(cells), false);
+      }
     
+      iterations = params.maxIters;
       for (ii=0;ii<params.maxIters;ii++) {
-        accelerate_flow_and_propagate(cl::EnqueueArgs(queue, cl::NDRange(params.ny, params.nx), cl::NDRange(1, work_size)), params.density, params.accel, cell_buf, tmp_buf, obs_buf);
-        rebound_or_collision(cl::EnqueueArgs(queue, cl::NDRange(params.ny, params.nx), cl::NDRange(1, work_size)),params.omega,cell_buf,tmp_buf,obs_buf);
-        av_vels[ii] = av_velocity(params,cell_buf,obs_buf,sum_velocity,loc_vel,queue, results);
+        if (tiled)
+          prop_event = accelerate_flow_and_propagate_tiled(cl::EnqueueArgs(queue, prop_global, prop_local), params.density, params.accel, cell_buf, tmp_buf, obs_buf, params.nx, params.ny, prop_tile);
+        else
+          prop_event = accelerate_flow_and_propagate(cl::EnqueueArgs(queue, global, prop_local), params.density, params.accel, cell_buf, tmp_buf, obs_buf);
+        coll_event = rebound_or_collision(cl::EnqueueArgs(queue, global, coll_local),params.omega,cell_buf,tmp_buf,obs_buf);
+        av_vels[ii] = av_velocity(params,cell_buf,obs_buf,sum_velocity,loc_vel,queue,tuning,&results[0],profile ? prof : NULL);
+        if (profile) {
+          /* the blocking read in av_velocity has completed both kernels */
+          record_event(&prof[PROF_PROPAGATE], prop_event);
+          record_event(&prof[PROF_COLLISION], coll_event);
+        }
+        if (steady.history != NULL) {
+          if (lbm_steady_sample_due(&steady, ii + 1)) {
+            host_cells = acquire_cells(params, queue, cell_buf, cells, zero_copy, NULL, &mapped);
+            velocity_field(params, host_cells, obstacles, &u_x[0], &u_y[0]);
+            release_cells(queue, cell_buf, mapped);
+            lbm_steady_sample(&steady, &u_x[0], &u_y[0]);
+          }
+          lbm_steady_add(&steady, av_vels[ii]);
+          if (lbm_steady_converged(&steady)) {
+            iterations = ii + 1;
+            break;
+          }
+        }
     #ifdef DEBUG
         printf("==timestep: %d==\n",ii);
         printf("av velocity: %.12E\n", av_vels[ii]);
-        printf("tot density: %.12E\n",total_density(params,cells));
+        host_cells = acquire_cells(params, queue, cell_buf, cells, zero_copy, NULL, &mapped);
+        printf("tot density: %.12E\n",total_density(params,host_cells));
+        release_cells(queue, cell_buf, mapped);
     #endif
       }
-      queue.enqueueReadBuffer(cell_buf, true, 0, sizeof(t_speed)*params.nx*params.ny, &cells[0]);
+      host_cells = acquire_cells(params, queue, cell_buf, cells, zero_copy, &read_event, &mapped);
+      if (profile) record_event(&prof[PROF_READ_CELLS], read_event);
       gettimeofday(&timstr,NULL);
       toc=timstr.tv_sec+(timstr.tv_usec/1000000.0);
       getrusage(RUSAGE_SELF, &ru);
@@ -221,12 +448,20 @@ int main(int argc, char* argv[])
     
       /* write final values and free memory */
       printf("==done==\n");
-      printf("Reynolds number:\t\t%.12E\n",calc_reynolds(params,cell_buf,obs_buf,sum_velocity,loc_vel,queue, results));
+      if (iterations < params.maxIters) printf("Steady state after:\t\t%d timesteps\n", iterations);
+      printf("Reynolds number:\t\t%.12E\n",calc_reynolds(params,cell_buf,obs_buf,sum_velocity,loc_vel,queue,tuning,&results[0]));
       printf("Elapsed time:\t\t\t%.6lf (s)\n", toc-tic);
       printf("Elapsed user CPU time:\t\t%.6lf (s)\n", usrtim);
       printf("Elapsed system CPU time:\t%.6lf (s)\n", systim);
-      write_values(params,cells,obstacles,av_vels);
+      if (profile) report_profile(params, prof, profilefile);
+      /* the outputs cover the timesteps run */
+      params.maxIters = iterations;
+      write_values(params,host_cells,obstacles,av_vels,binary);
+      release_cells(queue, cell_buf, mapped);
+      /* the buffer may use the grid's memory, so drop it first */
+      cell_buf = cl::Buffer();
       finalise(&params, cells, obstacles, &av_vels);
+      lbm_steady_free(&steady);
   } catch (cl::Error err) {
 		std::cout << "Exception\n";
 		std::cerr 
@@ -242,15 +477,16 @@ int main(int argc, char* argv[])
 }
 
 int initialise(const char* paramfile, const char* obstaclefile,
-               t_param* params, std::vector<t_speed> & cells_ptr,
-               std::vector<int> & obstacles_ptr, float** av_vels_ptr)
+               t_param* params, t_cells & cells_ptr,
+               std::vector<int> & obstacles_ptr, float** av_vels_ptr, lbm_steady* steady)
 {
   char   message[1024];  /* message buffer */
   FILE   *fp;            /* file pointer */
-  int    ii,jj;          /* generic counters */
-  int    xx,yy;          /* generic array indices */
+  int    ii,jj,kk;       /* generic counters */
+  long   line;           /* line no. of an error in the obstacle file */
   int    blocked;        /* indicates whether a cell is blocked by an obstacle */ 
   int    retval;         /* to hold return value for checking */
+  const char* what;      /* optional parameter that could not be read */
   float w0,w1,w2;       /* weighting factors */
 
   /* open the parameter file */
@@ -275,6 +511,10 @@ int initialise(const char* paramfile, const char* obstaclefile,
   if(retval != 1) die ("could not read param file: accel",__LINE__,__FILE__);
   retval = fscanf(fp,"%f\n",&(params->omega));
   if(retval != 1) die ("could not read param file: omega",__LINE__,__FILE__);
+  if (lbm_steady_read(fp, steady, &what) != 0) {
+    sprintf(message,"could not read param file: %s", what);
+    die(message,__LINE__,__FILE__);
+  }
   params->tot_cells = params->nx * params->ny;
 
   /* and close up the file */
@@ -313,56 +553,46 @@ int initialise(const char* paramfile, const char* obstaclefile,
   w0 = params->density * 4.0/9.0;
   w1 = params->density      /9.0;
   w2 = params->density      /36.0;
+  params->rest[0] = w0;
+  for(kk=1;kk<5;kk++) params->rest[kk] = w1;
+  for(kk=5;kk<NSPEEDS;kk++) params->rest[kk] = w2;
 
   for(ii=0;ii<params->ny;ii++) {
     for(jj=0;jj<params->nx;jj++) {
       /* centre */
-      (cells_ptr)[ii*params->nx + jj].speeds[0] = w0;
+      (cells_ptr)[ii*params->nx + jj].speeds[0] = LBM_STORE(w0, params->rest[0]);
       /* axis directions */
-      (cells_ptr)[ii*params->nx + jj].speeds[1] = w1;
-      (cells_ptr)[ii*params->nx + jj].speeds[2] = w1;
-      (cells_ptr)[ii*params->nx + jj].speeds[3] = w1;
-      (cells_ptr)[ii*params->nx + jj].speeds[4] = w1;
+      (cells_ptr)[ii*params->nx + jj].speeds[1] = LBM_STORE(w1, params->rest[1]);
+      (cells_ptr)[ii*params->nx + jj].speeds[2] = LBM_STORE(w1, params->rest[2]);
+      (cells_ptr)[ii*params->nx + jj].speeds[3] = LBM_STORE(w1, params->rest[3]);
+      (cells_ptr)[ii*params->nx + jj].speeds[4] = LBM_STORE(w1, params->rest[4]);
       /* diagonals */
-      (cells_ptr)[ii*params->nx + jj].speeds[5] = w2;
-      (cells_ptr)[ii*params->nx + jj].speeds[6] = w2;
-      (cells_ptr)[ii*params->nx + jj].speeds[7] = w2;
-      (cells_ptr)[ii*params->nx + jj].speeds[8] = w2;
+      (cells_ptr)[ii*params->nx + jj].speeds[5] = LBM_STORE(w2, params->rest[5]);
+      (cells_ptr)[ii*params->nx + jj].speeds[6] = LBM_STORE(w2, params->rest[6]);
+      (cells_ptr)[ii*params->nx + jj].speeds[7] = LBM_STORE(w2, params->rest[7]);
+      (cells_ptr)[ii*params->nx + jj].speeds[8] = LBM_STORE(w2, params->rest[8]);
     }
   }
 
-  /* first set all cells in obstacle array to zero */ 
-  for(ii=0;ii<params->ny;ii++) {
-    for(jj=0;jj<params->nx;jj++) {
-      (obstacles_ptr)[ii*params->nx + jj] = 0;
-    }
+  /* a binary obstacle file is a dense map, loaded in one go */
+  if (lbm_is_binary(obstaclefile)) {
+    retval = lbm_read_obstacles(obstaclefile, params->nx, params->ny, 0, params->ny, &obstacles_ptr[0], &blocked);
+    if (retval != LBM_OK) die(lbm_strerror(retval),__LINE__,__FILE__);
+    params->tot_cells -= blocked;
   }
-
-  /* open the obstacle data file */
-  fp = fopen(obstaclefile,"r");
-  if (fp == NULL) {
-    sprintf(message,"could not open input obstacles file: %s", obstaclefile);
-    die(message,__LINE__,__FILE__);
-  }
-
-  /* read-in the blocked cells list */
-  while( (retval = fscanf(fp,"%d %d %d\n", &xx, &yy, &blocked)) != EOF) {
-    /* some checks */
-    if ( retval != 3)
-      die("expected 3 values per line in obstacle file",__LINE__,__FILE__);
-    if ( xx<0 || xx>params->nx-1 )
-      die("obstacle x-coord out of range",__LINE__,__FILE__);
-    if ( yy<0 || yy>params->ny-1 )
-      die("obstacle y-coord out of range",__LINE__,__FILE__);
-    if ( blocked != 1 ) 
-      die("obstacle blocked value should be 1",__LINE__,__FILE__);
-    /* assign to array */
-    (obstacles_ptr)[yy*params->nx + xx] = blocked;
-    params->tot_cells--;
+  else {
+    /* read-in the blocked cells list */
+    retval = lbm_parse_obstacles(obstaclefile, params->nx, params->ny, &obstacles_ptr[0], &blocked, &line);
+    if (retval == LBM_EOPEN) {
+      sprintf(message,"could not open input obstacles file: %s", obstaclefile);
+      die(message,__LINE__,__FILE__);
+    }
+    if (retval != LBM_OK) {
+      sprintf(message,"%s (line %ld of %s)", lbm_strerror(retval), line, obstaclefile);
+      die(message,__LINE__,__FILE__);
+    }
+    params->tot_cells -= blocked;
   }
-  
-  /* and close the file */
-  fclose(fp);
 
   /* 
   ** allocate space to hold a record of the avarage velocities computed 
@@ -373,13 +603,13 @@ int initialise(const char* paramfile, const char* obstaclefile,
   return EXIT_SUCCESS;
 }
 
-int finalise(const t_param* params, std::vector<t_speed> & cells_ptr,
+int finalise(const t_param* params, t_cells & cells_ptr,
              std::vector<int> & obstacles_ptr, float** av_vels_ptr)
 {
   /* 
   ** free up allocated memory
   */
-  std::vector<t_speed>().swap(cells_ptr);
+  t_cells().swap(cells_ptr);
 
   std::vector<int>().swap(obstacles_ptr);
 
@@ -389,28 +619,72 @@ int finalise(const t_param* params, std::vector<t_speed> & cells_ptr,
   return EXIT_SUCCESS;
 }
 
-float av_velocity(const t_param params, cl::Buffer cell_buf, cl::Buffer obs_buf, cl::Kernel sum_velocity, cl::Buffer loc_vel, cl::CommandQueue queue, float *results)
+float av_velocity(const t_param params, cl::Buffer cell_buf, cl::Buffer obs_buf, cl::Kernel sum_velocity, cl::Buffer loc_vel, cl::CommandQueue queue, const t_tuning tuning, float *results, t_profile* profile)
 {
-  int ii;
   float tot_u_x = 0;
+  cl::Event sum_event, read_event;
   auto reduce = cl::make_kernel<cl::Buffer, cl::Buffer, cl::LocalSpaceArg, int, cl::Buffer>(sum_velocity);
-  reduce(cl::EnqueueArgs(queue, cl::NDRange(NGROUPS * NUNITS), cl::NDRange(NUNITS)), cell_buf, obs_buf, cl::Local(sizeof(float) * NUNITS), params.nx * params.ny, loc_vel);
-  queue.enqueueReadBuffer(loc_vel, true, 0, sizeof(float) * NGROUPS, results);
-  for (int ii = 0; ii < NGROUPS; ii++) {
+  sum_event = reduce(cl::EnqueueArgs(queue, cl::NDRange(tuning.ngroups * tuning.nunits), cl::NDRange(tuning.nunits)), cell_buf, obs_buf, cl::Local(sizeof(float) * tuning.nunits), params.nx * params.ny, loc_vel);
+  queue.enqueueReadBuffer(loc_vel, true, 0, sizeof(float) * tuning.ngroups, results, NULL, &read_event);
+  if (profile != NULL) {
+    record_event(&profile[PROF_SUM_VELOCITY], sum_event);
+    record_event(&profile[PROF_READ_VELOCITY], read_event);
+  }
+  for (int ii = 0; ii < tuning.ngroups; ii++) {
       tot_u_x += results[ii];
   }
 
   return tot_u_x / (float)params.tot_cells;
 }
 
-float calc_reynolds(const t_param params, cl::Buffer cell_buf, cl::Buffer obs_buf, cl::Kernel sum_velocity, cl::Buffer loc_vel, cl::CommandQueue queue, float *results)
+float calc_reynolds(const t_param params, cl::Buffer cell_buf, cl::Buffer obs_buf, cl::Kernel sum_velocity, cl::Buffer loc_vel, cl::CommandQueue queue, const t_tuning tuning, float *results)
 {
   const float viscosity = 1.0 / 6.0 * (2.0 / params.omega - 1.0);
   
-  return av_velocity(params,cell_buf,obs_buf,sum_velocity,loc_vel, queue, results) * params.reynolds_dim / viscosity;
+  return av_velocity(params,cell_buf,obs_buf,sum_velocity,loc_vel, queue, tuning, results, NULL) * params.reynolds_dim / viscosity;
+}
+
+void velocity_field(const t_param params, const t_speed* cells, std::vector<int> & obstacles, float* u_x, float* u_y)
+{
+  int ii,jj,kk;                 /* generic counters */
+  float local_density;         /* per grid cell sum of densities */
+  float speeds[NSPEEDS];       /* densities of the cell, widened to float */
+
+  for(ii=0;ii<params.ny;ii++) {
+    for(jj=0;jj<params.nx;jj++) {
+      /* an occupied cell */
+      if(obstacles[ii*params.nx + jj]) {
+        u_x[ii*params.nx + jj] = u_y[ii*params.nx + jj] = 0.0;
+      }
+      /* no obstacle */
+      else {
+        local_density = 0.0;
+        for(kk=0;kk<NSPEEDS;kk++) {
+          speeds[kk] = LOAD(cells[ii*params.nx + jj],kk);
+          local_density += speeds[kk];
+        }
+        /* compute x velocity component */
+        u_x[ii*params.nx + jj] = (speeds[1] +
+               speeds[5] +
+               speeds[8]
+               - (speeds[3] +
+                  speeds[6] +
+                  speeds[7]))
+          / local_density;
+        /* compute y velocity component */
+        u_y[ii*params.nx + jj] = (speeds[2] +
+               speeds[5] +
+               speeds[6]
+               - (speeds[4] +
+                  speeds[7] +
+                  speeds[8]))
+          / local_density;
+      }
+    }
+  }
 }
 
-float total_density(const t_param params, std::vector<t_speed> & cells)
+float total_density(const t_param params, const t_speed* cells)
 {
   int ii,jj,kk;        /* generic counters */
   float total = 0.0;  /* accumulator */
@@ -418,7 +692,7 @@ float total_density(const t_param params, std::vector<t_speed> & cells)
   for(ii=0;ii<params.ny;ii++) {
     for(jj=0;jj<params.nx;jj++) {
       for(kk=0;kk<NSPEEDS;kk++) {
-        total += cells[ii*params.nx + jj].speeds[kk];
+        total += LOAD(cells[ii*params.nx + jj],kk);
       }
     }
   }
@@ -426,59 +700,72 @@ float total_density(const t_param params, std::vector<t_speed> & cells)
   return total;
 }
 
-int write_values(const t_param params, std::vector<t_speed> & cells, std::vector<int> & obstacles, float *av_vels)
+int write_values(const t_param params, const t_speed* cells, std::vector<int> & obstacles, float *av_vels, const int binary)
 {
   FILE* fp;                     /* file pointer */
   int ii,jj,kk;                 /* generic counters */
+  int retval;                   /* to hold return value for checking */
   const float c_sq = 1.0/3.0;  /* sq. of speed of sound */
   float local_density;         /* per grid cell sum of densities */
-  float pressure;              /* fluid pressure in grid cell */
-  float u_x;                   /* x-component of velocity in grid cell */
-  float u_y;                   /* y-component of velocity in grid cell */
-
-  fp = fopen(FINALSTATEFILE,"w");
-  if (fp == NULL) {
-    die("could not open file output file",__LINE__,__FILE__);
-  }
+  float speeds[NSPEEDS];       /* densities of the cell, widened to float */
+  std::vector<float> pressure(params.nx * params.ny);  /* fluid pressure in each grid cell */
+  std::vector<float> u_x(params.nx * params.ny);       /* x-component of velocity in each grid cell */
+  std::vector<float> u_y(params.nx * params.ny);       /* y-component of velocity in each grid cell */
 
   for(ii=0;ii<params.ny;ii++) {
     for(jj=0;jj<params.nx;jj++) {
       /* an occupied cell */
       if(obstacles[ii*params.nx + jj]) {
-        u_x = u_y = 0.0;
-        pressure = params.density * c_sq;
+        u_x[ii*params.nx + jj] = u_y[ii*params.nx + jj] = 0.0;
+        pressure[ii*params.nx + jj] = params.density * c_sq;
       }
       /* no obstacle */
       else {
         local_density = 0.0;
         for(kk=0;kk<NSPEEDS;kk++) {
-          local_density += cells[ii*params.nx + jj].speeds[kk];
+          speeds[kk] = LOAD(cells[ii*params.nx + jj],kk);
+          local_density += speeds[kk];
         }
         /* compute x velocity component */
-        u_x = (cells[ii*params.nx + jj].speeds[1] +
-               cells[ii*params.nx + jj].speeds[5] +
-               cells[ii*params.nx + jj].speeds[8]
-               - (cells[ii*params.nx + jj].speeds[3] +
-                  cells[ii*params.nx + jj].speeds[6] +
-                  cells[ii*params.nx + jj].speeds[7]))
+        u_x[ii*params.nx + jj] = (speeds[1] +
+               speeds[5] +
+               speeds[8]
+               - (speeds[3] +
+                  speeds[6] +
+                  speeds[7]))
           / local_density;
         /* compute y velocity component */
-        u_y = (cells[ii*params.nx + jj].speeds[2] +
-               cells[ii*params.nx + jj].speeds[5] +
-               cells[ii*params.nx + jj].speeds[6]
-               - (cells[ii*params.nx + jj].speeds[4] +
-                  cells[ii*params.nx + jj].speeds[7] +
-                  cells[ii*params.nx + jj].speeds[8]))
+        u_y[ii*params.nx + jj] = (speeds[2] +
+               speeds[5] +
+               speeds[6]
+               - (speeds[4] +
+                  speeds[7] +
+                  speeds[8]))
           / local_density;
         /* compute pressure */
-        pressure = local_density * c_sq;
+        pressure[ii*params.nx + jj] = local_density * c_sq;
       }
-      /* write to file */
-      fprintf(fp,"%d %d %.12E %.12E %.12E %d\n",ii,jj,u_x,u_y,pressure,obstacles[ii*params.nx + jj]);
     }
   }
 
-  fclose(fp);
+  if (binary) {
+    retval = lbm_write_state(FINALSTATEBIN, params.nx, params.ny, &u_x[0], &u_y[0], &pressure[0], &obstacles[0]);
+    if (retval != LBM_OK) die(lbm_strerror(retval),__LINE__,__FILE__);
+  }
+  else {
+    fp = fopen(FINALSTATEFILE,"w");
+    if (fp == NULL) {
+      die("could not open file output file",__LINE__,__FILE__);
+    }
+    for(ii=0;ii<params.ny;ii++) {
+      for(jj=0;jj<params.nx;jj++) {
+        /* write to file */
+        fprintf(fp,"%d %d %.12E %.12E %.12E %d\n",ii,jj,u_x[ii*params.nx + jj],u_y[ii*params.nx + jj],
+                pressure[ii*params.nx + jj],obstacles[ii*params.nx + jj]);
+      }
+    }
+    fclose(fp);
+  }
 
   fp = fopen(AVVELSFILE,"w");
   if (fp == NULL) {
@@ -493,6 +780,548 @@ int write_values(const t_param params, std::vector<t_speed> & cells, std::vector
   return EXIT_SUCCESS;
 }
 
+const t_speed* acquire_cells(const t_param params, cl::CommandQueue queue, cl::Buffer cell_buf,
+                             t_cells & cells, const int zero_copy, cl::Event* event, void** mapped)
+{
+  if (!zero_copy) {
+    queue.enqueueReadBuffer(cell_buf, true, 0, sizeof(t_speed) * params.nx * params.ny, &cells[0], NULL, event);
+    *mapped = NULL;
+    return &cells[0];
+  }
+
+  /* the mapping of a CL_MEM_USE_HOST_PTR buffer is derived from cells,
+  ** which holds the device's values until it is unmapped; a runtime that
+  ** stages the data elsewhere is read there, as cells belongs to the
+  ** buffer and must not be written while it is mapped */
+  *mapped = queue.enqueueMapBuffer(cell_buf, CL_TRUE, CL_MAP_READ, 0, sizeof(t_speed) * params.nx * params.ny, NULL, event);
+
+  return (const t_speed*)*mapped;
+}
+
+void release_cells(cl::CommandQueue queue, cl::Buffer cell_buf, void* mapped)
+{
+  if (mapped == NULL) return;
+  queue.enqueueUnmapMemObject(cell_buf, mapped);
+  queue.finish();
+}
+
+void init_profile(const t_param params, const t_tuning tuning, t_profile* profile)
+{
+  const double cells = (double)params.nx * params.ny;
+  int kk;
+
+  for (kk = 0; kk < NPROF; kk++) {
+    profile[kk].count = 0;
+    profile[kk].queued = profile[kk].submitted = profile[kk].run = 0;
+  }
+  /* the lattice kernels read and write every cell and read the obstacle map;
+  ** the reduction only reads them */
+  profile[PROF_PROPAGATE].name = "accelerate_flow_and_propagate";
+  profile[PROF_PROPAGATE].bytes = (2 * sizeof(t_speed) + sizeof(int)) * cells;
+  profile[PROF_COLLISION].name = "rebound_or_collision";
+  profile[PROF_COLLISION].bytes = (2 * sizeof(t_speed) + sizeof(int)) * cells;
+  profile[PROF_SUM_VELOCITY].name = "sum_velocity";
+  profile[PROF_SUM_VELOCITY].bytes = (sizeof(t_speed) + sizeof(int)) * cells;
+  profile[PROF_READ_VELOCITY].name = "read loc_vel";
+  profile[PROF_READ_VELOCITY].bytes = sizeof(float) * tuning.ngroups;
+  profile[PROF_READ_CELLS].name = "read/map cells";
+  profile[PROF_READ_CELLS].bytes = sizeof(t_speed) * cells;
+}
+
+void record_event(t_profile* profile, const cl::Event & event)
+{
+  cl_ulong queued = event.getProfilingInfo<CL_PROFILING_COMMAND_QUEUED>();
+  cl_ulong submit = event.getProfilingInfo<CL_PROFILING_COMMAND_SUBMIT>();
+  cl_ulong start  = event.getProfilingInfo<CL_PROFILING_COMMAND_START>();
+  cl_ulong end    = event.getProfilingInfo<CL_PROFILING_COMMAND_END>();
+
+  profile->count++;
+  profile->queued += submit - queued;
+  profile->submitted += start - submit;
+  profile->run += end - start;
+}
+
+void report_profile(const t_param params, const t_profile* profile, const char* jsonfile)
+{
+  FILE*    fp;
+  double   total = 0.0;   /* ns spent executing commands */
+  double   lattice;       /* ns spent in the two lattice kernels */
+  double   seconds;
+  int      kk;
+
+  for (kk = 0; kk < NPROF; kk++) {
+    total += profile[kk].run;
+  }
+  lattice = (double)profile[PROF_PROPAGATE].run + profile[PROF_COLLISION].run;
+
+  printf("==profile==\n");
+  printf("%-30s %8s %12s %12s %12s %12s %6s %10s\n", "command", "count",
+         "queued(ms)", "submit(ms)", "run(ms)", "avg run(us)", "run%", "GB/s");
+  for (kk = 0; kk < NPROF; kk++) {
+    seconds = profile[kk].run * 1.0e-9;
+    printf("%-30s %8d %12.3lf %12.3lf %12.3lf %12.3lf %6.2lf %10.3lf\n", profile[kk].name, profile[kk].count,
+           profile[kk].queued * 1.0e-6, profile[kk].submitted * 1.0e-6, profile[kk].run * 1.0e-6,
+           profile[kk].count ? profile[kk].run * 1.0e-3 / profile[kk].count : 0.0,
+           total > 0.0 ? 100.0 * profile[kk].run / total : 0.0,
+           seconds > 0.0 ? profile[kk].bytes * profile[kk].count / seconds * 1.0e-9 : 0.0);
+  }
+  /* bytes per cell update x cell updates / time in the lattice kernels */
+  printf("Bytes per cell update:\t\t%lu\n", (unsigned long)(4 * sizeof(t_speed) + 2 * sizeof(int)));
+  printf("Lattice bandwidth:\t\t%.3lf (GB/s)\n", lattice > 0.0 ?
+         (profile[PROF_PROPAGATE].bytes * profile[PROF_PROPAGATE].count +
+          profile[PROF_COLLISION].bytes * profile[PROF_COLLISION].count) / lattice : 0.0);
+  printf("Cell updates per second:\t%.6E\n", lattice > 0.0 ?
+         (double)params.nx * params.ny * profile[PROF_COLLISION].count / (lattice * 1.0e-9) : 0.0);
+
+  if (jsonfile == NULL) return;
+  fp = fopen(jsonfile, "w");
+  if (fp == NULL) {
+    die("could not open profile output file",__LINE__,__FILE__);
+  }
+  fprintf(fp, "{\n  \"nx\": %d,\n  \"ny\": %d,\n  \"iterations\": %d,\n", params.nx, params.ny, profile[PROF_COLLISION].count);
+  fprintf(fp, "  \"lattice_bandwidth_gbs\": %.6lf,\n", lattice > 0.0 ?
+          (profile[PROF_PROPAGATE].bytes * profile[PROF_PROPAGATE].count +
+           profile[PROF_COLLISION].bytes * profile[PROF_COLLISION].count) / lattice : 0.0);
+  fprintf(fp, "  \"commands\": [\n");
+  for (kk = 0; kk < NPROF; kk++) {
+    fprintf(fp, "    {\"name\": \"%s\", \"count\": %d, \"bytes\": %.0lf, \"queued_ns\": %lu, \"submit_ns\": %lu, \"run_ns\": %lu}%s\n",
+            profile[kk].name, profile[kk].count, profile[kk].bytes, (unsigned long)profile[kk].queued,
+            (unsigned long)profile[kk].submitted, (unsigned long)profile[kk].run, kk + 1 < NPROF ? "," : "");
+  }
+  fprintf(fp, "  ]\n}\n");
+  fclose(fp);
+}
+
+/* largest divisor of n that is no larger than limit */
+static int largest_divisor(const int n, const size_t limit)
+{
+  int dd;
+  for (dd = (limit < (size_t)n) ? (int)limit : n; dd > 1; dd--) {
+    if (n % dd == 0) break;
+  }
+  return dd;
+}
+
+/* bytes of local memory the tiled kernel can have for its tile */
+static ::size_t tile_limit(const cl::Device & device, cl::Kernel propagate)
+{
+  const ::size_t total = device.getInfo<CL_DEVICE_LOCAL_MEM_SIZE>();
+  const ::size_t used = propagate.getWorkGroupInfo<CL_KERNEL_LOCAL_MEM_SIZE>(device);
+  return (used < total) ? total - used : 0;
+}
+
+/* local memory of a tile of ly x lx cells and its halo */
+static ::size_t tile_bytes(const int ly, const int lx)
+{
+  return sizeof(t_speed) * (ly + 2) * (lx + 2);
+}
+
+cl::NDRange padded_range(const t_param params, const int* local)
+{
+  return cl::NDRange((params.ny + local[0] - 1) / local[0] * local[0],
+                     (params.nx + local[1] - 1) / local[1] * local[1]);
+}
+
+/* key identifying a device, grid size and propagate variant in the tuning file */
+static std::string tuning_key(const std::string & device_name, const t_param params, const int tiled)
+{
+  std::ostringstream key;
+  std::string name = device_name;
+  for (size_t ii = 0; ii < name.size(); ii++) {
+    if (isspace((unsigned char)name[ii])) name[ii] = '_';
+  }
+  key << name << " " << params.nx << " " << params.ny;
+  if (tiled) key << " tiled";
+  return key.str();
+}
+
+void default_tuning(const t_param params, const cl::Device & device, cl::Kernel propagate,
+                    cl::Kernel collision, cl::Kernel sum_velocity, t_tuning* tuning)
+{
+  std::vector< ::size_t> item_max = device.getInfo<CL_DEVICE_MAX_WORK_ITEM_SIZES>();
+  ::size_t prop_max = propagate.getWorkGroupInfo<CL_KERNEL_WORK_GROUP_SIZE>(device);
+  ::size_t coll_max = collision.getWorkGroupInfo<CL_KERNEL_WORK_GROUP_SIZE>(device);
+  ::size_t sum_max = sum_velocity.getWorkGroupInfo<CL_KERNEL_WORK_GROUP_SIZE>(device);
+
+  /* one row per work-group, as many columns as evenly divide the row */
+  tuning->prop_local[0] = 1;
+  tuning->prop_local[1] = largest_divisor(params.nx, (prop_max < item_max[1]) ? prop_max : item_max[1]);
+  if (tuning->tiled) {
+    /* tiles of up to 8 x 32 cells; the grid is padded, so no need to divide it */
+    const ::size_t tile_max = tile_limit(device, propagate);
+    tuning->prop_local[1] = 1;
+    while (2 * tuning->prop_local[1] <= 32 && (::size_t)(2 * tuning->prop_local[1]) <= item_max[1] &&
+           (::size_t)(2 * tuning->prop_local[1]) <= prop_max && tile_bytes(1, 2 * tuning->prop_local[1]) <= tile_max)
+      tuning->prop_local[1] *= 2;
+    while (2 * tuning->prop_local[0] <= 8 && (::size_t)(2 * tuning->prop_local[0]) <= item_max[0] &&
+           (::size_t)(2 * tuning->prop_local[0] * tuning->prop_local[1]) <= prop_max &&
+           tile_bytes(2 * tuning->prop_local[0], tuning->prop_local[1]) <= tile_max)
+      tuning->prop_local[0] *= 2;
+  }
+  tuning->coll_local[0] = 1;
+  tuning->coll_local[1] = largest_divisor(params.nx, (coll_max < item_max[1]) ? coll_max : item_max[1]);
+
+  /* the tree reduction in sum_velocity needs a power of two work-group */
+  tuning->ngroups = NGROUPS;
+  tuning->nunits = NUNITS;
+  while ((::size_t)tuning->nunits > sum_max || (::size_t)tuning->nunits > item_max[0]) {
+    tuning->nunits /= 2;
+  }
+}
+
+int valid_tuning(const t_param params, const cl::Device & device, cl::Kernel propagate,
+                 cl::Kernel collision, cl::Kernel sum_velocity, const t_tuning tuning)
+{
+  std::vector< ::size_t> item_max = device.getInfo<CL_DEVICE_MAX_WORK_ITEM_SIZES>();
+  const int* local[2] = { tuning.prop_local, tuning.coll_local };
+  ::size_t max_size[2];
+  int kk;
+
+  max_size[0] = propagate.getWorkGroupInfo<CL_KERNEL_WORK_GROUP_SIZE>(device);
+  max_size[1] = collision.getWorkGroupInfo<CL_KERNEL_WORK_GROUP_SIZE>(device);
+  for (kk = 0; kk < 2; kk++) {
+    /* only the tiled propagate copes with a padded grid */
+    const int padded = (kk == 0 && tuning.tiled);
+    if (local[kk][0] < 1 || local[kk][1] < 1 ||
+        (!padded && (params.ny % local[kk][0] || params.nx % local[kk][1])) ||
+        (::size_t)local[kk][0] > item_max[0] || (::size_t)local[kk][1] > item_max[1] ||
+        (::size_t)(local[kk][0] * local[kk][1]) > max_size[kk])
+      return FALSE;
+  }
+  if (tuning.tiled && tile_bytes(tuning.prop_local[0], tuning.prop_local[1]) > tile_limit(device, propagate))
+    return FALSE;
+  if (tuning.ngroups < 1 || tuning.nunits < 1 || (tuning.nunits & (tuning.nunits - 1)) ||
+      (::size_t)tuning.nunits > sum_velocity.getWorkGroupInfo<CL_KERNEL_WORK_GROUP_SIZE>(device))
+    return FALSE;
+
+  return TRUE;
+}
+
+int load_tuning(const char* tuningfile, const std::string & device_name,
+                const t_param params, t_tuning* tuning)
+{
+  std::ifstream in(tuningfile);
+  std::string key = tuning_key(device_name, params, tuning->tiled);
+  std::string line, kind;
+
+  while (std::getline(in, line)) {
+    if (line.compare(0, key.size() + 1, key + " ") != 0) continue;
+    std::istringstream fields(line.substr(key.size() + 1));
+    if (fields >> kind && kind == "best" &&
+        fields >> tuning->prop_local[0] >> tuning->prop_local[1]
+               >> tuning->coll_local[0] >> tuning->coll_local[1]
+               >> tuning->ngroups >> tuning->nunits)
+      return EXIT_SUCCESS;
+  }
+
+  return EXIT_FAILURE;
+}
+
+int save_tuning(const char* tuningfile, const std::string & device_name,
+                const t_param params, const t_tuning tuning, const std::vector<std::string> & trials)
+{
+  std::string key = tuning_key(device_name, params, tuning.tiled);
+  std::vector<std::string> lines;
+  std::string line;
+  size_t ii;
+
+  /* keep the entries of other devices and grid sizes */
+  std::ifstream in(tuningfile);
+  while (std::getline(in, line)) {
+    if (line.compare(0, key.size() + 1, key + " ") != 0) lines.push_back(line);
+  }
+  in.close();
+
+  std::ofstream out(tuningfile);
+  if (!out.is_open()) {
+    die("could not open tuning file",__LINE__,__FILE__);
+  }
+  for (ii = 0; ii < lines.size(); ii++) {
+    out << lines[ii] << "\n";
+  }
+  out << key << " best "
+      << tuning.prop_local[0] << " " << tuning.prop_local[1] << " "
+      << tuning.coll_local[0] << " " << tuning.coll_local[1] << " "
+      << tuning.ngroups << " " << tuning.nunits << "\n";
+  for (ii = 0; ii < trials.size(); ii++) {
+    out << key << " trial " << trials[ii] << "\n";
+  }
+
+  return EXIT_SUCCESS;
+}
+
+/* all (rows, cols) work-group shapes that tile the grid and fit the kernel */
+static std::vector<std::pair<int,int> > local_candidates(const t_param params, const ::size_t max_size,
+                                                         const std::vector< ::size_t> & item_max)
+{
+  std::vector<std::pair<int,int> > shapes;
+  const ::size_t min_size = (max_size < TUNE_MIN_UNITS) ? max_size : TUNE_MIN_UNITS;
+  int ly, lx;
+
+  for (ly = 1; ly <= params.ny && (::size_t)ly <= item_max[0]; ly++) {
+    if (params.ny % ly) continue;
+    for (lx = 1; lx <= params.nx && (::size_t)lx <= item_max[1]; lx++) {
+      if (params.nx % lx) continue;
+      if ((::size_t)(ly * lx) > max_size || (::size_t)(ly * lx) < min_size) continue;
+      shapes.push_back(std::make_pair(ly, lx));
+    }
+  }
+
+  return shapes;
+}
+
+/* power of two tile shapes for the tiled propagate, whose grid is padded;
+** the tile and its halo must fit in tile_max bytes of local memory */
+static std::vector<std::pair<int,int> > tile_candidates(const ::size_t max_size, const ::size_t tile_max,
+                                                        const std::vector< ::size_t> & item_max)
+{
+  std::vector<std::pair<int,int> > shapes;
+  const ::size_t min_size = (max_size < TUNE_MIN_UNITS) ? max_size : TUNE_MIN_UNITS;
+  int ly, lx;
+
+  for (ly = 1; (::size_t)ly <= item_max[0]; ly *= 2) {
+    for (lx = 1; (::size_t)lx <= item_max[1]; lx *= 2) {
+      if ((::size_t)(ly * lx) > max_size || (::size_t)(ly * lx) < min_size) continue;
+      if (tile_bytes(ly, lx) > tile_max) continue;
+      shapes.push_back(std::make_pair(ly, lx));
+    }
+  }
+
+  return shapes;
+}
+
+/* average time in ms of one launch of a 2D kernel whose arguments are already set */
+static double time_kernel(cl::CommandQueue queue, cl::Kernel kernel, const cl::NDRange & global, const cl::NDRange & local)
+{
+  util::Timer timer;
+  int ii;
+
+  /* warm-up launch, which also rejects an unusable local size */
+  queue.enqueueNDRangeKernel(kernel, cl::NullRange, global, local);
+  queue.finish();
+  timer.reset();
+  for (ii = 0; ii < TUNE_ITERS; ii++) {
+    queue.enqueueNDRangeKernel(kernel, cl::NullRange, global, local);
+  }
+  queue.finish();
+
+  return timer.getTimeMicroseconds() / 1000.0 / TUNE_ITERS;
+}
+
+/* benchmark the shapes for one 2D kernel; returns the best time.
+** tile_arg is the index of the kernel's local tile argument, or -1 */
+static double tune_local(const char* name, const t_param params, cl::CommandQueue queue, cl::Kernel kernel,
+                         const std::vector<std::pair<int,int> > & shapes, const int tile_arg,
+                         int* local, std::vector<std::string> & trials)
+{
+  char   line[256];
+  double elapsed, best = -1.0;
+  size_t ii;
+
+  for (ii = 0; ii < shapes.size(); ii++) {
+    const int shape[2] = { shapes[ii].first, shapes[ii].second };
+    try {
+      if (tile_arg >= 0) kernel.setArg(tile_arg, cl::Local(tile_bytes(shape[0], shape[1])));
+      elapsed = time_kernel(queue, kernel, padded_range(params, shape), cl::NDRange(shape[0], shape[1]));
+    } catch (cl::Error err) {
+      continue;
+    }
+    printf("Tuning %-29s %4d x %-4d\t%.6lf (ms)\n", name, shapes[ii].first, shapes[ii].second, elapsed);
+    sprintf(line, "%s %d %d %.6lf", name, shapes[ii].first, shapes[ii].second, elapsed);
+    trials.push_back(line);
+    if (best < 0.0 || elapsed < best) {
+      best = elapsed;
+      local[0] = shapes[ii].first;
+      local[1] = shapes[ii].second;
+    }
+  }
+
+  return best;
+}
+
+int tune_kernels(const t_param params, cl::Context context, const cl::Device & device, cl::CommandQueue queue,
+                 cl::Kernel propagate, cl::Kernel collision, cl::Kernel sum_velocity,
+                 t_cells & cells, cl::Buffer obs_buf, t_tuning* tuning)
+{
+  std::vector< ::size_t> item_max = device.getInfo<CL_DEVICE_MAX_WORK_ITEM_SIZES>();
+  const int units = device.getInfo<CL_DEVICE_MAX_COMPUTE_UNITS>();
+  const ::size_t sum_max = sum_velocity.getWorkGroupInfo<CL_KERNEL_WORK_GROUP_SIZE>(device);
+  std::vector<std::string> trials;
+  std::vector<int> group_counts;
+  util::Timer timer;
+  char   line[256];
+  double elapsed, best = -1.0;
+  int    ngroups, nunits, ii;
+  size_t gg;
+
+  /* start from the default, in case no candidate can be launched */
+  default_tuning(params, device, propagate, collision, sum_velocity, tuning);
+
+  /* work on scratch copies of the grid, so the run itself starts from the initial state */
+  cl::Buffer cell_buf(context, begin(cells), end(cells), false);
+  cl::Buffer tmp_buf(context, CL_MEM_READ_WRITE, sizeof(t_speed) * params.nx * params.ny);
+
+  /* propagate first, so that the scratch grid holds sensible values for collision */
+  propagate.setArg(0, params.density);
+  propagate.setArg(1, params.accel);
+  propagate.setArg(2, cell_buf);
+  propagate.setArg(3, tmp_buf);
+  propagate.setArg(4, obs_buf);
+  if (tuning->tiled) {
+    propagate.setArg(5, params.nx);
+    propagate.setArg(6, params.ny);
+    tune_local("accelerate_flow_and_propagate_tiled", params, queue, propagate,
+               tile_candidates(propagate.getWorkGroupInfo<CL_KERNEL_WORK_GROUP_SIZE>(device),
+                               tile_limit(device, propagate), item_max),
+               7, tuning->prop_local, trials);
+  }
+  else {
+    tune_local("accelerate_flow_and_propagate", params, queue, propagate,
+               local_candidates(params, propagate.getWorkGroupInfo<CL_KERNEL_WORK_GROUP_SIZE>(device), item_max),
+               -1, tuning->prop_local, trials);
+  }
+
+  collision.setArg(0, params.omega);
+  collision.setArg(1, cell_buf);
+  collision.setArg(2, tmp_buf);
+  collision.setArg(3, obs_buf);
+  tune_local("rebound_or_collision", params, queue, collision,
+             local_candidates(params, collision.getWorkGroupInfo<CL_KERNEL_WORK_GROUP_SIZE>(device), item_max),
+             -1, tuning->coll_local, trials);
+
+  /* NGROUPS/NUNITS of the reduction: multiples of the compute units by powers of two */
+  group_counts.push_back(NGROUPS);
+  for (ngroups = units; ngroups <= 64 * units; ngroups *= 2) {
+    group_counts.push_back(ngroups);
+  }
+  cl::Buffer loc_vel(context, CL_MEM_READ_WRITE, sizeof(float) * group_counts.back());
+  std::vector<float> results(group_counts.back());
+  sum_velocity.setArg(0, cell_buf);
+  sum_velocity.setArg(1, obs_buf);
+  sum_velocity.setArg(3, params.nx * params.ny);
+  sum_velocity.setArg(4, loc_vel);
+  for (gg = 0; gg < group_counts.size(); gg++) {
+    ngroups = group_counts[gg];
+    for (nunits = 1; (::size_t)nunits <= sum_max && (::size_t)nunits <= item_max[0]; nunits *= 2) {
+      if (nunits < TUNE_MIN_UNITS && (::size_t)(2 * nunits) <= sum_max) continue;
+      sum_velocity.setArg(2, cl::Local(sizeof(float) * nunits));
+      try {
+        /* time the launch together with the read-back, as in av_velocity */
+        queue.enqueueNDRangeKernel(sum_velocity, cl::NullRange, cl::NDRange(ngroups * nunits), cl::NDRange(nunits));
+        queue.finish();
+        timer.reset();
+        for (ii = 0; ii < TUNE_ITERS; ii++) {
+          queue.enqueueNDRangeKernel(sum_velocity, cl::NullRange, cl::NDRange(ngroups * nunits), cl::NDRange(nunits));
+          queue.enqueueReadBuffer(loc_vel, true, 0, sizeof(float) * ngroups, &results[0]);
+        }
+        elapsed = timer.getTimeMicroseconds() / 1000.0 / TUNE_ITERS;
+      } catch (cl::Error err) {
+        continue;
+      }
+      printf("Tuning %-29s %4d x %-4d\t%.6lf (ms)\n", "sum_velocity", ngroups, nunits, elapsed);
+      sprintf(line, "%s %d %d %.6lf", "sum_velocity", ngroups, nunits, elapsed);
+      trials.push_back(line);
+      if (best < 0.0 || elapsed < best) {
+        best = elapsed;
+        tuning->ngroups = ngroups;
+        tuning->nunits = nunits;
+      }
+    }
+  }
+
+  return save_tuning(TUNINGFILE, device.getInfo<CL_DEVICE_NAME>(), params, *tuning, trials);
+}
+
+/* FNV-1a, to key the cached program binaries */
+static unsigned long long fnv1a(unsigned long long hash, const std::string & text)
+{
+  size_t ii;
+  for (ii = 0; ii < text.size(); ii++) {
+    hash ^= (unsigned char)text[ii];
+    hash *= 1099511628211ULL;
+  }
+  return hash;
+}
+
+cl::Program build_program(const t_param params, cl::Context context, const cl::Device & device,
+                          const int generic)
+{
+  const std::string source = util::loadProgram(KERNELFILE);
+  const std::vector<cl::Device> devices(1, device);
+  std::string options = "-cl-mad-enable";
+  unsigned long long key = 14695981039346656037ULL;
+  char   define[256];
+  char   cachefile[64];
+
+  if (!generic) {
+    /* fold the grid size and the parameters into the kernels; %.9e round-trips a float */
+    sprintf(define, " -D NX=%d -D NY=%d -D OMEGA=%.9ef -D ACCEL_W1=%.9ef -D ACCEL_W2=%.9ef",
+            params.nx, params.ny, params.omega,
+            params.density * params.accel / 9.0f, params.density * params.accel / 36.0f);
+    options += define;
+  }
+#if defined(LBM_STORAGE_FP16)
+  options += " -D LBM_STORAGE_FP16";
+#elif defined(LBM_STORAGE_BF16)
+  options += " -D LBM_STORAGE_BF16";
+#endif
+#ifdef LBM_STORAGE_DEVIATION
+  /* the kernels store the same deviations as the host */
+  sprintf(define, " -D LBM_STORAGE_DEVIATION -D REST_W0=%.9ef -D REST_W1=%.9ef -D REST_W2=%.9ef",
+          params.rest[0], params.rest[1], params.rest[5]);
+  options += define;
+#endif
+
+  key = fnv1a(key, source);
+  key = fnv1a(key, options);
+  key = fnv1a(key, device.getInfo<CL_DEVICE_NAME>());
+  key = fnv1a(key, device.getInfo<CL_DRIVER_VERSION>());
+  sprintf(cachefile, BINARYCACHE, key);
+
+  /* reuse the binary of an earlier run with the same source, options and device */
+  std::ifstream in(cachefile, std::ios::binary);
+  if (in) {
+    std::vector<char> binary((std::istreambuf_iterator<char>(in)), std::istreambuf_iterator<char>());
+    if (!binary.empty()) {
+      try {
+        cl::Program::Binaries binaries(1, std::make_pair((const void*)&binary[0], binary.size()));
+        cl::Program program(context, devices, binaries);
+        program.build(devices, options.c_str());
+        printf("Kernels:\t\t\t%s, cached in %s\n", generic ? "generic" : "specialised", cachefile);
+        return program;
+      } catch (cl::Error err) {
+        /* stale or foreign binary: compile from source below */
+      }
+    }
+  }
+
+  cl::Program program(context, source);
+  try {
+    program.build(devices, options.c_str());
+  } catch (cl::Error error) {
+    // If it was a build error then show the error
+    if (error.err() == CL_BUILD_PROGRAM_FAILURE) {
+      std::cerr << program.getBuildInfo<CL_PROGRAM_BUILD_LOG>(device) << "\n";
+    }
+    throw error;
+  }
+  printf("Kernels:\t\t\t%s, compiled from %s\n", generic ? "generic" : "specialised", KERNELFILE);
+
+  /* cache the binary when the program has a single device; failing
+  ** to write it only costs a compile next time */
+  std::vector< ::size_t> sizes = program.getInfo<CL_PROGRAM_BINARY_SIZES>();
+  if (sizes.size() == 1 && sizes[0] > 0) {
+    std::vector<unsigned char> binary(sizes[0]);
+    unsigned char* ptr = &binary[0];
+    if (clGetProgramInfo(program(), CL_PROGRAM_BINARIES, sizeof(ptr), &ptr, NULL) == CL_SUCCESS) {
+      std::ofstream out(cachefile, std::ios::binary);
+      out.write((const char*)&binary[0], binary.size());
+    }
+  }
+
+  return program;
+}
+
 void die(const char* message, const int line, const char *file)
 {
   fprintf(stderr, "Error at line %d of file %s:\n", line, file);
@@ -503,6 +1332,6 @@ void die(const char* message, const int line, const char *file)
 
 void usage(const char* exe)
 {
-  fprintf(stderr, "Usage: %s <paramfile> <obstaclefile>\n", exe);
+  fprintf(stderr, "Usage: %s <paramfile> <obstaclefile> [--tune] [--profile] [--profile-json <file>] [--copy|--zero-copy] [--generic] [--tiled] [--binary]\n", exe);
   exit(EXIT_FAILURE);
 }
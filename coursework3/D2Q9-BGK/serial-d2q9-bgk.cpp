@@ -47,37 +47,75 @@
 **
 ** Be sure to adjust the grid dimensions in the parameter file
 ** if you choose a different obstacle file.
+**
+** The solver is a template on its real type, and is built for both
+** float and double from this one source. It runs in float unless
+** given --double, which is for the long validation runs where the
+** drift of the total density in float shows. With --benchmark it
+** runs both, without writing the output files, and reports their
+** throughput and how well each conserves the total density:
+**
+**   d2q9-bgk.exe --benchmark input.params obstacles.dat
+**
+** The collision takes a row a block of cells at a time, a cell to
+** each lane of a vector register: four floats but two doubles with
+** SSE, twice as many with AVX and four times with AVX-512.
 */
 
 #include "util.hpp" // utility library
 
 #include<stdio.h>
 #include<stdlib.h>
+#include<string.h>
 #include<time.h>
 #include<vector>
 #include<sys/time.h>
 #include<sys/resource.h>
+#include"lbm_io.h"
 
 #define NSPEEDS         9
 #define FINALSTATEFILE  "final_state.dat"
 #define AVVELSFILE      "av_vels.dat"
 
+/* width of a vector register, and so the no. of cells the collision
+** takes at a time: SIMD_BYTES / sizeof(real) */
+#if defined(__AVX512F__)
+#define SIMD_BYTES      64
+#elif defined(__AVX__)
+#define SIMD_BYTES      32
+#else
+#define SIMD_BYTES      16
+#endif
+#define LANES(real)     (SIMD_BYTES / (int)sizeof(real))
+
 /* struct to hold the parameter values */
-typedef struct {
+template <typename real>
+struct t_param {
   int    nx;            /* no. of cells in x-direction */
   int    ny;            /* no. of cells in y-direction */
   int    maxIters;      /* no. of iterations */
   int    reynolds_dim;  /* dimension for Reynolds number */
   int tot_cells;
-  float density;       /* density per link */
-  float accel;         /* density redistribution */
-  float omega;         /* relaxation parameter */
-} t_param;
+  real density;       /* density per link */
+  real accel;         /* density redistribution */
+  real omega;         /* relaxation parameter */
+};
 
 /* struct to hold the 'speed' values */
+template <typename real>
+struct t_speed {
+  real speeds[NSPEEDS];
+};
+
+/* struct to hold the results of a benchmark run */
 typedef struct {
-  float speeds[NSPEEDS];
-} t_speed;
+  int    lanes;         /* cells per block of the collision */
+  double elapsed;       /* wallclock time of the timesteps */
+  double mlups;         /* million lattice updates per second */
+  double mass0;         /* total density at the start */
+  double mass1;         /* total density at the end */
+  double drift;         /* largest relative change of the total density */
+} t_bench;
 
 enum boolean { FALSE, TRUE };
 
@@ -85,35 +123,54 @@ enum boolean { FALSE, TRUE };
 ** function prototypes
 */
 
+/* initialise, run the timestep loop and finalise, for one real type;
+** given a t_bench, record the benchmark in it instead of writing output */
+template <typename real>
+int run(const char* paramfile, const char* obstaclefile, t_bench* bench);
+
 /* load params, allocate memory, load obstacles & initialise fluid particle densities */
+template <typename real>
 int initialise(const char* paramfile, const char* obstaclefile,
-               t_param* params, std::vector<t_speed> & cells_ptr, std::vector<t_speed> & tmp_cells_ptr,
-               std::vector<int> & obstacles_ptr, float** av_vels_ptr);
+               t_param<real>* params, std::vector<t_speed<real> > & cells_ptr, std::vector<t_speed<real> > & tmp_cells_ptr,
+               std::vector<int> & obstacles_ptr, real** av_vels_ptr);
 
 /* 
 ** The main calculation methods.
 ** timestep calls, in order, the functions:
 ** accelerate_flow(), propagate(), rebound() & collision()
 */
-int timestep(const t_param params, std::vector<t_speed> & cells, std::vector<t_speed> & tmp_cells, std::vector<int> & obstacles);
-int accelerate_flow(const t_param params, std::vector<t_speed> & cells, std::vector<int> & obstacles);
-int propagate(const t_param params, std::vector<t_speed> & cells, std::vector<t_speed> & tmp_cells);
-int rebound_or_collision(const t_param params, std::vector<t_speed> & cells, std::vector<t_speed> & tmp_cells, std::vector<int> & obstacles);
-int write_values(const t_param params, std::vector<t_speed> & cells, std::vector<int> & obstacles, float* av_vels);
+template <typename real>
+int timestep(const t_param<real> params, std::vector<t_speed<real> > & cells, std::vector<t_speed<real> > & tmp_cells, std::vector<int> & obstacles);
+template <typename real>
+int accelerate_flow(const t_param<real> params, std::vector<t_speed<real> > & cells, std::vector<int> & obstacles);
+template <typename real>
+int propagate(const t_param<real> params, std::vector<t_speed<real> > & cells, std::vector<t_speed<real> > & tmp_cells);
+template <typename real>
+int rebound_or_collision(const t_param<real> params, std::vector<t_speed<real> > & cells, std::vector<t_speed<real> > & tmp_cells, std::vector<int> & obstacles);
+template <typename real>
+int write_values(const t_param<real> params, std::vector<t_speed<real> > & cells, std::vector<int> & obstacles, real* av_vels);
 
 /* finalise, including freeing up allocated memory */
-int finalise(const t_param* params, std::vector<t_speed> & cells_ptr, std::vector<t_speed> & tmp_cells_ptr,
-             std::vector<int> & obstacles_ptr, float** av_vels_ptr);
+template <typename real>
+int finalise(const t_param<real>* params, std::vector<t_speed<real> > & cells_ptr, std::vector<t_speed<real> > & tmp_cells_ptr,
+             std::vector<int> & obstacles_ptr, real** av_vels_ptr);
 
-/* Sum all the densities in the grid.
+/* Sum all the densities in the grid, in double whatever the real type.
 ** The total should remain constant from one timestep to the next. */
-float total_density(const t_param params, std::vector<t_speed> & cells);
+template <typename real>
+double total_density(const t_param<real> params, std::vector<t_speed<real> > & cells);
 
 /* compute average velocity */
-float av_velocity(const t_param params, std::vector<t_speed> & cells, std::vector<int> & obstacles);
+template <typename real>
+real av_velocity(const t_param<real> params, std::vector<t_speed<real> > & cells, std::vector<int> & obstacles);
 
 /* calculate Reynolds number */
-float calc_reynolds(const t_param params, std::vector<t_speed> & cells, std::vector<int> & obstacles);
+template <typename real>
+real calc_reynolds(const t_param<real> params, std::vector<t_speed<real> > & cells, std::vector<int> & obstacles);
+
+/* read a real from the parameter file */
+int read_real(FILE* fp, float* value);
+int read_real(FILE* fp, double* value);
 
 /* utility functions */
 void die(const char* message, const int line, const char *file);
@@ -121,36 +178,74 @@ void usage(const char* exe);
 
 /*
 ** main program:
-** initialise, timestep loop, finalise
+** parse the command line and run the solver in float or double
 */
 int main(int argc, char* argv[])
 {
-  char*    paramfile;         /* name of the input parameter file */
-  char*    obstaclefile;      /* name of a the input obstacle file */
-  t_param  params;            /* struct to hold parameter values */
-  std::vector<t_speed> cells;  /* grid containing fluid densities */
-  std::vector<t_speed> tmp_cells;  /* scratch space */
+  char*    paramfile = NULL;    /* name of the input parameter file */
+  char*    obstaclefile = NULL; /* name of a the input obstacle file */
+  int      use_double = FALSE;  /* run in double precision */
+  int      benchmark = FALSE;   /* compare float and double */
+  t_bench  bench[2];            /* results of the benchmark, float then double */
+  int      ii;                  /* generic counter */
+
+  /* parse the command line */
+  for (ii=1;ii<argc;ii++) {
+    if (!strcmp(argv[ii],"--double")) use_double = TRUE;
+    else if (!strcmp(argv[ii],"--benchmark")) benchmark = TRUE;
+    else if (argv[ii][0] == '-') usage(argv[0]);
+    else if (paramfile == NULL) paramfile = argv[ii];
+    else if (obstaclefile == NULL) obstaclefile = argv[ii];
+    else usage(argv[0]);
+  }
+  if (obstaclefile == NULL || (use_double && benchmark)) {
+    usage(argv[0]);
+  }
+
+  if (!benchmark) {
+    return use_double ? run<double>(paramfile, obstaclefile, NULL)
+                      : run<float>(paramfile, obstaclefile, NULL);
+  }
+
+  run<float>(paramfile, obstaclefile, &bench[0]);
+  run<double>(paramfile, obstaclefile, &bench[1]);
+  printf("%-9s %5s %12s %10s %20s %20s %12s\n", "precision", "lanes", "time (s)", "MLUPS",
+         "initial density", "final density", "max drift");
+  for (ii=0;ii<2;ii++) {
+    printf("%-9s %5d %12.6lf %10.3lf %20.12E %20.12E %12.4E\n", ii ? "double" : "float",
+           bench[ii].lanes, bench[ii].elapsed, bench[ii].mlups,
+           bench[ii].mass0, bench[ii].mass1, bench[ii].drift);
+  }
+
+  return EXIT_SUCCESS;
+}
+
+template <typename real>
+int run(const char* paramfile, const char* obstaclefile, t_bench* bench)
+{
+  t_param<real>  params;      /* struct to hold parameter values */
+  std::vector<t_speed<real> > cells;  /* grid containing fluid densities */
+  std::vector<t_speed<real> > tmp_cells;  /* scratch space */
   std::vector<int> obstacles;  /* grid indicating which cells are blocked */
-  float*  av_vels   = NULL;  /* a record of the av. velocity computed for each timestep */
+  real*   av_vels   = NULL;  /* a record of the av. velocity computed for each timestep */
   int      ii;                /* generic counter */
   struct timeval timstr;      /* structure to hold elapsed time */
   struct rusage ru;           /* structure to hold CPU time--system and user */
   double tic,toc;             /* floating point numbers to calculate elapsed wallclock time */
   double usrtim;              /* floating point number to record elapsed user CPU time */
   double systim;              /* floating point number to record elapsed system CPU time */
-
-  /* parse the command line */
-  if(argc != 3) {
-    usage(argv[0]);
-  }
-  else{
-    paramfile = argv[1];
-    obstaclefile = argv[2];
-  }
+  double mass,drift;          /* total density, and its relative change */
 
   /* initialise our data structures and load values from file */
   initialise(paramfile, obstaclefile, &params, cells, tmp_cells, obstacles, &av_vels);
 
+  if (bench) {
+    bench->lanes = LANES(real);
+    bench->elapsed = 0.0;
+    bench->mass0 = bench->mass1 = total_density(params,cells);
+    bench->drift = 0.0;
+  }
+
   /* iterate for maxIters timesteps */
   gettimeofday(&timstr,NULL);
   tic=timstr.tv_sec+(timstr.tv_usec/1000000.0);
@@ -158,6 +253,18 @@ int main(int argc, char* argv[])
   for (ii=0;ii<params.maxIters;ii++) {
     timestep(params,cells,tmp_cells,obstacles);
     av_vels[ii] = av_velocity(params,cells,obstacles);
+    if (bench) {
+      /* keep the sum of the densities out of the time */
+      gettimeofday(&timstr,NULL);
+      toc=timstr.tv_sec+(timstr.tv_usec/1000000.0);
+      bench->elapsed += toc-tic;
+      bench->mass1 = mass = total_density(params,cells);
+      drift = (mass - bench->mass0) / bench->mass0;
+      if (drift < 0.0) drift = -drift;
+      if (drift > bench->drift) bench->drift = drift;
+      gettimeofday(&timstr,NULL);
+      tic=timstr.tv_sec+(timstr.tv_usec/1000000.0);
+    }
 #ifdef DEBUG
     printf("==timestep: %d==\n",ii);
     printf("av velocity: %.12E\n", av_vels[ii]);
@@ -172,6 +279,13 @@ int main(int argc, char* argv[])
   timstr=ru.ru_stime;        
   systim=timstr.tv_sec+(timstr.tv_usec/1000000.0);
 
+  if (bench) {
+    bench->elapsed += toc-tic;
+    bench->mlups = (double)params.nx * params.ny * params.maxIters / bench->elapsed / 1.0E6;
+    finalise(&params, cells, tmp_cells, obstacles, &av_vels);
+    return EXIT_SUCCESS;
+  }
+
   /* write final values and free memory */
   printf("==done==\n");
   printf("Reynolds number:\t\t%.12E\n",calc_reynolds(params,cells,obstacles));
@@ -184,7 +298,8 @@ int main(int argc, char* argv[])
   return EXIT_SUCCESS;
 }
 
-int timestep(const t_param params, std::vector<t_speed> & cells, std::vector<t_speed> & tmp_cells, std::vector<int> & obstacles)
+template <typename real>
+int timestep(const t_param<real> params, std::vector<t_speed<real> > & cells, std::vector<t_speed<real> > & tmp_cells, std::vector<int> & obstacles)
 {
   accelerate_flow(params,cells,obstacles);
   propagate(params,cells,tmp_cells);
@@ -192,10 +307,11 @@ int timestep(const t_param params, std::vector<t_speed> & cells, std::vector<t_s
   return EXIT_SUCCESS; 
 }
 
-int accelerate_flow(const t_param params, std::vector<t_speed> & cells, std::vector<int> & obstacles)
+template <typename real>
+int accelerate_flow(const t_param<real> params, std::vector<t_speed<real> > & cells, std::vector<int> & obstacles)
 {
   int ii,jj;     /* generic counters */
-  float w1,w2;  /* weighting factors */
+  real w1,w2;   /* weighting factors */
   
   /* compute weighting factors */
   w1 = params.density * params.accel / 9.0;
@@ -224,7 +340,8 @@ int accelerate_flow(const t_param params, std::vector<t_speed> & cells, std::vec
   return EXIT_SUCCESS;
 }
 
-int propagate(const t_param params, std::vector<t_speed> & cells, std::vector<t_speed> & tmp_cells)
+template <typename real>
+int propagate(const t_param<real> params, std::vector<t_speed<real> > & cells, std::vector<t_speed<real> > & tmp_cells)
 {
   int ii,jj;            /* generic counters */
   int x_e,x_w,y_n,y_s;  /* indices of neighbouring cells */
@@ -257,105 +374,108 @@ int propagate(const t_param params, std::vector<t_speed> & cells, std::vector<t_
   return EXIT_SUCCESS;
 }
 
-int rebound_or_collision(const t_param params, std::vector<t_speed> & cells, std::vector<t_speed> & tmp_cells, std::vector<int> & obstacles)
+template <typename real>
+int rebound_or_collision(const t_param<real> params, std::vector<t_speed<real> > & cells, std::vector<t_speed<real> > & tmp_cells, std::vector<int> & obstacles)
 {
-  int ii,jj,kk;                 /* generic counters */
-  const float c_sq = 1.0/3.0;  /* square of speed of sound */
-  const float w0 = 4.0/9.0;    /* weighting factor */
-  const float w1 = 1.0/9.0;    /* weighting factor */
-  const float w2 = 1.0/36.0;   /* weighting factor */
-  float u_x,u_y;               /* av. velocities in x and y directions */
-  float u[NSPEEDS];            /* directional velocities */
-  float d_equ[NSPEEDS];        /* equilibrium densities */
-  float u_sq;                  /* squared velocity */
-  float local_density;         /* sum of densities in a particular cell */
-
-  /* loop over the cells in the grid
+  const int lanes = LANES(real); /* cells in a block */
+  int ii,jj,kk,ll;              /* generic counters */
+  int nn;                       /* no. of cells of the row in the block */
+  const real c_sq = 1.0/3.0;   /* square of speed of sound */
+  const real w0 = 4.0/9.0;     /* weighting factor */
+  const real w1 = 1.0/9.0;     /* weighting factor */
+  const real w2 = 1.0/36.0;    /* weighting factor */
+  real f[NSPEEDS][LANES(real)];      /* densities of the block, a cell to a lane */
+  real u_x[LANES(real)];             /* av. velocity in x direction */
+  real u_y[LANES(real)];             /* av. velocity in y direction */
+  real u[NSPEEDS][LANES(real)];      /* directional velocities */
+  real d_equ[NSPEEDS][LANES(real)];  /* equilibrium densities */
+  real u_sq[LANES(real)];            /* squared velocity */
+  real local_density[LANES(real)];   /* sum of densities in a particular cell */
+
+  /* loop over the cells in the grid, a block of a row at a time
   ** NB the collision step is called after
   ** the propagate step and so values of interest
   ** are in the scratch-space grid */
   for(ii=0;ii<params.ny;ii++) {
-    for(jj=0;jj<params.nx;jj++) {
-      /* if the cell contains an obstacle */
-      if(obstacles[ii*params.nx + jj]) {
-          /* called after propagate, so taking values from scratch space
-          ** mirroring, and writing into main grid */
-          cells[ii*params.nx + jj].speeds[1] = tmp_cells[ii*params.nx + jj].speeds[3];
-          cells[ii*params.nx + jj].speeds[2] = tmp_cells[ii*params.nx + jj].speeds[4];
-          cells[ii*params.nx + jj].speeds[3] = tmp_cells[ii*params.nx + jj].speeds[1];
-          cells[ii*params.nx + jj].speeds[4] = tmp_cells[ii*params.nx + jj].speeds[2];
-          cells[ii*params.nx + jj].speeds[5] = tmp_cells[ii*params.nx + jj].speeds[7];
-          cells[ii*params.nx + jj].speeds[6] = tmp_cells[ii*params.nx + jj].speeds[8];
-          cells[ii*params.nx + jj].speeds[7] = tmp_cells[ii*params.nx + jj].speeds[5];
-          cells[ii*params.nx + jj].speeds[8] = tmp_cells[ii*params.nx + jj].speeds[6];
-      } else {
-          /* compute local density total */
-          local_density = 0.0;
-          for(kk=0;kk<NSPEEDS;kk++) {
-            local_density += tmp_cells[ii*params.nx + jj].speeds[kk];
-          }
-          /* compute x velocity component */
-          u_x = (tmp_cells[ii*params.nx + jj].speeds[1] +
-                 tmp_cells[ii*params.nx + jj].speeds[5] +
-                 tmp_cells[ii*params.nx + jj].speeds[8]
-                 - (tmp_cells[ii*params.nx + jj].speeds[3] +
-                    tmp_cells[ii*params.nx + jj].speeds[6] +
-                    tmp_cells[ii*params.nx + jj].speeds[7]))
-            / local_density;
-          /* compute y velocity component */
-          u_y = (tmp_cells[ii*params.nx + jj].speeds[2] +
-                 tmp_cells[ii*params.nx + jj].speeds[5] +
-                 tmp_cells[ii*params.nx + jj].speeds[6]
-                 - (tmp_cells[ii*params.nx + jj].speeds[4] +
-                    tmp_cells[ii*params.nx + jj].speeds[7] +
-                    tmp_cells[ii*params.nx + jj].speeds[8]))
-            / local_density;
-          /* velocity squared */
-          u_sq = u_x * u_x + u_y * u_y;
-          /* directional velocity components */
-          u[1] =   u_x;        /* east */
-          u[2] =         u_y;  /* north */
-          u[3] = - u_x;        /* west */
-          u[4] =       - u_y;  /* south */
-          u[5] =   u_x + u_y;  /* north-east */
-          u[6] = - u_x + u_y;  /* north-west */
-          u[7] = - u_x - u_y;  /* south-west */
-          u[8] =   u_x - u_y;  /* south-east */
-          /* equilibrium densities */
-          /* zero velocity density: weight w0 */
-          d_equ[0] = w0 * local_density * (1.0 - u_sq * (1.0 / (2.0 * c_sq)));
-          /* axis speeds: weight w1 */
-          d_equ[1] = w1 * local_density * (1.0 + u[1] * (1.0 / c_sq)
-                           + (u[1] * u[1]) * (1.0 / (2.0 * c_sq * c_sq))
-                           - u_sq * (1.0 / (2.0 * c_sq)));
-          d_equ[2] = w1 * local_density * (1.0 + u[2] * (1.0 / c_sq)
-                           + (u[2] * u[2]) * (1.0 / (2.0 * c_sq * c_sq))
-                           - u_sq * (1.0 / (2.0 * c_sq)));
-          d_equ[3] = w1 * local_density * (1.0 + u[3] * (1.0 / c_sq)
-                           + (u[3] * u[3]) * (1.0 / (2.0 * c_sq * c_sq))
-                           - u_sq * (1.0 / (2.0 * c_sq)));
-          d_equ[4] = w1 * local_density * (1.0 + u[4] * (1.0 / c_sq)
-                           + (u[4] * u[4]) * (1.0 / (2.0 * c_sq * c_sq))
-                           - u_sq * (1.0 / (2.0 * c_sq)));
-          /* diagonal speeds: weight w2 */
-          d_equ[5] = w2 * local_density * (1.0 + u[5] * (1.0 / c_sq)
-                           + (u[5] * u[5]) * (1.0 / (2.0 * c_sq * c_sq))
-                           - u_sq * (1.0 / (2.0 * c_sq)));
-          d_equ[6] = w2 * local_density * (1.0 + u[6] * (1.0 / c_sq)
-                           + (u[6] * u[6]) * (1.0 / (2.0 * c_sq * c_sq))
-                           - u_sq * (1.0 / (2.0 * c_sq)));
-          d_equ[7] = w2 * local_density * (1.0 + u[7] * (1.0 / c_sq)
-                           + (u[7] * u[7]) * (1.0 / (2.0 * c_sq * c_sq))
-                           - u_sq * (1.0 / (2.0 * c_sq)));
-          d_equ[8] = w2 * local_density * (1.0 + u[8] * (1.0 / c_sq)
-                           + (u[8] * u[8]) * (1.0 / (2.0 * c_sq * c_sq))
-                           - u_sq * (1.0 / (2.0 * c_sq)));
-          /* relaxation step */
+    for(jj=0;jj<params.nx;jj+=lanes) {
+      nn = (params.nx - jj < lanes) ? params.nx - jj : lanes;
+      /* gather the block, filling any lanes past the end
+      ** of the row with its last cell */
+      for(ll=0;ll<lanes;ll++) {
+        const t_speed<real> & cell = tmp_cells[ii*params.nx + jj + (ll < nn ? ll : nn - 1)];
+        for(kk=0;kk<NSPEEDS;kk++) {
+          f[kk][ll] = cell.speeds[kk];
+        }
+      }
+      /* compute local density total */
+      for(ll=0;ll<lanes;ll++) {
+        local_density[ll] = 0.0;
+      }
+      for(kk=0;kk<NSPEEDS;kk++) {
+        for(ll=0;ll<lanes;ll++) {
+          local_density[ll] += f[kk][ll];
+        }
+      }
+      for(ll=0;ll<lanes;ll++) {
+        /* compute x velocity component */
+        u_x[ll] = (f[1][ll] + f[5][ll] + f[8][ll]
+                   - (f[3][ll] + f[6][ll] + f[7][ll]))
+          / local_density[ll];
+        /* compute y velocity component */
+        u_y[ll] = (f[2][ll] + f[5][ll] + f[6][ll]
+                   - (f[4][ll] + f[7][ll] + f[8][ll]))
+          / local_density[ll];
+        /* velocity squared */
+        u_sq[ll] = u_x[ll] * u_x[ll] + u_y[ll] * u_y[ll];
+        /* directional velocity components */
+        u[1][ll] =   u_x[ll];            /* east */
+        u[2][ll] =             u_y[ll];  /* north */
+        u[3][ll] = - u_x[ll];            /* west */
+        u[4][ll] =           - u_y[ll];  /* south */
+        u[5][ll] =   u_x[ll] + u_y[ll];  /* north-east */
+        u[6][ll] = - u_x[ll] + u_y[ll];  /* north-west */
+        u[7][ll] = - u_x[ll] - u_y[ll];  /* south-west */
+        u[8][ll] =   u_x[ll] - u_y[ll];  /* south-east */
+      }
+      /* equilibrium densities */
+      for(ll=0;ll<lanes;ll++) {
+        /* zero velocity density: weight w0 */
+        d_equ[0][ll] = w0 * local_density[ll] * (1.0 - u_sq[ll] * (1.0 / (2.0 * c_sq)));
+      }
+      for(kk=1;kk<NSPEEDS;kk++) {
+        /* axis speeds: weight w1, diagonal speeds: weight w2 */
+        const real w = (kk < 5) ? w1 : w2;
+        for(ll=0;ll<lanes;ll++) {
+          d_equ[kk][ll] = w * local_density[ll] * (1.0 + u[kk][ll] * (1.0 / c_sq)
+                                + (u[kk][ll] * u[kk][ll]) * (1.0 / (2.0 * c_sq * c_sq))
+                                - u_sq[ll] * (1.0 / (2.0 * c_sq)));
+        }
+      }
+      /* relaxation step */
+      for(kk=0;kk<NSPEEDS;kk++) {
+        for(ll=0;ll<lanes;ll++) {
+          d_equ[kk][ll] = f[kk][ll] + params.omega * (d_equ[kk][ll] - f[kk][ll]);
+        }
+      }
+      /* scatter the block back into the main grid */
+      for(ll=0;ll<nn;ll++) {
+        t_speed<real> & cell = cells[ii*params.nx + jj + ll];
+        /* if the cell contains an obstacle */
+        if(obstacles[ii*params.nx + jj + ll]) {
+          /* mirroring the scratch space */
+          cell.speeds[1] = f[3][ll];
+          cell.speeds[2] = f[4][ll];
+          cell.speeds[3] = f[1][ll];
+          cell.speeds[4] = f[2][ll];
+          cell.speeds[5] = f[7][ll];
+          cell.speeds[6] = f[8][ll];
+          cell.speeds[7] = f[5][ll];
+          cell.speeds[8] = f[6][ll];
+        } else {
           for(kk=0;kk<NSPEEDS;kk++) {
-            cells[ii*params.nx + jj].speeds[kk] = (tmp_cells[ii*params.nx + jj].speeds[kk]
-                               + params.omega *
-                               (d_equ[kk] - tmp_cells[ii*params.nx + jj].speeds[kk]));
+            cell.speeds[kk] = d_equ[kk][ll];
           }
+        }
       }
     }
   }
@@ -363,17 +483,18 @@ int rebound_or_collision(const t_param params, std::vector<t_speed> & cells, std
   return EXIT_SUCCESS; 
 }
 
+template <typename real>
 int initialise(const char* paramfile, const char* obstaclefile,
-               t_param* params, std::vector<t_speed> & cells_ptr, std::vector<t_speed> & tmp_cells_ptr,
-               std::vector<int> & obstacles_ptr, float** av_vels_ptr)
+               t_param<real>* params, std::vector<t_speed<real> > & cells_ptr, std::vector<t_speed<real> > & tmp_cells_ptr,
+               std::vector<int> & obstacles_ptr, real** av_vels_ptr)
 {
   char   message[1024];  /* message buffer */
   FILE   *fp;            /* file pointer */
   int    ii,jj;          /* generic counters */
-  int    xx,yy;          /* generic array indices */
+  long   line;           /* line no. of an error in the obstacle file */
   int    blocked;        /* indicates whether a cell is blocked by an obstacle */ 
   int    retval;         /* to hold return value for checking */
-  float w0,w1,w2;       /* weighting factors */
+  real w0,w1,w2;        /* weighting factors */
 
   /* open the parameter file */
   fp = fopen(paramfile,"r");
@@ -391,11 +512,11 @@ int initialise(const char* paramfile, const char* obstaclefile,
   if(retval != 1) die ("could not read param file: maxIters",__LINE__,__FILE__);
   retval = fscanf(fp,"%d\n",&(params->reynolds_dim));
   if(retval != 1) die ("could not read param file: reynolds_dim",__LINE__,__FILE__);
-  retval = fscanf(fp,"%f\n",&(params->density));
+  retval = read_real(fp,&(params->density));
   if(retval != 1) die ("could not read param file: density",__LINE__,__FILE__);
-  retval = fscanf(fp,"%f\n",&(params->accel));
+  retval = read_real(fp,&(params->accel));
   if(retval != 1) die ("could not read param file: accel",__LINE__,__FILE__);
-  retval = fscanf(fp,"%f\n",&(params->omega));
+  retval = read_real(fp,&(params->omega));
   if(retval != 1) die ("could not read param file: omega",__LINE__,__FILE__);
   params->tot_cells = params->nx * params->ny;
 
@@ -458,57 +579,37 @@ int initialise(const char* paramfile, const char* obstaclefile,
     }
   }
 
-  /* first set all cells in obstacle array to zero */ 
-  for(ii=0;ii<params->ny;ii++) {
-    for(jj=0;jj<params->nx;jj++) {
-      (obstacles_ptr)[ii*params->nx + jj] = 0;
-    }
-  }
-
-  /* open the obstacle data file */
-  fp = fopen(obstaclefile,"r");
-  if (fp == NULL) {
+  /* read-in the blocked cells list */
+  retval = lbm_parse_obstacles(obstaclefile, params->nx, params->ny, &obstacles_ptr[0], &blocked, &line);
+  if (retval == LBM_EOPEN) {
     sprintf(message,"could not open input obstacles file: %s", obstaclefile);
     die(message,__LINE__,__FILE__);
   }
-
-  /* read-in the blocked cells list */
-  while( (retval = fscanf(fp,"%d %d %d\n", &xx, &yy, &blocked)) != EOF) {
-    /* some checks */
-    if ( retval != 3)
-      die("expected 3 values per line in obstacle file",__LINE__,__FILE__);
-    if ( xx<0 || xx>params->nx-1 )
-      die("obstacle x-coord out of range",__LINE__,__FILE__);
-    if ( yy<0 || yy>params->ny-1 )
-      die("obstacle y-coord out of range",__LINE__,__FILE__);
-    if ( blocked != 1 ) 
-      die("obstacle blocked value should be 1",__LINE__,__FILE__);
-    /* assign to array */
-    (obstacles_ptr)[yy*params->nx + xx] = blocked;
-    params->tot_cells--;
+  if (retval != LBM_OK) {
+    sprintf(message,"%s (line %ld of %s)", lbm_strerror(retval), line, obstaclefile);
+    die(message,__LINE__,__FILE__);
   }
-  
-  /* and close the file */
-  fclose(fp);
+  params->tot_cells -= blocked;
 
   /* 
   ** allocate space to hold a record of the avarage velocities computed 
   ** at each timestep
   */
-  *av_vels_ptr = (float*)malloc(sizeof(float)*params->maxIters);
+  *av_vels_ptr = (real*)malloc(sizeof(real)*params->maxIters);
 
   return EXIT_SUCCESS;
 }
 
-int finalise(const t_param* params, std::vector<t_speed> & cells_ptr, std::vector<t_speed> & tmp_cells_ptr,
-             std::vector<int> & obstacles_ptr, float** av_vels_ptr)
+template <typename real>
+int finalise(const t_param<real>* params, std::vector<t_speed<real> > & cells_ptr, std::vector<t_speed<real> > & tmp_cells_ptr,
+             std::vector<int> & obstacles_ptr, real** av_vels_ptr)
 {
   /* 
   ** free up allocated memory
   */
-  std::vector<t_speed>().swap(cells_ptr);
+  std::vector<t_speed<real> >().swap(cells_ptr);
 
-  std::vector<t_speed>().swap(tmp_cells_ptr);
+  std::vector<t_speed<real> >().swap(tmp_cells_ptr);
 
   std::vector<int>().swap(obstacles_ptr);
 
@@ -518,11 +619,12 @@ int finalise(const t_param* params, std::vector<t_speed> & cells_ptr, std::vecto
   return EXIT_SUCCESS;
 }
 
-float av_velocity(const t_param params, std::vector<t_speed> & cells, std::vector<int> & obstacles)
+template <typename real>
+real av_velocity(const t_param<real> params, std::vector<t_speed<real> > & cells, std::vector<int> & obstacles)
 {
   int    ii,jj,kk;       /* generic counters */
-  float local_density;  /* total density in cell */
-  float tot_u_x;        /* accumulated x-components of velocity */
+  real  local_density;  /* total density in cell */
+  real  tot_u_x;        /* accumulated x-components of velocity */
 
   /* initialise */
   tot_u_x = 0.0;
@@ -550,20 +652,22 @@ float av_velocity(const t_param params, std::vector<t_speed> & cells, std::vecto
     }
   }
 
-  return tot_u_x / (float)params.tot_cells;
+  return tot_u_x / (real)params.tot_cells;
 }
 
-float calc_reynolds(const t_param params, std::vector<t_speed> & cells, std::vector<int> & obstacles)
+template <typename real>
+real calc_reynolds(const t_param<real> params, std::vector<t_speed<real> > & cells, std::vector<int> & obstacles)
 {
-  const float viscosity = 1.0 / 6.0 * (2.0 / params.omega - 1.0);
+  const real viscosity = 1.0 / 6.0 * (2.0 / params.omega - 1.0);
   
   return av_velocity(params,cells,obstacles) * params.reynolds_dim / viscosity;
 }
 
-float total_density(const t_param params, std::vector<t_speed> & cells)
+template <typename real>
+double total_density(const t_param<real> params, std::vector<t_speed<real> > & cells)
 {
   int ii,jj,kk;        /* generic counters */
-  float total = 0.0;  /* accumulator */
+  double total = 0.0; /* accumulator */
 
   for(ii=0;ii<params.ny;ii++) {
     for(jj=0;jj<params.nx;jj++) {
@@ -576,15 +680,16 @@ float total_density(const t_param params, std::vector<t_speed> & cells)
   return total;
 }
 
-int write_values(const t_param params, std::vector<t_speed> & cells, std::vector<int> & obstacles, float *av_vels)
+template <typename real>
+int write_values(const t_param<real> params, std::vector<t_speed<real> > & cells, std::vector<int> & obstacles, real *av_vels)
 {
   FILE* fp;                     /* file pointer */
   int ii,jj,kk;                 /* generic counters */
-  const float c_sq = 1.0/3.0;  /* sq. of speed of sound */
-  float local_density;         /* per grid cell sum of densities */
-  float pressure;              /* fluid pressure in grid cell */
-  float u_x;                   /* x-component of velocity in grid cell */
-  float u_y;                   /* y-component of velocity in grid cell */
+  const real c_sq = 1.0/3.0;   /* sq. of speed of sound */
+  real local_density;          /* per grid cell sum of densities */
+  real pressure;               /* fluid pressure in grid cell */
+  real u_x;                    /* x-component of velocity in grid cell */
+  real u_y;                    /* y-component of velocity in grid cell */
 
   fp = fopen(FINALSTATEFILE,"w");
   if (fp == NULL) {
@@ -643,6 +748,16 @@ int write_values(const t_param params, std::vector<t_speed> & cells, std::vector
   return EXIT_SUCCESS;
 }
 
+int read_real(FILE* fp, float* value)
+{
+  return fscanf(fp,"%f\n",value);
+}
+
+int read_real(FILE* fp, double* value)
+{
+  return fscanf(fp,"%lf\n",value);
+}
+
 void die(const char* message, const int line, const char *file)
 {
   fprintf(stderr, "Error at line %d of file %s:\n", line, file);
@@ -653,6 +768,6 @@ void die(const char* message, const int line, const char *file)
 
 void usage(const char* exe)
 {
-  fprintf(stderr, "Usage: %s <paramfile> <obstaclefile>\n", exe);
+  fprintf(stderr, "Usage: %s [--double | --benchmark] <paramfile> <obstaclefile>\n", exe);
   exit(EXIT_FAILURE);
 }